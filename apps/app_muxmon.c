@@ -201,7 +201,7 @@ static void *muxmon_thread(void *obj)
 
         oflags |= cw_test_flag(muxmon, MUXFLAG_APPEND) ? O_APPEND : O_TRUNC;
         
-        if (!(fs = cw_writefile(muxmon->filename, ext, NULL, oflags, 0, 0644)))
+        if (!(fs = cw_writefile_async(muxmon->filename, ext, NULL, oflags, 0, 0644)))
         {
             cw_log(CW_LOG_ERROR, "Cannot open %s\n", muxmon->filename);
             spy.status = CHANSPY_DONE;
@@ -45,6 +45,10 @@
 #include <sys/mman.h>
 #include <time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 #define SPANDSP_EXPOSE_INTERNAL_STRUCTURES
 #include <spandsp.h>
 
@@ -69,6 +73,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/utils.h"
 #include "callweaver/phone_no_utils.h"
 #include "callweaver/keywords.h"
+#include "callweaver/callweaver_hash.h"
 
 #include "callweaver_addon/adsi.h"
 
@@ -1286,6 +1291,347 @@ yuck:
 
 #else
 
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* Message counts are cached per folder directory and kept honest by an inotify
+ * watch on each directory we have counted. Any change to a watched directory
+ * invalidates its count and the next lookup rescans it. Our own changes also
+ * invalidate explicitly so they are visible before the inotify event arrives.
+ * Changes made by anything else to a mailbox's INBOX or Old folders generate a
+ * MessageWaiting manager event so subscribers need not poll.
+ */
+
+#define VM_COUNT_BUCKETS	4096
+
+struct vm_count {
+	struct vm_count *next;		/* chained by path */
+	struct vm_count *wd_next;	/* chained by watch descriptor */
+	int wd;
+	unsigned int gen;		/* bumped on every change */
+	int valid;
+	int count;
+	char path[0];
+};
+
+static struct vm_count *vm_count_bypath[VM_COUNT_BUCKETS];
+static struct vm_count *vm_count_bywd[VM_COUNT_BUCKETS];
+static int vm_count_fd = -1;
+static pthread_t vm_count_thread = CW_PTHREADT_NULL;
+CW_MUTEX_DEFINE_STATIC(vm_count_lock);
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* Counts the message files (one .txt per message whatever the format) in a folder */
+static int vm_count_scan(const char *dir)
+{
+	DIR *vmdir;
+	struct dirent *vment;
+	size_t l;
+	int vmcount = 0;
+
+	if ((vmdir = opendir(dir))) {
+		while ((vment = readdir(vmdir))) {
+			if ((l = strlen(vment->d_name)) > 7 && !strncasecmp(vment->d_name, "msg", 3) && !strcasecmp(vment->d_name + l - 4, ".txt"))
+				vmcount++;
+		}
+		closedir(vmdir);
+	}
+
+	return vmcount;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/* Called with vm_count_lock held. Returns NULL if the directory can't be watched. */
+static struct vm_count *vm_count_get(const char *dir)
+{
+	struct vm_count **p, *vc;
+	size_t l;
+
+	for (p = &vm_count_bypath[cw_hash_string(0, dir) % VM_COUNT_BUCKETS]; (vc = *p); p = &vc->next)
+		if (!strcmp(vc->path, dir))
+			break;
+
+	if (!vc) {
+		l = strlen(dir) + 1;
+		if (!(vc = malloc(sizeof(*vc) + l)))
+			return NULL;
+		memcpy(vc->path, dir, l);
+		vc->wd = -1;
+		vc->gen = 0;
+		vc->valid = 0;
+		vc->count = 0;
+		vc->next = NULL;
+		*p = vc;
+	}
+
+	/* The watch has to be in place before we scan or we could miss a change */
+	if (vc->wd < 0) {
+		if ((vc->wd = inotify_add_watch(vm_count_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)) < 0) {
+			if (errno == ENOSPC)
+				cw_log(CW_LOG_WARNING, "Out of inotify watches - raise fs.inotify.max_user_watches. Mailbox counts will not be cached\n");
+			return NULL;
+		}
+		vc->wd_next = vm_count_bywd[vc->wd % VM_COUNT_BUCKETS];
+		vm_count_bywd[vc->wd % VM_COUNT_BUCKETS] = vc;
+	}
+
+	return vc;
+}
+
+static int vm_count_dir(const char *dir)
+{
+	struct vm_count *vc = NULL;
+	unsigned int gen = 0;
+	int count;
+
+	if (vm_count_fd >= 0) {
+		cw_mutex_lock(&vm_count_lock);
+
+		if ((vc = vm_count_get(dir))) {
+			if (vc->valid) {
+				count = vc->count;
+				cw_mutex_unlock(&vm_count_lock);
+				return count;
+			}
+			gen = vc->gen;
+		}
+
+		cw_mutex_unlock(&vm_count_lock);
+	}
+
+	count = vm_count_scan(dir);
+
+	if (vc) {
+		cw_mutex_lock(&vm_count_lock);
+		/* Only if nothing changed while we were looking */
+		if (vc->gen == gen && vc->wd >= 0) {
+			vc->count = count;
+			vc->valid = 1;
+		}
+		cw_mutex_unlock(&vm_count_lock);
+	}
+
+	return count;
+}
+
+/* Called after we change a folder ourselves */
+static void vm_count_invalidate(const char *dir)
+{
+	struct vm_count *vc;
+
+	if (vm_count_fd < 0)
+		return;
+
+	cw_mutex_lock(&vm_count_lock);
+
+	for (vc = vm_count_bypath[cw_hash_string(0, dir) % VM_COUNT_BUCKETS]; vc; vc = vc->next) {
+		if (!strcmp(vc->path, dir)) {
+			vc->gen++;
+			vc->valid = 0;
+			break;
+		}
+	}
+
+	cw_mutex_unlock(&vm_count_lock);
+}
+
+/* As above given the path of a message file rather than its folder */
+static void vm_count_invalidate_file(const char *fn)
+{
+	char dir[256];
+	char *p;
+
+	cw_copy_string(dir, fn, sizeof(dir));
+	if ((p = strrchr(dir, '/'))) {
+		*p = '\0';
+		vm_count_invalidate(dir);
+	}
+}
+
+static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs);
+
+static void vm_count_notify(const char *path)
+{
+	char mailbox[256];
+	const char *folder, *box, *context;
+	int newmsgs, oldmsgs;
+
+	/* path is .../voicemail/<context>/<mailbox>/<folder> */
+	if (!(folder = strrchr(path, '/')))
+		return;
+	for (box = folder; box > path && *(--box) != '/'; );
+	for (context = box; context > path && *(--context) != '/'; );
+	if (*box != '/' || *context != '/')
+		return;
+
+	snprintf(mailbox, sizeof(mailbox), "%.*s@%.*s",
+		(int)(folder - box - 1), box + 1,
+		(int)(box - context - 1), context + 1);
+
+	messagecount(mailbox, &newmsgs, &oldmsgs);
+
+	cw_manager_event(CW_EVENT_FLAG_CALL, "MessageWaiting",
+		4,
+		cw_msg_tuple("Mailbox", "%s", mailbox),
+		cw_msg_tuple("Waiting", "%d", (newmsgs ? 1 : 0)),
+		cw_msg_tuple("New",     "%d", newmsgs),
+		cw_msg_tuple("Old",     "%d", oldmsgs)
+	);
+}
+
+static void *vm_count_watcher(void *data)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct {
+		char *path;
+		int count;
+	} changed[64];
+	struct inotify_event *ev;
+	struct vm_count *vc;
+	const char *folder;
+	ssize_t len;
+	char *p;
+	int i, n;
+
+	CW_UNUSED(data);
+
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		len = read(vm_count_fd, buf, sizeof(buf));
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (len <= 0) {
+			if (len < 0 && errno != EINTR && errno != EAGAIN) {
+				cw_log(CW_LOG_ERROR, "inotify read failed: %s\n", strerror(errno));
+				break;
+			}
+			continue;
+		}
+
+		n = 0;
+
+		cw_mutex_lock(&vm_count_lock);
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			if (ev->wd < 0) {
+				/* The queue overflowed so we have no idea what changed */
+				for (i = 0; i < VM_COUNT_BUCKETS; i++) {
+					for (vc = vm_count_bypath[i]; vc; vc = vc->next) {
+						vc->gen++;
+						vc->valid = 0;
+					}
+				}
+				continue;
+			}
+
+			for (vc = vm_count_bywd[ev->wd % VM_COUNT_BUCKETS]; vc; vc = vc->wd_next) {
+				if (vc->wd != ev->wd)
+					continue;
+
+				/* Our own changes invalidate the count before the event
+				 * gets here so the count only changes under us if someone
+				 * else changed the folder.
+				 */
+				if (vc->valid && n < (int)arraysize(changed)
+				&& (folder = strrchr(vc->path, '/')) && (!strcmp(folder, "/INBOX") || !strcmp(folder, "/Old"))) {
+					if ((changed[n].path = strdup(vc->path)))
+						changed[n++].count = vc->count;
+				}
+
+				vc->gen++;
+				vc->valid = 0;
+			}
+
+			if (ev->mask & IN_IGNORED) {
+				struct vm_count **q;
+
+				for (q = &vm_count_bywd[ev->wd % VM_COUNT_BUCKETS]; *q; ) {
+					if ((*q)->wd == ev->wd) {
+						(*q)->wd = -1;
+						*q = (*q)->wd_next;
+					} else
+						q = &(*q)->wd_next;
+				}
+			}
+		}
+
+		cw_mutex_unlock(&vm_count_lock);
+
+		for (i = 0; i < n; i++) {
+			if (vm_count_dir(changed[i].path) != changed[i].count) {
+				/* One event per mailbox however many folders changed */
+				size_t l = strrchr(changed[i].path, '/') - changed[i].path;
+				int j;
+
+				for (j = i + 1; j < n; j++) {
+					if (!strncmp(changed[i].path, changed[j].path, l + 1)) {
+						free(changed[j].path);
+						changed[j--] = changed[--n];
+					}
+				}
+
+				vm_count_notify(changed[i].path);
+			}
+			free(changed[i].path);
+		}
+	}
+
+	return NULL;
+}
+
+static void vm_count_start(void)
+{
+	if ((vm_count_fd = inotify_init()) < 0) {
+		cw_log(CW_LOG_WARNING, "inotify unavailable (%s) - mailbox counts will not be cached\n", strerror(errno));
+		return;
+	}
+
+	fcntl(vm_count_fd, F_SETFD, FD_CLOEXEC);
+
+	if (cw_pthread_create(&vm_count_thread, &global_attr_default, vm_count_watcher, NULL)) {
+		cw_log(CW_LOG_WARNING, "Unable to start mailbox watcher - mailbox counts will not be cached\n");
+		vm_count_thread = CW_PTHREADT_NULL;
+		close(vm_count_fd);
+		vm_count_fd = -1;
+	}
+}
+
+static void vm_count_stop(void)
+{
+	struct vm_count *vc;
+	int i;
+
+	if (!pthread_equal(vm_count_thread, CW_PTHREADT_NULL)) {
+		pthread_cancel(vm_count_thread);
+		pthread_join(vm_count_thread, NULL);
+		vm_count_thread = CW_PTHREADT_NULL;
+	}
+
+	if (vm_count_fd >= 0) {
+		close(vm_count_fd);
+		vm_count_fd = -1;
+	}
+
+	for (i = 0; i < VM_COUNT_BUCKETS; i++) {
+		while ((vc = vm_count_bypath[i])) {
+			vm_count_bypath[i] = vc->next;
+			free(vc);
+		}
+		vm_count_bywd[i] = NULL;
+	}
+}
+
+#else
+
+#define vm_count_dir(dir)		vm_count_scan(dir)
+#define vm_count_invalidate(dir)	do { } while (0)
+#define vm_count_invalidate_file(fn)	do { } while (0)
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
 static int count_messages(struct cw_vm_user *vmu, char *dir)
 {
 	CW_UNUSED(vmu);
@@ -1293,19 +1639,12 @@ static int count_messages(struct cw_vm_user *vmu, char *dir)
 	/* Find all .txt files - even if they are not in sequence from 0000 */
 
 	int vmcount = 0;
-	DIR *vmdir = NULL;
-	struct dirent *vment = NULL;
 
 	if (vm_lock_path(dir))
 		return ERROR_LOCK_PATH;
 
-	if ((vmdir = opendir(dir))) {
-		while ((vment = readdir(vmdir))) {
-			if (strlen(vment->d_name) > 7 && !strncmp(vment->d_name + 7, ".txt", 4)) 
-				vmcount++;
-		}
-		closedir(vmdir);
-	}
+	vmcount = vm_count_dir(dir);
+
 	cw_unlock_path(dir);
 	
 	return vmcount;
@@ -1319,6 +1658,8 @@ static void rename_file(char *sfn, char *dfn)
 	snprintf(stxt, sizeof(stxt), "%s.txt", sfn);
 	snprintf(dtxt, sizeof(dtxt), "%s.txt", dfn);
 	rename(stxt, dtxt);
+	vm_count_invalidate_file(sfn);
+	vm_count_invalidate_file(dfn);
 }
 
 static int copy(char *infile, char *outfile)
@@ -1378,6 +1719,7 @@ static void copy_file(char *frompath, char *topath)
 	snprintf(frompath2, sizeof(frompath2), "%s.txt", frompath);
 	snprintf(topath2, sizeof(topath2), "%s.txt", topath);
 	copy(frompath2, topath2);
+	vm_count_invalidate_file(topath);
 }
 
 /*
@@ -1413,6 +1755,7 @@ static int vm_delete(const char *file)
 	 */
 	snprintf(txt, txtsize, "%s.txt", file);
 	unlink(txt);
+	vm_count_invalidate_file(file);
 	return cw_filedelete(file, NULL);
 }
 
@@ -2081,8 +2424,6 @@ static int has_voicemail(const char *mailbox, const char *folder)
 {
 	char fn[256];
 	char tmp[256]="";
-	DIR *dir;
-	struct dirent *de;
 	char *mb, *cur;
 	const char *context;
 
@@ -2109,17 +2450,7 @@ static int has_voicemail(const char *mailbox, const char *folder)
 	} else
 		context = "default";
 	snprintf(fn, sizeof(fn), "%s/voicemail/%s/%s/%s", cw_config[CW_SPOOL_DIR], context, tmp, folder);
-	dir = opendir(fn);
-	if (!dir)
-		return 0;
-	while ((de = readdir(dir))) {
-		if (!strncasecmp(de->d_name, "msg", 3))
-			break;
-	}
-	closedir(dir);
-	if (de)
-		return 1;
-	return 0;
+	return (vm_count_dir(fn) > 0);
 }
 
 
@@ -2127,8 +2458,6 @@ static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 {
 	char fn[256];
 	char tmp[256]="";
-	DIR *dir;
-	struct dirent *de;
 	char *mb, *cur;
 	const char *context;
 
@@ -2165,29 +2494,11 @@ static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 		context = "default";
 	if (newmsgs) {
 		snprintf(fn, sizeof(fn), "%s/voicemail/%s/%s/INBOX", cw_config[CW_SPOOL_DIR], context, tmp);
-		dir = opendir(fn);
-		if (dir) {
-			while ((de = readdir(dir))) {
-				if ((strlen(de->d_name) > 3) && !strncasecmp(de->d_name, "msg", 3) &&
-					!strcasecmp(de->d_name + strlen(de->d_name) - 3, "txt"))
-						(*newmsgs)++;
-					
-			}
-			closedir(dir);
-		}
+		*newmsgs = vm_count_dir(fn);
 	}
 	if (oldmsgs) {
 		snprintf(fn, sizeof(fn), "%s/voicemail/%s/%s/Old", cw_config[CW_SPOOL_DIR], context, tmp);
-		dir = opendir(fn);
-		if (dir) {
-			while ((de = readdir(dir))) {
-				if ((strlen(de->d_name) > 3) && !strncasecmp(de->d_name, "msg", 3) &&
-					!strcasecmp(de->d_name + strlen(de->d_name) - 3, "txt"))
-						(*oldmsgs)++;
-					
-			}
-			closedir(dir);
-		}
+		*oldmsgs = vm_count_dir(fn);
 	}
 	return 0;
 }
@@ -2466,6 +2777,9 @@ static int leave_voicemail(struct cw_channel *chan, char *ext, struct leave_vm_o
 			/* Store information */
 			snprintf(txtfile, sizeof(txtfile), "%s.txt", fn);
 			txt = fopen(txtfile, "w+");
+#ifndef USE_ODBC_STORAGE
+			vm_count_invalidate(dir);
+#endif
 			if (txt) {
 				struct cw_var_t *category = pbx_builtin_getvar_helper(chan, CW_KEYWORD_VM_CATEGORY, "VM_CATEGORY");
 				get_date(date, sizeof(date));
@@ -6127,6 +6441,9 @@ static int unload_module(void)
 	cw_cli_unregister(&show_voicemail_users_cli);
 	cw_cli_unregister(&show_voicemail_zones_cli);
 	cw_uninstall_vm_functions();
+#if !defined(USE_ODBC_STORAGE) && defined(HAVE_SYS_INOTIFY_H)
+	vm_count_stop();
+#endif
 	return res;
 }
 
@@ -6146,6 +6463,10 @@ static int load_module(void)
 	cw_cli_register(&show_voicemail_users_cli);
 	cw_cli_register(&show_voicemail_zones_cli);
 
+#if !defined(USE_ODBC_STORAGE) && defined(HAVE_SYS_INOTIFY_H)
+	vm_count_start();
+#endif
+
 	cw_install_vm_functions(has_voicemail, messagecount);
 
 #if defined(USE_ODBC_STORAGE) && !defined(EXTENDED_ODBC_STORAGE)
@@ -19,6 +19,7 @@
 /* callweaver includes */
 #include "callweaver.h"
 
+#include "callweaver/atomic.h"
 #include "callweaver/lock.h"
 #include "callweaver/file.h"
 #include "callweaver/logger.h"
@@ -42,6 +43,7 @@
 /* standard includes */
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <math.h>
@@ -81,6 +83,14 @@ extern cw_mutex_t conflist_lock;
 // Time to destroy empty conferences (seconds)
 #define CW_CONF_DESTROY_TIME 300
 
+// The conference thread mixes once every tick (milliseconds)
+#define CW_CONF_MIX_MS 20
+#define CW_CONF_MIX_SAMPLES (CW_CONF_SAMPLE_RATE / 1000 * CW_CONF_MIX_MS)
+
+// Formats in which every frame stands alone so one encoding of the
+// shared mix can be sent to all listeners using them
+#define CW_CONF_SHARED_FORMATS (CW_FORMAT_ULAW | CW_FORMAT_ALAW)
+
 // -----------------------------------------------
 #define CW_CONF_SKIP_MS_AFTER_VOICE_DETECTION 	210
 #define CW_CONF_SKIP_MS_WHEN_SILENT     		90
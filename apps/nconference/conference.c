@@ -78,6 +78,8 @@ int add_command_to_queue (
 	cq_last->next = cq;
     }
 
+    cw_cond_signal( &conf->cond ) ;
+
     cw_log(CW_CONF_DEBUG, "Conference, name => %s - Added command %d params: '%d/%s'\n", 
 	      conf->name, cq->command, cq->param_number, cq->param_text );
 
@@ -358,8 +360,11 @@ static void conference_exec( struct cw_conference *conf )
 
     struct cw_conf_member *member, *temp_member ;
     struct timeval empty_start = {0,0}, tv = {0,0} ;
+    struct timespec tick, now ;
 	
     cw_log( CW_CONF_DEBUG, "Entered conference_exec, name => %s\n", conf->name ) ;
+
+    cw_clock_gettime( global_cond_clock_monotonic, &tick ) ;
 	
     //
     // main conference thread loop
@@ -436,11 +441,32 @@ static void conference_exec( struct cw_conference *conf )
 	// CLEANUP //
 	//---------//
 
+	//-----//
+	// MIX //
+	//-----//
+
+	// Mix once per tick. Members and commands wake us as they
+	// arrive so we may get here early.
+	cw_clock_gettime( global_cond_clock_monotonic, &now ) ;
+	if ( now.tv_sec > tick.tv_sec || ( now.tv_sec == tick.tv_sec && now.tv_nsec >= tick.tv_nsec ) ) {
+	    if ( conf->memberlist != NULL )
+		conference_mix( conf ) ;
+
+	    tick.tv_nsec += CW_CONF_MIX_MS * 1000000L ;
+	    if ( tick.tv_nsec >= 1000000000L ) {
+		tick.tv_sec++ ;
+		tick.tv_nsec -= 1000000000L ;
+	    }
+
+	    // If we have fallen more than a tick behind start again from now
+	    if ( now.tv_sec > tick.tv_sec || ( now.tv_sec == tick.tv_sec && now.tv_nsec >= tick.tv_nsec ) )
+		tick = now ;
+	}
+
+	cw_cond_timedwait( &conf->cond, &conf->lock, &tick ) ;
+
 	// release conference mutex
 	cw_mutex_unlock( &conf->lock ) ;
-
-	//Sleep for 1ms (relax)
-	usleep(1000);
     } // end while ( 1 )
 
     //
@@ -547,6 +573,8 @@ static struct cw_conference* create_conf( char* name, struct cw_conf_member* mem
     strncpy( (char*)&(conf->name), name, sizeof(conf->name) - 1 ) ;
     // initialize mutexes
     cw_mutex_init( &conf->lock ) ;
+    cw_cond_init( &conf->cond, &global_condattr_monotonic ) ;
+    cw_mutex_init( &conf->mixlock ) ;
 	
     // add the initial member
     add_member( conf, member) ;
@@ -590,6 +618,8 @@ static struct cw_conference* create_conf( char* name, struct cw_conf_member* mem
 	cw_mutex_unlock( &conf->lock ) ;
 
 	// clean up conference
+	cw_cond_destroy( &conf->cond ) ;
+	cw_mutex_destroy( &conf->mixlock ) ;
 	free( conf ) ;
 	conf = NULL ;
     }
@@ -656,6 +686,9 @@ void remove_conf( struct cw_conference *conf )
 	    }
 
 
+	    conference_mix_free( conf_current ) ;
+	    cw_cond_destroy( &conf_current->cond ) ;
+	    cw_mutex_destroy( &conf_current->mixlock ) ;
 	    free( conf_current ) ;
 	    conf_current = NULL ;
 			
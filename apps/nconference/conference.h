@@ -47,6 +47,16 @@ struct cw_conf_command_queue
     struct cw_conf_command_queue *next;
 };
 
+// The shared mix encoded in one format
+struct cw_conf_mixcache
+{
+	int format ;
+	struct cw_trans_pvt *trans ;
+	unsigned int tick[2] ;		// mix_tick each frame was encoded from
+	struct cw_frame *frame[2] ;	// encoded mix_out
+	struct cw_conf_mixcache *next ;
+} ;
+
 struct cw_conference 
 {
 	// conference name
@@ -68,6 +78,14 @@ struct cw_conference
 	pthread_t conference_thread ;
 	// conference data mutex
 	cw_mutex_t lock ;
+	// signalled when the conference thread has work to do
+	cw_cond_t cond ;
+
+	// Mix made by the conference thread every tick (see conference_mix)
+	cw_mutex_t mixlock ;
+	unsigned int mix_tick ;		// bumped after each mix
+	int16_t mix_out[2][CW_CONF_MIX_SAMPLES] ;	// mix for non-speakers, [1] for masters
+	struct cw_conf_mixcache *mixcache ;	// mix_out encoded for each write format
 	
 	// pointer to next conference in single-linked list
 	struct cw_conference* next ;
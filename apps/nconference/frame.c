@@ -16,6 +16,11 @@
 #include <stdio.h> 
 #define SPANDSP_EXPOSE_INTERNAL_STRUCTURES
 #include <spandsp.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "common.h"
 #include "conference.h"
@@ -43,48 +48,227 @@ static signed char gain_map[] =
       Ring buffer functions
  ******************************************************************************/
 
-static void mix_slinear_frames(int16_t *dst, const int16_t *src, int samples, int startindex, int cbuffersize ) 
+/*
+ * The conference thread mixes once per tick (see conference_mix). Speakers are
+ * summed into 32 bit accumulators, one for ordinary members and one for
+ * consultants (who are only heard by the master). Each speaker gets the
+ * accumulators less their own contribution, everyone else shares a single
+ * copy, and both are saturated back down to 16 bits.
+ */
+
+#if defined(__AVX2__)
+
+static void mix_add(int32_t *acc, const int16_t *src, int n)
 {
-    int i=0;
-    int i_dst = 0;
-    int i_src = 0;
-    int16_t val = 0;
-    int16_t v1;
-    int16_t v2;
+    for (; n >= 8; n -= 8, acc += 8, src += 8) {
+        __m256i s = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)src));
+        _mm256_storeu_si256((__m256i *)acc, _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)acc), s));
+    }
+    for (; n > 0; n--)
+        *(acc++) += *(src++);
+}
 
-    if (dst == NULL)
-        return;
-    if (src == NULL)
-        return;
+static void mix_out(int16_t *dst, const int32_t *a, const int32_t *c, const int16_t *own, int n)
+{
+    for (; n >= 16; n -= 16, dst += 16, a += 16) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)a);
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(a + 8));
+
+        if (c) {
+            lo = _mm256_add_epi32(lo, _mm256_loadu_si256((const __m256i *)c));
+            hi = _mm256_add_epi32(hi, _mm256_loadu_si256((const __m256i *)(c + 8)));
+            c += 16;
+        }
+        if (own) {
+            lo = _mm256_sub_epi32(lo, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)own)));
+            hi = _mm256_sub_epi32(hi, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(own + 8))));
+            own += 16;
+        }
 
-#if  ( APP_NCONFERENCE_DEBUG == 1 )
-    if (vdebug) 
-        cw_log(CW_CONF_DEBUG, 
-                 "STARTING TO MIX: " 
-                 "SRC at %p   DST at %p   BUFFERSIZE: %d Samples %d  STARTINDEX: %d\n",        
-                 src,                   dst,                cbuffersize,  samples,         startindex
-            );
-#endif
+        /* packs works within 128 bit lanes so the quadwords need putting back in order */
+        _mm256_storeu_si256((__m256i *)dst, _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8));
+    }
+    for (; n > 0; n--)
+        *(dst++) = saturate(*(a++) + (c ? *(c++) : 0) - (own ? *(own++) : 0));
+}
 
-    for (i = 0;  i < samples;  ++i) 
-    {
-        i_dst = i;
-        i_src = (startindex - samples + i_dst) % cbuffersize;
-        if (i_src < 0)
-            i_src = i_src + cbuffersize; 
+#elif defined(__SSE2__)
 
-        v1  = dst[i_dst];
-        v2  = src[i_src];
+static inline __m128i mix_widen_lo(__m128i v)
+{
+    return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+}
 
-        val = saturate((int) v1 + (int) v2);
-        dst[i_dst] = val;
+static inline __m128i mix_widen_hi(__m128i v)
+{
+    return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+}
+
+static void mix_add(int32_t *acc, const int16_t *src, int n)
+{
+    for (; n >= 8; n -= 8, acc += 8, src += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)acc, _mm_add_epi32(_mm_loadu_si128((const __m128i *)acc), mix_widen_lo(s)));
+        _mm_storeu_si128((__m128i *)(acc + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + 4)), mix_widen_hi(s)));
+    }
+    for (; n > 0; n--)
+        *(acc++) += *(src++);
+}
+
+static void mix_out(int16_t *dst, const int32_t *a, const int32_t *c, const int16_t *own, int n)
+{
+    for (; n >= 8; n -= 8, dst += 8, a += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)a);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(a + 4));
+
+        if (c) {
+            lo = _mm_add_epi32(lo, _mm_loadu_si128((const __m128i *)c));
+            hi = _mm_add_epi32(hi, _mm_loadu_si128((const __m128i *)(c + 4)));
+            c += 8;
+        }
+        if (own) {
+            __m128i s = _mm_loadu_si128((const __m128i *)own);
+            lo = _mm_sub_epi32(lo, mix_widen_lo(s));
+            hi = _mm_sub_epi32(hi, mix_widen_hi(s));
+            own += 8;
+        }
+
+        _mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(lo, hi));
+    }
+    for (; n > 0; n--)
+        *(dst++) = saturate(*(a++) + (c ? *(c++) : 0) - (own ? *(own++) : 0));
+}
+
+#else
+
+static void mix_add(int32_t *acc, const int16_t *src, int n)
+{
+    for (; n > 0; n--)
+        *(acc++) += *(src++);
+}
+
+static void mix_out(int16_t *dst, const int32_t *a, const int32_t *c, const int16_t *own, int n)
+{
+    for (; n > 0; n--)
+        *(dst++) = saturate(*(a++) + (c ? *(c++) : 0) - (own ? *(own++) : 0));
+}
 
-#if  ( APP_NCONFERENCE_DEBUG == 1 )
-        if (vdebug) 
-            cw_log(CW_CONF_DEBUG,
-                "start %d - DST(%3d) %08d (at %p)   SRC(%3d) %08d (at %p) VAL: %08d \n", 
-                startindex, i_dst,  v1 ,&dst[i_dst],i_src,  v2,  &src[i_src], val);
 #endif
+
+
+/* Returns the ring index of the first of the last 'samples' samples written */
+static inline int mix_window(const struct member_cbuffer *cbuf, int samples)
+{
+    int start = (cbuf->index8k - samples) % CW_CONF_CBUFFER_8K_SIZE;
+
+    return (start < 0 ? start + CW_CONF_CBUFFER_8K_SIZE : start);
+}
+
+/* Called by the conference thread with conf->lock held */
+void conference_mix( struct cw_conference *conf )
+{
+    struct cw_conf_member *member;
+    int32_t mix[2][CW_CONF_MIX_SAMPLES];
+    int start, n;
+
+    memset(mix, 0, sizeof(mix));
+
+    // Take a copy of what each speaker said so that what is taken out
+    // again below is exactly what went in
+    for (member = conf->memberlist; member; member = member->next) {
+        cw_mutex_lock(&member->lock);
+
+        member->mix_in_which = 0;
+        if (member->is_speaking && member->cbuf) {
+            member->mix_in_which = (member->type == MEMBERTYPE_CONSULTANT ? 2 : 1);
+            start = mix_window(member->cbuf, CW_CONF_MIX_SAMPLES);
+
+            n = CW_CONF_CBUFFER_8K_SIZE - start;
+            if (n > CW_CONF_MIX_SAMPLES)
+                n = CW_CONF_MIX_SAMPLES;
+            memcpy(member->mix_in, &member->cbuf->buffer8k[start], n * sizeof(int16_t));
+            if (n < CW_CONF_MIX_SAMPLES)
+                memcpy(member->mix_in + n, member->cbuf->buffer8k, (CW_CONF_MIX_SAMPLES - n) * sizeof(int16_t));
+        }
+
+        cw_mutex_unlock(&member->lock);
+
+        if (member->mix_in_which)
+            mix_add(mix[member->mix_in_which - 1], member->mix_in, CW_CONF_MIX_SAMPLES);
+    }
+
+    cw_mutex_lock(&conf->mixlock);
+
+    mix_out(conf->mix_out[0], mix[0], NULL, NULL, CW_CONF_MIX_SAMPLES);
+    mix_out(conf->mix_out[1], mix[0], mix[1], NULL, CW_CONF_MIX_SAMPLES);
+
+    for (member = conf->memberlist; member; member = member->next) {
+        member->mix_own_valid = (member->mix_in_which == 1);
+        if (member->mix_own_valid)
+            mix_out(member->mix_own, mix[0], (member->type == MEMBERTYPE_MASTER ? mix[1] : NULL), member->mix_in, CW_CONF_MIX_SAMPLES);
+    }
+
+    conf->mix_tick++;
+
+    cw_mutex_unlock(&conf->mixlock);
+}
+
+/* Returns the shared mix in the given format, encoding it at most once per
+ * tick. Called with conf->mixlock held.
+ */
+static struct cw_frame *mix_encoded( struct cw_conference *conf, int format, int master )
+{
+    struct cw_conf_mixcache *cache;
+    struct cw_frame sf, *f;
+
+    for (cache = conf->mixcache; cache; cache = cache->next)
+        if (cache->format == format)
+            break;
+
+    if (!cache) {
+        if (!(cache = calloc(1, sizeof(*cache))))
+            return NULL;
+        if (!(cache->trans = cw_translator_build_path(format, CW_FORMAT_SLINEAR))) {
+            cw_log(CW_LOG_ERROR, "unable to translate the conference mix to %s\n", cw_getformatname(format));
+            free(cache);
+            return NULL;
+        }
+        cache->format = format;
+        cache->next = conf->mixcache;
+        conf->mixcache = cache;
+    }
+
+    if (!cache->frame[master] || cache->tick[master] != conf->mix_tick) {
+        if (cache->frame[master]) {
+            cw_fr_free(cache->frame[master]);
+            cache->frame[master] = NULL;
+        }
+
+        cw_fr_init_ex(&sf, CW_FRAME_VOICE, CW_FORMAT_SLINEAR);
+        sf.data = conf->mix_out[master];
+        sf.datalen = CW_CONF_MIX_SAMPLES * sizeof(int16_t);
+        sf.samples = CW_CONF_MIX_SAMPLES;
+
+        if ((f = cw_translate(cache->trans, &sf, 0)))
+            cache->frame[master] = cw_frisolate(f);
+        cache->tick[master] = conf->mix_tick;
+    }
+
+    return (cache->frame[master] ? cw_frdup(cache->frame[master]) : NULL);
+}
+
+void conference_mix_free( struct cw_conference *conf )
+{
+    struct cw_conf_mixcache *cache;
+
+    while ((cache = conf->mixcache)) {
+        conf->mixcache = cache->next;
+        if (cache->frame[0])
+            cw_fr_free(cache->frame[0]);
+        if (cache->frame[1])
+            cw_fr_free(cache->frame[1]);
+        cw_translator_free_path(cache->trans);
+        free(cache);
     }
 }
 
@@ -114,68 +298,56 @@ struct cw_frame* get_outgoing_frame( struct cw_conference *conf, struct cw_conf_
         return NULL ;
     }
 
+    // The mix is made once per conference tick so frames always carry
+    // a tick's worth of audio. The generator times itself from that.
+    CW_UNUSED(samples);
+
     // ***********************************
     // Mixing procedure
     // ***********************************
 
-    int members =0;
     struct cw_frame *f = NULL;
-    struct cw_conf_member *mixmember;
-    int16_t *dst = member->framedata;
-    int16_t *src = NULL;
+    int master = (member->type == MEMBERTYPE_MASTER);
 
-    memset(member->framedata,0,sizeof(member->framedata));
-
-    mixmember=conf->memberlist;
-    while ( mixmember ) {
-        if (
-            mixmember!=member && mixmember->is_speaking
-            &&
-            ( mixmember->type != MEMBERTYPE_CONSULTANT || ( mixmember->type == MEMBERTYPE_CONSULTANT && member->type == MEMBERTYPE_MASTER ) ) 
-           ) {
-            members++;
+    cw_mutex_lock(&conf->mixlock);
 
-                src = mixmember->cbuf->buffer8k;
-#if  ( APP_NCONFERENCE_DEBUG == 1 )
-            if(vdebug) 
-            cw_log(CW_CONF_DEBUG,
-                "Mixing memb %s Chan %s Ind %d Samples %d "
-                " bufpos: %p with offset %p  FOR MEMBER %s\n", 
-                mixmember->id, mixmember->chan->name, mixmember->cbuf->index8k, samples,
-                member->framedata, member->framedata + CW_FRIENDLY_OFFSET/sizeof(int16_t),
-                member->chan->name
-            );
-#endif
-            mix_slinear_frames( 
-                    dst, src,
-                    samples, mixmember->cbuf->index8k, sizeof(mixmember->cbuf->buffer8k)/sizeof(int16_t) 
-            );
-        }
-        mixmember=mixmember->next;
+    if (!member->mix_own_valid && member->write_format != CW_FORMAT_SLINEAR) {
+        // Everyone who isn't speaking hears the same thing so it only
+        // needs encoding once for each format
+        f = mix_encoded(conf, member->write_format, master);
+        cw_mutex_unlock(&conf->mixlock);
+        return f;
     }
 
+    memcpy(member->framedata, (member->mix_own_valid ? member->mix_own : conf->mix_out[master]), CW_CONF_MIX_SAMPLES * sizeof(int16_t));
+
+    cw_mutex_unlock(&conf->mixlock);
+
     //Building the frame
-    f = calloc(1, sizeof(struct cw_frame));
+    if (member->from_slinear) {
+        struct cw_frame sf;
+
+        cw_fr_init_ex(&sf, CW_FRAME_VOICE, CW_FORMAT_SLINEAR);
+        sf.data = member->framedata;
+        sf.datalen = CW_CONF_MIX_SAMPLES * sizeof(int16_t);
+        sf.samples = CW_CONF_MIX_SAMPLES;
+
+        return ((f = cw_translate(member->from_slinear, &sf, 0)) ? cw_frisolate(f) : NULL);
+    }
+
+    f = cw_fr_new(CW_FRAME_VOICE, CW_FORMAT_SLINEAR, 0);
     if (f != NULL) {
-        cw_fr_init_ex(f, CW_FRAME_VOICE, CW_FORMAT_SLINEAR);
         f->data = member->framedata;
-        f->datalen = samples*sizeof(int16_t);
-        f->samples = samples;
+        f->datalen = CW_CONF_MIX_SAMPLES*sizeof(int16_t);
+        f->samples = CW_CONF_MIX_SAMPLES;
         f->offset = 0;
     } else
         return NULL;
 
 #if  ( APP_NCONFERENCE_DEBUG == 1 )
-    if (vdebug && members) {
+    if (vdebug) {
         int count=0;
-        int16_t *msrc;
-        msrc = f->data + CW_FRIENDLY_OFFSET;
-
-        if (vdebug) cw_log(CW_CONF_DEBUG,
-                        "Offset %d  OFO: %d    Data at %p  SRC at %p memberdata at %p \n",
-                        f->offset, CW_FRIENDLY_OFFSET,
-                        f->data, &msrc, member->framedata 
-                    );
+        int16_t *msrc = f->data;
 
         for( count=0; count<f->samples; count++ ) {
                 cw_log(CW_CONF_DEBUG,
@@ -187,7 +359,6 @@ struct cw_frame* get_outgoing_frame( struct cw_conference *conf, struct cw_conf_
     return f ;
 }
 
-
 static void copy_frame_content( struct member_cbuffer *cbuf, struct cw_frame *sfr ) 
 {
     int count=0;
@@ -258,6 +429,9 @@ int queue_incoming_frame( struct cw_conf_member *member, struct cw_frame *fr )
 
 //    copy_frame_content(member->cbuf, fr); return 0; // This code is to bypass the Smoother on the input frames
 
+    // The conference thread takes its copy for the mix under the same lock
+    cw_mutex_lock( &member->lock ) ;
+
     // Feed the smoother if exists
     if ( member->inSmoother != NULL )
         res = cw_smoother_feed( member->inSmoother, fr );
@@ -272,6 +446,8 @@ int queue_incoming_frame( struct cw_conf_member *member, struct cw_frame *fr )
     else {
         copy_frame_content(member->cbuf, fr);
     }
+
+    cw_mutex_unlock( &member->lock ) ;
 /**/
     return 0 ;
 }
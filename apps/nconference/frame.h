@@ -29,6 +29,8 @@ struct member_cbuffer {
 
 
 
+void conference_mix( struct cw_conference *conf ) ;
+void conference_mix_free( struct cw_conference *conf ) ;
 struct cw_frame* get_outgoing_frame( struct cw_conference *conf, struct cw_conf_member* member, int samples ) ;
 int queue_incoming_frame( struct cw_conf_member* member, struct cw_frame* fr ) ;
 int queue_incoming_silent_frame( struct cw_conf_member *member, int count);
@@ -563,8 +563,14 @@ int member_exec( struct cw_channel* chan, int argc, char **argv ) {
     // clean up
     //
 
-    if ( member != NULL ) 
+    if ( member != NULL ) {
+	// Take the conference lock so the conference thread cannot
+	// miss the wakeup between checking the flag and sleeping
+	cw_mutex_lock( &conf->lock ) ;
 	member->remove_flag = 1 ;
+	cw_cond_signal( &conf->cond ) ;
+	cw_mutex_unlock( &conf->lock ) ;
+    }
 
     cw_log( CW_CONF_DEBUG, "end member event loop, time_entered => %ld -  removal: %d\n", member->time_entered.tv_sec, member->remove_flag ) ;
 
@@ -847,7 +853,16 @@ struct cw_conf_member *create_member( struct cw_channel *chan, int argc, char **
     // set member's audio formats, taking dsp preprocessing into account
     // ( chan->nativeformats, CW_FORMAT_SLINEAR, CW_FORMAT_ULAW, CW_FORMAT_GSM )
     member->read_format = CW_FORMAT_SLINEAR ;
-    member->write_format = CW_FORMAT_SLINEAR ;
+
+    // G.711 members are sent the shared conference mix encoded once
+    // for all of them (see get_outgoing_frame) so they take it in the
+    // channel's own format. Anyone else is translated by the channel.
+    if ( chan->rawwriteformat & CW_CONF_SHARED_FORMATS ) {
+	member->write_format = chan->rawwriteformat ;
+	member->from_slinear = cw_translator_build_path( member->write_format, CW_FORMAT_SLINEAR ) ;
+    }
+    if ( member->from_slinear == NULL )
+	member->write_format = CW_FORMAT_SLINEAR ;
 
     //
     // finish up
@@ -919,6 +934,9 @@ struct cw_conf_member* delete_member( struct cw_conf_member* member )
     // free the smoother
     if (member->inSmoother != NULL)
     	cw_smoother_free(member->inSmoother);
+
+    if (member->from_slinear != NULL)
+	cw_translator_free_path(member->from_slinear);
 	
     // get a pointer to the next 
     // member so we can return it
@@ -93,6 +93,12 @@ struct cw_conf_member
 	// Output frame buffer
 	short framedata[2048];
 
+	// Our part in the conference mix (see conference_mix)
+	int16_t mix_in[CW_CONF_MIX_SAMPLES];	// what we contributed to the last mix
+	int mix_in_which;	// 0 = not mixed, 1 = members, 2 = consultants
+	int16_t mix_own[CW_CONF_MIX_SAMPLES];	// the last mix less mix_in
+	int mix_own_valid;	// mix_own is what we should hear
+
 	// values passed to create_member () via *data
 	enum member_types type ;	// L = ListenOnly, M = Moderator, S = Standard (Listen/Talk)
 	char* id ;			// member id
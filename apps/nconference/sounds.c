@@ -50,7 +50,7 @@ static int conf_play_soundfile( struct cw_conf_member *member, char * file )
 	cw_log(CW_LOG_DEBUG, "Soundfile not found %s - lang: %s\n", file, member->chan->language );
 
 
-    cw_set_write_format( member->chan, CW_FORMAT_SLINEAR );
+    cw_set_write_format( member->chan, member->write_format );
 
     return res;
 }
@@ -34,6 +34,8 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "callweaver.h"
 
@@ -45,6 +47,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/config.h"
 #include "callweaver/pbx.h"
 #include "callweaver/logger.h"
+#include "callweaver/dynstr.h"
 #include "callweaver/utils.h"
 
 #define DATE_FORMAT "%Y-%m-%d %T"
@@ -64,9 +67,24 @@ static const char name[] = "pgsql";
 
 CW_MUTEX_DEFINE_STATIC(pgsql_lock);
 #define CDR_PGSQL_CONF "cdr_pgsql.conf"
+#define DEFAULT_SPOOL_MAX	10240	/* KB */
+
+#define COLUMNS	"calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield"
+#define NCOLUMNS	16
+
 static char conninfo[512];
 static char table[128];
+static char spool[PATH_MAX];
+static off_t spool_max;
+static off_t spool_size;
 static PGconn *conn = NULL;
+static int prepared;
+
+/* Each submission is built as COPY text format rows. If it can't be sent to the
+ * database the rows are appended to the spool file as they are and sent ahead of
+ * later submissions once the database is back.
+ */
+static struct cw_dynstr rows = CW_DYNSTR_INIT;
 
 static int parse_config(void);
 static int pgsql_reconnect(void);
@@ -74,8 +92,12 @@ static int pgsql_reconnect(void);
 static int parse_config(void)
 {
 	struct cw_config *config;
+	struct stat st;
 	char *s;
 
+	spool[0] = '\0';
+	spool_max = (off_t)DEFAULT_SPOOL_MAX * 1024;
+
 	config = cw_config_load(CDR_PGSQL_CONF);
 
 	if (config) {
@@ -98,14 +120,52 @@ static int parse_config(void)
 			strncpy(table, s, sizeof(table));
 		}
 
+		/* where to keep CDRs while the database is unavailable */
+		if ((s = cw_variable_retrieve(config, "global", "spool")))
+			cw_copy_string(spool, s, sizeof(spool));
+		else
+			snprintf(spool, sizeof(spool), "%s/cdr_pgsql.spool", cw_config[CW_SPOOL_DIR]);
+
+		if ((s = cw_variable_retrieve(config, "global", "spoolmax")))
+			spool_max = (off_t)atol(s) * 1024;
+
 	} else {
 		cw_log(CW_LOG_WARNING, "Config file (%s) not found.\n", CDR_PGSQL_CONF);
 	}
 	cw_config_destroy(config);
 
+	/* There may be records left over from last time */
+	spool_size = (spool[0] && !stat(spool, &st) ? st.st_size : 0);
+
 	return 1;
 }
 
+static int pgsql_prepare(void)
+{
+	struct cw_dynstr sql = CW_DYNSTR_INIT;
+	PGresult *res;
+	int i, ret = -1;
+
+	cw_dynstr_printf(&sql, "INSERT INTO %s (" COLUMNS ") VALUES ($1", table);
+	for (i = 2; i <= NCOLUMNS; i++)
+		cw_dynstr_printf(&sql, ",$%d", i);
+	cw_dynstr_printf(&sql, ")");
+
+	if (!sql.error) {
+		res = PQprepare(conn, "cdr_insert", sql.data, 0, NULL);
+		if (PQresultStatus(res) == PGRES_COMMAND_OK)
+			ret = 0;
+		else
+			cw_log(CW_LOG_ERROR, "Unable to prepare CDR insert: %s\n", PQresultErrorMessage(res));
+		PQclear(res);
+	}
+
+	cw_dynstr_free(&sql);
+
+	prepared = !ret;
+	return ret;
+}
+
 static int pgsql_reconnect(void)
 {
 	if (conn != NULL) {
@@ -116,6 +176,7 @@ static int pgsql_reconnect(void)
 			cw_log(CW_LOG_NOTICE, "Existing database connection broken. Trying to reset.\n");
 
 			/* try to reset the connection */
+			prepared = 0;
 			if (PQstatus(conn) != CONNECTION_BAD)
 				PQreset(conn);
 
@@ -131,6 +192,7 @@ static int pgsql_reconnect(void)
 		}
 	}
 
+	prepared = 0;
 	conn = PQconnectdb(conninfo);
 
 	if (PQstatus(conn) == CONNECTION_OK) {
@@ -144,78 +206,279 @@ static int pgsql_reconnect(void)
 	return -1;
 }
 
-static int pgsql_log(struct cw_cdr *batch)
+
+/* Append a string to a COPY row escaping as required by the text format */
+static void pgsql_copy_field(struct cw_dynstr *ds, const char *s, int last)
+{
+	char *p;
+
+	if (!cw_dynstr_need(ds, 2 * strlen(s) + 2)) {
+		p = &ds->data[ds->used];
+
+		for (; *s; s++) {
+			switch (*s) {
+				case '\\': *(p++) = '\\'; *(p++) = '\\'; break;
+				case '\t': *(p++) = '\\'; *(p++) = 't'; break;
+				case '\n': *(p++) = '\\'; *(p++) = 'n'; break;
+				case '\r': *(p++) = '\\'; *(p++) = 'r'; break;
+				default: *(p++) = *s; break;
+			}
+		}
+		*(p++) = (last ? '\n' : '\t');
+		*p = '\0';
+
+		ds->used = p - ds->data;
+	}
+}
+
+static void pgsql_copy_row(struct cw_dynstr *ds, struct cw_cdr *cdr)
 {
-	char sql[2048] = "";
 	char timestr[128];
 	struct tm tm;
+
+	localtime_r(&cdr->start.tv_sec, &tm);
+	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
+
+	pgsql_copy_field(ds, timestr, 0);
+	pgsql_copy_field(ds, cdr->clid, 0);
+	pgsql_copy_field(ds, cdr->src, 0);
+	pgsql_copy_field(ds, cdr->dst, 0);
+	pgsql_copy_field(ds, cdr->dcontext, 0);
+	pgsql_copy_field(ds, cdr->channel, 0);
+	pgsql_copy_field(ds, cdr->dstchannel, 0);
+	pgsql_copy_field(ds, cdr->lastapp, 0);
+	pgsql_copy_field(ds, cdr->lastdata, 0);
+	cw_dynstr_printf(ds, "%d\t%d\t", cdr->duration, cdr->billsec);
+	pgsql_copy_field(ds, cw_cdr_disp2str(cdr->disposition), 0);
+	cw_dynstr_printf(ds, "%d\t", cdr->amaflags);
+	pgsql_copy_field(ds, cdr->accountcode, 0);
+	pgsql_copy_field(ds, cdr->uniqueid, 0);
+	pgsql_copy_field(ds, cdr->userfield, 1);
+}
+
+
+/* Insert a single CDR using the prepared statement. Everything goes as text,
+ * which needs no escaping and lets the server convert integers to whatever
+ * type the table uses.
+ */
+static int pgsql_insert(struct cw_cdr *cdr)
+{
+	char timestr[128];
+	struct tm tm;
+	char duration[32], billsec[32], amaflags[32];
+	const char *values[NCOLUMNS];
+	PGresult *res;
+	int ret = 0;
+
+	if (!prepared && pgsql_prepare())
+		return -1;
+
+	localtime_r(&cdr->start.tv_sec, &tm);
+	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
+
+	snprintf(duration, sizeof(duration), "%d", cdr->duration);
+	snprintf(billsec, sizeof(billsec), "%d", cdr->billsec);
+	snprintf(amaflags, sizeof(amaflags), "%d", cdr->amaflags);
+
+	values[0] = timestr;
+	values[1] = cdr->clid;
+	values[2] = cdr->src;
+	values[3] = cdr->dst;
+	values[4] = cdr->dcontext;
+	values[5] = cdr->channel;
+	values[6] = cdr->dstchannel;
+	values[7] = cdr->lastapp;
+	values[8] = cdr->lastdata;
+	values[9] = duration;
+	values[10] = billsec;
+	values[11] = cw_cdr_disp2str(cdr->disposition);
+	values[12] = amaflags;
+	values[13] = cdr->accountcode;
+	values[14] = cdr->uniqueid;
+	values[15] = cdr->userfield;
+
+	res = PQexecPrepared(conn, "cdr_insert", NCOLUMNS, values, NULL, NULL, 0);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		cw_log(CW_LOG_ERROR, "Failed to insert call detail record into database: %s\n", PQresultErrorMessage(res));
+		ret = -1;
+	}
+	PQclear(res);
+
+	return ret;
+}
+
+
+static int pgsql_copy_end(const char *errmsg)
+{
+	PGresult *res;
+	int ret = -1;
+
+	if (PQputCopyEnd(conn, errmsg) == 1) {
+		while ((res = PQgetResult(conn))) {
+			if (PQresultStatus(res) == PGRES_COMMAND_OK)
+				ret = 0;
+			else if (!errmsg)
+				cw_log(CW_LOG_ERROR, "Failed to copy call detail records into database: %s\n", PQresultErrorMessage(res));
+			PQclear(res);
+		}
+	}
+
+	return (errmsg ? -1 : ret);
+}
+
+static int pgsql_copy_start(void)
+{
+	char sql[256];
 	PGresult *res;
-	char *clid=NULL, *dcontext=NULL, *channel=NULL, *dstchannel=NULL, *lastapp=NULL, *lastdata=NULL;
-	char *uniqueid=NULL, *userfield=NULL;
-	struct cw_cdr *cdrset, *cdr;
+	int ret = 0;
+
+	snprintf(sql, sizeof(sql), "COPY %s (" COLUMNS ") FROM STDIN", table);
+
+	res = PQexec(conn, sql);
+	if (PQresultStatus(res) != PGRES_COPY_IN) {
+		cw_log(CW_LOG_ERROR, "Unable to start copying call detail records into database: %s\n", PQresultErrorMessage(res));
+		ret = -1;
+	}
+	PQclear(res);
+
+	return ret;
+}
+
+/* Send a batch of rows with a single COPY. The COPY either succeeds or fails as a whole. */
+static int pgsql_copy(const char *data, size_t len)
+{
+	if (pgsql_copy_start())
+		return -1;
+
+	if (PQputCopyData(conn, data, len) != 1)
+		return pgsql_copy_end("write failed");
+
+	return pgsql_copy_end(NULL);
+}
+
+
+static void pgsql_spool(const char *data, size_t len, int count)
+{
+	int fd;
+
+	if (!spool[0] || spool_size + len > spool_max) {
+		cw_log(CW_LOG_ERROR, "CDR spool %s, %d call detail records lost!\n", (spool[0] ? "full" : "disabled"), count);
+		return;
+	}
+
+	if ((fd = open_cloexec(spool, O_WRONLY | O_CREAT | O_APPEND, 0600)) >= 0) {
+		if (cw_write_all(fd, data, len) == len) {
+			spool_size += len;
+			cw_log(CW_LOG_WARNING, "%d call detail records spooled to %s for later\n", count, spool);
+		} else
+			cw_log(CW_LOG_ERROR, "Write to CDR spool %s failed: %s. %d call detail records lost!\n", spool, strerror(errno), count);
+		close(fd);
+	} else
+		cw_log(CW_LOG_ERROR, "Unable to open CDR spool %s: %s. %d call detail records lost!\n", spool, strerror(errno), count);
+}
+
+/* Send anything spooled to the database. This must succeed before anything newer is sent. */
+static int pgsql_unspool(void)
+{
+	char buf[65536];
+	char *bad;
+	ssize_t n;
+	int fd, ret, rejected = 0;
+
+	if ((fd = open_cloexec(spool, O_RDONLY, 0)) < 0) {
+		if (errno == ENOENT) {
+			spool_size = 0;
+			return 0;
+		}
+		cw_log(CW_LOG_ERROR, "Unable to open CDR spool %s: %s\n", spool, strerror(errno));
+		return -1;
+	}
+
+	if (!(ret = pgsql_copy_start())) {
+		while ((n = read(fd, buf, sizeof(buf))) > 0) {
+			if (PQputCopyData(conn, buf, n) != 1)
+				break;
+		}
+		if (n) {
+			if (n < 0)
+				cw_log(CW_LOG_ERROR, "Unable to read CDR spool %s: %s\n", spool, strerror(errno));
+			ret = pgsql_copy_end("spool read failed");
+		} else
+			rejected = ret = pgsql_copy_end(NULL);
+	}
+
+	close(fd);
+
+	if (!ret) {
+		cw_log(CW_LOG_NOTICE, "Call detail records spooled in %s have been copied to the database\n", spool);
+		unlink(spool);
+		spool_size = 0;
+	} else if (rejected && PQstatus(conn) == CONNECTION_OK) {
+		/* The database is there but didn't like what we sent. Trying again
+		 * isn't going to help so move the spool aside for someone to look at.
+		 */
+		if ((bad = alloca(strlen(spool) + sizeof(".bad")))) {
+			sprintf(bad, "%s.bad", spool);
+			if (!rename(spool, bad)) {
+				cw_log(CW_LOG_ERROR, "Call detail records spooled in %s were rejected by the database. Moved to %s\n", spool, bad);
+				spool_size = 0;
+			}
+		}
+	}
+
+	return ret;
+}
+
+
+static int pgsql_log(struct cw_cdr *batch)
+{
+	struct cw_cdr *cdrset, *cdr, *first = NULL;
+	int count = 0;
+	int ret = -1;
 
 	cw_mutex_lock(&pgsql_lock);
 
+	cw_dynstr_reset(&rows);
+
 	while ((cdrset = batch)) {
 		batch = batch->batch_next;
 
 		while ((cdr = cdrset)) {
 			cdrset = cdrset->next;
 
-			localtime_r(&cdr->start.tv_sec, &tm);
-			strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
-
-			/* maximum space needed would be if all characters needed to be escaped, plus a trailing NULL */
-			clid = alloca(strlen(cdr->clid) * 2 + 1);
-			PQescapeString(clid, cdr->clid, strlen(cdr->clid));
-			dcontext = alloca(strlen(cdr->dcontext) * 2 + 1);
-			PQescapeString(dcontext, cdr->dcontext, strlen(cdr->dcontext));
-			channel = alloca(strlen(cdr->channel) * 2 + 1);
-			PQescapeString(channel, cdr->channel, strlen(cdr->channel));
-			dstchannel = alloca(strlen(cdr->dstchannel) * 2 + 1);
-			PQescapeString(dstchannel, cdr->dstchannel, strlen(cdr->dstchannel));
-			lastapp = alloca(strlen(cdr->lastapp) * 2 + 1);
-			PQescapeString(lastapp, cdr->lastapp, strlen(cdr->lastapp));
-			lastdata = alloca(strlen(cdr->lastdata) * 2 + 1);
-			PQescapeString(lastdata, cdr->lastdata, strlen(cdr->lastdata));
-			uniqueid = alloca(strlen(cdr->uniqueid) * 2 + 1);
-			PQescapeString(uniqueid, cdr->uniqueid, strlen(cdr->uniqueid));
-			userfield = alloca(strlen(cdr->userfield) * 2 + 1);
-			PQescapeString(userfield, cdr->userfield, strlen(cdr->userfield));
-
-			cw_log(CW_LOG_DEBUG,"Inserting a CDR record.\n");
-
-			snprintf(sql, sizeof(sql), "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
-				"lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES"
-				" ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%d,%d,'%s',%d,'%s','%s','%s')",
-				table, timestr, clid, cdr->src, cdr->dst, dcontext,channel, dstchannel, lastapp, lastdata,
-				cdr->duration, cdr->billsec, cw_cdr_disp2str(cdr->disposition), cdr->amaflags, cdr->accountcode, uniqueid, userfield);
-
-			cw_log(CW_LOG_DEBUG, "SQL command executed:  %s\n", sql);
-
-			/* check if database connection is still good */
-			if (!pgsql_reconnect()) {
-				cw_log(CW_LOG_ERROR, "Unable to reconnect to database server. Some calls will not be logged!\n");
-				cw_mutex_unlock(&pgsql_lock);
-				return -1;
-			}
+			if (!first)
+				first = cdr;
+			pgsql_copy_row(&rows, cdr);
+			count++;
+		}
+	}
 
-			res = PQexec(conn, sql);
+	if (rows.error) {
+		cw_log(CW_LOG_ERROR, "Out of memory! %d call detail records lost!\n", count);
+		cw_dynstr_free(&rows);
+		goto out;
+	}
 
-			if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-				cw_log(CW_LOG_ERROR, "Failed to insert call detail record into database!\n");
-				cw_log(CW_LOG_ERROR, "Reason: %s\n", PQresultErrorMessage(res));
-				PQclear(res);
-				cw_mutex_unlock(&pgsql_lock);
-				return -1;
-			}
+	cw_log(CW_LOG_DEBUG, "Inserting %d CDR records.\n", count);
 
-			PQclear(res);
-		}
-	}
+	/* check if database connection is still good */
+	if (pgsql_reconnect() < 0 || (spool_size && pgsql_unspool()))
+		goto spool;
+
+	if (count == 1)
+		ret = pgsql_insert(first);
+	else
+		ret = pgsql_copy(rows.data, rows.used);
+
+	if (!ret)
+		goto out;
 
+spool:
+	pgsql_spool(rows.data, rows.used, count);
+
+out:
 	cw_mutex_unlock(&pgsql_lock);
-	return 0;
+	return ret;
 }
 
 
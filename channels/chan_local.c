@@ -193,7 +193,7 @@ static void check_bridge(struct local_pvt *p, int isoutbound)
 	   frames on the owner channel (because they would be transferred to the
 	   outbound channel during the masquerade)
 	*/
-	if (isoutbound && p->chan->_bridge /* Not cw_bridged_channel!  Only go one step! */ && !p->owner->readq) {
+	if (isoutbound && p->chan->_bridge /* Not cw_bridged_channel!  Only go one step! */ && !cw_channel_readq_len(p->owner)) {
 		/* Masquerade bridged channel into owner */
 		/* Lock everything we need, one by one, and give up if
 		   we can't get everything.  Remember, we'll get another
@@ -216,7 +216,7 @@ static void check_bridge(struct local_pvt *p, int isoutbound)
 	   when the local channels go away.
 	*/
 #if 0
-	} else if (!isoutbound && p->owner && p->owner->_bridge && p->chan && !p->chan->readq) {
+	} else if (!isoutbound && p->owner && p->owner->_bridge && p->chan && !cw_channel_readq_len(p->chan)) {
 		/* Masquerade bridged channel into chan */
 		if (!cw_channel_trylock(p->owner->_bridge)) {
 			if (!p->owner->_bridge->_softhangup) {
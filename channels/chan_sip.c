@@ -111,6 +111,10 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #define DEFAULT_REGISTRATION_TIMEOUT    20
 #define DEFAULT_MAX_FORWARDS    "70"
 
+#define DEFAULT_RECVBATCH     16        /*!< Datagrams read per wakeup on each connection */
+#define MAX_RECVBATCH         256
+#define MAX_READERS           64        /*!< Max reader sockets/threads per connection */
+
 #ifdef ENABLE_SRTP
 #  define SRTP_MASTER_LEN	30
 #  define SRTP_MASTERKEY_LEN	16
@@ -686,6 +690,8 @@ static struct sched_context *sched;
 static cw_io_context_t io;
 
 #define SIP_MAX_LINES         64            /*!< Max amount of lines in SIP attachment (like SDP) */
+#define SIP_MAX_HEADERS       64            /*!< Max headers indexed per message (more are found by scanning) */
+#define SIP_HDR_BUCKETS       32            /*!< Hash buckets in the per-message header index */
 
 #define DEC_CALL_LIMIT    0
 #define INC_CALL_LIMIT    1
@@ -693,6 +699,12 @@ static cw_io_context_t io;
 static struct cw_codec_pref prefs;
 
 
+/*! \brief sip_hdr_entry: An entry in a message's header index */
+struct sip_hdr_entry {
+	unsigned int line;		/*!< Offset of the start of the header line */
+	unsigned char next;		/*!< 1 + index of the next header in the same bucket, 0 if none */
+};
+
 /*! \brief sip_request: The data grabbed from the UDP socket */
 struct sip_request {
 	struct cw_object obj;
@@ -733,6 +745,15 @@ struct sip_request {
 	unsigned int from;
 	unsigned int from_len;
 
+	/* Header index built by parse_request. Headers are hashed by their
+	 * full name (compact forms are expanded) and each bucket chains its
+	 * headers in message order. If hdr_count is zero the message has not
+	 * been indexed and lookups fall back to scanning.
+	 */
+	unsigned int hdr_count;
+	unsigned char hdr_bucket[SIP_HDR_BUCKETS];
+	struct sip_hdr_entry hdr[SIP_MAX_HEADERS];
+
 	struct cw_dynstr pkt;
 };
 
@@ -1198,10 +1219,12 @@ static int sip_poke_peer(void *data);
 
 
 static int sipsock_read(struct cw_connection *conn);
+static int sipsock_read_batch(struct cw_connection *conn, struct cw_udpfromto_msg *msgs, int n);
 
 static struct cw_connection_tech tech_sip = {
 	.name = "SIP",
 	.read = sipsock_read,
+	.read_batch = sipsock_read_batch,
 };
 
 
@@ -2039,6 +2062,7 @@ static int transaction_retransmit(void *data)
     msg->uriresp_len = sizeof("408 Timeout") - 1;
     msg->method = SIP_RESPONSE;
     msg->hdr_start = msg->body_start = msg->pkt.used;
+    msg->hdr_count = 0;
     msg->tag = msg->taglen = 0;
     handle_message(msg);
 
@@ -2140,7 +2164,9 @@ struct parse_request_state {
 	int state;
 	int key, value;
 	int content_length;
+	unsigned char hdr_tail[SIP_HDR_BUCKETS];
 	unsigned int error:1;
+	unsigned int hdr_overflow:1;
 };
 
 static inline void parse_request_init(struct parse_request_state *pstate)
@@ -3707,12 +3733,95 @@ static char *get_sdp(struct sip_request *req, const char *name, size_t len, int
 }
 
 
+/*! \brief  sip_hdr_hash: Case insensitive hash of a header name, compact forms hash as their full name */
+static unsigned int sip_hdr_hash(const char *name, size_t name_len)
+{
+	unsigned int hash = 0;
+	size_t j;
+
+	if (name_len == 1) {
+		for (j = 0; j < arraysize(sip_hdr_shortname); j++) {
+			if (tolower(sip_hdr_shortname[j][0]) == tolower(name[0])) {
+				name = sip_hdr_fullname[j];
+				name_len = strlen(name);
+				break;
+			}
+		}
+	}
+
+	for (j = 0; j < name_len; j++)
+		hash = cw_hash_add(hash, tolower(name[j]));
+
+	return hash % SIP_HDR_BUCKETS;
+}
+
+
+/*! \brief  sip_hdr_index: Add the header line starting at the given offset to the message's header index */
+static void sip_hdr_index(struct parse_request_state *state, struct sip_request *req, int line)
+{
+	unsigned int bucket;
+	int len;
+
+	if (state->hdr_overflow)
+		return;
+
+	if (req->hdr_count == SIP_MAX_HEADERS) {
+		/* Too many to index. Lookups will have to scan. */
+		state->hdr_overflow = 1;
+		req->hdr_count = 0;
+		return;
+	}
+
+	for (len = 0; req->pkt.data[line + len] && req->pkt.data[line + len] != ':' && req->pkt.data[line + len] != ' ' && req->pkt.data[line + len] != '\t'; len++);
+
+	bucket = sip_hdr_hash(&req->pkt.data[line], len);
+
+	req->hdr[req->hdr_count].line = line;
+	req->hdr[req->hdr_count].next = 0;
+	req->hdr_count++;
+
+	if (state->hdr_tail[bucket])
+		req->hdr[state->hdr_tail[bucket] - 1].next = req->hdr_count;
+	else
+		req->hdr_bucket[bucket] = req->hdr_count;
+	state->hdr_tail[bucket] = req->hdr_count;
+}
+
+
 static char *__get_header(const struct sip_request *req, const char *name, size_t name_len, const char *alias, size_t alias_len, int *i)
 {
 	/* We don't return NULL, so get_header is always a valid pointer */
 	char *ret = (char *)"";
 	int len;
 
+	if (req->hdr_count) {
+		const struct sip_hdr_entry *hdr;
+		unsigned int n;
+
+		for (n = req->hdr_bucket[sip_hdr_hash(name, name_len)]; n; n = hdr->next) {
+			char *p;
+
+			hdr = &req->hdr[n - 1];
+			if (hdr->line < *i)
+				continue;
+
+			p = &req->pkt.data[hdr->line];
+
+			if (((len = name_len),CW_KEYCMP(p, name, name_len))
+			|| (((len = alias_len) && CW_KEYCMP(p, alias, alias_len)))) {
+				while (p[len] == ' ' || p[len] == '\t') len++;
+				if (p[len] == ':') {
+					*i = hdr->line + 1;
+					for (ret = &p[len + 1]; ret[0] == ' ' || ret[0] == '\t'; ret++);
+					return ret;
+				}
+			}
+		}
+
+		*i = req->body_start;
+		return ret;
+	}
+
 	while (*i < req->body_start) {
 		char *p = &req->pkt.data[*i];
 		int l = strlen(&req->pkt.data[*i]);
@@ -4058,6 +4167,9 @@ static int parse_request(struct parse_request_state *state, struct sip_request *
 {
 	int j;
 
+	req->hdr_count = 0;
+	memset(req->hdr_bucket, 0, sizeof(req->hdr_bucket));
+
 	for (state->i = 0; req->pkt.data[state->i]; state->i++) {
 		switch (state->state) {
 			case 0: /* Start of message, scanning method, looking for white space */
@@ -4146,6 +4258,7 @@ static int parse_request(struct parse_request_state *state, struct sip_request *
 					req->pkt.data[state->i - 1] = '\0';
 				req->pkt.data[state->i] = '\0';
 				state->state = 3;
+				sip_hdr_index(state, req, state->key);
 				if (CW_HDRCMP(&req->pkt.data[state->key], SIP_HDR_VIA)) {
 					/* RFC 3261 8.1.3.3: Vias
 					 * If more than one Via header field is present in a response, the UAC
@@ -13514,12 +13627,42 @@ static int handle_message(struct sip_request *msg)
 }
 
 
+/*! \brief  sipsock_parse: Check and parse a message received on a SIP socket
+ * Returns 0 if the message should be passed on to transaction_recv
+ */
+static int sipsock_parse(struct cw_connection *conn, struct sip_request *req)
+{
+	struct parse_request_state pstate;
+
+	if (req->ouraddr.sa.sa_family != AF_UNSPEC)
+		cw_sockaddr_set_port(&req->ouraddr.sa, cw_sockaddr_get_port(&conn->addr));
+
+	/* If this is IPv4 and either of the first two bytes are less than 32 this must be a stun packet */
+	if (req->recvdaddr.sa.sa_family == AF_INET && (req->pkt.data[0] < ' ' || req->pkt.data[1] < ' ')) {
+		cw_stun_handle_packet(conn->sock, &req->recvdaddr.sin, (unsigned char *)req->pkt.data, req->pkt.used, NULL);
+		return -1;
+	}
+
+	if ((req->debug = sip_debug_test_addr(&req->recvdaddr.sa))) {
+		cw_log(CW_LOG_DEBUG, "<-- SIP received from %#l@ to %#l@:\n%s---\n", &req->recvdaddr.sa, &req->ouraddr.sa, req->pkt.data);
+	}
+
+	parse_request_init(&pstate);
+
+	if (parse_request(&pstate, req)) {
+		cw_log(CW_LOG_DEBUG, "Unable to parse message\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
 /*! \brief  sipsock_read: Read data from SIP socket */
 static int sipsock_read(struct cw_connection *conn)
 {
 	static int oom = 0;
 	struct sip_request *req;
-	struct parse_request_state pstate;
 	socklen_t sa_from_len, sa_to_len;
 	int msgsize, msgread;
 
@@ -13563,26 +13706,67 @@ static int sipsock_read(struct cw_connection *conn)
 	req->pkt.data[msgsize] = '\0';
 	req->pkt.used = msgread;
 
-	if (req->ouraddr.sa.sa_family != AF_UNSPEC)
-		cw_sockaddr_set_port(&req->ouraddr.sa, cw_sockaddr_get_port(&conn->addr));
+	if (!sipsock_parse(conn, req))
+		transaction_recv(req);
 
-	/* If this is IPv4 and either of the first two bytes are less than 32 this must be a stun packet */
-	if (req->recvdaddr.sa.sa_family == AF_INET && (req->pkt.data[0] < ' ' || req->pkt.data[1] < ' ')) {
-		cw_stun_handle_packet(conn->sock, &req->recvdaddr.sin, (unsigned char *)req->pkt.data, req->pkt.used, NULL);
-	} else {
-		if ((req->debug = sip_debug_test_addr(&req->recvdaddr.sa))) {
-			cw_log(CW_LOG_DEBUG, "<-- SIP received from %#l@ to %#l@:\n%s---\n", &req->recvdaddr.sa, &req->ouraddr.sa, req->pkt.data);
+	cw_object_put(req);
+	return 1;
+}
+
+
+/*! \brief  sipsock_read_batch: Handle a batch of datagrams read from a SIP socket
+ *
+ * The whole batch is parsed before any of it is passed on to the
+ * transaction layer.
+ */
+static int sipsock_read_batch(struct cw_connection *conn, struct cw_udpfromto_msg *msgs, int n)
+{
+	static int oom = 0;
+	struct sip_request *reqs[n];
+	struct sip_request *req;
+	int i, nreqs;
+
+	for (nreqs = i = 0; i < n; i++) {
+		if ((msgs[i].flags & MSG_TRUNC)) {
+			cw_log(CW_LOG_WARNING, "SIP: Discarding oversize message from %#l@\n", msgs[i].from);
+			continue;
 		}
 
-		parse_request_init(&pstate);
+		if ((req = sip_message_new())) {
+			req->conn = cw_object_dup(conn);
+			cw_dynstr_init(&req->pkt, 0, 1);
+			cw_dynstr_need(&req->pkt, msgs[i].len + 1);
+		}
 
-		if (!parse_request(&pstate, req)) {
-			transaction_recv(req);
-		} else
-			cw_log(CW_LOG_DEBUG, "Unable to parse message\n");
+		if (!req || req->pkt.error) {
+			if (!oom) {
+				cw_log(CW_LOG_WARNING, "Out of memory!\n");
+				oom = 1;
+			}
+			if (req)
+				cw_object_put(req);
+			continue;
+		}
+		oom = 0;
+
+		memcpy(req->pkt.data, msgs[i].buf, msgs[i].len);
+		req->pkt.data[msgs[i].len] = '\0';
+		req->pkt.used = msgs[i].len;
+		memcpy(&req->recvdaddr, msgs[i].from, (msgs[i].fromlen < sizeof(req->recvdaddr) ? msgs[i].fromlen : sizeof(req->recvdaddr)));
+		if (msgs[i].to->sa_family != AF_UNSPEC)
+			memcpy(&req->ouraddr, msgs[i].to, (msgs[i].tolen < sizeof(req->ouraddr) ? msgs[i].tolen : sizeof(req->ouraddr)));
+
+		if (!sipsock_parse(conn, req))
+			reqs[nreqs++] = req;
+		else
+			cw_object_put(req);
+	}
+
+	for (i = 0; i < nreqs; i++) {
+		transaction_recv(reqs[i]);
+		cw_object_put(reqs[i]);
 	}
 
-	cw_object_put(req);
 	return 1;
 }
 
@@ -13648,6 +13832,12 @@ static int do_monitor_dialogue_one(struct cw_object *obj, void *data)
 	/* If we can't get the lock it's not a problem. We'll just try again next time. */
 	if (!cw_mutex_trylock(&dialogue->lock)) {
 		if (dialogue->rtp && dialogue->owner && (dialogue->owner->_state == CW_STATE_UP) && !cw_sockaddr_is_specific(&dialogue->redirip.sa)) {
+			/* Media relayed in-core by a native bridge doesn't pass through sip_read */
+			if (dialogue->rtp->lastrelayrx > dialogue->lastrtprx)
+				dialogue->lastrtprx = dialogue->rtp->lastrelayrx;
+			if (dialogue->rtp->lastrelaytx > dialogue->lastrtptx)
+				dialogue->lastrtptx = dialogue->rtp->lastrelaytx;
+
 			if (dialogue->lastrtptx && dialogue->rtpkeepalive && args->t > dialogue->lastrtptx + dialogue->rtpkeepalive) {
 				/* Need to send an empty RTP packet */
 				dialogue->lastrtptx = args->t;
@@ -14415,6 +14605,7 @@ static struct sip_user *build_user(const char *name, struct cw_variable *v, int
          */
         v = v->next;
     }
+    cw_acl_compile(user->acl);
 
     cw_copy_flags(user, &userflags, mask.flags);
 
@@ -14812,6 +15003,7 @@ ipaddr:
          */
         v = v->next;
     }
+    cw_acl_compile(peer->acl);
     if (!cw_test_flag((&global_flags_page2), SIP_PAGE2_IGNOREREGEXPIRE) && cw_test_flag(&peer->flags_page2, SIP_PAGE2_DYNAMIC)  &&  realtime)
     {
         time_t nowtime;
@@ -14871,6 +15063,24 @@ static struct cw_rtp *sip_get_vrtp_peer(struct cw_channel *chan)
     return rtp;
 }
 
+/*! \brief  sip_get_relay_peer: Returns null if the audio can't be relayed in-core (part of RTP interface) */
+static struct cw_rtp *sip_get_relay_peer(struct cw_channel *chan)
+{
+    struct sip_pvt *p;
+    struct cw_rtp *rtp = NULL;
+
+    p = chan->tech_pvt;
+    if (!p)
+        return NULL;
+
+    /* The relay only carries audio RTP. T.38 and video need the frame path. */
+    cw_mutex_lock(&p->lock);
+    if (p->rtp && !p->udptl_active && (!p->vrtp || cw_rtp_get_peer(p->vrtp)->sa_family == AF_UNSPEC))
+        rtp = p->rtp;
+    cw_mutex_unlock(&p->lock);
+    return rtp;
+}
+
 /*! \brief  sip_set_rtp_peer: Set the RTP peer for this call */
 static int sip_set_rtp_peer(struct cw_channel *chan, struct cw_rtp *rtp, struct cw_rtp *vrtp, int codecs, int nat_active)
 {
@@ -15440,6 +15650,7 @@ static struct cw_rtp_protocol sip_rtp =
     get_vrtp_info: sip_get_vrtp_peer,
     set_rtp_peer: sip_set_rtp_peer,
     get_codec: sip_get_codec,
+    get_relay_info: sip_get_relay_peer,
 };
 
 /*! \brief  sip_udptl: Interface structure with callbacks used to connect to UDPTL module */
@@ -15937,6 +16148,8 @@ static int sip_reload_config(void)
             cw_log(CW_LOG_ERROR, "sip.conf line %d: %s is not valid here\n", v->lineno, v->name);
     }
 
+    cw_acl_compile(localaddr);
+
     if (!allow_external_domains && CW_LIST_EMPTY(&domain_list))
     {
         cw_log(CW_LOG_WARNING, "To disallow external domains, you need to configure local SIP domains.\n");
@@ -15960,6 +16173,8 @@ static int sip_reload_config(void)
             char *addr = NULL;
             char *port = NULL;
 	    int conntos = tos;
+	    int connbatch = DEFAULT_RECVBATCH;
+	    int connreaders = 1;
 
             for (v = cw_variable_browse(cfg, cat); v; v = v->next) {
                 if (!strcasecmp(v->name, "bindaddr"))
@@ -15970,6 +16185,16 @@ static int sip_reload_config(void)
                     if (!strcasecmp(v->name, "tos")) {
                         if (cw_str2tos(v->value, &conntos))
                             cw_log(CW_LOG_WARNING, "Invalid \"tos\" value at line %d, should be 'lowdelay', 'throughput', 'reliability', 'mincost', or 'none'\n", v->lineno);
+		    } else if (!strcasecmp(v->name, "recvbatch")) {
+                        if (sscanf(v->value, "%d", &connbatch) != 1 || connbatch < 1 || connbatch > MAX_RECVBATCH) {
+                            cw_log(CW_LOG_WARNING, "Invalid \"recvbatch\" value at line %d, should be between 1 and %d\n", v->lineno, MAX_RECVBATCH);
+                            connbatch = DEFAULT_RECVBATCH;
+                        }
+		    } else if (!strcasecmp(v->name, "readers")) {
+                        if (sscanf(v->value, "%d", &connreaders) != 1 || connreaders < 1 || connreaders > MAX_READERS) {
+                            cw_log(CW_LOG_WARNING, "Invalid \"readers\" value at line %d, should be between 1 and %d\n", v->lineno, MAX_READERS);
+                            connreaders = 1;
+                        }
 		    } else
                         cw_log(CW_LOG_ERROR, "sip.conf line %d: \"%s\" is not valid here\n", v->lineno, v->name);
                 }
@@ -15998,13 +16223,21 @@ static int sip_reload_config(void)
 
                     for (ai = addrs; ai; ai = ai->ai_next) {
                         struct cw_connection *conn;
-
-                        if ((conn = cw_connection_listen(SOCK_DGRAM, ai->ai_addr, ai->ai_addrlen, &tech_sip, NULL))) {
-                            cw_log(CW_LOG_NOTICE, "Listening on %#l@\n", ai->ai_addr);
-
-                            cw_udpfromto_init(conn->sock, conn->addr.sa_family);
-                            if (conntos)
-                                setsockopt(conn->sock, IPPROTO_IP, IP_TOS, &conntos, sizeof(conntos));
+                        int reader;
+
+                        /* With more than one reader each gets its own socket bound to the
+                         * same address and the kernel spreads incoming traffic across them.
+                         */
+                        for (reader = 0; reader < connreaders; reader++) {
+                            if ((conn = cw_connection_listen_batch(SOCK_DGRAM, ai->ai_addr, ai->ai_addrlen, &tech_sip, NULL, connbatch, (connreaders > 1 ? CW_CONNECTION_REUSEPORT : 0)))) {
+                                if (connreaders > 1)
+                                    cw_log(CW_LOG_NOTICE, "Listening on %#l@ (reader %d of %d)\n", ai->ai_addr, reader + 1, connreaders);
+                                else
+                                    cw_log(CW_LOG_NOTICE, "Listening on %#l@\n", ai->ai_addr);
+
+                                cw_udpfromto_init(conn->sock, conn->addr.sa_family);
+                                if (conntos)
+                                    setsockopt(conn->sock, IPPROTO_IP, IP_TOS, &conntos, sizeof(conntos));
 
 #if 0
 			    /* This would assume every destination on this connection
@@ -16013,13 +16246,16 @@ static int sip_reload_config(void)
 			     * Of course, we really want at least externip, and preferably
 			     * stunserver_ip as well, to be per-listener.
 			     */
-                            if (conn->addr.sa_family == stunserver_ip.sin_family)
-                                cw_stun_bindrequest(conn->sock, &conn->addr, conn->addrlen, &stunserver_ip.sa, sizeof(stunserver_ip), &externip.sin);
+                                if (conn->addr.sa_family == stunserver_ip.sin_family)
+                                    cw_stun_bindrequest(conn->sock, &conn->addr, conn->addrlen, &stunserver_ip.sa, sizeof(stunserver_ip), &externip.sin);
 #endif
 
-                            cw_object_put(conn);
-                        } else
-                            cw_log(CW_LOG_ERROR, "Unable to listen on %#l@: %s\n", ai->ai_addr, strerror(errno));
+                                cw_object_put(conn);
+                            } else {
+                                cw_log(CW_LOG_ERROR, "Unable to listen on %#l@: %s\n", ai->ai_addr, strerror(errno));
+                                break;
+                            }
+                        }
 
                         if (auto_sip_domains) {
                             if (cw_sockaddr_is_specific(ai->ai_addr)) {
@@ -144,7 +144,7 @@ static struct cw_channel *channel_new(struct faxmodem *fm);
 static void *generic_pipe_clock_thread(void *obj)
 {
 	struct timespec ts;
-	int fd = *(int *)obj;
+	int *alertpipe = obj;
 #if !defined(__USE_XOPEN2K)
 	const clockid_t clk = CLOCK_REALTIME;
 	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -165,9 +165,7 @@ static void *generic_pipe_clock_thread(void *obj)
 	cw_clock_gettime(clk, &ts);
 
 	for (;;) {
-		char blah;
-
-		write(fd, &blah, sizeof(blah));
+		cw_alertpipe_write(alertpipe);
 
 		cw_clock_add_ms(&ts, SAMPLES / 8);
 
@@ -320,7 +318,7 @@ static int modem_control_handler(t31_state_t *t31, void *user_data, int op, cons
 				fm->start = fm->frame.delivery;
 				fm->frame.ts = fm->frame.seq_no = 0;
 
-				if (!cw_pthread_create(&fm->clock_thread, &global_attr_rr, generic_pipe_clock_thread, &fm->owner->alertpipe[1]))
+				if (!cw_pthread_create(&fm->clock_thread, &global_attr_rr, generic_pipe_clock_thread, fm->owner->alertpipe))
 					fm->state = FAXMODEM_STATE_ANSWERED;
 				else
 					cw_log(CW_LOG_ERROR, "%s: failed to start TX clock thread: %s\n", fm->devlink, strerror(errno));
@@ -793,7 +791,7 @@ static int tech_answer(struct cw_channel *chan)
 	fm->start = fm->frame.delivery;
 	fm->frame.ts = fm->frame.seq_no = 0;
 
-	if (!cw_pthread_create(&fm->clock_thread, &global_attr_rr, generic_pipe_clock_thread, &chan->alertpipe[1])) {
+	if (!cw_pthread_create(&fm->clock_thread, &global_attr_rr, generic_pipe_clock_thread, chan->alertpipe)) {
 		if (cfg_vblevel > 0)
 			cw_log(CW_LOG_DEBUG, "%s: connected\n", fm->devlink);
 		fm->state = FAXMODEM_STATE_CONNECTED;
@@ -920,6 +920,9 @@ static int reload_config(void) {
 		v = v->next;
 	}
 
+	cw_acl_compile(GLOB(ha));
+	cw_acl_compile(GLOB(localaddr));
+
 	cw_codec_pref_string(&GLOB(global_codecs), pref_buf, sizeof(pref_buf) - 1);
 	cw_verbose(VERBOSE_PREFIX_3 "GLOBAL: Preferred capability %s\n", pref_buf);
 
@@ -939,6 +942,7 @@ static int reload_config(void) {
 		if (!strcasecmp(v->name, "device")) {
 			if ( (strlen(v->value) == 15) && ((strncmp(v->value, "SEP",3) == 0) || (strncmp(v->value, "ATA",3)==0)) ) {
 				cw_copy_string(d->id, v->value, sizeof(d->id));
+				cw_acl_compile(d->ha);
 				cw_verbose(VERBOSE_PREFIX_3 "Added device '%s' (%s)\n", d->id, d->config_type);
 				cw_mutex_lock(&GLOB(devices_lock));
 				d->next = GLOB(devices);
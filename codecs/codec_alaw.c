@@ -147,8 +147,6 @@ static void *lintoalaw_new(void)
 static int alawtolin_framein(void *pvt, struct cw_frame *f)
 {
     struct alaw_decoder_pvt *tmp = (struct alaw_decoder_pvt *) pvt;
-    int x;
-    unsigned char *b;
 
     if (f->datalen == 0) {
         /* perform PLC with nominal framesize of 20ms/160 samples */
@@ -168,10 +166,7 @@ static int alawtolin_framein(void *pvt, struct cw_frame *f)
         return -1;
     }
 
-    /* Reset ssindex and signal to frame's specified values */
-    b = f->data;
-    for (x = 0;  x < f->datalen;  x++)
-        tmp->outbuf[tmp->tail + x] = CW_ALAW(b[x]);
+    cw_alaw_buf(tmp->outbuf + tmp->tail, f->data, f->datalen);
 
     if (useplc)
         plc_rx(&tmp->plc, tmp->outbuf+tmp->tail, f->datalen);
@@ -221,17 +216,13 @@ static struct cw_frame *alawtolin_frameout(void *pvt)
 static int lintoalaw_framein(void *pvt, struct cw_frame *f)
 {
     struct alaw_encoder_pvt *tmp = (struct alaw_encoder_pvt *) pvt;
-    int x;
-    int16_t *s;
   
     if (tmp->tail + f->datalen/sizeof(int16_t) >= sizeof(tmp->outbuf))
     {
         cw_log(CW_LOG_WARNING, "Out of buffer space\n");
         return -1;
     }
-    s = f->data;
-    for (x = 0;  x < f->datalen/sizeof(int16_t);  x++) 
-        tmp->outbuf[x + tmp->tail] = CW_LIN2A(s[x]);
+    cw_lin2a_buf(tmp->outbuf + tmp->tail, f->data, f->datalen/sizeof(int16_t));
     tmp->tail += f->datalen/sizeof(int16_t);
     return 0;
 }
@@ -73,10 +73,26 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/srv.h"
 
 
+struct acl_node {
+	struct acl_node *child[2];
+	const struct cw_acl *ace;	/* rule ending exactly here, if any */
+	int index;			/* position of that rule in the list */
+	int bits;			/* prefix length of this node */
+	uint8_t addr[16];		/* prefix, zero beyond bits */
+};
+
+struct cw_acl_tree {
+	struct acl_node *root[2];	/* IPv4, IPv6 */
+	int nnodes;
+	struct acl_node nodes[0];
+};
+
 struct cw_acl {
 	/* Host access rule */
 	int sense;
 	int masklen;
+	/* Compiled form of the whole list. Only valid on the head entry. */
+	struct cw_acl_tree *tree;
 	struct cw_list list;
 	/* This must be last */
 	struct sockaddr addr;
@@ -88,6 +104,8 @@ void cw_acl_free(struct cw_acl *acl)
 	struct cw_acl *ace;
 
 	if ((ace = acl)) {
+		free(acl->tree);
+
 		do {
 			struct cw_acl *tmp = ace;
 			ace = container_of(ace->list.next, struct cw_acl, list);
@@ -108,6 +126,7 @@ int cw_acl_add_addr(struct cw_acl **acl_p, const char *sense, const struct socka
 
 	if ((ace = malloc(sizeof(*ace) - sizeof(ace->addr) + addrlen))) {
 		ace->sense = (sense[0] == 'p' || sense[0] == 'P');
+		ace->tree = NULL;
 
 		if (is_mapped) {
 			ace->masklen = masklen - (sizeof(((struct sockaddr_in6 *)0)->sin6_addr.s6_addr) - sizeof(((struct sockaddr_in *)0)->sin_addr.s_addr)) * 8;
@@ -117,9 +136,12 @@ int cw_acl_add_addr(struct cw_acl **acl_p, const char *sense, const struct socka
 			memcpy(&ace->addr, addr, addrlen);
 		}
 
-		if (*acl_p)
+		if (*acl_p) {
+			/* Any compiled form no longer describes the list */
+			free((*acl_p)->tree);
+			(*acl_p)->tree = NULL;
 			cw_list_add((*acl_p)->list.prev, &ace->list);
-		else {
+		} else {
 			cw_list_init(&ace->list);
 			*acl_p = ace;
 		}
@@ -154,6 +176,230 @@ int cw_acl_add(struct cw_acl **acl_p, const char *sense, const char *spec)
 	return err;
 }
 
+/* The compiled form of an ACL is a path compressed binary (Patricia) trie
+ * per address family keyed on the rule prefixes. Each node that ends a rule
+ * records the position of the last rule in the list with exactly that prefix.
+ * Every rule that matches an address lies on the path from the root to the
+ * address so a lookup visits at most one node per address bit and the
+ * highest positioned rule seen on the way is the one that the list walk
+ * (last match wins) would have found.
+ */
+
+static inline int acl_bit(const uint8_t *addr, int bit)
+{
+	return (addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+
+/* Compare bits [from, to) of a and b. Bits before from are already known
+ * to match so the bytes holding them may be compared again harmlessly.
+ */
+static inline int acl_bits_match(const uint8_t *a, const uint8_t *b, int from, int to)
+{
+	int i;
+
+	for (i = from >> 3; i < (to >> 3); i++)
+		if (a[i] != b[i])
+			return 0;
+
+	if ((to & 7) && ((a[i] ^ b[i]) & (0xff00 >> (to & 7))))
+		return 0;
+
+	return 1;
+}
+
+
+static int acl_common_bits(const uint8_t *a, const uint8_t *b, int max)
+{
+	int n = 0;
+
+	while (n + 8 <= max && a[n >> 3] == b[n >> 3])
+		n += 8;
+	while (n < max && acl_bit(a, n) == acl_bit(b, n))
+		n++;
+
+	return n;
+}
+
+
+static struct acl_node *acl_node_new(struct cw_acl_tree *tree, const uint8_t *addr, int bits)
+{
+	struct acl_node *node = &tree->nodes[tree->nnodes++];
+	int i;
+
+	memset(node, 0, sizeof(*node));
+	node->index = -1;
+	node->bits = bits;
+
+	for (i = 0; i < (bits >> 3); i++)
+		node->addr[i] = addr[i];
+	if (bits & 7)
+		node->addr[i] = addr[i] & (0xff00 >> (bits & 7));
+
+	return node;
+}
+
+
+static void acl_tree_insert(struct cw_acl_tree *tree, struct acl_node **root_p, const uint8_t *addr, int bits, const struct cw_acl *ace, int index)
+{
+	struct acl_node *node, *child, *leaf, *split;
+	int b, common;
+
+	if (!(node = *root_p))
+		node = *root_p = acl_node_new(tree, addr, 0);
+
+	for (;;) {
+		if (node->bits == bits) {
+			node->ace = ace;
+			node->index = index;
+			return;
+		}
+
+		b = acl_bit(addr, node->bits);
+
+		if (!(child = node->child[b])) {
+			leaf = acl_node_new(tree, addr, bits);
+			leaf->ace = ace;
+			leaf->index = index;
+			node->child[b] = leaf;
+			return;
+		}
+
+		common = acl_common_bits(addr, child->addr, (bits < child->bits ? bits : child->bits));
+
+		if (common == child->bits) {
+			node = child;
+			continue;
+		}
+
+		/* The new prefix diverges from, or is a prefix of, the child's */
+		split = acl_node_new(tree, addr, common);
+		split->child[acl_bit(child->addr, common)] = child;
+		node->child[b] = split;
+
+		if (common == bits) {
+			split->ace = ace;
+			split->index = index;
+		} else {
+			leaf = acl_node_new(tree, addr, bits);
+			leaf->ace = ace;
+			leaf->index = index;
+			split->child[acl_bit(addr, common)] = leaf;
+		}
+		return;
+	}
+}
+
+
+/* A rule is dead if a later rule with a shorter prefix covers it, since the
+ * later rule will always be the last match. Drop dead rules and any branches
+ * left with no rules so lookups have less to walk.
+ */
+static struct acl_node *acl_tree_prune(struct acl_node *node, int cover)
+{
+	if (node) {
+		if (node->ace) {
+			if (node->index < cover)
+				node->ace = NULL;
+			else
+				cover = node->index;
+		}
+
+		node->child[0] = acl_tree_prune(node->child[0], cover);
+		node->child[1] = acl_tree_prune(node->child[1], cover);
+
+		if (!node->ace && !node->child[0] && !node->child[1])
+			node = NULL;
+	}
+
+	return node;
+}
+
+
+static const struct cw_acl *acl_tree_lookup(const struct acl_node *node, const uint8_t *addr, int maxbits)
+{
+	const struct acl_node *best = NULL;
+	int from = 0;
+
+	while (node && acl_bits_match(addr, node->addr, from, node->bits)) {
+		if (node->ace && (!best || node->index > best->index))
+			best = node;
+
+		if (node->bits == maxbits)
+			break;
+
+		from = node->bits;
+		node = node->child[acl_bit(addr, node->bits)];
+	}
+
+	return (best ? best->ace : NULL);
+}
+
+
+int cw_acl_compile(struct cw_acl *acl)
+{
+	struct cw_acl_tree *tree;
+	struct cw_acl *ace;
+	int n, index;
+
+	if (!acl)
+		return 0;
+
+	free(acl->tree);
+	acl->tree = NULL;
+
+	/* Only plain IP prefixes can go in the tree. Anything else (local
+	 * sockets, rules that also constrain the port) stays with the list walk.
+	 */
+	n = 0;
+	ace = acl;
+	do {
+		if (ace->addr.sa_family == AF_INET) {
+			if (((struct sockaddr_in *)&ace->addr)->sin_port)
+				return -1;
+		} else if (ace->addr.sa_family == AF_INET6) {
+			if (((struct sockaddr_in6 *)&ace->addr)->sin6_port)
+				return -1;
+		} else
+			return -1;
+
+		n++;
+		ace = container_of(ace->list.next, struct cw_acl, list);
+	} while (ace != acl);
+
+	/* A Patricia trie with n keys has at most 2n - 1 nodes, plus the roots */
+	if (!(tree = malloc(sizeof(*tree) + (2 * n + 2) * sizeof(tree->nodes[0]))))
+		return -1;
+
+	tree->root[0] = tree->root[1] = NULL;
+	tree->nnodes = 0;
+
+	index = 0;
+	ace = acl;
+	do {
+		if (ace->addr.sa_family == AF_INET) {
+			const uint8_t *addr = (const uint8_t *)&((struct sockaddr_in *)&ace->addr)->sin_addr;
+			int bits = (ace->masklen < 0 || ace->masklen > 32 ? 32 : ace->masklen);
+
+			acl_tree_insert(tree, &tree->root[0], addr, bits, ace, index);
+		} else {
+			const uint8_t *addr = (const uint8_t *)&((struct sockaddr_in6 *)&ace->addr)->sin6_addr;
+			int bits = (ace->masklen < 0 || ace->masklen > 128 ? 128 : ace->masklen);
+
+			acl_tree_insert(tree, &tree->root[1], addr, bits, ace, index);
+		}
+
+		index++;
+		ace = container_of(ace->list.next, struct cw_acl, list);
+	} while (ace != acl);
+
+	tree->root[0] = acl_tree_prune(tree->root[0], -1);
+	tree->root[1] = acl_tree_prune(tree->root[1], -1);
+
+	acl->tree = tree;
+	return 0;
+}
+
 
 int cw_acl_check(struct cw_acl *acl, struct sockaddr *addr, int defsense)
 {
@@ -168,6 +414,24 @@ int cw_acl_check(struct cw_acl *acl, struct sockaddr *addr, int defsense)
 			addr = (struct sockaddr *)&sinbuf;
 		}
 
+		if (acl->tree) {
+			const struct cw_acl *ace = NULL;
+
+			if (addr->sa_family == AF_INET)
+				ace = acl_tree_lookup(acl->tree->root[0], (const uint8_t *)&((struct sockaddr_in *)addr)->sin_addr, 32);
+			else if (addr->sa_family == AF_INET6)
+				ace = acl_tree_lookup(acl->tree->root[1], (const uint8_t *)&((struct sockaddr_in6 *)addr)->sin6_addr, 128);
+
+			if (ace) {
+				if (option_debug > 5)
+					cw_log(CW_LOG_DEBUG, "%l@ matches %.*l@ => %s\n", addr, ace->masklen, &ace->addr, (ace->sense ? "permit" : "deny"));
+
+				res = ace->sense;
+			}
+
+			return res;
+		}
+
 		do {
 			struct cw_acl *ace = container_of(l, struct cw_acl, list);
 
@@ -31,11 +31,93 @@
 
 CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 
+#include "callweaver/logger.h"
 #include "core/alaw.h"
+#include "core/g711_vec.h"
 
 uint8_t __cw_lin2a[8192];
 int16_t __cw_alaw[256];
 
+
+#ifdef G711_VEC
+
+/* Chosen and checked against the table at startup (see ulaw.c) */
+static g711_vec_encoder_t alaw_encode_simd;
+
+/*
+ * As for mu-law the vector encoder computes what the table holds, which is
+ * the A-law code for the sample with its bottom three bits set. There is no
+ * bias so magnitudes below 0x100 (segment 0, which shares segment 1's
+ * mantissa shift) are simply shifted down.
+ */
+#define ALAW_ENCODE_VEC(isa) \
+static inline g711_vec_target(isa) g711_vec_t(isa) alaw_encode_##isa(g711_vec_t(isa) x) \
+{ \
+	g711_vec_t(isa) sign, mag, code; \
+ \
+	x = g711_vec_op(isa, or)(x, g711_vec_op(isa, set1)(7)); \
+	sign = g711_vec_op(isa, srai)(x, 15); \
+	mag = g711_vec_op(isa, xor)(x, sign); \
+ \
+	code = g711_vec_op(isa, blend)(g711_vec_op(isa, cmpgt)(g711_vec_op(isa, set1)(0x100), mag), \
+		g711_vec_op(isa, srli)(mag, 4), g711_vec_op(isa, float_code)(mag)); \
+ \
+	return g711_vec_op(isa, xor)(code, \
+		g711_vec_op(isa, xor)(g711_vec_op(isa, set1)(0xd5), g711_vec_op(isa, and)(sign, g711_vec_op(isa, set1)(0x80)))); \
+}
+
+ALAW_ENCODE_VEC(sse2)
+ALAW_ENCODE_VEC(avx2)
+
+G711_VEC_ENCODER(cw_lin2a, alaw_encode, sse2)
+G711_VEC_ENCODER(cw_lin2a, alaw_encode, avx2)
+
+static int alaw_simd_check(g711_vec_encoder_t encode, const char *isa)
+{
+	int16_t lin[256];
+	uint8_t a[256];
+	int i, j;
+
+	for (i = -32768; i < 32768; i += 256) {
+		for (j = 0; j < 256; j++)
+			lin[j] = i + j;
+		encode(a, lin, 256);
+		for (j = 0; j < 256; j++) {
+			if (a[j] != CW_LIN2A(lin[j])) {
+				cw_log(CW_LOG_WARNING, "%s A-law encoder disagrees with SpanDSP at %d - using tables\n", isa, lin[j]);
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+#endif
+
+
+void cw_lin2a_buf(uint8_t *dst, const int16_t *src, int n)
+{
+	int i = 0;
+
+#ifdef G711_VEC
+	if (alaw_encode_simd)
+		i = alaw_encode_simd(dst, src, n);
+#endif
+
+	for (; i < n; i++)
+		dst[i] = CW_LIN2A(src[i]);
+}
+
+void cw_alaw_buf(int16_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = CW_ALAW(src[i]);
+}
+
+
 void cw_alaw_init(void)
 {
 	int i;
@@ -46,5 +128,14 @@ void cw_alaw_init(void)
 	/* Set up the reverse (A-law) conversion table */
 	for(i = -32768;  i < 32768;  i++)
 		__cw_lin2a[((uint16_t) i) >> 3] = linear_to_alaw(i);
+
+#ifdef G711_VEC
+	{
+		const char *isa;
+		g711_vec_encoder_t encode = g711_vec_select(cw_lin2a_sse2, cw_lin2a_avx2, &isa);
+
+		alaw_encode_simd = (encode && alaw_simd_check(encode, isa) ? encode : NULL);
+	}
+#endif
 }
 
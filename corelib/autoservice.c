@@ -47,11 +47,350 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/indications.h"
 #include "callweaver/lock.h"
 #include "callweaver/utils.h"
+#include "callweaver/cli.h"
+#include "callweaver/io.h"
 
-#define MAX_AUTOMONS 256
 
 CW_MUTEX_DEFINE_STATIC(autolock);
 
+static struct {
+	unsigned long started;		/* Channels ever put in autoservice */
+	unsigned long peak;		/* Most channels in autoservice at once */
+	unsigned int current;		/* Channels in autoservice now */
+} as_stats;
+
+
+#ifdef HAVE_EPOLL
+
+/* Channels in autoservice are spread over a small pool of worker threads
+ * each of which has its own persistent I/O context. A channel's fds are
+ * registered with a worker when autoservice starts and deregistered when
+ * it stops so a worker only ever wakes up for channels that actually have
+ * something to read.
+ */
+
+#define AUTOSERVICE_MAX_WORKERS	8
+#define AUTOSERVICE_HASH_SIZE	256
+#define AUTOSERVICE_SWEEP_MS	1000
+
+struct as_worker;
+
+struct asent {
+	struct cw_channel *chan;
+	struct as_worker *worker;
+	cw_mutex_t lock;
+	int dead;
+	struct asent *hash_next;	/* Protected by autolock */
+	struct asent *prev, *next;	/* Protected by worker->lock */
+	struct asent *dead_next;
+	struct cw_io_rec ior[CW_MAX_FDS];
+};
+
+struct as_worker {
+	pthread_t tid;
+	cw_io_context_t ioc;
+	cw_mutex_t lock;
+	struct asent *head;
+	struct asent *dead;
+	unsigned int count;
+	/* Only updated by the worker itself */
+	unsigned long wakeups;
+	unsigned long frames;
+};
+
+static struct asent *ashash[AUTOSERVICE_HASH_SIZE];
+static struct as_worker *as_workers;
+static int nas_workers;
+
+
+static inline unsigned int as_hash(const struct cw_channel *chan)
+{
+	return ((unsigned long)chan / sizeof(void *)) % AUTOSERVICE_HASH_SIZE;
+}
+
+
+/* Called with as->lock held. Brings the fds registered for the channel into
+ * line with the fds it has now. Channels that have been hung up are left
+ * with nothing registered, as the old poll loop left them out of the poll
+ * set, until (if ever) the soft hangup is cleared.
+ */
+static void autoservice_sync(struct asent *as)
+{
+	struct cw_channel *chan = as->chan;
+	int y;
+
+	for (y = 0; y < CW_MAX_FDS; y++) {
+		int fd = (chan->_softhangup || as->dead ? -1 : chan->fds[y]);
+
+		if (as->ior[y].fd == fd)
+			continue;
+
+		/* If the old fd has been closed the kernel has already
+		 * dropped it from the I/O context
+		 */
+		if (cw_io_isactive(&as->ior[y]) && cw_io_remove(as->worker->ioc, &as->ior[y]))
+			as->ior[y].fd = -1;
+
+		if (fd > -1 && cw_io_add(as->worker->ioc, &as->ior[y], fd, CW_IO_IN | CW_IO_PRI))
+			cw_log(CW_LOG_WARNING, "%s: unable to watch fd %d: %s\n", chan->name, fd, strerror(errno));
+	}
+}
+
+
+static int autoservice_handler(struct cw_io_rec *ior, int fd, short events, void *data)
+{
+	struct asent *as = data;
+	struct cw_channel *chan;
+	struct cw_frame *f;
+	int ms;
+
+	CW_UNUSED(ior);
+	CW_UNUSED(fd);
+	CW_UNUSED(events);
+
+	cw_mutex_lock(&as->lock);
+
+	if (!as->dead) {
+		chan = as->chan;
+
+		if (!chan->_softhangup) {
+			/* This does any pending masquerade and sets up fdno for the read */
+			ms = 0;
+			if (cw_waitfor_n(&chan, 1, &ms)) {
+				/* Read and ignore anything that occurs */
+				if ((f = cw_read(chan))) {
+					as->worker->frames++;
+					cw_fr_free(f);
+				}
+			}
+		}
+
+		autoservice_sync(as);
+	}
+
+	cw_mutex_unlock(&as->lock);
+
+	return 1;
+}
+
+
+static void *autoservice_run(void *data)
+{
+	struct as_worker *worker = data;
+	struct timespec now, next;
+	struct asent *as, *dead;
+
+	cw_clock_gettime(global_cond_clock_monotonic, &next);
+
+	for (;;) {
+		if (cw_io_run(worker->ioc, AUTOSERVICE_SWEEP_MS) > 0)
+			worker->wakeups++;
+
+		cw_mutex_lock(&worker->lock);
+
+		/* Entries that were stopped while we were waiting can't have any
+		 * events outstanding now so they're safe to free.
+		 */
+		dead = worker->dead;
+		worker->dead = NULL;
+
+		/* Channels that are not generating events won't be resynced by
+		 * the handler so check them now and then in case their fds have
+		 * been changed (by a masquerade, for instance) or their soft
+		 * hangup has been cleared.
+		 */
+		cw_clock_gettime(global_cond_clock_monotonic, &now);
+		if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)) {
+			for (as = worker->head; as; as = as->next) {
+				cw_mutex_lock(&as->lock);
+				autoservice_sync(as);
+				cw_mutex_unlock(&as->lock);
+			}
+
+			next = now;
+			next.tv_sec += AUTOSERVICE_SWEEP_MS / 1000;
+		}
+
+		cw_mutex_unlock(&worker->lock);
+
+		while (dead) {
+			as = dead->dead_next;
+			cw_mutex_destroy(&dead->lock);
+			free(dead);
+			dead = as;
+		}
+	}
+
+	return NULL;
+}
+
+
+int cw_autoservice_start(struct cw_channel *chan)
+{
+	struct asent *as;
+	struct as_worker *worker;
+	unsigned int h;
+	int i;
+
+	if (!nas_workers) {
+		cw_log(CW_LOG_WARNING, "No autoservice workers available\n");
+		return -1;
+	}
+
+	h = as_hash(chan);
+
+	cw_mutex_lock(&autolock);
+
+	for (as = ashash[h]; as; as = as->hash_next) {
+		if (as->chan == chan) {
+			cw_mutex_unlock(&autolock);
+			return -1;
+		}
+	}
+
+	if (!(as = calloc(1, sizeof(*as)))) {
+		cw_mutex_unlock(&autolock);
+		cw_log(CW_LOG_ERROR, "Out of memory!\n");
+		return -1;
+	}
+
+	as->chan = chan;
+	cw_mutex_init(&as->lock);
+	for (i = 0; i < CW_MAX_FDS; i++)
+		cw_io_init(&as->ior[i], autoservice_handler, as);
+
+	as->hash_next = ashash[h];
+	ashash[h] = as;
+
+	as_stats.started++;
+	if (++as_stats.current > as_stats.peak)
+		as_stats.peak = as_stats.current;
+
+	cw_mutex_unlock(&autolock);
+
+	/* Pick the least loaded worker. The counts may be changing under
+	 * us but an approximate balance is all that's needed.
+	 */
+	worker = &as_workers[0];
+	for (i = 1; i < nas_workers; i++) {
+		if (as_workers[i].count < worker->count)
+			worker = &as_workers[i];
+	}
+	as->worker = worker;
+
+	cw_mutex_lock(&worker->lock);
+	as->prev = NULL;
+	if ((as->next = worker->head))
+		as->next->prev = as;
+	worker->head = as;
+	worker->count++;
+	cw_mutex_unlock(&worker->lock);
+
+	cw_mutex_lock(&as->lock);
+	autoservice_sync(as);
+	cw_mutex_unlock(&as->lock);
+
+	return 0;
+}
+
+
+int cw_autoservice_stop(struct cw_channel *chan)
+{
+	struct asent *as, **p;
+	struct as_worker *worker;
+
+	cw_mutex_lock(&autolock);
+
+	for (p = &ashash[as_hash(chan)]; (as = *p); p = &as->hash_next) {
+		if (as->chan == chan) {
+			*p = as->hash_next;
+			as_stats.current--;
+			break;
+		}
+	}
+
+	cw_mutex_unlock(&autolock);
+
+	if (!as)
+		return -1;
+
+	/* Once we hold the entry's lock the worker is not touching the
+	 * channel and, with the entry marked dead, never will again.
+	 */
+	cw_mutex_lock(&as->lock);
+	as->dead = 1;
+	autoservice_sync(as);
+	cw_mutex_unlock(&as->lock);
+
+	worker = as->worker;
+
+	cw_mutex_lock(&worker->lock);
+	if (as->prev)
+		as->prev->next = as->next;
+	else
+		worker->head = as->next;
+	if (as->next)
+		as->next->prev = as->prev;
+	worker->count--;
+	as->dead_next = worker->dead;
+	worker->dead = as;
+	cw_mutex_unlock(&worker->lock);
+
+	return (chan->_softhangup ? -1 : 0);
+}
+
+
+static void autoservice_show_workers(struct cw_dynstr *ds_p)
+{
+	int i;
+
+	cw_dynstr_printf(ds_p, "%-8s %10s %12s %14s\n", "Worker", "Channels", "Wakeups", "Frames dropped");
+
+	for (i = 0; i < nas_workers; i++)
+		cw_dynstr_printf(ds_p, "%-8d %10u %12lu %14lu\n", i, as_workers[i].count, as_workers[i].wakeups, as_workers[i].frames);
+}
+
+
+static int autoservice_init_workers(void)
+{
+	long ncpus;
+	int i;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpus = 1;
+	else if (ncpus > AUTOSERVICE_MAX_WORKERS)
+		ncpus = AUTOSERVICE_MAX_WORKERS;
+
+	if (!(as_workers = calloc(ncpus, sizeof(*as_workers)))) {
+		cw_log(CW_LOG_ERROR, "Out of memory!\n");
+		return -1;
+	}
+
+	for (i = 0; i < ncpus; i++) {
+		struct as_worker *worker = &as_workers[nas_workers];
+
+		if ((worker->ioc = cw_io_context_create(64)) == CW_IO_CONTEXT_NONE) {
+			cw_log(CW_LOG_ERROR, "unable to create autoservice I/O context: %s\n", strerror(errno));
+			break;
+		}
+
+		cw_mutex_init(&worker->lock);
+
+		if (cw_pthread_create(&worker->tid, &global_attr_detached, autoservice_run, worker)) {
+			cw_log(CW_LOG_ERROR, "unable to start autoservice worker: %s\n", strerror(errno));
+			cw_mutex_destroy(&worker->lock);
+			cw_io_context_destroy(worker->ioc);
+			break;
+		}
+
+		nas_workers++;
+	}
+
+	return (nas_workers ? 0 : -1);
+}
+
+#else /* HAVE_EPOLL */
+
 struct asent {
 	struct cw_channel *chan;
 	struct asent *next;
@@ -60,9 +399,13 @@ struct asent {
 static struct asent *aslist = NULL;
 static pthread_t asthread = CW_PTHREADT_NULL;
 
+static unsigned long as_frames;
+
+
 static __attribute__((noreturn)) void *autoservice_run(void *data)
 {
-	struct cw_channel *mons[MAX_AUTOMONS];
+	struct cw_channel **mons = NULL;
+	int nmons = 0;
 	int x;
 	int ms;
 	struct cw_channel *chan;
@@ -74,27 +417,31 @@ static __attribute__((noreturn)) void *autoservice_run(void *data)
 	for (;;) {
 		x = 0;
 		cw_mutex_lock(&autolock);
+		if (nmons < as_stats.current) {
+			struct cw_channel **tmp;
+
+			if ((tmp = realloc(mons, as_stats.current * sizeof(*mons)))) {
+				mons = tmp;
+				nmons = as_stats.current;
+			}
+		}
 		as = aslist;
 		while(as) {
-			if (!as->chan->_softhangup) {
-				if (x < MAX_AUTOMONS)
-					mons[x++] = as->chan;
-				else
-					cw_log(CW_LOG_WARNING, "Exceeded maximum number of automatic monitoring events.  Fix autoservice.c\n");
-			}
+			if (!as->chan->_softhangup && x < nmons)
+				mons[x++] = as->chan;
 			as = as->next;
 		}
 		cw_mutex_unlock(&autolock);
 
-/* 		if (!aslist)
-			break; */
 		ms = 500;
 		chan = cw_waitfor_n(mons, x, &ms);
 		if (chan) {
 			/* Read and ignore anything that occurs */
 			f = cw_read(chan);
-			if (f)
+			if (f) {
+				as_frames++;
 				cw_fr_free(f);
+			}
 		}
 	}
 }
@@ -120,11 +467,15 @@ int cw_autoservice_start(struct cw_channel *chan)
 			as->next = aslist;
 			aslist = as;
 			res = 0;
+			as_stats.started++;
+			if (++as_stats.current > as_stats.peak)
+				as_stats.peak = as_stats.current;
 			if (needstart) {
 				if (cw_pthread_create(&asthread, &global_attr_default, autoservice_run, NULL)) {
 					cw_log(CW_LOG_WARNING, "Unable to create autoservice thread :(\n");
 					free(aslist);
 					aslist = NULL;
+					as_stats.current = 0;
 					res = -1;
 				} else
 					pthread_kill(asthread, SIGURG);
@@ -154,6 +505,7 @@ int cw_autoservice_stop(struct cw_channel *chan)
 		else
 			aslist = as->next;
 		free(as);
+		as_stats.current--;
 		if (!chan->_softhangup)
 			res = 0;
 	}
@@ -165,3 +517,58 @@ int cw_autoservice_stop(struct cw_channel *chan)
 		usleep(1000);
 	return res;
 }
+
+
+static void autoservice_show_workers(struct cw_dynstr *ds_p)
+{
+	cw_dynstr_printf(ds_p, "Frames dropped: %lu\n", as_frames);
+}
+
+
+static int autoservice_init_workers(void)
+{
+	return 0;
+}
+
+#endif /* HAVE_EPOLL */
+
+
+static int autoservice_show(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	CW_UNUSED(argv);
+
+	if (argc != 2)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&autolock);
+	cw_dynstr_printf(ds_p, "Channels in autoservice: %u (peak %lu, %lu serviced since start)\n\n", as_stats.current, as_stats.peak, as_stats.started);
+	cw_mutex_unlock(&autolock);
+
+	autoservice_show_workers(ds_p);
+
+	return RESULT_SUCCESS;
+}
+
+
+static const char autoservice_show_usage[] =
+	"Usage: show autoservice\n"
+	"       Shows how many channels are being serviced automatically while\n"
+	"       their owners are busy elsewhere and how many frames have been\n"
+	"       read and thrown away on their behalf.\n";
+
+static struct cw_clicmd cli_autoservice_show = {
+	.cmda = { "show", "autoservice", NULL },
+	.handler = autoservice_show,
+	.summary = "Show autoservice statistics",
+	.usage = autoservice_show_usage,
+};
+
+
+int cw_autoservice_init(void)
+{
+	if (autoservice_init_workers())
+		return -1;
+
+	cw_cli_register(&cli_autoservice_show);
+	return 0;
+}
@@ -55,18 +55,13 @@ struct tdd_state {
 
 static inline int lin2xlaw(int codec, int16_t *lin, int slen, uint8_t *xlaw, int xmax)
 {
-	int i;
-
 	if (slen > xmax)
 		slen = xmax;
 
-	if (codec == CW_FORMAT_ULAW) {
-		for (i = 0; i < slen; i++)
-			xlaw[i] = CW_LIN2MU(lin[i]);
-	} else {
-		for (i = 0; i < slen; i++)
-			xlaw[i] = CW_LIN2A(lin[i]);
-	}
+	if (codec == CW_FORMAT_ULAW)
+		cw_lin2mu_buf(xlaw, lin, slen);
+	else
+		cw_lin2a_buf(xlaw, lin, slen);
 
 	return slen;
 }
@@ -120,6 +120,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/cdr.h"
 #include "callweaver/pbx.h"
 #include "callweaver/enum.h"
+#include "callweaver/dns.h"
 #include "callweaver/rtp.h"
 #include "callweaver/udptl.h"
 #include "callweaver/stun.h"
@@ -182,6 +183,11 @@ int option_exec=0;
 int option_initcrypto=0;
 int option_dumpcore = 0;
 int option_cache_record_files = 0;
+int option_prompt_cache = 16384;
+int option_prompt_cache_maxfile = 1024;
+int option_recording_writers = 2;
+int option_recording_buffer = 32;
+int option_recording_dropcache = 0;
 int option_reconnect = 0;
 int option_transcode_slin = 1;
 int option_maxcalls = 0;
@@ -1178,9 +1184,12 @@ static void boot(void)
 
 	if (cw_blacklist_init()
 	|| cw_loader_cli_init()
+	|| cw_dns_init()
+	|| cw_autoservice_init()
 	|| load_modules(1)
 	|| cw_connection_init()
 	|| cw_channels_init()
+	|| cw_generator_init()
 	|| cw_cdr_engine_init()
 	|| cw_device_state_engine_init()
 	|| cw_rtp_init()
@@ -1376,6 +1385,29 @@ static void cw_readconfig(const char *config)
 		/* Specify cache directory */
 		}  else if (!strcasecmp(v->name, "record_cache_dir")) {
 			cw_copy_string(record_cache_dir, v->value, CW_CACHE_DIR_LEN);
+		/* Memory (in kB) to keep frequently played sound files in */
+		} else if (!strcasecmp(v->name, "promptcache")) {
+			if ((sscanf(v->value, "%d", &option_prompt_cache) != 1) || (option_prompt_cache < 0)) {
+				option_prompt_cache = cw_true(v->value) ? 16384 : 0;
+			}
+		/* Largest sound file (in kB) worth keeping in memory */
+		} else if (!strcasecmp(v->name, "promptcachemaxfile")) {
+			if ((sscanf(v->value, "%d", &option_prompt_cache_maxfile) != 1) || (option_prompt_cache_maxfile < 0)) {
+				option_prompt_cache_maxfile = 1024;
+			}
+		/* Threads writing recordings in the background (0 to write them synchronously) */
+		} else if (!strcasecmp(v->name, "recordingwriters")) {
+			if ((sscanf(v->value, "%d", &option_recording_writers) != 1) || (option_recording_writers < 0)) {
+				option_recording_writers = 2;
+			}
+		/* Audio (in kB) each recording may have waiting to be written */
+		} else if (!strcasecmp(v->name, "recordingbuffer")) {
+			if ((sscanf(v->value, "%d", &option_recording_buffer) != 1) || (option_recording_buffer <= 0)) {
+				option_recording_buffer = 32;
+			}
+		/* Keep recordings out of the page cache once written */
+		} else if (!strcasecmp(v->name, "recordingdropcache")) {
+			option_recording_dropcache = cw_true(v->value);
 		/* Build transcode paths via SLINEAR, instead of directly */
 		} else if (!strcasecmp(v->name, "transcode_via_sln")) {
 			option_transcode_slin = cw_true(v->value);
@@ -32,6 +32,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 #include "callweaver.h"
 
@@ -62,9 +66,12 @@ static int cw_cdrbe_qsort_compare_by_name(const void *a, const void *b)
 	return strcmp(cdrbe_a->name, cdrbe_b->name);
 }
 
+static void cdrbe_registry_onchange(void);
+
 struct cw_registry cdrbe_registry = {
 	.name = "CDR back-end",
 	.qsort_compare = cw_cdrbe_qsort_compare_by_name,
+	.onchange = cdrbe_registry_onchange,
 };
 
 
@@ -73,22 +80,77 @@ int cw_end_cdr_before_h_exten;
 char cw_default_accountcode[CW_MAX_ACCOUNT_CODE] = "";
 
 
+#define BATCH_SIZE_DEFAULT	100
+#define BATCH_TIME_DEFAULT	0
+#define QUEUE_MAX_DEFAULT	10000
+#define SPOOL_RETRIES_DEFAULT	0
+#define SPOOL_BACKOFF_MAX	60
+
+/* How long shutdown waits for back-ends to drain their queues (seconds) */
+#define SHUTDOWN_WAIT		10
+
 static struct {
 	int size;
+	struct timespec first;
 	struct cw_cdr *head;
 	struct cw_cdr **tail;
 } curbatch;
 
-static pthread_t cdr_thread = CW_PTHREADT_NULL;
+/* A batch is shared by every back-end queue it is put on and freed by
+ * whichever finishes with it last.
+ */
+struct cdr_batch {
+	int refs;
+	int size;
+	struct timespec queued;
+	struct cw_cdr *head;
+};
 
-#define BATCH_SIZE_DEFAULT 100
-#define BATCH_TIME_DEFAULT 300
-#define BATCH_SCHEDULER_ONLY_DEFAULT 0
+struct cdr_qent {
+	struct cdr_qent *next;
+	struct cdr_batch *batch;
+};
+
+struct cdr_worker {
+	struct cdr_worker *next;
+	struct cw_cdrbe *cdrbe;
+	pthread_t tid;
+	pthread_cond_t cond;
+	int stale, dead;
+
+	struct cdr_qent *head, **tail;
+	int depth, depth_max;
+
+	pthread_mutex_t spool_lock;	/* Serialises spool appends with the end of a replay */
+	int writers;			/* Spool appends in progress without cdr_batch_lock */
+	struct cdr_worker *spool_next;	/* Only used by cdr_dispatch() */
+	int spool_depth;		/* Only used by cdr_dispatch() */
+	int spool_fd;
+	off_t spool_read, spool_size;
+	int spool_tries;		/* Failed attempts to replay the records at spool_read */
+	struct timespec spool_retry;	/* When to try them again */
+
+	unsigned long batches, posted, failed, spooled, replayed, dropped;
+	unsigned long lat_last, lat_max;
+	unsigned long long lat_total;
+
+	char spool[0];
+};
+
+static struct cdr_worker *cdr_workers;
+
+static pthread_t cdr_thread = CW_PTHREADT_NULL;
 
 static int enabled;
+static int batch_size = BATCH_SIZE_DEFAULT;
+static int batch_time = BATCH_TIME_DEFAULT;
+static int queue_max = QUEUE_MAX_DEFAULT;
+static int spool_retries = SPOOL_RETRIES_DEFAULT;
+static int shutting_down;
 
 pthread_mutex_t cdr_batch_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cdr_batch_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cdr_batch_cond;
+static pthread_cond_t cdr_workers_cond;
 
 
 struct cw_cdr *cw_cdr_dup(struct cw_cdr *cdr) 
@@ -667,21 +729,11 @@ int cw_cdr_amaflags2int(const char *flag)
 }
 
 
-static int post_cdrbe(struct cw_object *obj, void *data)
-{
-	struct cw_cdrbe *cdrbe = container_of(obj, struct cw_cdrbe, obj);
-	struct cw_cdr *batch = data;
-
-	cdrbe->handler(batch);
-	return 0;
-}
-
-static void post_cdr(struct cw_cdr *submission)
+static void cdr_mark_posted(struct cw_cdr *batch)
 {
-	struct cw_cdr *batch, *cdrset, *cdr;
+	struct cw_cdr *cdrset, *cdr;
 	const char *chan;
 
-	batch = submission;
 	while ((cdrset = batch)) {
 		batch = batch->batch_next;
 
@@ -698,10 +750,6 @@ static void post_cdr(struct cw_cdr *submission)
 			cw_set_flag(cdr, CW_CDR_FLAG_POSTED);
 		}
 	}
-
-	cw_registry_iterate(&cdrbe_registry, post_cdrbe, submission);
-
-	cw_cdr_free(submission);
 }
 
 void cw_cdr_reset(struct cw_cdr *cdr, unsigned int flags)
@@ -756,32 +804,629 @@ struct cw_cdr *cw_cdr_append(struct cw_cdr *cdr, struct cw_cdr *newcdr)
 }
 
 
-static __attribute__((__noreturn__)) void *cw_cdr_submit(void *data)
+/* ***************************************************************************
+ * Overflow spool
+ *
+ * When a back-end falls more than queue_max CDRs behind, further batches for
+ * it are appended to a per-back-end spool file instead of being held in memory.
+ * The worker replays the spool whenever its in-memory queue is empty. Records
+ * are the CDR structure up to the variables, followed by the variables as
+ * NUL terminated name/value pairs, so a spool is only meaningful to the build
+ * that wrote it (the header records the size of the fixed part as a check).
+ */
+
+#define CDR_SPOOL_MAGIC		0x43445253	/* "CDRS" */
+#define CDR_SPOOL_FIXED		offsetof(struct cw_cdr, vars)
+
+struct cdr_spool_hdr {
+	uint32_t magic;
+	uint32_t fixed;
+	uint32_t len;
+	uint32_t ncdr;
+};
+
+
+static int cdr_spool_var(struct cw_object *obj, void *data)
+{
+	struct cw_var_t *var = container_of(obj, struct cw_var_t, obj);
+	struct cw_dynstr *ds_p = data;
+	const char *name = cw_var_name(var);
+	size_t nlen = strlen(name) + 1;
+	size_t vlen = strlen(var->value) + 1;
+
+	if (!cw_dynstr_need(ds_p, nlen + vlen)) {
+		memcpy(&ds_p->data[ds_p->used], name, nlen);
+		memcpy(&ds_p->data[ds_p->used + nlen], var->value, vlen);
+		ds_p->used += nlen + vlen;
+	}
+
+	return 0;
+}
+
+static void cdr_spool_encode(struct cw_dynstr *ds_p, struct cw_cdr *batch)
+{
+	struct cdr_spool_hdr hdr;
+	struct cw_cdr *cdr;
+	size_t start, mark;
+	uint32_t vlen;
+
+	for (; batch; batch = batch->batch_next) {
+		start = ds_p->used;
+		if (cw_dynstr_need(ds_p, sizeof(hdr)))
+			return;
+		ds_p->used += sizeof(hdr);
+
+		hdr.ncdr = 0;
+		for (cdr = batch; cdr; cdr = cdr->next) {
+			if (cw_dynstr_need(ds_p, CDR_SPOOL_FIXED + sizeof(vlen)))
+				return;
+			memcpy(&ds_p->data[ds_p->used], cdr, CDR_SPOOL_FIXED);
+			ds_p->used += CDR_SPOOL_FIXED;
+			mark = ds_p->used;
+			ds_p->used += sizeof(vlen);
+
+			cw_registry_iterate(&cdr->vars, cdr_spool_var, ds_p);
+			if (ds_p->error)
+				return;
+
+			vlen = ds_p->used - mark - sizeof(vlen);
+			memcpy(&ds_p->data[mark], &vlen, sizeof(vlen));
+			hdr.ncdr++;
+		}
+
+		hdr.magic = CDR_SPOOL_MAGIC;
+		hdr.fixed = CDR_SPOOL_FIXED;
+		hdr.len = ds_p->used - start - sizeof(hdr);
+		memcpy(&ds_p->data[start], &hdr, sizeof(hdr));
+	}
+}
+
+
+/* Appends a batch to the worker's spool. The disk I/O happens without
+ * cdr_batch_lock so that a slow disk never holds up cw_cdr_detach().
+ * The caller must not hold cdr_batch_lock and must have taken a writer
+ * reference on the worker (under cdr_batch_lock), which this drops. The
+ * worker cannot go away while it has writers. depth is the worker's queue
+ * depth when the batch was diverted, for the log.
+ */
+static void cdr_spool_write(struct cdr_worker *w, struct cdr_batch *batch, int depth, struct cw_dynstr *enc)
 {
-	struct cw_cdr *oldbatchitems;
+	int ok, err = 0;
 
-	CW_UNUSED(data);
+	if (!enc->used)
+		cdr_spool_encode(enc, batch->head);
+
+	pthread_mutex_lock(&w->spool_lock);
+
+	if (w->spool_fd < 0)
+		w->spool_fd = open_cloexec(w->spool, O_RDWR | O_CREAT | O_APPEND, 0600);
+
+	ok = (w->spool_fd >= 0 && !enc->error && cw_write_all(w->spool_fd, enc->data, enc->used) == enc->used);
+	if (!ok) {
+		err = errno;
+		/* Don't leave a partial record for the replay to trip over */
+		if (w->spool_fd >= 0 && ftruncate(w->spool_fd, w->spool_size))
+			cw_log(CW_LOG_ERROR, "%s: %s\n", w->spool, strerror(errno));
+	}
+
+	pthread_mutex_lock(&cdr_batch_lock);
+
+	if (ok) {
+		if (!w->spool_size)
+			cw_log(CW_LOG_WARNING, "CDR back-end %s has fallen %d CDRs behind - spooling to %s\n", w->cdrbe->name, depth, w->spool);
+		w->spool_size += enc->used;
+		w->spooled += batch->size;
+	} else {
+		w->dropped += batch->size;
+		cw_log(CW_LOG_ERROR, "CDR back-end %s: unable to spool %d CDRs to %s: %s\n", w->cdrbe->name, batch->size, w->spool, (enc->error ? "out of memory" : strerror(err)));
+	}
+
+	/* Either there is more to replay or a dead worker may be waiting to exit */
+	w->writers--;
+	pthread_cond_signal(&w->cond);
+
+	pthread_mutex_unlock(&cdr_batch_lock);
+	pthread_mutex_unlock(&w->spool_lock);
+}
+
+
+/* Called with w->spool_lock and cdr_batch_lock held once the spool has been replayed or found to be unusable */
+static void cdr_spool_done(struct cdr_worker *w, int bad)
+{
+	char path[PATH_MAX];
+
+	if (bad) {
+		snprintf(path, sizeof(path), "%s.bad", w->spool);
+		if (!rename(w->spool, path))
+			cw_log(CW_LOG_ERROR, "CDR back-end %s: spool %s is corrupt - moved to %s\n", w->cdrbe->name, w->spool, path);
+		else
+			cw_log(CW_LOG_ERROR, "CDR back-end %s: spool %s is corrupt and cannot be moved aside: %s\n", w->cdrbe->name, w->spool, strerror(errno));
+	} else {
+		unlink(w->spool);
+		cw_log(CW_LOG_NOTICE, "CDR back-end %s has caught up - spool replayed\n", w->cdrbe->name);
+	}
+
+	close(w->spool_fd);
+	w->spool_fd = -1;
+	w->spool_read = w->spool_size = 0;
+	w->spool_tries = 0;
+}
+
+
+/* Called with cdr_batch_lock held. Returns non-zero if the spool may be replayed now. */
+static int cdr_spool_due(struct cdr_worker *w)
+{
+	struct timespec now;
+
+	if (!w->spool_tries)
+		return 1;
+
+	cw_clock_gettime(global_cond_clock_monotonic, &now);
+	return (now.tv_sec > w->spool_retry.tv_sec || (now.tv_sec == w->spool_retry.tv_sec && now.tv_nsec >= w->spool_retry.tv_nsec));
+}
+
+
+/* Reads up to batch_size CDR sets from the spool, starting at the current
+ * read offset and stopping at end. Only the worker moves the read offset and
+ * appends only ever happen beyond end so this needs no lock.
+ *
+ * Returns the number of CDR sets read (with *batch_p set to them and *used to
+ * the number of bytes consumed) or -1 if the spool is unreadable.
+ */
+static int cdr_spool_read(struct cdr_worker *w, off_t end, struct cw_cdr **batch_p, off_t *used)
+{
+	struct cdr_spool_hdr hdr;
+	struct cw_cdr *set, *cdr, **link, **batch_link;
+	char *buf, *p, *q, *vend, *value;
+	off_t off;
+	uint32_t vlen, i;
+	int n, oom;
+
+	*batch_p = NULL;
+	batch_link = batch_p;
+	off = w->spool_read;
+	n = 0;
+
+	while (n < batch_size && off < end) {
+		if (end - off < (off_t)sizeof(hdr)
+		|| pread(w->spool_fd, &hdr, sizeof(hdr), off) != sizeof(hdr)
+		|| hdr.magic != CDR_SPOOL_MAGIC || hdr.fixed != CDR_SPOOL_FIXED || !hdr.ncdr
+		|| hdr.len > end - off - sizeof(hdr))
+			goto bad;
+
+		if (!(buf = malloc(hdr.len))) {
+			cw_log(CW_LOG_ERROR, "Out of memory\n");
+			break;
+		}
+
+		if (pread(w->spool_fd, buf, hdr.len, off + sizeof(hdr)) != hdr.len) {
+			free(buf);
+			goto bad;
+		}
+
+		set = NULL;
+		link = &set;
+		oom = 0;
+		p = buf;
+		q = buf + hdr.len;
+		for (i = 0; i < hdr.ncdr; i++) {
+			if (q - p < CDR_SPOOL_FIXED + sizeof(vlen))
+				break;
+
+			if (!(cdr = malloc(sizeof(*cdr)))) {
+				cw_log(CW_LOG_ERROR, "Out of memory\n");
+				oom = 1;
+				break;
+			}
+
+			memcpy(cdr, p, CDR_SPOOL_FIXED);
+			p += CDR_SPOOL_FIXED;
+			cw_var_registry_init(&cdr->vars, 256);
+			cdr->next = cdr->batch_next = NULL;
+			*link = cdr;
+			link = &cdr->next;
+
+			memcpy(&vlen, p, sizeof(vlen));
+			p += sizeof(vlen);
+			if (vlen > q - p || (vlen && p[vlen - 1]))
+				break;
+
+			for (vend = p + vlen; p < vend; p = value + strlen(value) + 1) {
+				value = p + strlen(p) + 1;
+				if (value >= vend)
+					break;
+				cw_var_assign(&cdr->vars, p, value);
+			}
+			p = vend;
+		}
+
+		free(buf);
+
+		/* Leave the set where it is and try again later */
+		if (oom) {
+			cw_cdr_free(set);
+			break;
+		}
+
+		if (i < hdr.ncdr) {
+			cw_cdr_free(set);
+			goto bad;
+		}
+
+		*batch_link = set;
+		batch_link = &set->batch_next;
+		off += sizeof(hdr) + hdr.len;
+		n++;
+	}
+
+	*used = off - w->spool_read;
+	return n;
+
+bad:
+	cw_cdr_free(*batch_p);
+	*batch_p = NULL;
+	return -1;
+}
+
+
+/* ***************************************************************************
+ * Per back-end workers
+ */
+
+static void cdr_batch_free(struct cdr_batch *batch)
+{
+	cw_cdr_free(batch->head);
+	free(batch);
+}
+
+
+static void *cdr_worker_run(void *data)
+{
+	struct cdr_worker *w = data;
+	struct cdr_worker **wp;
+	struct cdr_qent *qent;
+	struct cdr_batch *batch;
+	struct cw_cdr *replay;
+	struct timespec now;
+	unsigned long lat;
+	off_t end, used;
+	int n, res;
+
+	pthread_mutex_lock(&cdr_batch_lock);
 
 	for (;;) {
-		pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &cdr_batch_lock);
-		pthread_mutex_lock(&cdr_batch_lock);
+		if ((qent = w->head)) {
+			if (!(w->head = qent->next))
+				w->tail = &w->head;
+			batch = qent->batch;
+			free(qent);
+
+			pthread_mutex_unlock(&cdr_batch_lock);
+
+			res = w->cdrbe->handler(batch->head);
 
+			cw_clock_gettime(global_cond_clock_monotonic, &now);
+			lat = (now.tv_sec - batch->queued.tv_sec) * 1000 + (now.tv_nsec - batch->queued.tv_nsec) / 1000000;
+
+			pthread_mutex_lock(&cdr_batch_lock);
+
+			w->depth -= batch->size;
+			w->batches++;
+			if (res)
+				w->failed += batch->size;
+			else
+				w->posted += batch->size;
+			w->lat_last = lat;
+			w->lat_total += lat;
+			if (lat > w->lat_max)
+				w->lat_max = lat;
+
+			if (!--batch->refs) {
+				pthread_mutex_unlock(&cdr_batch_lock);
+				cdr_batch_free(batch);
+				pthread_mutex_lock(&cdr_batch_lock);
+			}
+		} else if (w->spool_read < w->spool_size && !w->dead && cdr_spool_due(w)) {
+			end = w->spool_size;
+
+			pthread_mutex_unlock(&cdr_batch_lock);
+
+			res = 0;
+			if ((n = cdr_spool_read(w, end, &replay, &used)) > 0) {
+				res = w->cdrbe->handler(replay);
+				cw_cdr_free(replay);
+			}
+
+			pthread_mutex_lock(&w->spool_lock);
+			pthread_mutex_lock(&cdr_batch_lock);
+
+			if (n < 0)
+				cdr_spool_done(w, 1);
+			else if (n > 0) {
+				if (res && (!spool_retries || ++w->spool_tries < spool_retries)) {
+					/* The back-end is still down. Leave the records in the
+					 * spool and back off before trying them again.
+					 */
+					if (!spool_retries)
+						w->spool_tries++;
+					lat = (w->spool_tries < 7 ? 1UL << (w->spool_tries - 1) : SPOOL_BACKOFF_MAX);
+					if (lat > SPOOL_BACKOFF_MAX)
+						lat = SPOOL_BACKOFF_MAX;
+					cw_clock_gettime(global_cond_clock_monotonic, &w->spool_retry);
+					w->spool_retry.tv_sec += lat;
+					cw_log(CW_LOG_WARNING, "CDR back-end %s failed to take %d spooled CDRs - retrying in %lus\n", w->cdrbe->name, n, lat);
+				} else {
+					if (res) {
+						cw_log(CW_LOG_ERROR, "CDR back-end %s failed to take %d spooled CDRs %d times - discarding them\n", w->cdrbe->name, n, w->spool_tries);
+						w->failed += n;
+					} else
+						w->replayed += n;
+					w->spool_tries = 0;
+					w->spool_read += used;
+					if (w->spool_read >= w->spool_size)
+						cdr_spool_done(w, 0);
+				}
+			}
+
+			pthread_mutex_unlock(&w->spool_lock);
+
+			if (!n) {
+				/* Out of memory - give it a moment before trying again */
+				pthread_mutex_unlock(&cdr_batch_lock);
+				sleep(1);
+				pthread_mutex_lock(&cdr_batch_lock);
+			}
+		} else if (w->dead && !w->writers) {
+			break;
+		} else if (w->spool_read < w->spool_size && !w->dead)
+			pthread_cond_timedwait(&w->cond, &cdr_batch_lock, &w->spool_retry);
+		else
+			pthread_cond_wait(&w->cond, &cdr_batch_lock);
+	}
+
+	/* Anything left in the spool is picked up when (if) the back-end registers again */
+	for (wp = &cdr_workers; *wp != w; wp = &(*wp)->next);
+	*wp = w->next;
+	pthread_cond_broadcast(&cdr_workers_cond);
+
+	pthread_mutex_unlock(&cdr_batch_lock);
+
+	if (w->spool_fd >= 0)
+		close(w->spool_fd);
+	pthread_mutex_destroy(&w->spool_lock);
+	pthread_cond_destroy(&w->cond);
+	cw_object_put(w->cdrbe);
+	free(w);
+	return NULL;
+}
+
+
+/* Called with cdr_batch_lock held */
+static void cdr_worker_start(struct cw_cdrbe *cdrbe)
+{
+	struct stat st;
+	struct cdr_worker *w;
+	int l, res;
+
+	l = snprintf(NULL, 0, "%s/cdr-%s.spool", cw_config[CW_SPOOL_DIR], cdrbe->name);
+
+	if (!(w = calloc(1, sizeof(*w) + l + 1))) {
+		cw_log(CW_LOG_ERROR, "Out of memory - CDR back-end %s will receive nothing\n", cdrbe->name);
+		return;
+	}
+
+	sprintf(w->spool, "%s/cdr-%s.spool", cw_config[CW_SPOOL_DIR], cdrbe->name);
+	w->cdrbe = cw_object_dup(cdrbe);
+	w->tail = &w->head;
+	pthread_mutex_init(&w->spool_lock, NULL);
+	pthread_cond_init(&w->cond, &global_condattr_monotonic);
+
+	/* Pick up anything spooled by a previous instance */
+	if ((w->spool_fd = open_cloexec(w->spool, O_RDWR | O_APPEND, 0)) >= 0) {
+		if (!fstat(w->spool_fd, &st) && st.st_size > 0) {
+			w->spool_size = st.st_size;
+			cw_log(CW_LOG_NOTICE, "CDR back-end %s: replaying %lu bytes of spooled CDRs from %s\n", cdrbe->name, (unsigned long)st.st_size, w->spool);
+		} else {
+			close(w->spool_fd);
+			w->spool_fd = -1;
+			unlink(w->spool);
+		}
+	}
+
+	if ((res = cw_pthread_create(&w->tid, &global_attr_detached, cdr_worker_run, w))) {
+		cw_log(CW_LOG_ERROR, "Failed to create CDR worker for back-end %s: %s\n", cdrbe->name, strerror(res));
+		if (w->spool_fd >= 0)
+			close(w->spool_fd);
+		pthread_mutex_destroy(&w->spool_lock);
+		pthread_cond_destroy(&w->cond);
+		cw_object_put(w->cdrbe);
+		free(w);
+		return;
+	}
+
+	w->next = cdr_workers;
+	cdr_workers = w;
+}
+
+
+static int cdr_worker_sync_one(struct cw_object *obj, void *data)
+{
+	struct cw_cdrbe *cdrbe = container_of(obj, struct cw_cdrbe, obj);
+	struct cdr_worker *w;
+
+	CW_UNUSED(data);
+
+	for (w = cdr_workers; w; w = w->next) {
+		if (w->cdrbe == cdrbe && !w->dead) {
+			w->stale = 0;
+			return 0;
+		}
+	}
+
+	cdr_worker_start(cdrbe);
+	return 0;
+}
+
+/* Keep exactly one live worker per registered back-end. Workers for back-ends
+ * that have gone away drain what is already queued for them and exit.
+ */
+static void cdrbe_registry_onchange(void)
+{
+	struct cdr_worker *w;
+
+	pthread_mutex_lock(&cdr_batch_lock);
+
+	if (!pthread_equal(cdr_thread, CW_PTHREADT_NULL) && !shutting_down) {
+		for (w = cdr_workers; w; w = w->next)
+			w->stale = 1;
+
+		cw_registry_iterate(&cdrbe_registry, cdr_worker_sync_one, NULL);
+
+		for (w = cdr_workers; w; w = w->next) {
+			if (w->stale && !w->dead) {
+				w->dead = 1;
+				pthread_cond_signal(&w->cond);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&cdr_batch_lock);
+}
+
+
+/* ***************************************************************************
+ * Batching and dispatch
+ */
+
+/* Puts the batch on the queue of every live back-end, or in its spool if it
+ * is too far behind. Spooling happens after cdr_batch_lock is released.
+ * Called without cdr_batch_lock. Returns non-zero if the caller now holds
+ * the last reference to the batch.
+ */
+static int cdr_dispatch(struct cdr_batch *batch)
+{
+	struct cw_dynstr enc = CW_DYNSTR_INIT;
+	struct cdr_worker *w, *next, *spool, **spool_tail;
+	struct cdr_qent *qent;
+	int res;
+
+	spool = NULL;
+	spool_tail = &spool;
+
+	pthread_mutex_lock(&cdr_batch_lock);
+
+	batch->refs = 1;
+
+	for (w = cdr_workers; w; w = w->next) {
+		if (w->dead)
+			continue;
+
+		if ((!queue_max || !w->depth || w->depth + batch->size <= queue_max) && (qent = malloc(sizeof(*qent)))) {
+			qent->next = NULL;
+			qent->batch = batch;
+			*w->tail = qent;
+			w->tail = &qent->next;
+			batch->refs++;
+
+			w->depth += batch->size;
+			if (w->depth > w->depth_max)
+				w->depth_max = w->depth;
+
+			pthread_cond_signal(&w->cond);
+		} else {
+			w->writers++;
+			w->spool_depth = w->depth;
+			w->spool_next = NULL;
+			*spool_tail = w;
+			spool_tail = &w->spool_next;
+		}
+	}
+
+	pthread_mutex_unlock(&cdr_batch_lock);
+
+	/* Our own reference keeps the batch alive while it is spooled */
+	for (w = spool; w; w = next) {
+		next = w->spool_next;
+		cdr_spool_write(w, batch, w->spool_depth, &enc);
+	}
+
+	cw_dynstr_free(&enc);
+
+	pthread_mutex_lock(&cdr_batch_lock);
+	res = !--batch->refs;
+	pthread_mutex_unlock(&cdr_batch_lock);
+
+	return res;
+}
+
+
+static void *cw_cdr_submit(void *data)
+{
+	struct cdr_batch *batch;
+	struct cw_cdr **link;
+	struct timespec tick;
+	int n;
+
+	CW_UNUSED(data);
+
+	pthread_mutex_lock(&cdr_batch_lock);
+
+	for (;;) {
 		if (!curbatch.head) {
-			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			if (shutting_down)
+				break;
 			pthread_cond_wait(&cdr_batch_cond, &cdr_batch_lock);
-			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			continue;
+		}
+
+		/* Give the batch a chance to fill unless it already has */
+		if (!shutting_down && curbatch.size < batch_size && batch_time > 0) {
+			tick = curbatch.first;
+			tick.tv_sec += batch_time / 1000;
+			tick.tv_nsec += (batch_time % 1000) * 1000000L;
+			if (tick.tv_nsec >= 1000000000L) {
+				tick.tv_sec++;
+				tick.tv_nsec -= 1000000000L;
+			}
+			while (!shutting_down && curbatch.size < batch_size && pthread_cond_timedwait(&cdr_batch_cond, &cdr_batch_lock, &tick) != ETIMEDOUT);
 		}
 
-		oldbatchitems = curbatch.head;
-		curbatch.size = 0;
-		curbatch.head = NULL;
-		curbatch.tail = &curbatch.head;
+		if (!(batch = malloc(sizeof(*batch)))) {
+			pthread_mutex_unlock(&cdr_batch_lock);
+			cw_log(CW_LOG_ERROR, "Out of memory\n");
+			sleep(1);
+			pthread_mutex_lock(&cdr_batch_lock);
+			continue;
+		}
+
+		batch->head = curbatch.head;
+		batch->queued = curbatch.first;
+
+		for (n = 0, link = &curbatch.head; *link && n < batch_size; link = &(*link)->batch_next, n++);
+		curbatch.head = *link;
+		*link = NULL;
+		curbatch.size -= n;
+		batch->size = n;
+		if (!curbatch.head)
+			curbatch.tail = &curbatch.head;
+		else
+			cw_clock_gettime(global_cond_clock_monotonic, &curbatch.first);
+
+		pthread_mutex_unlock(&cdr_batch_lock);
+
+		cdr_mark_posted(batch->head);
 
-		pthread_cleanup_pop(1);
+		n = cdr_dispatch(batch);
 
-		if (oldbatchitems)
-			post_cdr(oldbatchitems);
+		if (n)
+			cdr_batch_free(batch);
+
+		pthread_mutex_lock(&cdr_batch_lock);
 	}
+
+	pthread_mutex_unlock(&cdr_batch_lock);
+
+	return NULL;
 }
 
 
@@ -792,8 +1437,15 @@ void cw_cdr_detach(struct cw_cdr *cdr)
 
 		*curbatch.tail = cdr;
 		curbatch.tail = &cdr->batch_next;
-		curbatch.size++;
-		pthread_cond_signal(&cdr_batch_cond);
+
+		/* The submit thread only needs to know when a batch starts
+		 * (to start the clock) and when it is full.
+		 */
+		if (++curbatch.size == 1) {
+			cw_clock_gettime(global_cond_clock_monotonic, &curbatch.first);
+			pthread_cond_signal(&cdr_batch_cond);
+		} else if (curbatch.size == batch_size)
+			pthread_cond_signal(&cdr_batch_cond);
 
 		pthread_mutex_unlock(&cdr_batch_lock);
 
@@ -806,26 +1458,48 @@ void cw_cdr_detach(struct cw_cdr *cdr)
 }
 
 
-static int cdrbe_print(struct cw_object *obj, void *data)
-{
-	struct cw_cdrbe *cdrbe = container_of(obj, struct cw_cdrbe, obj);
-	struct cw_dynstr *ds_p = data;
-
-	cw_dynstr_printf(ds_p, "CDR registered backend: %s\n", cdrbe->name);
-	return 0;
-}
-
-
 static int handle_cli_status(struct cw_dynstr *ds_p, int argc, char *argv[])
 {
+	struct cdr_worker *w;
+
 	CW_UNUSED(argv);
 
 	if (argc > 2)
 		return RESULT_SHOWUSAGE;
 
 	cw_dynstr_printf(ds_p, "CDR logging: %s\n", enabled ? "enabled" : "disabled");
-	if (enabled)
-		cw_registry_iterate_ordered(&cdrbe_registry, cdrbe_print, ds_p);
+
+	if (enabled) {
+		pthread_mutex_lock(&cdr_batch_lock);
+
+		cw_dynstr_printf(ds_p, "Batch size: %d CDRs\n", batch_size);
+		cw_dynstr_printf(ds_p, "Batch time: %dms\n", batch_time);
+		if (queue_max)
+			cw_dynstr_printf(ds_p, "Queue limit: %d CDRs per back-end\n", queue_max);
+		else
+			cw_dynstr_printf(ds_p, "Queue limit: none\n");
+		if (spool_retries)
+			cw_dynstr_printf(ds_p, "Spool retries: %d\n", spool_retries);
+		else
+			cw_dynstr_printf(ds_p, "Spool retries: unlimited\n");
+		cw_dynstr_printf(ds_p, "Waiting for batch: %d\n\n", curbatch.size);
+
+		cw_dynstr_printf(ds_p, "%-16s %7s %7s %9s %7s %7s %8s %7s %10s %-16s\n",
+			"Back-end", "Queued", "Peak", "Posted", "Failed", "Spooled", "Replayed", "Dropped", "Spool", "Latency ms");
+		cw_dynstr_printf(ds_p, "%-16s %7s %7s %9s %7s %7s %8s %7s %10s %-16s\n",
+			"", "", "", "", "", "", "", "", "(bytes)", "last/avg/max");
+
+		for (w = cdr_workers; w; w = w->next) {
+			cw_dynstr_printf(ds_p, "%-16s %7d %7d %9lu %7lu %7lu %8lu %7lu %10lu %lu/%lu/%lu%s\n",
+				w->cdrbe->name, w->depth, w->depth_max,
+				w->posted, w->failed, w->spooled, w->replayed, w->dropped,
+				(unsigned long)(w->spool_size - w->spool_read),
+				w->lat_last, (w->batches ? (unsigned long)(w->lat_total / w->batches) : 0UL), w->lat_max,
+				(w->dead ? " (unregistering)" : ""));
+		}
+
+		pthread_mutex_unlock(&cdr_batch_lock);
+	}
 
 	return 0;
 }
@@ -837,16 +1511,71 @@ static struct cw_clicmd cli_status = {
 	.summary = "Display the CDR status",
 	.usage =
 	"Usage: cdr status\n"
-	"	Displays the Call Detail Record engine system status.\n"
+	"	Displays the Call Detail Record engine system status together with\n"
+	"	the queue depth, counters and posting latency of each back-end.\n"
 };
 
 
 static void cw_cdr_engine_term(void)
 {
-	if (!pthread_equal(cdr_thread, CW_PTHREADT_NULL)) {
-		pthread_cancel(cdr_thread);
-		pthread_join(cdr_thread, NULL);
+	struct cw_dynstr enc = CW_DYNSTR_INIT;
+	struct timespec tick;
+	struct cdr_worker *w, *next;
+	struct cdr_qent *qent;
+	int depth;
+
+	if (pthread_equal(cdr_thread, CW_PTHREADT_NULL))
+		return;
+
+	pthread_mutex_lock(&cdr_batch_lock);
+	shutting_down = 1;
+	pthread_cond_signal(&cdr_batch_cond);
+	pthread_mutex_unlock(&cdr_batch_lock);
+
+	/* The submit thread dispatches whatever is waiting before it exits */
+	pthread_join(cdr_thread, NULL);
+
+	pthread_mutex_lock(&cdr_batch_lock);
+
+	cdr_thread = CW_PTHREADT_NULL;
+
+	for (w = cdr_workers; w; w = w->next) {
+		w->dead = 1;
+		pthread_cond_signal(&w->cond);
+	}
+
+	cw_clock_gettime(global_cond_clock_monotonic, &tick);
+	tick.tv_sec += SHUTDOWN_WAIT;
+	while (cdr_workers && pthread_cond_timedwait(&cdr_workers_cond, &cdr_batch_lock, &tick) != ETIMEDOUT);
+
+	/* Anything still queued behind a back-end that is stuck goes to its
+	 * spool to be replayed next time.
+	 */
+	for (w = cdr_workers; w; w = next) {
+		/* A writer reference stops w exiting while the lock is dropped */
+		w->writers++;
+		while ((qent = w->head)) {
+			if (!(w->head = qent->next))
+				w->tail = &w->head;
+			depth = w->depth;
+			w->depth -= qent->batch->size;
+			w->writers++;
+			pthread_mutex_unlock(&cdr_batch_lock);
+
+			cdr_spool_write(w, qent->batch, depth, &enc);
+			cw_dynstr_reset(&enc);
+			free(qent);
+
+			pthread_mutex_lock(&cdr_batch_lock);
+		}
+		next = w->next;
+		w->writers--;
+		pthread_cond_signal(&w->cond);
 	}
+
+	pthread_mutex_unlock(&cdr_batch_lock);
+
+	cw_dynstr_free(&enc);
 }
 
 static struct cw_atexit cdr_atexit = {
@@ -860,15 +1589,38 @@ static int do_reload(void)
 	struct cw_config *config = NULL;
 	const char *value = NULL;
 	int new_enabled, new_cw_end_cdr_before_h_exten;
+	int new_batch_size, new_batch_time, new_queue_max, new_spool_retries;
 
 	new_enabled = 1;
 	new_cw_end_cdr_before_h_exten = 0;
+	new_batch_size = BATCH_SIZE_DEFAULT;
+	new_batch_time = BATCH_TIME_DEFAULT;
+	new_queue_max = QUEUE_MAX_DEFAULT;
+	new_spool_retries = SPOOL_RETRIES_DEFAULT;
 
 	if ((config = cw_config_load("cdr.conf"))) {
 		if ((value = cw_variable_retrieve(config, "general", "enable")))
 			new_enabled = cw_true(value);
 		if ((value = cw_variable_retrieve(config, "general", "endbeforehexten")))
 			new_cw_end_cdr_before_h_exten = cw_true(value);
+		if ((value = cw_variable_retrieve(config, "general", "batchsize"))) {
+			if ((new_batch_size = atoi(value)) < 1) {
+				cw_log(CW_LOG_WARNING, "batchsize in cdr.conf must be at least 1\n");
+				new_batch_size = 1;
+			}
+		}
+		if ((value = cw_variable_retrieve(config, "general", "batchtime"))) {
+			if ((new_batch_time = atoi(value)) < 0)
+				new_batch_time = 0;
+		}
+		if ((value = cw_variable_retrieve(config, "general", "queuemax"))) {
+			if ((new_queue_max = atoi(value)) < 0)
+				new_queue_max = 0;
+		}
+		if ((value = cw_variable_retrieve(config, "general", "spoolretries"))) {
+			if ((new_spool_retries = atoi(value)) < 0)
+				new_spool_retries = 0;
+		}
 
 		/* DEPRECATED */
 		if (cw_variable_retrieve(config, "general", "batch"))
@@ -878,12 +1630,21 @@ static int do_reload(void)
 		if (cw_variable_retrieve(config, "general", "scheduleronly"))
 			cw_log(CW_LOG_NOTICE, "scheduleronly option in cdr.conf is deprecated and should be removed\n");
 		if (cw_variable_retrieve(config, "general", "size"))
-			cw_log(CW_LOG_NOTICE, "size option in cdr.conf is deprecated and should be removed\n");
+			cw_log(CW_LOG_NOTICE, "size option in cdr.conf is deprecated and should be replaced by batchsize\n");
 		if (cw_variable_retrieve(config, "general", "time"))
-			cw_log(CW_LOG_NOTICE, "time option in cdr.conf is deprecated and should be removed\n");
+			cw_log(CW_LOG_NOTICE, "time option in cdr.conf is deprecated and should be replaced by batchtime (in milliseconds)\n");
 	}
 
+	pthread_mutex_lock(&cdr_batch_lock);
 	enabled = new_enabled;
+	batch_size = new_batch_size;
+	batch_time = new_batch_time;
+	queue_max = new_queue_max;
+	spool_retries = new_spool_retries;
+	/* Let the submit thread re-evaluate what it is waiting for */
+	pthread_cond_signal(&cdr_batch_cond);
+	pthread_mutex_unlock(&cdr_batch_lock);
+
 	cw_end_cdr_before_h_exten = new_cw_end_cdr_before_h_exten;
 
 	if (enabled)
@@ -903,11 +1664,17 @@ int cw_cdr_engine_init(void)
 
 	curbatch.tail = &curbatch.head;
 
+	pthread_cond_init(&cdr_batch_cond, &global_condattr_monotonic);
+	pthread_cond_init(&cdr_workers_cond, &global_condattr_monotonic);
+
 	cw_atexit_register(&cdr_atexit);
 
 	if (!(res = cw_pthread_create(&cdr_thread, &global_attr_default, cw_cdr_submit, NULL))) {
 		cw_cli_register(&cli_status);
 		res = do_reload();
+
+		/* Pick up any back-ends that registered before we were ready */
+		cdrbe_registry_onchange();
 	} else
 		cw_log(CW_LOG_ERROR, "Failed to create CDR posting thread: %s\n", strerror(res));
 
@@ -919,4 +1686,3 @@ void cw_cdr_engine_reload(void)
 {
 	do_reload();
 }
-
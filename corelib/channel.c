@@ -28,7 +28,12 @@
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 #include <math.h>
+#include <stdint.h>
+#ifdef HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
 #define SPANDSP_EXPOSE_INTERNAL_STRUCTURES
 #include <spandsp.h>
 
@@ -599,6 +604,118 @@ static void free_cid(struct cw_callerid *cid)
 }
 
 
+/* The read queue is an intrusive MPSC list threaded through the frames'
+ * own next pointers with a stub node so it is never empty. Producers
+ * only swap the tail so queueing is O(1) and needs no lock. The single
+ * consumer is cw_read() with the channel locked. A producer swaps the
+ * tail and then links the previous frame to its own so the consumer can
+ * catch it in between. By then cw_read() has already taken the alert
+ * for that frame so rather than report an empty queue the consumer waits
+ * for the link, which is only ever a store away.
+ */
+/* A no-op cmpxchg is a read with a full barrier */
+#define READQ_LOAD(q, p)	cmpxchg(&(q)->lock, (p), NULL, NULL)
+
+static void readq_init(struct cw_readq *q)
+{
+	pthread_mutex_init(&q->lock, &global_mutexattr_simple);
+	q->front = NULL;
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+	atomic_set(&q->count, 0);
+	atomic_set(&q->hangup, 0);
+}
+
+static void readq_push(struct cw_readq *q, struct cw_frame *f)
+{
+	struct cw_frame *prev;
+
+	f->next = NULL;
+	do {
+		prev = q->tail;
+	} while (cmpxchg(&q->lock, &q->tail, prev, f) != prev);
+	(void)cmpxchg(&q->lock, &prev->next, NULL, f);
+}
+
+static struct cw_frame *readq_wait(struct cw_readq *q, struct cw_frame *f)
+{
+	struct cw_frame *next;
+
+	while (!(next = READQ_LOAD(q, &f->next)))
+		sched_yield();
+	return next;
+}
+
+static struct cw_frame *readq_pop(struct cw_readq *q)
+{
+	struct cw_frame *head = q->head;
+	struct cw_frame *next;
+
+	if (head == &q->stub) {
+		if (!(next = READQ_LOAD(q, &head->next))) {
+			if (READQ_LOAD(q, &q->tail) == head)
+				return NULL;
+			next = readq_wait(q, head);
+		}
+		q->head = head = next;
+	}
+
+	if (!(next = READQ_LOAD(q, &head->next))) {
+		/* If head is the last frame the stub goes back on so head can
+		 * be unlinked. Otherwise a push is in progress.
+		 */
+		if (READQ_LOAD(q, &q->tail) == head)
+			readq_push(q, &q->stub);
+		next = readq_wait(q, head);
+	}
+
+	q->head = next;
+	return head;
+}
+
+/* Add a frame to the queue regardless of its length */
+static void readq_put(struct cw_readq *q, struct cw_frame *f)
+{
+	atomic_inc(&q->count);
+	if (f->frametype == CW_FRAME_CONTROL && f->subclass == CW_CONTROL_HANGUP)
+		atomic_inc(&q->hangup);
+	readq_push(q, f);
+}
+
+/* Put a list of frames back at the front of the queue. Caller must
+ * hold the channel lock.
+ */
+static void readq_unget(struct cw_readq *q, struct cw_frame *f)
+{
+	struct cw_frame **p;
+
+	for (p = &f; *p; p = &(*p)->next) {
+		atomic_inc(&q->count);
+		if ((*p)->frametype == CW_FRAME_CONTROL && (*p)->subclass == CW_CONTROL_HANGUP)
+			atomic_inc(&q->hangup);
+	}
+	*p = q->front;
+	q->front = f;
+}
+
+/* Caller must hold the channel lock */
+static struct cw_frame *readq_get(struct cw_readq *q)
+{
+	struct cw_frame *f;
+
+	if ((f = q->front))
+		q->front = f->next;
+	else if (!(f = readq_pop(q)))
+		return NULL;
+
+	f->next = NULL;
+	atomic_dec(&q->count);
+	if (f->frametype == CW_FRAME_CONTROL && f->subclass == CW_CONTROL_HANGUP)
+		atomic_dec(&q->hangup);
+	return f;
+}
+
+
 static void cw_channel_release(struct cw_object *obj)
 {
 	struct cw_channel *chan = container_of(obj, struct cw_channel, obj);
@@ -614,13 +731,14 @@ static void cw_channel_release(struct cw_object *obj)
 	/* Close pipes if appropriate */
 	if (chan->alertpipe[0] > -1)
 		close(chan->alertpipe[0]);
-	if (chan->alertpipe[1] > -1)
+	if (chan->alertpipe[1] > -1 && chan->alertpipe[1] != chan->alertpipe[0])
 		close(chan->alertpipe[1]);
 
-	while ((f = chan->readq)) {
-		chan->readq = chan->readq->next;
+	while ((f = readq_get(&chan->readq)))
 		cw_fr_free(f);
-	}
+	atomic_destroy(&chan->readq.count);
+	atomic_destroy(&chan->readq.hangup);
+	pthread_mutex_destroy(&chan->readq.lock);
 
 	cw_mutex_destroy(&chan->lock);
 	cw_registry_destroy(&chan->vars);
@@ -650,19 +768,29 @@ struct cw_channel *cw_channel_alloc(int needqueue, const char *fmt, ...)
 				chan->fds[x] = -1;
 
 			if (needqueue) {
+#ifdef HAVE_EVENTFD
+				/* A semaphore eventfd counts alerts just as the pipe
+				 * counts bytes but costs one fd rather than two
+				 */
+				if ((chan->alertpipe[0] = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE)) >= 0) {
+					chan->alertpipe[1] = chan->alertpipe[0];
+				} else
+#endif
 				if (!pipe(chan->alertpipe)) {
 					fcntl(chan->alertpipe[0], F_SETFL, fcntl(chan->alertpipe[0], F_GETFL) | O_NONBLOCK);
 					fcntl(chan->alertpipe[1], F_SETFL, fcntl(chan->alertpipe[1], F_GETFL) | O_NONBLOCK);
-
-					/* Always watch the alertpipe */
-					chan->fds[CW_MAX_FDS-1] = chan->alertpipe[0];
 				} else {
 					cw_log(CW_LOG_WARNING, "Channel allocation failed: Can't create alert pipe!\n");
 					free(chan);
 					return NULL;
 				}
+
+				/* Always watch the alertpipe */
+				chan->fds[CW_MAX_FDS-1] = chan->alertpipe[0];
 			}
 
+			readq_init(&chan->readq);
+
 			chan->tech = &null_tech;
 
 			/* Initial state */
@@ -755,36 +883,48 @@ t38_status_t cw_channel_get_t38_status( struct cw_channel *tmp )
 
 
 
+int cw_alertpipe_write(int *alertpipe)
+{
+	if (alertpipe[0] == alertpipe[1]) {
+		uint64_t one = 1;
+
+		return (write(alertpipe[1], &one, sizeof(one)) == sizeof(one) ? 0 : -1);
+	} else {
+		char blah = 0;
+
+		return (write(alertpipe[1], &blah, sizeof(blah)) == sizeof(blah) ? 0 : -1);
+	}
+}
+
+int cw_alertpipe_read(int *alertpipe)
+{
+	if (alertpipe[0] == alertpipe[1]) {
+		uint64_t val;
+
+		return (read(alertpipe[0], &val, sizeof(val)) == sizeof(val) ? 0 : -1);
+	} else {
+		char blah;
+
+		return (read(alertpipe[0], &blah, sizeof(blah)) == sizeof(blah) ? 0 : -1);
+	}
+}
+
+
 /*--- cw_queue_frame: Queue an outgoing media frame */
 int cw_queue_frame(struct cw_channel *chan, struct cw_frame *fin)
 {
 	struct cw_frame *f;
-	struct cw_frame *prev, *cur;
-	int qlen = 0;
+	int qlen;
+
+	/* Don't bother actually queueing anything after a hangup */
+	if (atomic_read(&chan->readq.hangup))
+		return 0;
 
-	/* Build us a copy and free the original one */
-	if ((f = cw_frdup(fin)) == NULL)
-	{
-		cw_log(CW_LOG_WARNING, "Unable to duplicate frame\n");
-		return -1;
-	}
-	cw_channel_lock(chan);
-	prev = NULL;
-	for (cur = chan->readq;  cur;  cur = cur->next)
-	{
-		if ((cur->frametype == CW_FRAME_CONTROL) && (cur->subclass == CW_CONTROL_HANGUP))
-			{
-			/* Don't bother actually queueing anything after a hangup */
-			cw_fr_free(f);
-			cw_channel_unlock(chan);
-			return 0;
-		}
-		prev = cur;
-		qlen++;
-	}
 	/* Allow up to 96 voice frames outstanding, and up to 128 total frames */
+	qlen = atomic_fetch_and_add(&chan->readq.count, 1);
 	if (((fin->frametype == CW_FRAME_VOICE) && (qlen > 96)) || (qlen  > 128))
 	{
+		atomic_dec(&chan->readq.count);
 		if (fin->frametype != CW_FRAME_VOICE)
 			{
 			cw_log(CW_LOG_ERROR, "Dropping non-voice (type %d) frame for %s due to long queue length\n", fin->frametype, chan->name);
@@ -793,30 +933,35 @@ int cw_queue_frame(struct cw_channel *chan, struct cw_frame *fin)
 			{	
 			cw_log(CW_LOG_WARNING, "Dropping voice frame for %s due to exceptionally long queue\n", chan->name);
 		}
-		cw_fr_free(f);
-		cw_channel_unlock(chan);
 		return 0;
 	}
-	if (prev)
-		prev->next = f;
-	else
-		chan->readq = f;
+
+	/* Build us a copy and free the original one */
+	if ((f = cw_frdup(fin)) == NULL)
+	{
+		atomic_dec(&chan->readq.count);
+		cw_log(CW_LOG_WARNING, "Unable to duplicate frame\n");
+		return -1;
+	}
+
+	if (f->frametype == CW_FRAME_CONTROL && f->subclass == CW_CONTROL_HANGUP)
+		atomic_inc(&chan->readq.hangup);
+	readq_push(&chan->readq, f);
 
 	if (chan->alertpipe[1] > -1)
 	{
-		if (write(chan->alertpipe[1], &chan, 1) != 1)
+		if (cw_alertpipe_write(chan->alertpipe))
 			cw_log(CW_LOG_WARNING, 
 				"Unable to write to alert pipe on %s, frametype/subclass %d/%d (qlen = %d): %s!\n",
 				chan->name,
-				f->frametype,
-				f->subclass,
+				fin->frametype,
+				fin->subclass,
 				qlen,
 				strerror(errno)
 			);
 	} else if (cw_test_flag(chan, CW_FLAG_BLOCKING)) {
 		pthread_kill(chan->blocker, SIGURG);
 	}
-	cw_channel_unlock(chan);
 	return 0;
 }
 
@@ -1824,17 +1969,12 @@ struct cw_frame *cw_read(struct cw_channel *chan)
 	}
 
 	/* Read and ignore anything on the alertpipe, but read only
-	   one sizeof(blah) per frame that we send from it */
-	if (chan->alertpipe[0] > -1) {
-		char blah;
-		read(chan->alertpipe[0], &blah, sizeof(blah));
-	}
+	   one alert per frame that we send from it */
+	if (chan->alertpipe[0] > -1)
+		cw_alertpipe_read(chan->alertpipe);
 
 	/* Check for pending read queue */
-	if (chan->readq) {
-		f = chan->readq;
-		chan->readq = f->next;
-	} else {
+	if (!(f = readq_get(&chan->readq))) {
 		chan->blocker = pthread_self();
 		if (cw_test_flag(chan, CW_FLAG_EXCEPTION)) {
 			if (chan->tech->exception) {
@@ -1857,8 +1997,8 @@ struct cw_frame *cw_read(struct cw_channel *chan)
 		/* If the channel driver returned more than one frame, stuff the excess
 		   into the readq for the next cw_read call */
 		if (f->next) {
-			/* We can safely assume the read queue is empty, or we wouldn't be here */
-			chan->readq = f->next;
+			/* Anything queued since we looked comes after these */
+			readq_unget(&chan->readq, f->next);
 			f->next = NULL;
 		}
 
@@ -2809,7 +2949,7 @@ int cw_do_masquerade(struct cw_channel *original)
 	int x,i;
 	int res=0;
 	int origstate;
-	struct cw_frame *cur, *prev;
+	struct cw_frame *cur;
 	const struct cw_channel_tech *t;
 	void *t_pvt;
 	struct cw_callerid tmpcid;
@@ -2853,11 +2993,6 @@ int cw_do_masquerade(struct cw_channel *original)
 	original->tech_pvt = oldchan->tech_pvt;
 	oldchan->tech_pvt = t_pvt;
 
-	/* Swap the readq's */
-	cur = original->readq;
-	original->readq = oldchan->readq;
-	oldchan->readq = cur;
-
 	/* Swap the alertpipes */
 	for (i = 0;  i < 2;  i++) {
 		x = original->alertpipe[i];
@@ -2873,28 +3008,16 @@ int cw_do_masquerade(struct cw_channel *original)
 	original->rawwriteformat = oldchan->rawwriteformat;
 	oldchan->rawwriteformat = x;
 
-	/* Save any pending frames on both sides.  Start by counting
-	 * how many we're going to need... */
-	prev = NULL;
-	cur = oldchan->readq;
-	x = 0;
-	while (cur) {
-		x++;
-		prev = cur;
-		cur = cur->next;
-	}
-	/* If we had any, prepend them to the ones already in the queue, and 
-	 * load up the alertpipe */
-	if (prev) {
-		prev->next = original->readq;
-		original->readq = oldchan->readq;
-		oldchan->readq = NULL;
-		if (original->alertpipe[1] > -1) {
-			for (i = 0;  i < x;  i++) {
-				char c;
-				write(original->alertpipe[1], &c, sizeof(c));
-			}
-		}
+	/* Save any pending frames on both sides. The original keeps its own
+	 * frames followed by the clone's. The alertpipes have been swapped
+	 * so the one the original now has already holds alerts for the
+	 * clone's frames. Load it up for the original's own frames. */
+	x = cw_channel_readq_len(original);
+	while ((cur = readq_get(&oldchan->readq)))
+		readq_put(&original->readq, cur);
+	if (original->alertpipe[1] > -1) {
+		for (i = 0;  i < x;  i++)
+			cw_alertpipe_write(original->alertpipe);
 	}
 	oldchan->_softhangup = CW_SOFTHANGUP_DEV;
 
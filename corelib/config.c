@@ -49,6 +49,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/utils.h"
 #include "callweaver/channel.h"
 #include "callweaver/app.h"
+#include "callweaver/callweaver_hash.h"
 
 #define MAX_NESTED_COMMENTS 128
 #define COMMENT_START ";--"
@@ -83,7 +84,7 @@ static int cw_config_engine_qsort_compare_by_name(const void *a, const void *b)
 static int config_engine_object_match(struct cw_object *obj, const void *pattern)
 {
 	struct cw_config_engine *ce = container_of(obj, struct cw_config_engine, obj);
-	return strcasecmp(ce->name, pattern);
+	return !strcasecmp(ce->name, pattern);
 }
 
 struct cw_registry config_engine_registry = {
@@ -684,6 +685,417 @@ static struct cw_config *config_text_file_load(const char *filename, struct cw_c
 	return cfg;
 }
 
+/* Realtime lookup cache
+ *
+ * Results of cw_load_realtime() and cw_load_realtime_multientry() are kept
+ * for the TTL given to the family in the [cache] section of extconfig.conf.
+ * Lookups that found nothing may be cached as well, with their own (usually
+ * much shorter) TTL, so that a stream of requests for unknown peers does not
+ * turn into a stream of queries. Concurrent identical lookups are coalesced
+ * so only the first goes to the engine and the rest wait for its answer.
+ *
+ * Callers own and free what they are given so every hit hands out a copy.
+ * Entries are dropped when cw_update_realtime() touches a row they hold or
+ * were looked up by and when the mappings are reloaded.
+ */
+#define RTCACHE_BUCKETS		256
+#define RTCACHE_MAX_ENTRIES	10000
+
+struct rtcache_family {
+	struct rtcache_family *next;
+	int ttl;
+	int negttl;
+	unsigned int entries;
+	unsigned long hits, neghits, misses, coalesced, invalidated;
+	char name[0];
+};
+
+struct rtcache_entry {
+	struct rtcache_entry *next;
+	struct rtcache_family *family;
+	unsigned int hash;
+	int refs;
+	int loading;		/* the first caller is still asking the engine */
+	int stale;		/* no longer in the table, freed on last put */
+	time_t expires;
+	struct cw_variable *var;
+	struct cw_config *cfg;
+	size_t keylen;
+	char key[0];		/* type, family, then param/value pairs, all NUL terminated */
+};
+
+static struct rtcache_family *rtcache_families;
+static struct rtcache_entry *rtcache[RTCACHE_BUCKETS];
+static unsigned int rtcache_count;
+
+CW_MUTEX_DEFINE_STATIC(rtcache_lock);
+static pthread_cond_t rtcache_cond = PTHREAD_COND_INITIALIZER;
+
+
+static time_t rtcache_now(void)
+{
+	struct timespec ts;
+
+	cw_clock_gettime(global_cond_clock_monotonic, &ts);
+	return ts.tv_sec;
+}
+
+static struct cw_variable *rtcache_clone_vars(const struct cw_variable *v)
+{
+	struct cw_variable *head = NULL, **tail = &head;
+
+	for (; v; v = v->next) {
+		if (!(*tail = variable_clone(v))) {
+			cw_variables_destroy(head);
+			return NULL;
+		}
+		tail = &(*tail)->next;
+	}
+
+	return head;
+}
+
+static struct cw_config *rtcache_clone_config(const struct cw_config *cfg)
+{
+	struct cw_config *new;
+	struct cw_category *cat, *ncat;
+	struct cw_variable *v, *nv;
+
+	if (!(new = cw_config_new()))
+		return NULL;
+
+	for (cat = cfg->root; cat; cat = cat->next) {
+		if (!(ncat = cw_category_new(cat->name)))
+			goto fail;
+		ncat->ignored = cat->ignored;
+		cw_category_append(new, ncat);
+
+		for (v = cat->root; v; v = v->next) {
+			if (!(nv = variable_clone(v)))
+				goto fail;
+			cw_variable_append(ncat, nv);
+		}
+	}
+
+	return new;
+
+fail:
+	cw_config_destroy(new);
+	return NULL;
+}
+
+static void rtcache_free(struct rtcache_entry *ent)
+{
+	cw_variables_destroy(ent->var);
+	cw_config_destroy(ent->cfg);
+	free(ent);
+}
+
+/* Must be called with rtcache_lock held */
+static void rtcache_unlink(struct rtcache_entry *ent)
+{
+	struct rtcache_entry **p;
+
+	for (p = &rtcache[ent->hash % RTCACHE_BUCKETS]; *p; p = &(*p)->next) {
+		if (*p == ent) {
+			*p = ent->next;
+			break;
+		}
+	}
+
+	ent->stale = 1;
+	ent->family->entries--;
+	rtcache_count--;
+
+	if (!ent->refs)
+		rtcache_free(ent);
+}
+
+/* Must be called with rtcache_lock held */
+static void rtcache_sweep(time_t now)
+{
+	struct rtcache_entry *ent, *next;
+	int i;
+
+	for (i = 0; i < RTCACHE_BUCKETS; i++) {
+		for (ent = rtcache[i]; ent; ent = next) {
+			next = ent->next;
+			if (!ent->loading && ent->expires <= now)
+				rtcache_unlink(ent);
+		}
+	}
+}
+
+static void rtcache_put(struct rtcache_entry *ent)
+{
+	cw_mutex_lock(&rtcache_lock);
+	if (!--ent->refs && ent->stale)
+		rtcache_free(ent);
+	cw_mutex_unlock(&rtcache_lock);
+}
+
+/*! \brief Find or start a cached realtime lookup
+ *
+ * Returns NULL if the family is not cached (or the cache is full), in which
+ * case the caller goes to the engine as it always has. Otherwise returns a
+ * referenced entry. If *leader is set the caller must do the lookup itself
+ * and pass the result to rtcache_fill(), otherwise the entry holds the
+ * answer and must be released with rtcache_put() once it has been copied.
+ */
+static struct rtcache_entry *rtcache_get(int multi, const char *family, va_list ap, int *leader)
+{
+	struct rtcache_family *fam;
+	struct rtcache_entry *ent, *new;
+	const char *param, *value;
+	va_list aq;
+	size_t len;
+	time_t now;
+	char *q;
+
+	*leader = 0;
+
+	len = strlen(family) + 2;
+	va_copy(aq, ap);
+	while ((param = va_arg(aq, const char *))) {
+		value = va_arg(aq, const char *);
+		len += strlen(param) + (value ? strlen(value) : 0) + 2;
+	}
+	va_end(aq);
+
+	if (!(new = malloc(sizeof(*new) + len)))
+		return NULL;
+
+	q = new->key;
+	*(q++) = (multi ? 'm' : 's');
+	q = stpcpy(q, family) + 1;
+	va_copy(aq, ap);
+	while ((param = va_arg(aq, const char *))) {
+		value = va_arg(aq, const char *);
+		q = stpcpy(q, param) + 1;
+		q = stpcpy(q, (value ? value : "")) + 1;
+	}
+	va_end(aq);
+	new->keylen = len;
+	new->hash = cw_hash_mem(0, new->key, len);
+
+	cw_mutex_lock(&rtcache_lock);
+
+	for (fam = rtcache_families; fam && strcasecmp(fam->name, family); fam = fam->next);
+	if (!fam || (fam->ttl <= 0 && fam->negttl <= 0))
+		goto uncached;
+
+	now = rtcache_now();
+
+	for (ent = rtcache[new->hash % RTCACHE_BUCKETS]; ent; ent = ent->next) {
+		if (ent->hash == new->hash && ent->keylen == len && !memcmp(ent->key, new->key, len))
+			break;
+	}
+
+	if (ent && !ent->loading && ent->expires <= now) {
+		rtcache_unlink(ent);
+		ent = NULL;
+	}
+
+	if (ent) {
+		ent->refs++;
+		if (ent->loading) {
+			fam->coalesced++;
+			while (ent->loading)
+				cw_cond_wait(&rtcache_cond, &rtcache_lock);
+		} else if (ent->var || ent->cfg)
+			fam->hits++;
+		else
+			fam->neghits++;
+		cw_mutex_unlock(&rtcache_lock);
+		free(new);
+		return ent;
+	}
+
+	fam->misses++;
+
+	if (rtcache_count >= RTCACHE_MAX_ENTRIES) {
+		rtcache_sweep(now);
+		if (rtcache_count >= RTCACHE_MAX_ENTRIES)
+			goto uncached;
+	}
+
+	new->family = fam;
+	new->refs = 1;
+	new->loading = 1;
+	new->stale = 0;
+	new->expires = 0;
+	new->var = NULL;
+	new->cfg = NULL;
+	new->next = rtcache[new->hash % RTCACHE_BUCKETS];
+	rtcache[new->hash % RTCACHE_BUCKETS] = new;
+	fam->entries++;
+	rtcache_count++;
+
+	cw_mutex_unlock(&rtcache_lock);
+
+	*leader = 1;
+	return new;
+
+uncached:
+	cw_mutex_unlock(&rtcache_lock);
+	free(new);
+	return NULL;
+}
+
+/*! \brief Publish the result of a lookup started by rtcache_get()
+ *
+ * The entry keeps its own copy of the result. Anyone who was waiting
+ * for it is woken and the caller's reference is released.
+ */
+static void rtcache_fill(struct rtcache_entry *ent, const struct cw_variable *var, const struct cw_config *cfg)
+{
+	struct cw_variable *nvar = NULL;
+	struct cw_config *ncfg = NULL;
+	int ok = 1;
+	int ttl;
+
+	if (var)
+		ok = ((nvar = rtcache_clone_vars(var)) != NULL);
+	else if (cfg)
+		ok = ((ncfg = rtcache_clone_config(cfg)) != NULL);
+
+	cw_mutex_lock(&rtcache_lock);
+
+	ent->var = nvar;
+	ent->cfg = ncfg;
+	ent->loading = 0;
+
+	ttl = (var || cfg ? ent->family->ttl : ent->family->negttl);
+	if (ok && ttl > 0)
+		ent->expires = rtcache_now() + ttl;
+	else if (!ent->stale)
+		rtcache_unlink(ent);
+
+	cw_cond_broadcast(&rtcache_cond);
+
+	if (!--ent->refs && ent->stale)
+		rtcache_free(ent);
+
+	cw_mutex_unlock(&rtcache_lock);
+}
+
+static int rtcache_vars_match(const struct cw_variable *v, const char *keyfield, const char *lookup)
+{
+	for (; v; v = v->next) {
+		if (!strcasecmp(v->name, keyfield) && !strcmp(v->value, lookup))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int rtcache_entry_match(const struct rtcache_entry *ent, const char *keyfield, const char *lookup)
+{
+	const struct cw_category *cat;
+	const char *p, *end, *param;
+
+	/* Looked up by the key that was updated? */
+	end = ent->key + ent->keylen;
+	p = ent->key + 1;
+	p += strlen(p) + 1;
+	while (p < end) {
+		param = p;
+		p += strlen(p) + 1;
+		if (!strcasecmp(param, keyfield) && !strcmp(p, lookup))
+			return 1;
+		p += strlen(p) + 1;
+	}
+
+	/* Holding the row that was updated? */
+	if (rtcache_vars_match(ent->var, keyfield, lookup))
+		return 1;
+	if (ent->cfg) {
+		for (cat = ent->cfg->root; cat; cat = cat->next)
+			if (rtcache_vars_match(cat->root, keyfield, lookup))
+				return 1;
+	}
+
+	return 0;
+}
+
+/*! \brief Drop cached lookups that an update may have made wrong
+ *
+ * That is anything looked up by, or holding a row with, the updated key
+ * plus every negative entry for the family since the update may have given
+ * a row the value some earlier lookup failed to find. Lookups in progress
+ * are dropped too so they answer their waiters but are not kept.
+ * If keyfield is NULL the whole family (or everything if family is NULL)
+ * is dropped.
+ */
+static void rtcache_invalidate(const char *family, const char *keyfield, const char *lookup)
+{
+	struct rtcache_entry *ent, *next;
+	int i;
+
+	cw_mutex_lock(&rtcache_lock);
+
+	for (i = 0; i < RTCACHE_BUCKETS; i++) {
+		for (ent = rtcache[i]; ent; ent = next) {
+			next = ent->next;
+
+			if (family && strcasecmp(ent->family->name, family))
+				continue;
+
+			if (!keyfield || ent->loading || (!ent->var && !ent->cfg) || rtcache_entry_match(ent, keyfield, lookup)) {
+				ent->family->invalidated++;
+				rtcache_unlink(ent);
+			}
+		}
+	}
+
+	cw_mutex_unlock(&rtcache_lock);
+}
+
+/*! \brief Apply the [cache] section of extconfig.conf
+ *
+ * Each entry is "family => ttl[,negative ttl]" in seconds. Families that
+ * are not listed are not cached. Everything cached so far is dropped.
+ */
+static void rtcache_configure(const struct cw_config *config)
+{
+	struct rtcache_family *fam;
+	struct cw_variable *v;
+	int ttl, negttl;
+
+	rtcache_invalidate(NULL, NULL, NULL);
+
+	cw_mutex_lock(&rtcache_lock);
+
+	for (fam = rtcache_families; fam; fam = fam->next)
+		fam->ttl = fam->negttl = 0;
+
+	for (v = (config ? cw_variable_browse(config, "cache") : NULL); v; v = v->next) {
+		ttl = negttl = 0;
+		if (sscanf(v->value, "%d , %d", &ttl, &negttl) < 1 || ttl < 0 || negttl < 0) {
+			cw_log(CW_LOG_WARNING, "Invalid cache setting '%s => %s' at line %d of %s\n", v->name, v->value, v->lineno, extconfig_conf);
+			continue;
+		}
+
+		for (fam = rtcache_families; fam && strcasecmp(fam->name, v->name); fam = fam->next);
+		if (!fam) {
+			if (!(fam = calloc(1, sizeof(*fam) + strlen(v->name) + 1)))
+				continue;
+			strcpy(fam->name, v->name);
+			fam->next = rtcache_families;
+			rtcache_families = fam;
+		}
+
+		fam->ttl = ttl;
+		fam->negttl = negttl;
+
+		if (option_verbose > 1)
+			cw_verbose(VERBOSE_PREFIX_2 "Caching realtime %s for %ds (not found for %ds)\n", fam->name, ttl, negttl);
+	}
+
+	cw_mutex_unlock(&rtcache_lock);
+}
+
+
 static void clear_config_maps(void) 
 {
 	struct cw_config_map *map;
@@ -749,6 +1161,7 @@ void read_config_maps(void)
 	config = cw_config_internal_load(extconfig_conf, configtmp);
 	if (!config) {
 		cw_config_destroy(configtmp);
+		rtcache_configure(NULL);
 		return;
 	}
 
@@ -786,7 +1199,9 @@ void read_config_maps(void)
 		} else 
 			append_mapping(v->name, driver, database, table);
 	}
-		
+
+	rtcache_configure(config);
+
 	cw_config_destroy(config);
 }
 
@@ -887,17 +1302,28 @@ struct cw_config *cw_config_load(const char *filename)
 struct cw_variable *cw_load_realtime(const char *family, ...)
 {
 	struct cw_config_engine *eng;
+	struct rtcache_entry *ent;
 	char db[256]="";
 	char table[256]="";
 	struct cw_variable *res=NULL;
 	va_list ap;
+	int leader;
 
 	va_start(ap, family);
-	eng = find_engine(family, db, sizeof(db), table, sizeof(table));
-	if (eng) {
-		if (eng->realtime_func) 
-			res = eng->realtime_func(db, table, ap);
-		cw_object_put(eng);
+	ent = rtcache_get(0, family, ap, &leader);
+	if (ent && !leader) {
+		if (ent->var)
+			res = rtcache_clone_vars(ent->var);
+		rtcache_put(ent);
+	} else {
+		eng = find_engine(family, db, sizeof(db), table, sizeof(table));
+		if (eng) {
+			if (eng->realtime_func) 
+				res = eng->realtime_func(db, table, ap);
+			cw_object_put(eng);
+		}
+		if (ent)
+			rtcache_fill(ent, res, NULL);
 	}
 	va_end(ap);
 
@@ -921,17 +1347,28 @@ int cw_check_realtime(const char *family)
 struct cw_config *cw_load_realtime_multientry(const char *family, ...)
 {
 	struct cw_config_engine *eng;
+	struct rtcache_entry *ent;
 	char db[256]="";
 	char table[256]="";
 	struct cw_config *res=NULL;
 	va_list ap;
+	int leader;
 
 	va_start(ap, family);
-	eng = find_engine(family, db, sizeof(db), table, sizeof(table));
-	if (eng) {
-		if (eng->realtime_multi_func) 
-			res = eng->realtime_multi_func(db, table, ap);
-		cw_object_put(eng);
+	ent = rtcache_get(1, family, ap, &leader);
+	if (ent && !leader) {
+		if (ent->cfg)
+			res = rtcache_clone_config(ent->cfg);
+		rtcache_put(ent);
+	} else {
+		eng = find_engine(family, db, sizeof(db), table, sizeof(table));
+		if (eng) {
+			if (eng->realtime_multi_func) 
+				res = eng->realtime_multi_func(db, table, ap);
+			cw_object_put(eng);
+		}
+		if (ent)
+			rtcache_fill(ent, NULL, res);
 	}
 	va_end(ap);
 
@@ -955,6 +1392,8 @@ int cw_update_realtime(const char *family, const char *keyfield, const char *loo
 	}
 	va_end(ap);
 
+	rtcache_invalidate(family, keyfield, lookup);
+
 	return res;
 }
 
@@ -988,14 +1427,83 @@ static const char show_config_help[] =
 	"Usage: show config mappings\n"
 	"	Shows the filenames to config engines.\n";
 
-static struct cw_clicmd config_command_struct = {
-	.cmda = { "show", "config", "mappings", NULL },
-	.handler = config_command,
-	.summary = "Show Config mappings (file names to config engines)",
-	.usage = show_config_help,
+static int rtcache_show(struct cw_dynstr *ds_p, int argc, char **argv)
+{
+	struct rtcache_family *fam;
+	unsigned long total;
+
+	if (argc < 3 || argc > 4)
+		return RESULT_SHOWUSAGE;
+
+	cw_dynstr_printf(ds_p, "%-20s %6s %6s %8s %10s %10s %10s %10s %10s %6s\n",
+		"Family", "TTL", "NegTTL", "Entries", "Hits", "NegHits", "Misses", "Coalesced", "Dropped", "Hit%");
+
+	cw_mutex_lock(&rtcache_lock);
+
+	for (fam = rtcache_families; fam; fam = fam->next) {
+		if (argc == 4 && strcasecmp(fam->name, argv[3]))
+			continue;
+
+		total = fam->hits + fam->neghits + fam->misses + fam->coalesced;
+		cw_dynstr_printf(ds_p, "%-20s %6d %6d %8u %10lu %10lu %10lu %10lu %10lu %5lu%%\n",
+			fam->name, fam->ttl, fam->negttl, fam->entries,
+			fam->hits, fam->neghits, fam->misses, fam->coalesced, fam->invalidated,
+			(total ? (100UL * (total - fam->misses)) / total : 0UL));
+	}
+
+	cw_dynstr_printf(ds_p, "%u of at most %d entries in use\n", rtcache_count, RTCACHE_MAX_ENTRIES);
+
+	cw_mutex_unlock(&rtcache_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static int rtcache_flush(struct cw_dynstr *ds_p, int argc, char **argv)
+{
+	CW_UNUSED(ds_p);
+
+	if (argc < 3 || argc > 4)
+		return RESULT_SHOWUSAGE;
+
+	rtcache_invalidate((argc == 4 ? argv[3] : NULL), NULL, NULL);
+	return RESULT_SUCCESS;
+}
+
+static const char rtcache_show_help[] =
+	"Usage: realtime show cache [family]\n"
+	"	Shows the realtime lookup cache settings and hit rates for each\n"
+	"	family listed in the [cache] section of extconfig.conf.\n"
+	"	Coalesced lookups waited for an identical lookup already in progress.\n"
+	"	Dropped entries were invalidated by updates, reloads or flushes.\n";
+
+static const char rtcache_flush_help[] =
+	"Usage: realtime flush cache [family]\n"
+	"	Drops cached realtime lookups so the next lookups go to the database.\n"
+	"	Use this after changing realtime tables other than through CallWeaver.\n";
+
+static struct cw_clicmd config_cli[] = {
+	{
+		.cmda = { "show", "config", "mappings", NULL },
+		.handler = config_command,
+		.summary = "Show Config mappings (file names to config engines)",
+		.usage = show_config_help,
+	},
+	{
+		.cmda = { "realtime", "show", "cache", NULL },
+		.handler = rtcache_show,
+		.summary = "Show realtime lookup cache statistics",
+		.usage = rtcache_show_help,
+	},
+	{
+		.cmda = { "realtime", "flush", "cache", NULL },
+		.handler = rtcache_flush,
+		.summary = "Drop cached realtime lookups",
+		.usage = rtcache_flush_help,
+	},
 };
 
 int register_config_cli(void)
 {
-	return cw_cli_register(&config_command_struct);
+	cw_cli_register_multiple(config_cli, arraysize(config_cli));
+	return 0;
 }
@@ -112,6 +112,103 @@ static void *service_thread(void *data)
 }
 
 
+struct service_batch {
+	struct cw_connection *conn;
+	struct cw_udpfromto_msg *msgs;
+	struct cw_sockaddr_net *addrs;
+	char *bufs;
+};
+
+
+static void service_thread_batch_cleanup(void *data)
+{
+	struct service_batch *sb = data;
+
+	free(sb->bufs);
+	free(sb->addrs);
+	free(sb->msgs);
+	cw_object_put(sb->conn);
+}
+
+
+/* Datagram connections with a batch size are read here rather than by the
+ * tech. Each wakeup receives as many datagrams as are waiting, up to the
+ * batch size, with a single system call where the platform allows and
+ * hands them all to the tech's read_batch in one go.
+ */
+static void *service_thread_batch(void *data)
+{
+	struct service_batch sb = {
+		.conn = data,
+	};
+	struct pollfd pfd = {
+		.fd = sb.conn->sock,
+		.events = POLLIN,
+	};
+	unsigned int i;
+	int n;
+
+	pthread_cleanup_push(service_thread_batch_cleanup, &sb);
+
+	sb.msgs = malloc(sb.conn->batch * sizeof(sb.msgs[0]));
+	sb.addrs = malloc(2 * sb.conn->batch * sizeof(sb.addrs[0]));
+	sb.bufs = malloc(sb.conn->batch * CW_CONNECTION_DGRAM_MAX);
+
+	if (!sb.msgs || !sb.addrs || !sb.bufs) {
+		cw_log(CW_LOG_ERROR, "Out of memory!\n");
+		goto out;
+	}
+
+	for (;;) {
+		for (i = 0; i < sb.conn->batch; i++) {
+			sb.msgs[i].buf = sb.bufs + i * CW_CONNECTION_DGRAM_MAX;
+			sb.msgs[i].len = CW_CONNECTION_DGRAM_MAX;
+			sb.msgs[i].from = &sb.addrs[2 * i].sa;
+			sb.msgs[i].fromlen = sizeof(sb.addrs[0]);
+			sb.msgs[i].to = &sb.addrs[2 * i + 1].sa;
+			sb.msgs[i].tolen = sizeof(sb.addrs[0]);
+			sb.msgs[i].to->sa_family = AF_UNSPEC;
+			sb.msgs[i].flags = 0;
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		n = poll(&pfd, 1, -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (n == 1) {
+			if ((n = cw_recvmmsgfromto(sb.conn->sock, sb.msgs, sb.conn->batch, MSG_DONTWAIT)) > 0)
+				n = sb.conn->tech->read_batch(sb.conn, sb.msgs, n);
+			else if (n < 0) {
+#if !defined(__FreeBSD__)
+				/* On Linux EAGAIN after a successful poll means a bad UDP checksum */
+				if (errno == EAGAIN)
+					cw_log(CW_LOG_NOTICE, "%s: Received packet with bad UDP checksum\n", sb.conn->tech->name);
+				else
+#endif
+				if (errno != EINTR && errno != ECONNREFUSED)
+					cw_log(CW_LOG_WARNING, "%s: Recv error: %s\n", sb.conn->tech->name, strerror(errno));
+				n = 0;
+			}
+		} else if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOMEM)
+				break;
+			n = 1000;
+		}
+
+		if (unlikely(n > 0))
+			sleep(n / 1000);
+		if (unlikely(n < 0))
+			break;
+	}
+
+out:
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+
 static void cw_connection_release(struct cw_object *obj)
 {
 	struct cw_connection *conn = container_of(obj, struct cw_connection, obj);
@@ -144,7 +241,7 @@ void cw_connection_close(struct cw_connection *conn)
 }
 
 
-struct cw_connection *cw_connection_listen(int type, struct sockaddr *addr, socklen_t addrlen, const struct cw_connection_tech *tech, struct cw_object *pvt_obj)
+struct cw_connection *cw_connection_listen_batch(int type, struct sockaddr *addr, socklen_t addrlen, const struct cw_connection_tech *tech, struct cw_object *pvt_obj, unsigned int batch, int flags)
 {
 	struct cw_connection *conn = NULL;
 	int sock;
@@ -155,6 +252,15 @@ struct cw_connection *cw_connection_listen(int type, struct sockaddr *addr, sock
 
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
+	if ((flags & CW_CONNECTION_REUSEPORT)) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+			cw_log(CW_LOG_WARNING, "Unable to set SO_REUSEPORT on %#l@: %s\n", addr, strerror(errno));
+#else
+		cw_log(CW_LOG_WARNING, "SO_REUSEPORT is not supported on this platform\n");
+#endif
+	}
+
 #if 0
 #ifdef IPV6_V6ONLY
 	if (addr->sa_family == AF_INET6)
@@ -182,6 +288,7 @@ struct cw_connection *cw_connection_listen(int type, struct sockaddr *addr, sock
 	cw_object_init(conn, NULL, 1);
 	conn->obj.release = cw_connection_release;
 	conn->reliable = (type == SOCK_STREAM || type == SOCK_SEQPACKET);
+	conn->batch = (type == SOCK_DGRAM && tech->read_batch && batch > 1 ? batch : 0);
 	conn->state = LISTENING;
 	conn->sock = sock;
 	conn->tech = tech;
@@ -196,7 +303,7 @@ struct cw_connection *cw_connection_listen(int type, struct sockaddr *addr, sock
 	if (!(conn->reg_entry = cw_registry_add(&cw_connection_registry, cw_sockaddr_hash(addr, 0), &conn->obj)))
 		goto out_release;
 
-	if (!(errno = cw_pthread_create(&conn->tid, &global_attr_default, service_thread, cw_object_dup(conn))))
+	if (!(errno = cw_pthread_create(&conn->tid, &global_attr_default, (conn->batch ? service_thread_batch : service_thread), cw_object_dup(conn))))
 		goto out;
 
 	cw_object_put(conn);
@@ -212,6 +319,12 @@ out:
 }
 
 
+struct cw_connection *cw_connection_listen(int type, struct sockaddr *addr, socklen_t addrlen, const struct cw_connection_tech *tech, struct cw_object *pvt_obj)
+{
+	return cw_connection_listen_batch(type, addr, addrlen, tech, pvt_obj, 0, 0);
+}
+
+
 #define FORMAT_HEAD "%5.5s %5.5s %5.5s %-12.12s %s\n"
 #define FORMAT_BODY "%5d %5d %5d %-12.12s %#l@\n"
 
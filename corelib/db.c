@@ -50,11 +50,24 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/utils.h"
 #include "callweaver/lock.h"
 #include "callweaver/manager.h"
+#include "callweaver/atexit.h"
+#include "callweaver/atomic.h"
+#include "callweaver/config.h"
+#include "callweaver/callweaver_hash.h"
 #include "sqlite3.h"
 
 #define SQL_MAX_RETRIES 5
 #define SQL_RETRY_USEC  500000
 
+#define DB_DEFAULT_CONNECTIONS	4
+#define DB_MAX_CONNECTIONS	32
+
+#define DB_DEFAULT_WB_INTERVAL	100	/* ms */
+#define DB_DEFAULT_WB_BATCH	256
+
+#define DB_CACHE_BUCKETS	256
+#define DB_WB_BUCKETS		1024
+
 CW_MUTEX_DEFINE_STATIC(dblock);
 
 static const char *create_odb_sql =
@@ -67,6 +80,15 @@ static const char *create_odb_sql =
 "CREATE INDEX odb_index_2 ON odb(keys);\n"
 "CREATE INDEX odb_index_3 ON odb(value);\n";
 
+/* Puts are done as a single insert-or-replace which needs (family, keys) to be
+ * unique. That was always true in practice because puts deleted first, but
+ * older databases may have picked up duplicates from concurrent puts so the
+ * newest of each is kept.
+ */
+static const char *unique_odb_sql =
+"delete from %q where rowid not in (select max(rowid) from %q group by family, keys);\n"
+"create unique index if not exists odb_index_fk on %q(family, keys);\n";
+
 static int debug = 0;
 static int loaded = 0;
 
@@ -77,12 +99,127 @@ static struct {
 	const char *tablename;
 } globals;
 
+
+enum db_stmt {
+	DB_STMT_GET,
+	DB_STMT_PUT,
+	DB_STMT_DEL,
+	DB_STMT_DEL_FAMILY,
+	DB_STMT_DELTREE,
+	DB_STMT_DELTREE_KEYS,
+	DB_STMT_DELTREE_VALUE,
+	DB_STMT_GETTREE,
+	DB_STMT_GETTREE_KEYS,
+	DB_STMT_BEGIN,
+	DB_STMT_COMMIT,
+	DB_STMT_ROLLBACK,
+	DB_STMT_COUNT
+};
+
+/* Every statement is a format for sqlite3_mprintf taking the table name */
+static const char *db_stmt_sql[DB_STMT_COUNT] = {
+	[DB_STMT_GET] = "select value from %q where family = ?1 and keys = ?2",
+	[DB_STMT_PUT] = "insert or replace into %q (family, keys, value) values (?1, ?2, ?3)",
+	[DB_STMT_DEL] = "delete from %q where family = ?1 and keys = ?2",
+	[DB_STMT_DEL_FAMILY] = "delete from %q where family = ?1",
+	[DB_STMT_DELTREE] = "delete from %q where family like ?1 || '%%'",
+	[DB_STMT_DELTREE_KEYS] = "delete from %q where family like ?1 || '%%' and keys like ?2 || '%%'",
+	[DB_STMT_DELTREE_VALUE] = "delete from %q where family like ?1 || '%%' and keys like ?2 || '%%' and value like ?3 || '%%'",
+	[DB_STMT_GETTREE] = "select keys, value from %q where family = ?1",
+	[DB_STMT_GETTREE_KEYS] = "select keys, value from %q where family = ?1 and keys like ?2 || '%%'",
+	[DB_STMT_BEGIN] = "begin",
+	[DB_STMT_COMMIT] = "commit",
+	[DB_STMT_ROLLBACK] = "rollback",
+};
+
+
+/* A pooled connection with its statements prepared on first use */
+struct db_conn {
+	cw_mutex_t lock;
+	sqlite3 *db;
+	sqlite3_stmt *stmt[DB_STMT_COUNT];
+};
+
+static struct db_conn *db_pool;
+static int db_pool_size;
+static unsigned int db_pool_next;
+
+
+/* Families named in db.conf are held entirely in memory. The cache is loaded
+ * from the database on first use and kept up to date by puts and dels, so a
+ * miss is as good as a database lookup that found nothing.
+ */
+struct db_cache_entry {
+	struct db_cache_entry *next;
+	char *value;
+	char key[0];
+};
+
+struct db_cache_family {
+	struct db_cache_family *next;
+	int loaded;
+	unsigned int entries;
+	struct db_cache_entry *bucket[DB_CACHE_BUCKETS];
+	char name[0];
+};
+
+/* The list of families is fixed after init so may be walked without the lock.
+ * Their contents are protected by db_cache_lock.
+ */
+static struct db_cache_family *db_cache;
+CW_MUTEX_DEFINE_STATIC(db_cache_lock);
+
+
+/* Pending writes when write-behind is enabled. There is at most one entry per
+ * family and key holding the latest value (or NULL for a delete). A flush
+ * moves the queue to the in-flight set under db_wb_lock and commits it
+ * without, so queueing never waits on the database. Lookups check the queue
+ * then the in-flight set so anything found in neither is already in the
+ * database. db_wb_flush_lock allows only one batch in flight at a time.
+ */
+struct db_wb_entry {
+	struct db_wb_entry *next;
+	unsigned int hash;
+	char *family;
+	char *key;
+	char *value;
+	char data[0];
+};
+
+static int db_wb_enabled;
+static int db_wb_interval = DB_DEFAULT_WB_INTERVAL;
+static int db_wb_batch = DB_DEFAULT_WB_BATCH;
+static struct db_wb_entry *db_wb_bucket[DB_WB_BUCKETS];
+static int db_wb_count;
+static struct db_wb_entry *db_wb_inflight[DB_WB_BUCKETS];
+static int db_wb_inflight_count;
+static int db_wb_shutdown;
+static pthread_t db_wb_thread = CW_PTHREADT_NULL;
+static cw_cond_t db_wb_cond;
+CW_MUTEX_DEFINE_STATIC(db_wb_lock);
+CW_MUTEX_DEFINE_STATIC(db_wb_flush_lock);
+
+
+static struct {
+	atomic_t gets;
+	atomic_t get_cache_hits;
+	atomic_t get_pending_hits;
+	atomic_t puts;
+	atomic_t dels;
+	atomic_t queued;
+	atomic_t coalesced;
+	atomic_t batches;
+	atomic_t batch_rows;
+	atomic_t batch_failures;
+	atomic_t errors;
+	int batch_max;
+} db_stats;
+
+
 static int dbinit(void);
 static void sqlite_pick_path(const char *dbname, char *buf, size_t size);
 static sqlite3 *sqlite_open_db(const char *filename);
 static void sqlite_check_table_exists(const char *dbfile, const char *test_sql, const char *create_sql);
-static int get_callback(void *pArg, int argc, char **argv, char **columnNames);
-static int tree_callback(void *pArg, int argc, char **argv, char **columnNames);
 static int show_callback(void *pArg, int argc, char **argv, char **columnNames);
 static int database_show(struct cw_dynstr *ds_p, int argc, char *argv[]);
 static int database_put(struct cw_dynstr *ds_p, int argc, char *argv[]);
@@ -100,27 +237,6 @@ static int sanity_check(void)
 	return 0;
 }
 
-static int dbinit(void)
-{
-	char *sql;
-
-	cw_mutex_lock(&dblock);
-	globals.dbdir = cw_config[CW_DB_DIR];
-	globals.dbfile = cw_config[CW_DB];
-	globals.tablename = "odb";
-	
-	
-	if ((sql = sqlite3_mprintf("select count(*) from %q limit 1", globals.tablename))) {
-		sqlite_check_table_exists(globals.dbfile, sql, create_odb_sql);
-		sqlite3_free(sql);
-		sql = NULL;
-		loaded = 1;
-	}
-
-	cw_mutex_unlock(&dblock);
-	return loaded ? 0 : -1;
-}
-
 
 static void sqlite_pick_path(const char *dbname, char *buf, size_t size)
 {
@@ -137,7 +253,7 @@ static sqlite3 *sqlite_open_db(const char *filename)
 {
 	sqlite3 *db;
 	char path[1024];
-	
+
 	sqlite_pick_path(filename, path, sizeof(path));
 	if (sqlite3_open(path, &db)) {
 		cw_log(CW_LOG_WARNING, "SQL ERR [%s]\n", sqlite3_errmsg(db));
@@ -187,200 +303,772 @@ static void sqlite_check_table_exists(const char *dbfile, const char *test_sql,
 
 }
 
-int cw_db_put(const char *family, const char *keys, const char *value)
+
+/* ***************************************************************************
+ * Connection pool
+ */
+
+static struct db_conn *db_conn_get(void)
 {
-	char *sql;
-	char *zErr = 0;
-	int res = 0;
-	sqlite3 *db;
+	struct db_conn *conn;
+	unsigned int n = db_pool_next;
+	int i;
+
+	/* Take the first idle connection if there is one, otherwise queue
+	 * on the next one round.
+	 */
+	for (i = 0; i < db_pool_size; i++) {
+		conn = &db_pool[(n + i) % db_pool_size];
+		if (!cw_mutex_trylock(&conn->lock)) {
+			db_pool_next = n + i + 1;
+			goto out;
+		}
+	}
 
-	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
-		return -1;
+	conn = &db_pool[n % db_pool_size];
+	db_pool_next = n + 1;
+	cw_mutex_lock(&conn->lock);
+
+out:
+	if (!conn->db) {
+		cw_mutex_unlock(&conn->lock);
+		conn = NULL;
 	}
+	return conn;
+}
 
+static void db_conn_put(struct db_conn *conn)
+{
+	cw_mutex_unlock(&conn->lock);
+}
 
-	if (!family || cw_strlen_zero(family)) {
-		family = "_undef_";
+static sqlite3_stmt *db_stmt(struct db_conn *conn, enum db_stmt which)
+{
+	sqlite3_stmt *stmt;
+	char *sql;
+
+	if (!(stmt = conn->stmt[which])) {
+		if ((sql = sqlite3_mprintf(db_stmt_sql[which], globals.tablename))) {
+			if (sqlite3_prepare_v2(conn->db, sql, -1, &stmt, NULL) == SQLITE_OK)
+				conn->stmt[which] = stmt;
+			else {
+				cw_log(CW_LOG_ERROR, "SQL ERR [%s] [%s]\n", sql, sqlite3_errmsg(conn->db));
+				stmt = NULL;
+			}
+			sqlite3_free(sql);
+		} else
+			cw_log(CW_LOG_ERROR, "Out of memory\n");
 	}
 
-	cw_db_del(family, keys);
+	return stmt;
+}
 
-	if ((sql = sqlite3_mprintf("insert into %q values('%q','%q','%q')", globals.tablename, family, keys, value))) {
-		if (debug) cw_log(CW_LOG_DEBUG, "SQL [%s]\n", sql);
+static void db_stmt_done(sqlite3_stmt *stmt)
+{
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
 
-		res = sqlite3_exec(db, sql, NULL, NULL, &zErr);
+/* Binds up to three text arguments (NULLs are skipped) and runs a statement
+ * that returns no rows. Returns the number of rows changed or -1 on error.
+ */
+static int db_exec(struct db_conn *conn, enum db_stmt which, const char *a1, const char *a2, const char *a3)
+{
+	sqlite3_stmt *stmt;
+	int res = -1;
+
+	if ((stmt = db_stmt(conn, which))) {
+		if (a1)
+			sqlite3_bind_text(stmt, 1, a1, -1, SQLITE_STATIC);
+		if (a2)
+			sqlite3_bind_text(stmt, 2, a2, -1, SQLITE_STATIC);
+		if (a3)
+			sqlite3_bind_text(stmt, 3, a3, -1, SQLITE_STATIC);
+
+		if (debug)
+			cw_log(CW_LOG_DEBUG, "SQL [%s] [%s] [%s] [%s]\n", sqlite3_sql(stmt), (a1 ? a1 : ""), (a2 ? a2 : ""), (a3 ? a3 : ""));
+
+		if (sqlite3_step(stmt) == SQLITE_DONE)
+			res = sqlite3_changes(conn->db);
+		else {
+			cw_log(CW_LOG_ERROR, "SQL ERR [%s] [%s]\n", sqlite3_sql(stmt), sqlite3_errmsg(conn->db));
+			atomic_inc(&db_stats.errors);
+		}
 
-		if (zErr) {
-			cw_log(CW_LOG_ERROR, "SQL ERR [%s] [%s]\n", sql, zErr);
-			res = -1;
-			sqlite3_free(zErr);
-		} else
-			res = 0;
-	} else {
-		cw_log(CW_LOG_ERROR, "Out of memory\n");
-		res = -1;	/* Return an error */
+		db_stmt_done(stmt);
 	}
 
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
+	return res;
+}
+
+/* Looks up a single value and appends it to result (if not NULL).
+ * Returns 0 if found, -1 if not.
+ */
+static int db_get_value(const char *family, const char *keys, struct cw_dynstr *result)
+{
+	struct db_conn *conn;
+	sqlite3_stmt *stmt;
+	int res = -1;
+
+	if ((conn = db_conn_get())) {
+		if ((stmt = db_stmt(conn, DB_STMT_GET))) {
+			sqlite3_bind_text(stmt, 1, family, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 2, keys, -1, SQLITE_STATIC);
+
+			if (debug)
+				cw_log(CW_LOG_DEBUG, "SQL [%s] [%s] [%s]\n", sqlite3_sql(stmt), family, keys);
+
+			while (sqlite3_step(stmt) == SQLITE_ROW) {
+				if (result)
+					cw_dynstr_printf(result, "%s", (const char *)sqlite3_column_text(stmt, 0));
+				res = 0;
+			}
+
+			db_stmt_done(stmt);
+		}
+		db_conn_put(conn);
 	}
-	sqlite3_close(db);
+
 	return res;
 }
 
 
-struct get_callback_args {
-	struct cw_dynstr *ds_p;
-	int rownum;
-};
+/* ***************************************************************************
+ * Read cache
+ */
 
-static int get_callback(void *pArg, int argc, char **argv, char **columnNames) 
+static struct db_cache_family *db_cache_find(const char *family)
 {
-	struct get_callback_args *args = pArg;
+	struct db_cache_family *fam;
 
-	CW_UNUSED(argc);
-	CW_UNUSED(columnNames);
+	for (fam = db_cache; fam; fam = fam->next)
+		if (!strcmp(fam->name, family))
+			break;
 
-	if (args->ds_p)
-		cw_dynstr_printf(args->ds_p, "%s", argv[0]);
-	args->rownum++;
-	return 0;
+	return fam;
 }
 
-int cw_db_get(const char *family, const char *keys, struct cw_dynstr *result)
+static struct db_cache_entry **db_cache_lookup(struct db_cache_family *fam, const char *keys)
 {
-	struct get_callback_args args;
-	sqlite3 *db;
-	char *sql;
-	char *zErr = 0;
-	int res = 0;
-	int retry=0;
+	struct db_cache_entry **entry;
 
-	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
+	for (entry = &fam->bucket[cw_hash_string(0, keys) % DB_CACHE_BUCKETS]; *entry; entry = &(*entry)->next)
+		if (!strcmp((*entry)->key, keys))
+			break;
+
+	return entry;
+}
+
+static int db_cache_set(struct db_cache_family *fam, const char *keys, const char *value)
+{
+	struct db_cache_entry **entry = db_cache_lookup(fam, keys);
+	char *v;
+
+	if (!value) {
+		struct db_cache_entry *old;
+
+		if (!(old = *entry))
+			return -1;
+
+		*entry = old->next;
+		free(old->value);
+		free(old);
+		fam->entries--;
+		return 0;
+	}
+
+	if (!(v = strdup(value)))
 		return -1;
+
+	if (*entry) {
+		free((*entry)->value);
+		(*entry)->value = v;
+	} else {
+		struct db_cache_entry *e;
+		size_t l = strlen(keys) + 1;
+
+		if (!(e = malloc(sizeof(*e) + l))) {
+			free(v);
+			return -1;
+		}
+		memcpy(e->key, keys, l);
+		e->value = v;
+		e->next = NULL;
+		*entry = e;
+		fam->entries++;
 	}
 
-	if (!family || cw_strlen_zero(family)) {
-		family = "_undef_";
+	return 0;
+}
+
+static void db_cache_clear(struct db_cache_family *fam)
+{
+	struct db_cache_entry *entry;
+	int i;
+
+	for (i = 0; i < DB_CACHE_BUCKETS; i++) {
+		while ((entry = fam->bucket[i])) {
+			fam->bucket[i] = entry->next;
+			free(entry->value);
+			free(entry);
+		}
 	}
 
-	args.ds_p = result;
-	args.rownum = 0;
+	fam->entries = 0;
+	fam->loaded = 0;
+}
 
-retry_1:
-	if ((sql = sqlite3_mprintf("select value from %q where family='%q' and keys='%q'", globals.tablename, family, keys))) {
-		if (debug) cw_log(CW_LOG_DEBUG, "SQL [%s]\n", sql);
+static int db_wb_flush(void);
+
+/* Called with db_cache_lock held */
+static void db_cache_load(struct db_cache_family *fam)
+{
+	struct db_conn *conn;
+	sqlite3_stmt *stmt;
 
-		res = sqlite3_exec(db, sql, get_callback, &args, &zErr);
+	/* Anything still queued has to be in the database first. If it
+	 * can't be written the family stays unloaded and is looked up in
+	 * the queue and the database as if it were not cached.
+	 */
+	if (db_wb_flush())
+		return;
 
-		if (zErr) {
-			if (retry >= SQL_MAX_RETRIES) {
-				cw_log(CW_LOG_ERROR, "SQL ERR [%s] [%s]\n", sql, zErr);
-				sqlite3_free(zErr);
-			} else {
-				cw_log(CW_LOG_WARNING, "SQL ERR [%s] (retry %d)\n", zErr, ++retry);
-				sqlite3_free(zErr);
-				usleep(SQL_RETRY_USEC);
-				goto retry_1;
+	if ((conn = db_conn_get())) {
+		if ((stmt = db_stmt(conn, DB_STMT_GETTREE))) {
+			sqlite3_bind_text(stmt, 1, fam->name, -1, SQLITE_STATIC);
+
+			while (sqlite3_step(stmt) == SQLITE_ROW)
+				db_cache_set(fam, (const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1));
+
+			db_stmt_done(stmt);
+			fam->loaded = 1;
+		}
+		db_conn_put(conn);
+	}
+
+	if (debug)
+		cw_log(CW_LOG_DEBUG, "cached %u entries for family %s\n", fam->entries, fam->name);
+}
+
+
+/* ***************************************************************************
+ * Write-behind queue
+ */
+
+static struct db_wb_entry **db_wb_lookup(struct db_wb_entry **bucket, unsigned int hash, const char *family, const char *keys)
+{
+	struct db_wb_entry **entry;
+
+	for (entry = &bucket[hash % DB_WB_BUCKETS]; *entry; entry = &(*entry)->next)
+		if ((*entry)->hash == hash && !strcmp((*entry)->key, keys) && !strcmp((*entry)->family, family))
+			break;
+
+	return entry;
+}
+
+/* Finds the latest unwritten change to a key, if any. Called with db_wb_lock held. */
+static struct db_wb_entry *db_wb_find(const char *family, const char *keys)
+{
+	unsigned int hash = cw_hash_string(cw_hash_string(0, family), keys);
+	struct db_wb_entry *entry;
+
+	if (!(entry = *db_wb_lookup(db_wb_bucket, hash, family, keys)))
+		entry = *db_wb_lookup(db_wb_inflight, hash, family, keys);
+
+	return entry;
+}
+
+/* Queues a put (or a delete if value is NULL). Called with db_wb_lock held. */
+static int db_wb_queue(const char *family, const char *keys, const char *value)
+{
+	struct db_wb_entry **entry, *e;
+	unsigned int hash = cw_hash_string(cw_hash_string(0, family), keys);
+	size_t lf = strlen(family) + 1;
+	size_t lk = strlen(keys) + 1;
+	size_t lv = (value ? strlen(value) + 1 : 0);
+
+	if (!(e = malloc(sizeof(*e) + lf + lk + lv)))
+		return -1;
+
+	e->hash = hash;
+	e->family = e->data;
+	e->key = e->family + lf;
+	e->value = (value ? e->key + lk : NULL);
+	memcpy(e->family, family, lf);
+	memcpy(e->key, keys, lk);
+	if (value)
+		memcpy(e->value, value, lv);
+
+	entry = db_wb_lookup(db_wb_bucket, hash, family, keys);
+	if (*entry) {
+		/* Only the latest write to a key needs to reach the database */
+		e->next = (*entry)->next;
+		free(*entry);
+		atomic_inc(&db_stats.coalesced);
+	} else {
+		e->next = NULL;
+		if (++db_wb_count == 1 || db_wb_count == db_wb_batch)
+			cw_cond_signal(&db_wb_cond);
+	}
+	*entry = e;
+
+	atomic_inc(&db_stats.queued);
+	return 0;
+}
+
+/* Writes everything queued in a single transaction. Called with
+ * db_wb_flush_lock held and db_wb_lock not held. Returns 0 if the queue
+ * was written or -1 if the batch failed and has been queued again.
+ */
+static int db_wb_flush_locked(void)
+{
+	struct db_conn *conn;
+	struct db_wb_entry *entry;
+	int i, n, res;
+
+	cw_mutex_lock(&db_wb_lock);
+	n = db_wb_inflight_count = db_wb_count;
+	memcpy(db_wb_inflight, db_wb_bucket, sizeof(db_wb_inflight));
+	memset(db_wb_bucket, 0, sizeof(db_wb_bucket));
+	db_wb_count = 0;
+	cw_mutex_unlock(&db_wb_lock);
+
+	if (!n)
+		return 0;
+
+	/* Nothing else changes the in-flight set so it needs no lock to read */
+	res = -1;
+	if ((conn = db_conn_get())) {
+		if (!(res = (db_exec(conn, DB_STMT_BEGIN, NULL, NULL, NULL) < 0 ? -1 : 0))) {
+			for (i = 0; !res && i < DB_WB_BUCKETS; i++) {
+				for (entry = db_wb_inflight[i]; !res && entry; entry = entry->next) {
+					if (entry->value)
+						res = db_exec(conn, DB_STMT_PUT, entry->family, entry->key, entry->value);
+					else
+						res = db_exec(conn, DB_STMT_DEL, entry->family, entry->key, NULL);
+					res = (res < 0 ? -1 : 0);
+				}
 			}
-			res = -1;
-		} else {
-			if (args.rownum)
-				res = 0;
-			else
+
+			if (res || db_exec(conn, DB_STMT_COMMIT, NULL, NULL, NULL) < 0) {
+				db_exec(conn, DB_STMT_ROLLBACK, NULL, NULL, NULL);
 				res = -1;
+			}
 		}
-	} else {
-		cw_log(CW_LOG_ERROR, "Out of memory\n");
-		res = -1;   /* Return an error */
+		db_conn_put(conn);
 	}
 
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
+	cw_mutex_lock(&db_wb_lock);
+
+	for (i = 0; i < DB_WB_BUCKETS; i++) {
+		while ((entry = db_wb_inflight[i])) {
+			struct db_wb_entry **pending;
+
+			db_wb_inflight[i] = entry->next;
+
+			/* A failed change goes back on the queue unless it has
+			 * since been superseded.
+			 */
+			if (res && !*(pending = db_wb_lookup(db_wb_bucket, entry->hash, entry->family, entry->key))) {
+				entry->next = NULL;
+				*pending = entry;
+				db_wb_count++;
+			} else
+				free(entry);
+		}
+	}
+	db_wb_inflight_count = 0;
+
+	cw_mutex_unlock(&db_wb_lock);
+
+	if (res) {
+		atomic_inc(&db_stats.batch_failures);
+		cw_log(CW_LOG_ERROR, "Failed to write %d queued database changes - will retry\n", n);
+		return -1;
 	}
 
-	sqlite3_close(db);
+	atomic_inc(&db_stats.batches);
+	atomic_fetch_and_add(&db_stats.batch_rows, n);
+	if (n > db_stats.batch_max)
+		db_stats.batch_max = n;
+
+	if (debug)
+		cw_log(CW_LOG_DEBUG, "wrote %d queued database changes\n", n);
+
+	return 0;
+}
+
+static int db_wb_flush(void)
+{
+	int res;
+
+	cw_mutex_lock(&db_wb_flush_lock);
+	res = db_wb_flush_locked();
+	cw_mutex_unlock(&db_wb_flush_lock);
+
 	return res;
 }
 
-static int cw_db_del_main(const char *family, const char *keys, int like, const char *value)
+static void *db_wb_writer(void *data)
 {
-	char *sql;
-	char *zErr = 0;
-	int res = 0;
-	sqlite3 *db;
-	const char *op = "=";
-	const char *pct = "";
-	int retry=0;
+	struct timespec tick;
+	int failed = 0;
 
-	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
-		return -1;
+	CW_UNUSED(data);
+
+	cw_mutex_lock(&db_wb_lock);
+
+	while (!db_wb_shutdown) {
+		if (!db_wb_count) {
+			cw_cond_wait(&db_wb_cond, &db_wb_lock);
+			continue;
+		}
+
+		/* Give the batch a chance to fill unless it already has. After
+		 * a failure always wait before trying again.
+		 */
+		if (failed || db_wb_count < db_wb_batch) {
+			cw_clock_gettime(global_cond_clock_monotonic, &tick);
+			tick.tv_sec += db_wb_interval / 1000;
+			tick.tv_nsec += (db_wb_interval % 1000) * 1000000L;
+			if (tick.tv_nsec >= 1000000000L) {
+				tick.tv_sec++;
+				tick.tv_nsec -= 1000000000L;
+			}
+			while (!db_wb_shutdown && (failed || db_wb_count < db_wb_batch) && cw_cond_timedwait(&db_wb_cond, &db_wb_lock, &tick) != ETIMEDOUT);
+		}
+
+		cw_mutex_unlock(&db_wb_lock);
+		failed = db_wb_flush();
+		cw_mutex_lock(&db_wb_lock);
 	}
 
-	if (!family || cw_strlen_zero(family)) {
-		family = "_undef_";
+	cw_mutex_unlock(&db_wb_lock);
+
+	if (db_wb_flush())
+		cw_log(CW_LOG_ERROR, "%d queued database changes have been lost\n", db_wb_count);
+
+	return NULL;
+}
+
+static void db_term(void)
+{
+	if (!pthread_equal(db_wb_thread, CW_PTHREADT_NULL)) {
+		cw_mutex_lock(&db_wb_lock);
+		db_wb_shutdown = 1;
+		cw_cond_signal(&db_wb_cond);
+		cw_mutex_unlock(&db_wb_lock);
+		pthread_join(db_wb_thread, NULL);
+		db_wb_thread = CW_PTHREADT_NULL;
 	}
+}
+
+static struct cw_atexit db_atexit = {
+	.name = "DB Write-Behind Flush",
+	.function = db_term,
+};
+
 
-	if (like) {
-		op = "like";
-		pct = "%";
+/* ***************************************************************************
+ * Setup
+ */
+
+static void db_load_config(void)
+{
+	struct cw_config *cfg;
+	struct cw_variable *v;
+	struct db_cache_family *fam;
+	size_t l;
+
+	db_pool_size = DB_DEFAULT_CONNECTIONS;
+
+	if ((cfg = cw_config_load("db.conf"))) {
+		for (v = cw_variable_browse(cfg, "general"); v; v = v->next) {
+			if (!strcasecmp(v->name, "connections")) {
+				db_pool_size = atoi(v->value);
+				if (db_pool_size < 1)
+					db_pool_size = 1;
+				else if (db_pool_size > DB_MAX_CONNECTIONS)
+					db_pool_size = DB_MAX_CONNECTIONS;
+			} else if (!strcasecmp(v->name, "cache")) {
+				if (db_cache_find(v->value))
+					continue;
+				l = strlen(v->value) + 1;
+				if ((fam = calloc(1, sizeof(*fam) + l))) {
+					memcpy(fam->name, v->value, l);
+					fam->next = db_cache;
+					db_cache = fam;
+				}
+			} else if (!strcasecmp(v->name, "writebehind")) {
+				db_wb_enabled = cw_true(v->value);
+			} else if (!strcasecmp(v->name, "writebehind_interval")) {
+				if ((db_wb_interval = atoi(v->value)) < 1)
+					db_wb_interval = DB_DEFAULT_WB_INTERVAL;
+			} else if (!strcasecmp(v->name, "writebehind_batch")) {
+				if ((db_wb_batch = atoi(v->value)) < 1)
+					db_wb_batch = DB_DEFAULT_WB_BATCH;
+			} else
+				cw_log(CW_LOG_WARNING, "Unknown option %s at line %d of db.conf\n", v->name, v->lineno);
+		}
+
+		cw_config_destroy(cfg);
 	}
+}
 
-	if (family && keys && value) {
-		sql = sqlite3_mprintf("delete from %q where family %s '%q%s' and keys %s '%q%s' AND value %s '%q%s' ", 
-                                        globals.tablename, op, family, pct, op, keys, pct, op, value, pct );
-	} else if (family && keys) {
-		sql = sqlite3_mprintf("delete from %q where family %s '%q%s' and keys %s '%q%s'", globals.tablename, op, family, pct, op, keys, pct);
-	} else if (family) {
-		sql = sqlite3_mprintf("delete from %q where family %s '%q%s'", globals.tablename, op, family, pct);
-	} else {
-		sql = sqlite3_mprintf("delete from %q", globals.tablename);
+static int dbinit(void)
+{
+	char *sql, *errmsg;
+	int i;
+
+	cw_mutex_lock(&dblock);
+
+	if (loaded) {
+		cw_mutex_unlock(&dblock);
+		return 0;
 	}
 
-	if (sql) {
-retry_2:
-		if (debug) {
-			if (retry)
-				cw_log(CW_LOG_DEBUG, "SQL [%s] (retry %d)\n", sql, retry);
+	globals.dbdir = cw_config[CW_DB_DIR];
+	globals.dbfile = cw_config[CW_DB];
+	globals.tablename = "odb";
+
+
+	if ((sql = sqlite3_mprintf("select count(*) from %q limit 1", globals.tablename))) {
+		sqlite_check_table_exists(globals.dbfile, sql, create_odb_sql);
+		sqlite3_free(sql);
+		sql = NULL;
+	}
+
+	atomic_set(&db_stats.gets, 0);
+	atomic_set(&db_stats.get_cache_hits, 0);
+	atomic_set(&db_stats.get_pending_hits, 0);
+	atomic_set(&db_stats.puts, 0);
+	atomic_set(&db_stats.dels, 0);
+	atomic_set(&db_stats.queued, 0);
+	atomic_set(&db_stats.coalesced, 0);
+	atomic_set(&db_stats.batches, 0);
+	atomic_set(&db_stats.batch_rows, 0);
+	atomic_set(&db_stats.batch_failures, 0);
+	atomic_set(&db_stats.errors, 0);
+
+	db_load_config();
+
+	if ((db_pool = calloc(db_pool_size, sizeof(*db_pool)))) {
+		for (i = 0; i < db_pool_size; i++) {
+			cw_mutex_init(&db_pool[i].lock);
+
+			if (!(db_pool[i].db = sqlite_open_db(globals.dbfile)))
+				continue;
+
+			sqlite3_busy_timeout(db_pool[i].db, SQL_MAX_RETRIES * SQL_RETRY_USEC / 1000);
+
+			/* WAL lets the pooled connections read while one of them writes */
+			sqlite3_exec(db_pool[i].db, "pragma journal_mode=wal", NULL, NULL, NULL);
+
+			if (i == 0 && (sql = sqlite3_mprintf(unique_odb_sql, globals.tablename, globals.tablename, globals.tablename))) {
+				errmsg = NULL;
+				sqlite3_exec(db_pool[i].db, sql, NULL, NULL, &errmsg);
+				if (errmsg) {
+					cw_log(CW_LOG_WARNING, "SQL ERR [%s]\n[%s]\n", errmsg, sql);
+					sqlite3_free(errmsg);
+				}
+				sqlite3_free(sql);
+			}
+
+			loaded = 1;
+		}
+	} else
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+
+	if (loaded && db_wb_enabled) {
+		cw_cond_init(&db_wb_cond, &global_condattr_monotonic);
+		if (cw_pthread_create(&db_wb_thread, &global_attr_default, db_wb_writer, NULL)) {
+			cw_log(CW_LOG_ERROR, "Unable to start database write-behind thread - writes will be synchronous\n");
+			db_wb_thread = CW_PTHREADT_NULL;
+			db_wb_enabled = 0;
+		} else
+			cw_atexit_register(&db_atexit);
+	}
+
+	cw_mutex_unlock(&dblock);
+	return loaded ? 0 : -1;
+}
+
+
+/* ***************************************************************************
+ * Public interface
+ */
+
+/* Applies a put (value != NULL) or a delete of a single key. Returns 0 on
+ * success or -1 on failure (or, for a delete, if the key did not exist).
+ */
+static int db_write(const char *family, const char *keys, const char *value)
+{
+	struct db_cache_family *fam;
+	struct db_conn *conn;
+	int res = -1;
+
+	if ((fam = db_cache_find(family))) {
+		/* Hold the cache across the write so it sees writes in the
+		 * same order as the database.
+		 */
+		cw_mutex_lock(&db_cache_lock);
+		if (!fam->loaded)
+			db_cache_load(fam);
+	}
+
+	if (db_wb_enabled) {
+		cw_mutex_lock(&db_wb_lock);
+
+		res = 0;
+		if (!value) {
+			struct db_wb_entry *entry;
+
+			/* A delete fails if there was nothing to delete */
+			if ((entry = db_wb_find(family, keys)))
+				res = (entry->value ? 0 : -1);
+			else if (fam && fam->loaded)
+				res = (*db_cache_lookup(fam, keys) ? 0 : -1);
 			else
-				cw_log(CW_LOG_DEBUG, "SQL [%s]\n", sql);
+				res = db_get_value(family, keys, NULL);
 		}
 
-		res = sqlite3_exec(db, sql, NULL, NULL, &zErr);
+		if (!res)
+			res = db_wb_queue(family, keys, value);
 
-		if (zErr) {
-			if (retry >= SQL_MAX_RETRIES) {
-				cw_log(CW_LOG_ERROR, "SQL ERR [%s] [%s]\n", sql, zErr);
-				sqlite3_free(zErr);
-			} else {
-				cw_log(CW_LOG_WARNING, "SQL ERR [%s] (retry %d)\n", zErr, ++retry);
-				sqlite3_free(zErr);
-				usleep(SQL_RETRY_USEC);
-				goto retry_2;
+		cw_mutex_unlock(&db_wb_lock);
+	} else if ((conn = db_conn_get())) {
+		if (value)
+			res = (db_exec(conn, DB_STMT_PUT, family, keys, value) < 0 ? -1 : 0);
+		else
+			res = (db_exec(conn, DB_STMT_DEL, family, keys, NULL) > 0 ? 0 : -1);
+		db_conn_put(conn);
+	}
+
+	if (fam) {
+		if (!res && fam->loaded)
+			db_cache_set(fam, keys, value);
+		cw_mutex_unlock(&db_cache_lock);
+	}
+
+	return res;
+}
+
+int cw_db_put(const char *family, const char *keys, const char *value)
+{
+	sanity_check();
+
+	if (!family || cw_strlen_zero(family)) {
+		family = "_undef_";
+	}
+
+	atomic_inc(&db_stats.puts);
+
+	return db_write(family, keys, value);
+}
+
+int cw_db_get(const char *family, const char *keys, struct cw_dynstr *result)
+{
+	struct db_cache_family *fam;
+	int res = -1;
+
+	sanity_check();
+
+	if (!family || cw_strlen_zero(family)) {
+		family = "_undef_";
+	}
+
+	atomic_inc(&db_stats.gets);
+
+	if ((fam = db_cache_find(family))) {
+		struct db_cache_entry *entry;
+
+		cw_mutex_lock(&db_cache_lock);
+
+		if (!fam->loaded)
+			db_cache_load(fam);
+
+		if (fam->loaded) {
+			if ((entry = *db_cache_lookup(fam, keys))) {
+				if (result)
+					cw_dynstr_printf(result, "%s", entry->value);
+				res = 0;
 			}
-			res = -1;
-		} else {
-			if (!sqlite3_changes(db))
-				res = -1;
-			else
+			cw_mutex_unlock(&db_cache_lock);
+			atomic_inc(&db_stats.get_cache_hits);
+			return res;
+		}
+
+		cw_mutex_unlock(&db_cache_lock);
+	}
+
+	if (db_wb_enabled) {
+		struct db_wb_entry *entry;
+
+		cw_mutex_lock(&db_wb_lock);
+
+		if ((entry = db_wb_find(family, keys))) {
+			if (entry->value) {
+				if (result)
+					cw_dynstr_printf(result, "%s", entry->value);
 				res = 0;
+			}
+			cw_mutex_unlock(&db_wb_lock);
+			atomic_inc(&db_stats.get_pending_hits);
+			return res;
 		}
-	} else {
-		cw_log(CW_LOG_ERROR, "Out of memory\n");
-		res = -1;   /* Return an error */
+
+		cw_mutex_unlock(&db_wb_lock);
 	}
 
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
+	return db_get_value(family, keys, result);
+}
+
+static int cw_db_del_main(const char *family, const char *keys, int like, const char *value)
+{
+	struct db_cache_family *fam;
+	struct db_conn *conn;
+	int res = -1;
+
+	sanity_check();
+
+	if (!family || cw_strlen_zero(family)) {
+		family = "_undef_";
+	}
+
+	atomic_inc(&db_stats.dels);
+
+	if (!like && keys)
+		return db_write(family, keys, NULL);
+
+	/* Wider deletes go straight to the database once everything queued
+	 * has been written and may hit any cached family.
+	 */
+	cw_mutex_lock(&db_cache_lock);
+	cw_mutex_lock(&db_wb_flush_lock);
+
+	if (!db_wb_flush_locked() && (conn = db_conn_get())) {
+		if (!like)
+			res = db_exec(conn, DB_STMT_DEL_FAMILY, family, NULL, NULL);
+		else if (keys && value)
+			res = db_exec(conn, DB_STMT_DELTREE_VALUE, family, keys, value);
+		else if (keys)
+			res = db_exec(conn, DB_STMT_DELTREE_KEYS, family, keys, NULL);
+		else
+			res = db_exec(conn, DB_STMT_DELTREE, family, NULL, NULL);
+		db_conn_put(conn);
+
+		res = (res > 0 ? 0 : -1);
+	}
+
+	cw_mutex_unlock(&db_wb_flush_lock);
+
+	if (!res) {
+		for (fam = db_cache; fam; fam = fam->next)
+			db_cache_clear(fam);
 	}
 
-	sqlite3_close(db);
+	cw_mutex_unlock(&db_cache_lock);
+
 	return res;
 }
 
@@ -399,97 +1087,53 @@ int cw_db_deltree_with_value(const char *family, const char *keytree, const char
 	return cw_db_del_main(family, keytree, 1, value);
 }
 
-static int tree_callback(void *pArg, int argc, char **argv, char **columnNames) 
-{
-	int x = 0;
-	char *keys, *values;
-	struct cw_db_entry **treeptr = pArg,
-		*cur = NULL,
-		*ret = NULL;
-
-	CW_UNUSED(columnNames);
-
-	for(x=0; x < argc; x++) {
-		keys = argv[0];
-		values = argv[1];
-
-		cur = malloc(sizeof(struct cw_db_entry) + strlen(keys) + strlen(values) + 2);
-		if (cur) {
-			cur->next = NULL;
-			cur->key = cur->data + strlen(values) + 1;
-			strcpy(cur->data, values);
-			strcpy(cur->key, keys);
-			if (*treeptr) {
-				cur->next = *treeptr;
-			}
-			ret = cur;
-		}
-	}
-
-	*treeptr = ret;
-	return 0;
-}
-
 struct cw_db_entry *cw_db_gettree(const char *family, const char *keytree)
 {
-	char *sql;
-	char *zErr = 0;
-	struct cw_db_entry *tree = NULL;
-	sqlite3 *db;
-	int retry=0;
+	struct cw_db_entry *tree = NULL, *cur;
+	struct db_conn *conn;
+	sqlite3_stmt *stmt;
+	const char *keys, *values;
+	size_t lk, lv;
 
 	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
-		return NULL;
-	}
 
 	if (!family || cw_strlen_zero(family)) {
 		family = "_undef_";
 	}
 
-	if (family && keytree && !cw_strlen_zero(keytree)) {
-		sql = sqlite3_mprintf("select keys,value from %q where family='%q' and keys like '%q%%'", globals.tablename, family, keytree);
-	} else if(family) {
-		sql = sqlite3_mprintf("select keys,value from %q where family='%q'", globals.tablename, family);
-	} else {
-		cw_log(CW_LOG_ERROR, "No parameters supplied.\n");
-		return NULL;
-	}
-
-	if (sql) {
-retry_3:
-		if (debug) {
-			if (retry)
-				cw_log(CW_LOG_DEBUG, "SQL [%s] (retry %d)\n", sql, retry);
-			else
-				cw_log(CW_LOG_DEBUG, "SQL [%s]\n", sql);
-		}
-
-		sqlite3_exec(db, sql, tree_callback, &tree, &zErr);
-		
-		if (zErr) {
-			if (retry >= SQL_MAX_RETRIES) {
-				cw_log(CW_LOG_ERROR, "SQL ERR [%s] [%s]\n", sql, zErr);
-				sqlite3_free(zErr);
-			} else {
-				cw_log(CW_LOG_WARNING, "SQL ERR [%s] (retry %d)\n", zErr, ++retry);
-				sqlite3_free(zErr);
-				usleep(SQL_RETRY_USEC);
-				goto retry_3;
+	if (db_wb_enabled)
+		db_wb_flush();
+
+	if ((conn = db_conn_get())) {
+		if ((stmt = db_stmt(conn, (keytree && !cw_strlen_zero(keytree) ? DB_STMT_GETTREE_KEYS : DB_STMT_GETTREE)))) {
+			sqlite3_bind_text(stmt, 1, family, -1, SQLITE_STATIC);
+			if (keytree && !cw_strlen_zero(keytree))
+				sqlite3_bind_text(stmt, 2, keytree, -1, SQLITE_STATIC);
+
+			if (debug)
+				cw_log(CW_LOG_DEBUG, "SQL [%s] [%s] [%s]\n", sqlite3_sql(stmt), family, (keytree ? keytree : ""));
+
+			while (sqlite3_step(stmt) == SQLITE_ROW) {
+				keys = (const char *)sqlite3_column_text(stmt, 0);
+				values = (const char *)sqlite3_column_text(stmt, 1);
+				lk = strlen(keys) + 1;
+				lv = strlen(values) + 1;
+
+				if ((cur = malloc(sizeof(struct cw_db_entry) + lk + lv))) {
+					cur->key = cur->data + lv;
+					memcpy(cur->data, values, lv);
+					memcpy(cur->key, keys, lk);
+					cur->next = tree;
+					tree = cur;
+				}
 			}
-		}
-	} else {
-		cw_log(CW_LOG_ERROR, "Out of memory\n");
-	}
 
-	if (sql) {
-		sqlite3_free(sql);
-		sql = NULL;
+			db_stmt_done(stmt);
+		}
+		db_conn_put(conn);
 	}
 
-	sqlite3_close(db);
 	return tree;
-
 }
 
 void cw_db_freetree(struct cw_db_entry *dbe)
@@ -504,7 +1148,7 @@ void cw_db_freetree(struct cw_db_entry *dbe)
 }
 
 
-static int show_callback(void *pArg, int argc, char **argv, char **columnNames) 
+static int show_callback(void *pArg, int argc, char **argv, char **columnNames)
 {
 	struct cw_dynstr *ds_p = pArg;
 
@@ -521,12 +1165,9 @@ static int database_show(struct cw_dynstr *ds_p, int argc, char *argv[])
 	char *prefix, *family;
 	char *sql;
 	char *zErr = 0;
-	sqlite3 *db;
+	struct db_conn *conn;
 
 	sanity_check();
-	if (!(db = sqlite_open_db(globals.dbfile))) {
-		return -1;
-	}
 
 	if (argc == 4) {
 		/* Family and key tree */
@@ -543,6 +1184,12 @@ static int database_show(struct cw_dynstr *ds_p, int argc, char *argv[])
 		return RESULT_SHOWUSAGE;
 	}
 
+	if (db_wb_enabled)
+		db_wb_flush();
+
+	if (!(conn = db_conn_get()))
+		return RESULT_FAILURE;
+
 	if (family && prefix) {
 		sql = sqlite3_mprintf("select family, keys, value from %q where family='%q' and keys='%q' order by family, keys", globals.tablename, family, prefix);
 	} else if (family) {
@@ -554,8 +1201,8 @@ static int database_show(struct cw_dynstr *ds_p, int argc, char *argv[])
 	if (sql) {
 		if (debug) cw_log(CW_LOG_DEBUG, "SQL [%s]\n", sql);
 
-		sqlite3_exec(db, sql, show_callback, ds_p, &zErr);
-		
+		sqlite3_exec(conn->db, sql, show_callback, ds_p, &zErr);
+
 		if (zErr) {
 			cw_log(CW_LOG_ERROR, "SQL ERR [%s] [%s]\n", sql, zErr);
 			sqlite3_free(zErr);
@@ -569,12 +1216,11 @@ static int database_show(struct cw_dynstr *ds_p, int argc, char *argv[])
 		sql = NULL;
 	}
 
-	sqlite3_close(db);
-	return RESULT_SUCCESS;	
+	db_conn_put(conn);
+	return RESULT_SUCCESS;
 }
 
 
-
 static int database_put(struct cw_dynstr *ds_p, int argc, char *argv[])
 {
 	if (argc != 5)
@@ -644,7 +1290,46 @@ static int database_debug(struct cw_dynstr *ds_p, int argc, char *argv[])
 	int res = RESULT_SUCCESS;
 
 	if (argc == 2) {
-		cw_dynstr_printf(ds_p, "Database debug is %s.\n", (debug ? "enabled" : "disabled"));
+		struct db_cache_family *fam;
+		int batches = atomic_read(&db_stats.batches);
+
+		cw_dynstr_printf(ds_p, "Database debug is %s.\n\n", (debug ? "enabled" : "disabled"));
+
+		cw_dynstr_printf(ds_p,
+			"Connections:        %d\n"
+			"Gets:               %d (%d from cache, %d from write queue)\n"
+			"Puts:               %d\n"
+			"Deletes:            %d\n"
+			"Errors:             %d\n",
+			db_pool_size,
+			atomic_read(&db_stats.gets), atomic_read(&db_stats.get_cache_hits), atomic_read(&db_stats.get_pending_hits),
+			atomic_read(&db_stats.puts),
+			atomic_read(&db_stats.dels),
+			atomic_read(&db_stats.errors));
+
+		if (db_wb_enabled) {
+			cw_dynstr_printf(ds_p,
+				"Write-behind:       every %dms or %d changes\n"
+				"  Queued:           %d (%d coalesced, %d pending)\n"
+				"  Batches:          %d (average %d, max %d rows, %d failed)\n",
+				db_wb_interval, db_wb_batch,
+				atomic_read(&db_stats.queued), atomic_read(&db_stats.coalesced), db_wb_count,
+				batches, (batches ? atomic_read(&db_stats.batch_rows) / batches : 0), db_stats.batch_max,
+				atomic_read(&db_stats.batch_failures));
+		} else
+			cw_dynstr_printf(ds_p, "Write-behind:       disabled\n");
+
+		if (db_cache) {
+			cw_dynstr_printf(ds_p, "\n%-40s %s\n", "Cached family", "Entries");
+			cw_mutex_lock(&db_cache_lock);
+			for (fam = db_cache; fam; fam = fam->next) {
+				if (fam->loaded)
+					cw_dynstr_printf(ds_p, "%-40s %u\n", fam->name, fam->entries);
+				else
+					cw_dynstr_printf(ds_p, "%-40s (not loaded)\n", fam->name);
+			}
+			cw_mutex_unlock(&db_cache_lock);
+		}
 	} else if (argc == 3) {
 		if (cw_true(argv[2]))
 			debug = 1;
@@ -686,7 +1371,8 @@ static const char database_deltree_usage[] =
 
 static const char database_debug_usage[] =
 "Usage: database debug [on|off]\n"
-"       Turns database debug messages on or off.\n";
+"       Turns database debug messages on or off. With no argument shows\n"
+"the debug status along with connection, cache and write-behind statistics.\n";
 
 
 static struct cw_clicmd  my_clis[] = {
@@ -723,7 +1409,7 @@ static struct cw_clicmd  my_clis[] = {
 	{
 		.cmda = { "database", "debug", NULL },
 		.handler = database_debug,
-		.summary = "Displays database debug message status",
+		.summary = "Displays database debug status and statistics",
 		.usage = database_debug_usage,
 	},
 	{
@@ -32,6 +32,7 @@
 #include <arpa/nameser.h>
 #include <resolv.h>
 #include <unistd.h>
+#include <ctype.h>
 
 #include "callweaver.h"
 
@@ -40,6 +41,11 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/logger.h"
 #include "callweaver/channel.h"
 #include "callweaver/dns.h"
+#include "callweaver/callweaver_hash.h"
+#include "callweaver/cli.h"
+#include "callweaver/lock.h"
+#include "callweaver/utils.h"
+
 #define MAX_SIZE 4096
 
 typedef struct {
@@ -186,12 +192,107 @@ static struct state *states;
 #endif
 
 
-/*--- cw_search_dns: Lookup record in DNS */
-int cw_search_dns(void *context,
-	   const char *dname, int class, int type,
-	   int (*callback)(void *context, char *answer, int len, char *fullanswer))
+/* Answers are cached by (name, class, type) for the smallest TTL in the
+ * answer section, capped at DNS_MAX_TTL. Names that don't exist or have no
+ * records of the type are cached for DNS_NEGATIVE_TTL. Failures to reach
+ * a server are not cached. While a query is outstanding anyone else asking
+ * the same question waits for its answer rather than asking again.
+ */
+#define DNS_MAX_TTL		3600
+#define DNS_NEGATIVE_TTL	60
+#define DNS_CACHE_MAX		4096
+#define DNS_CACHE_BUCKETS	1024
+
+#define DNS_ASYNC_WORKERS	4
+
+struct dns_cache_entry {
+	struct dns_cache_entry *next;		/* hash chain */
+	struct dns_cache_entry *age_next;	/* oldest first */
+	struct dns_cache_entry **age_prev;
+	unsigned int hash;
+	int class;
+	int type;
+	int pending;
+	int linked;
+	int refs;
+	int ret;
+	time_t expires;
+	cw_cond_t cond;
+	unsigned char *answer;
+	char name[0];
+};
+
+static struct dns_cache_entry *dns_cache[DNS_CACHE_BUCKETS];
+static struct dns_cache_entry *dns_cache_oldest;
+static struct dns_cache_entry **dns_cache_newest = &dns_cache_oldest;
+static int dns_cache_count;
+static size_t dns_cache_bytes;
+CW_MUTEX_DEFINE_STATIC(dns_cache_lock);
+
+static struct {
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned long negative_hits;
+	unsigned long coalesced;
+	unsigned long misses;
+	unsigned long failures;
+	unsigned long expired;
+	unsigned long evicted;
+} dns_stats;
+
+
+static time_t dns_now(void)
+{
+	struct timespec ts;
+
+	cw_clock_gettime(global_cond_clock_monotonic, &ts);
+	return ts.tv_sec;
+}
+
+/* Returns the smallest TTL in the answer section or -1 if there are no answers */
+static int dns_answer_ttl(unsigned char *answer, int len)
+{
+	struct dn_answer *ans;
+	dns_HEADER *h;
+	int ttl = -1;
+	int res;
+	int x;
+
+	if (len < (int)sizeof(dns_HEADER))
+		return -1;
+
+	h = (dns_HEADER *)answer;
+	answer += sizeof(dns_HEADER);
+	len -= sizeof(dns_HEADER);
+
+	for (x = 0; x < ntohs(h->qdcount); x++) {
+		if ((res = skip_name((char *)answer, len)) < 0 || (len -= res + 4) < 0)
+			return -1;
+		answer += res + 4;
+	}
+
+	for (x = 0; x < ntohs(h->ancount); x++) {
+		if ((res = skip_name((char *)answer, len)) < 0)
+			return -1;
+		answer += res;
+		len -= res;
+		if (len < (int)sizeof(struct dn_answer))
+			break;
+		ans = (struct dn_answer *)answer;
+		if (ttl < 0 || ntohl(ans->ttl) < (unsigned int)ttl)
+			ttl = (ntohl(ans->ttl) > DNS_MAX_TTL ? DNS_MAX_TTL : ntohl(ans->ttl));
+		answer += sizeof(struct dn_answer) + ntohs(ans->size);
+		len -= sizeof(struct dn_answer) + ntohs(ans->size);
+	}
+
+	return ttl;
+}
+
+/* Asks the resolver. Returns the answer length or -1 with *negative set
+ * if the name or data definitely doesn't exist.
+ */
+static int dns_query(const char *dname, int class, int type, unsigned char *answer, int size, int *negative)
 {
-	char answer[MAX_SIZE];
 	int ret = -1;
 #ifdef HAS_RES_NINIT
 	struct state *s;
@@ -205,7 +306,8 @@ int cw_search_dns(void *context,
 		return -1;
 
 	if (!(ret = res_ninit(&s->rs))) {
-		ret = res_nsearch(&s->rs, dname, class, type, (unsigned char *)answer, sizeof(answer));
+		ret = res_nsearch(&s->rs, dname, class, type, answer, size);
+		*negative = (ret < 0 && (s->rs.res_h_errno == HOST_NOT_FOUND || s->rs.res_h_errno == NO_DATA));
 		res_nclose(&s->rs);
 	}
 
@@ -213,25 +315,354 @@ int cw_search_dns(void *context,
 	s->next = states;
 	states = s;
 	cw_mutex_unlock(&res_lock);
-
-	if (ret > 0 && (ret = dns_parse_answer(context, class, type, answer, ret, callback)) < 0)
-		cw_log(CW_LOG_WARNING, "DNS Parse error for %s\n", dname);
-	if (ret == 0)
-		cw_log(CW_LOG_DEBUG, "No matches found in DNS for %s\n", dname);
 #else
 	cw_mutex_lock(&res_lock);
 	if ((ret = res_init())) {
-		ret = res_search(dname, class, type, answer, sizeof(answer));
+		ret = res_search(dname, class, type, answer, size);
+		*negative = (ret < 0 && (h_errno == HOST_NOT_FOUND || h_errno == NO_DATA));
 #ifndef __APPLE__
 		res_close();
 #endif
 	}
 	cw_mutex_unlock(&res_lock);
+#endif
+	return ret;
+}
+
+/* Called with dns_cache_lock held */
+static void dns_cache_unlink(struct dns_cache_entry *entry)
+{
+	struct dns_cache_entry **p;
+
+	for (p = &dns_cache[entry->hash % DNS_CACHE_BUCKETS]; *p; p = &(*p)->next) {
+		if (*p == entry) {
+			*p = entry->next;
+			break;
+		}
+	}
+
+	if ((*entry->age_prev = entry->age_next))
+		entry->age_next->age_prev = entry->age_prev;
+	else
+		dns_cache_newest = entry->age_prev;
+
+	entry->linked = 0;
+	dns_cache_count--;
+	dns_cache_bytes -= (entry->ret > 0 ? entry->ret : 0);
+}
+
+/* Called with dns_cache_lock held */
+static void dns_cache_release(struct dns_cache_entry *entry)
+{
+	if (!--entry->refs && !entry->linked) {
+		cw_cond_destroy(&entry->cond);
+		free(entry->answer);
+		free(entry);
+	}
+}
+
+/*--- cw_search_dns: Lookup record in DNS */
+int cw_search_dns(void *context,
+	   const char *dname, int class, int type,
+	   int (*callback)(void *context, char *answer, int len, char *fullanswer))
+{
+	char answer[MAX_SIZE];
+	struct dns_cache_entry *entry;
+	const char *p;
+	unsigned int hash;
+	size_t l;
+	time_t now;
+	int negative = 0;
+	int ttl;
+	int ret = -1;
+
+	/* Names are case insensitive */
+	hash = cw_hash_add(class, type);
+	for (p = dname; *p; p++)
+		hash = cw_hash_add(hash, tolower(*p));
+	now = dns_now();
+
+	cw_mutex_lock(&dns_cache_lock);
+
+	dns_stats.lookups++;
+
+	for (entry = dns_cache[hash % DNS_CACHE_BUCKETS]; entry; entry = entry->next) {
+		if (entry->hash == hash && entry->class == class && entry->type == type && !strcasecmp(entry->name, dname))
+			break;
+	}
+
+	if (entry && !entry->pending && entry->expires <= now) {
+		dns_stats.expired++;
+		dns_cache_unlink(entry);
+		entry->refs++;
+		dns_cache_release(entry);
+		entry = NULL;
+	}
+
+	if (entry) {
+		if (entry->pending) {
+			dns_stats.coalesced++;
+			entry->refs++;
+			while (entry->pending)
+				cw_cond_wait(&entry->cond, &dns_cache_lock);
+		} else {
+			if (entry->ret > 0)
+				dns_stats.hits++;
+			else
+				dns_stats.negative_hits++;
+			entry->refs++;
+		}
+
+		if ((ret = entry->ret) > 0)
+			memcpy(answer, entry->answer, ret);
+
+		dns_cache_release(entry);
+		cw_mutex_unlock(&dns_cache_lock);
+	} else {
+		dns_stats.misses++;
+
+		l = strlen(dname) + 1;
+		if ((entry = malloc(sizeof(*entry) + l))) {
+			memcpy(entry->name, dname, l);
+			entry->hash = hash;
+			entry->class = class;
+			entry->type = type;
+			entry->pending = 1;
+			entry->refs = 1;
+			entry->ret = -1;
+			entry->answer = NULL;
+			cw_cond_init(&entry->cond, &global_condattr_monotonic);
+
+			entry->next = dns_cache[hash % DNS_CACHE_BUCKETS];
+			dns_cache[hash % DNS_CACHE_BUCKETS] = entry;
+			entry->age_next = NULL;
+			entry->age_prev = dns_cache_newest;
+			*dns_cache_newest = entry;
+			dns_cache_newest = &entry->age_next;
+			entry->linked = 1;
+			dns_cache_count++;
+
+			/* Make room by dropping the oldest answers we have */
+			while (dns_cache_count > DNS_CACHE_MAX && dns_cache_oldest != entry) {
+				struct dns_cache_entry *old = dns_cache_oldest;
+
+				if (old->pending)
+					break;
+				dns_stats.evicted++;
+				dns_cache_unlink(old);
+				old->refs++;
+				dns_cache_release(old);
+			}
+		}
+
+		cw_mutex_unlock(&dns_cache_lock);
+
+		ret = dns_query(dname, class, type, (unsigned char *)answer, sizeof(answer), &negative);
+		if (ret > (int)sizeof(answer))
+			ret = sizeof(answer);
+
+		if (entry) {
+			ttl = -1;
+			if (ret > 0)
+				ttl = dns_answer_ttl((unsigned char *)answer, ret);
+			else if (negative)
+				ttl = DNS_NEGATIVE_TTL;
+
+			cw_mutex_lock(&dns_cache_lock);
+
+			if (ret > 0) {
+				if ((entry->answer = malloc(ret))) {
+					memcpy(entry->answer, answer, ret);
+					entry->ret = ret;
+					dns_cache_bytes += ret;
+				}
+			} else
+				dns_stats.failures++;
+
+			entry->expires = now + (ttl > 0 ? ttl : 0);
+			entry->pending = 0;
+			cw_cond_broadcast(&entry->cond);
+
+			/* Anyone already waiting gets the answer but nobody else will */
+			if (ttl <= 0 || (ret > 0 && !entry->answer))
+				dns_cache_unlink(entry);
+
+			dns_cache_release(entry);
+			cw_mutex_unlock(&dns_cache_lock);
+		}
+	}
 
 	if (ret > 0 && (ret = dns_parse_answer(context, class, type, answer, ret, callback)) < 0)
 		cw_log(CW_LOG_WARNING, "DNS Parse error for %s\n", dname);
 	if (ret == 0)
 		cw_log(CW_LOG_DEBUG, "No matches found in DNS for %s\n", dname);
-#endif
+
 	return ret;
 }
+
+
+/* Asynchronous lookups are queued for a small pool of worker threads */
+struct dns_job {
+	struct dns_job *next;
+	void *context;
+	int class;
+	int type;
+	int (*callback)(void *context, char *answer, int len, char *fullanswer);
+	void (*done)(void *context, int result);
+	char name[0];
+};
+
+static struct dns_job *dns_jobs;
+static struct dns_job **dns_jobs_tail = &dns_jobs;
+static int dns_jobs_queued;
+static pthread_t dns_workers[DNS_ASYNC_WORKERS];
+static cw_cond_t dns_jobs_cond;
+CW_MUTEX_DEFINE_STATIC(dns_jobs_lock);
+
+static void *dns_worker(void *data)
+{
+	struct dns_job *job;
+	int ret;
+
+	CW_UNUSED(data);
+
+	for (;;) {
+		cw_mutex_lock(&dns_jobs_lock);
+
+		while (!dns_jobs)
+			cw_cond_wait(&dns_jobs_cond, &dns_jobs_lock);
+
+		job = dns_jobs;
+		if (!(dns_jobs = job->next))
+			dns_jobs_tail = &dns_jobs;
+		dns_jobs_queued--;
+
+		cw_mutex_unlock(&dns_jobs_lock);
+
+		ret = cw_search_dns(job->context, job->name, job->class, job->type, job->callback);
+		if (job->done)
+			job->done(job->context, ret);
+
+		free(job);
+	}
+
+	return NULL;
+}
+
+int cw_search_dns_async(void *context, const char *dname, int class, int type,
+	int (*callback)(void *context, char *answer, int len, char *fullanswer),
+	void (*done)(void *context, int result))
+{
+	struct dns_job *job;
+	size_t l = strlen(dname) + 1;
+
+	if (!(job = malloc(sizeof(*job) + l)))
+		return -1;
+
+	job->next = NULL;
+	job->context = context;
+	job->class = class;
+	job->type = type;
+	job->callback = callback;
+	job->done = done;
+	memcpy(job->name, dname, l);
+
+	cw_mutex_lock(&dns_jobs_lock);
+	*dns_jobs_tail = job;
+	dns_jobs_tail = &job->next;
+	dns_jobs_queued++;
+	cw_cond_signal(&dns_jobs_cond);
+	cw_mutex_unlock(&dns_jobs_lock);
+
+	return 0;
+}
+
+
+static const char *dns_type_name(int type)
+{
+	switch (type) {
+		case T_A: return "A";
+		case T_AAAA: return "AAAA";
+		case T_CNAME: return "CNAME";
+		case T_MX: return "MX";
+		case T_NAPTR: return "NAPTR";
+		case T_PTR: return "PTR";
+		case T_SRV: return "SRV";
+		case T_TXT: return "TXT";
+	}
+	return "?";
+}
+
+static int dns_show_cache(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	struct dns_cache_entry *entry;
+	time_t now;
+
+	CW_UNUSED(argv);
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	now = dns_now();
+
+	cw_mutex_lock(&dns_cache_lock);
+
+	cw_dynstr_printf(ds_p, "%-50s %-6s %8s %s\n", "Name", "Type", "TTL", "Answer");
+
+	for (entry = dns_cache_oldest; entry; entry = entry->age_next) {
+		if (entry->pending)
+			cw_dynstr_printf(ds_p, "%-50.50s %-6s %8s (lookup in progress)\n", entry->name, dns_type_name(entry->type), "");
+		else if (entry->ret > 0)
+			cw_dynstr_printf(ds_p, "%-50.50s %-6s %8ld %d bytes\n", entry->name, dns_type_name(entry->type), (long)(entry->expires - now), entry->ret);
+		else
+			cw_dynstr_printf(ds_p, "%-50.50s %-6s %8ld (does not exist)\n", entry->name, dns_type_name(entry->type), (long)(entry->expires - now));
+	}
+
+	cw_dynstr_printf(ds_p, "\n%d of %d entries using %lu bytes\n", dns_cache_count, DNS_CACHE_MAX, (unsigned long)dns_cache_bytes);
+	cw_dynstr_printf(ds_p, "Lookups:       %lu\n", dns_stats.lookups);
+	cw_dynstr_printf(ds_p, "Hits:          %lu (%lu negative)\n", dns_stats.hits + dns_stats.negative_hits, dns_stats.negative_hits);
+	cw_dynstr_printf(ds_p, "Coalesced:     %lu\n", dns_stats.coalesced);
+	cw_dynstr_printf(ds_p, "Misses:        %lu (%lu failed)\n", dns_stats.misses, dns_stats.failures);
+	cw_dynstr_printf(ds_p, "Expired:       %lu\n", dns_stats.expired);
+	cw_dynstr_printf(ds_p, "Evicted:       %lu\n", dns_stats.evicted);
+
+	cw_mutex_unlock(&dns_cache_lock);
+
+	cw_mutex_lock(&dns_jobs_lock);
+	cw_dynstr_printf(ds_p, "Async queued:  %d\n", dns_jobs_queued);
+	cw_mutex_unlock(&dns_jobs_lock);
+
+	return RESULT_SUCCESS;
+}
+
+
+static const char dns_show_cache_usage[] =
+	"Usage: dns show cache\n"
+	"       Lists cached DNS answers with their remaining TTL and shows\n"
+	"       cache statistics.\n";
+
+static struct cw_clicmd cli_dns_show_cache =
+{
+	.cmda = { "dns", "show", "cache", NULL },
+	.handler = dns_show_cache,
+	.summary = "Show the DNS cache",
+	.usage = dns_show_cache_usage,
+};
+
+
+int cw_dns_init(void)
+{
+	int i;
+
+	cw_cond_init(&dns_jobs_cond, &global_condattr_monotonic);
+
+	for (i = 0; i < DNS_ASYNC_WORKERS; i++) {
+		if (cw_pthread_create(&dns_workers[i], &global_attr_detached, dns_worker, NULL)) {
+			cw_log(CW_LOG_ERROR, "Unable to start DNS worker thread\n");
+			return -1;
+		}
+	}
+
+	cw_cli_register(&cli_dns_show_cache);
+	return 0;
+}
@@ -498,7 +498,6 @@ int cw_dsp_silence(struct cw_dsp *dsp, struct cw_frame *f, int *totalsilence)
     int16_t *amp;
     uint8_t *data;
     int len;
-    int x;
 
     if (f->frametype != CW_FRAME_VOICE)
     {
@@ -516,14 +515,12 @@ int cw_dsp_silence(struct cw_dsp *dsp, struct cw_frame *f, int *totalsilence)
     case CW_FORMAT_ULAW:
         amp = alloca(f->datalen*sizeof(int16_t));
         len = f->datalen;
-        for (x = 0;  x < len;  x++) 
-            amp[x] = CW_MULAW(data[x]);
+        cw_mulaw_buf(amp, data, len);
         break;
     case CW_FORMAT_ALAW:
         amp = alloca(f->datalen*sizeof(int16_t));
         len = f->datalen;
-        for (x = 0;  x < len;  x++) 
-            amp[x] = CW_ALAW(data[x]);
+        cw_alaw_buf(amp, data, len);
         break;
     default:
         cw_log(CW_LOG_WARNING, "Silence detection is not supported on codec %s. Use RFC2833\n", cw_getformatname(f->subclass));
@@ -554,14 +551,12 @@ struct cw_frame *cw_dsp_process(struct cw_channel *chan, struct cw_dsp *dsp, str
     case CW_FORMAT_ULAW:
         amp = alloca(af->datalen * sizeof(int16_t));
         samples = af->datalen;
-        for (x = 0;  x < af->datalen;  x++) 
-            amp[x] = CW_MULAW(((uint8_t *)af->data)[x]);
+        cw_mulaw_buf(amp, af->data, af->datalen);
         break;
     case CW_FORMAT_ALAW:
         amp = alloca(af->datalen * sizeof(int16_t));
         samples = af->datalen;
-        for (x = 0;  x < af->datalen;  x++) 
-            amp[x] = CW_ALAW(((uint8_t *)af->data)[x]);
+        cw_alaw_buf(amp, af->data, af->datalen);
         break;
     default:
         cw_log(CW_LOG_WARNING, "Tone detection is not supported on codec %s. Use RFC2833\n", cw_getformatname(af->subclass));
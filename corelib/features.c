@@ -58,6 +58,8 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/manager.h"
 #include "callweaver/utils.h"
 #include "callweaver/keywords.h"
+#include "callweaver/sched.h"
+#include "callweaver/io.h"
 
 #include "callweaver_addon/adsi.h"
 
@@ -150,14 +152,40 @@ struct parkeduser {
 	int notquiteyet;
 	char peername[1024];
 	unsigned char moh_trys;
-	struct parkeduser *next;
+	int parked;			/* In the lot (protected by parking_lock) */
+	struct sched_state timeout;
+#ifdef HAVE_EPOLL
+	struct cw_io_rec ior[CW_MAX_FDS];
+#endif
+	struct parkeduser *hash_next;
+	struct parkeduser *prev, *next;
+	struct parkeduser *dead_next;
 };
 
+/* Parked calls are on a list, for listing them, and hashed by parking
+ * number, for finding them. Timeouts are handled by the scheduler and,
+ * where epoll is available, the parked channels' fds are registered
+ * with a persistent I/O context serviced by the parking thread.
+ *
+ * Once parked a call may be taken out of the lot by a ParkedCall, by
+ * its timeout or by hanging up. Whichever happens first unparks it
+ * but the parkeduser is only freed by the parking thread once it can
+ * be sure no I/O events for it are still outstanding and the timeout
+ * has either been cancelled or has run.
+ */
+#define PARKING_HASH_SIZE	64
+
 static struct parkeduser *parkinglot;
+static struct parkeduser *parkhash[PARKING_HASH_SIZE];
+static struct parkeduser *parking_dead;
 
 CW_MUTEX_DEFINE_STATIC(parking_lock);
 
 static pthread_t parking_thread = CW_PTHREADT_NULL;
+static struct sched_context *parking_sched;
+#ifdef HAVE_EPOLL
+static cw_io_context_t parking_ioc = CW_IO_CONTEXT_NONE;
+#endif
 
 
 char *cw_parking_ext(void)
@@ -265,12 +293,259 @@ static int adsi_announce_park(struct cw_channel *chan, int parkingnum)
 	return adsi_print(chan, message, justify, 1);
 }
 
+static inline struct parkeduser **parking_hash_bucket(int parkingnum)
+{
+	return &parkhash[(unsigned int)parkingnum % PARKING_HASH_SIZE];
+}
+
+
+/* Called with parking_lock held */
+static struct parkeduser *parking_find(int parkingnum)
+{
+	struct parkeduser *pu;
+
+	for (pu = *parking_hash_bucket(parkingnum); pu; pu = pu->hash_next) {
+		if (pu->parkingnum == parkingnum)
+			break;
+	}
+
+	return pu;
+}
+
+
+static void parking_remove_exten(int parkingnum)
+{
+	char exten[CW_MAX_EXTENSION];
+	struct cw_context *con;
+
+	if ((con = cw_context_find(parking_con))) {
+		snprintf(exten, sizeof(exten), "%d", parkingnum);
+		if (cw_context_remove_extension2(con, exten, 1, NULL))
+			cw_log(CW_LOG_WARNING, "Whoa, failed to remove the extension!\n");
+	} else
+		cw_log(CW_LOG_WARNING, "Whoa, no parking context?\n");
+}
+
+
+#ifdef HAVE_EPOLL
+static int parking_handler(struct cw_io_rec *ior, int fd, short events, void *data);
+
+/* Called with parking_lock held. Brings the fds registered for a parked
+ * channel into line with the fds it has now, or with none at all if it
+ * is no longer parked.
+ */
+static void parking_sync_fds(struct parkeduser *pu)
+{
+	int x;
+
+	for (x = 0; x < CW_MAX_FDS; x++) {
+		int fd = (pu->parked && !pu->notquiteyet ? pu->chan->fds[x] : -1);
+
+		if (pu->ior[x].fd == fd)
+			continue;
+
+		/* If the old fd has been closed the kernel has already
+		 * dropped it from the I/O context
+		 */
+		if (cw_io_isactive(&pu->ior[x]) && cw_io_remove(parking_ioc, &pu->ior[x]))
+			pu->ior[x].fd = -1;
+
+		if (fd > -1 && cw_io_add(parking_ioc, &pu->ior[x], fd, CW_IO_IN | CW_IO_PRI))
+			cw_log(CW_LOG_WARNING, "%s: unable to watch fd %d: %s\n", pu->chan->name, fd, strerror(errno));
+	}
+}
+#else
+#define parking_sync_fds(pu)
+#endif
+
+
+/* Called with parking_lock held. Takes the call out of the lot. The
+ * parkeduser itself is handed to the parking thread to free unless the
+ * timeout is already running, in which case the timeout does that.
+ */
+static void parking_unpark(struct parkeduser *pu, int timedout)
+{
+	struct parkeduser **p;
+
+	pu->parked = 0;
+
+	for (p = parking_hash_bucket(pu->parkingnum); *p; p = &(*p)->hash_next) {
+		if (*p == pu) {
+			*p = pu->hash_next;
+			break;
+		}
+	}
+
+	if (pu->prev)
+		pu->prev->next = pu->next;
+	else
+		parkinglot = pu->next;
+	if (pu->next)
+		pu->next->prev = pu->prev;
+
+	parking_sync_fds(pu);
+
+	if (timedout || !cw_sched_del(parking_sched, &pu->timeout)) {
+		pu->dead_next = parking_dead;
+		parking_dead = pu;
+	}
+}
+
+
+static int parking_timeout(void *data)
+{
+	struct parkeduser *pu = data;
+	struct cw_context *con;
+	char returnexten[CW_MAX_EXTENSION];
+	char *peername, *cp;
+
+	cw_mutex_lock(&parking_lock);
+
+	if (!pu->parked) {
+		/* Somebody else got there first but couldn't cancel us */
+		pu->dead_next = parking_dead;
+		parking_dead = pu;
+		cw_mutex_unlock(&parking_lock);
+		return 0;
+	}
+
+	parking_unpark(pu, 1);
+
+	/* Stop music on hold */
+	cw_moh_stop(pu->chan);
+	cw_indicate(pu->chan, CW_CONTROL_UNHOLD);
+	/* Get chan, exten from derived kludge */
+	if (pu->peername[0]) {
+		peername = cw_strdupa(pu->peername);
+		cp = strrchr(peername, '-');
+		if (cp) 
+			*cp = 0;
+		con = cw_context_find(parking_con_dial);
+		if (!con) {
+			con = cw_context_create(NULL, parking_con_dial, registrar);
+			if (!con) {
+				cw_log(CW_LOG_ERROR, "Parking dial context '%s' does not exist and unable to create\n", parking_con_dial);
+			}
+		}
+		if (con) {
+			snprintf(returnexten, sizeof(returnexten), "%s,,t", peername);
+			cw_add_extension2(con, 1, peername, 1, NULL, NULL, "Dial", strdup(returnexten), FREE, registrar);
+		}
+		cw_copy_string(pu->chan->exten, peername, sizeof(pu->chan->exten));
+		cw_copy_string(pu->chan->context, parking_con_dial, sizeof(pu->chan->context));
+		pu->chan->priority = 1;
+
+	} else {
+		/* They've been waiting too long, send them back to where they came.  Theoretically they
+		   should have their original extensions and such, but we copy to be on the safe side */
+		cw_copy_string(pu->chan->exten, pu->exten, sizeof(pu->chan->exten));
+		cw_copy_string(pu->chan->context, pu->context, sizeof(pu->chan->context));
+		pu->chan->priority = pu->priority;
+	}
+
+	cw_manager_event(CW_EVENT_FLAG_CALL, "ParkedCallTimeOut",
+		4,
+		cw_msg_tuple("Exten",        "%d", pu->parkingnum),
+		cw_msg_tuple("Channel",      "%s", pu->chan->name),
+		cw_msg_tuple("CallerID",     "%s", (pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")),
+		cw_msg_tuple("CallerIDName", "%s", (pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>"))
+	);
+
+	if (option_verbose > 1) 
+		cw_verbose(VERBOSE_PREFIX_2 "Timeout for %s parked on %d. Returning to %s,%s,%d\n", pu->chan->name, pu->parkingnum, pu->chan->context, pu->chan->exten, pu->chan->priority);
+	/* Start up the PBX, or hang them up */
+	if (cw_pbx_start(pu->chan))  {
+		cw_log(CW_LOG_WARNING, "Unable to restart the PBX for user on '%s', hanging them up...\n", pu->chan->name);
+		cw_hangup(pu->chan);
+	}
+
+	parking_remove_exten(pu->parkingnum);
+
+	cw_mutex_unlock(&parking_lock);
+	return 0;
+}
+
+
+/* Called with parking_lock held. Starts servicing a parked call. */
+static void parking_activate(struct parkeduser *pu)
+{
+	long ms;
+
+	pu->notquiteyet = 0;
+	parking_sync_fds(pu);
+
+	if ((ms = pu->parkingtime - cw_tvdiff_ms(cw_tvnow(), pu->start)) < 1)
+		ms = 1;
+	if (cw_sched_add(parking_sched, &pu->timeout, ms, parking_timeout, pu))
+		cw_log(CW_LOG_ERROR, "Unable to schedule timeout for %s parked on %d\n", pu->chan->name, pu->parkingnum);
+}
+
+
+/* Called with parking_lock held. Services a parked channel that has
+ * something to read. Returns non-zero if the caller gave up.
+ */
+static int parking_service(struct parkeduser *pu, int fdno, int exception)
+{
+	struct cw_frame *f;
+
+	if (exception)
+		cw_set_flag(pu->chan, CW_FLAG_EXCEPTION);
+	else
+		cw_clear_flag(pu->chan, CW_FLAG_EXCEPTION);
+	pu->chan->fdno = fdno;
+	/* See if they need servicing */
+	f = cw_read(pu->chan);
+	if (!f || ((f->frametype == CW_FRAME_CONTROL) && (f->subclass ==  CW_CONTROL_HANGUP))) {
+		if (f)
+			cw_fr_free(f);
+
+		cw_manager_event(CW_EVENT_FLAG_CALL, "ParkedCallGiveUp",
+			4,
+			cw_msg_tuple("Exten",        "%d", pu->parkingnum),
+			cw_msg_tuple("Channel",      "%s", pu->chan->name),
+			cw_msg_tuple("CallerID",     "%s", (pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")),
+			cw_msg_tuple("CallerIDName", "%s", (pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>"))
+		);
+
+		/* There's a problem, hang them up*/
+		if (option_verbose > 1) 
+			cw_verbose(VERBOSE_PREFIX_2 "%s got tired of being parked\n", pu->chan->name);
+		/* And take them out of the parking lot */
+		parking_unpark(pu, 0);
+		cw_hangup(pu->chan);
+		parking_remove_exten(pu->parkingnum);
+		return 1;
+	}
+
+	/* XXX Maybe we could do something with packets, like dial "0" for operator or something XXX */
+	cw_fr_free(f);
+	if (pu->moh_trys < 3 && !cw_generator_is_active(pu->chan)) {
+		cw_log(CW_LOG_DEBUG, "MOH on parked call stopped by outside source.  Restarting.\n");
+		cw_moh_start(pu->chan, NULL);
+		pu->moh_trys++;
+	}
+
+	return 0;
+}
+
+
+/* Called with parking_lock held */
+static void parking_free_dead(void)
+{
+	struct parkeduser *pu;
+
+	while ((pu = parking_dead)) {
+		parking_dead = pu->dead_next;
+		free(pu);
+	}
+}
+
 /*--- cw_park_call: Park a call */
 /* We put the user in the parking list, then wake up the parking thread to be sure it looks
 	   after these channels too */
 int cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int timeout, int *extout)
 {
-	struct parkeduser *pu, *cur;
+	struct parkeduser *pu, **bucket;
 	int i,x,parking_range;
 	char exten[CW_MAX_EXTENSION];
 	struct cw_context *con;
@@ -281,17 +556,16 @@ int cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int timeout,
 		return -1;
 	}
 	memset(pu, 0, sizeof(struct parkeduser));
+	cw_sched_state_init(&pu->timeout);
+#ifdef HAVE_EPOLL
+	for (i = 0; i < CW_MAX_FDS; i++)
+		cw_io_init(&pu->ior[i], parking_handler, pu);
+#endif
 	cw_mutex_lock(&parking_lock);
 	parking_range = parking_stop - parking_start+1;
 	for (i = 0; i < parking_range; i++) {
 		x = (i + parking_offset) % parking_range + parking_start;
-		cur = parkinglot;
-		while(cur) {
-			if (cur->parkingnum == x) 
-				break;
-			cur = cur->next;
-		}
-		if (!cur)
+		if (!parking_find(x))
 			break;
 	}
 
@@ -336,14 +610,19 @@ int cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int timeout,
 		pu->priority = chan->proc_priority;
 	else
 		pu->priority = chan->priority;
-	pu->next = parkinglot;
+	pu->parked = 1;
+	bucket = parking_hash_bucket(x);
+	pu->hash_next = *bucket;
+	*bucket = pu;
+	pu->prev = NULL;
+	if ((pu->next = parkinglot))
+		pu->next->prev = pu;
 	parkinglot = pu;
-	/* If parking a channel directly, don't quiet yet get parking running on it */
-	if (peer == chan) 
-		pu->notquiteyet = 1;
+	/* Nothing looks at the call until it is activated below. If parking a
+	 * channel directly, don't quiet yet get parking running on it
+	 */
+	pu->notquiteyet = 1;
 	cw_mutex_unlock(&parking_lock);
-	/* Wake up the (presumably select()ing) thread */
-	pthread_kill(parking_thread, SIGURG);
 	if (option_verbose > 1) 
 		cw_verbose(VERBOSE_PREFIX_2 "Parked %s on %d. Will timeout back to extension [%s] %s, %d in %d seconds\n", pu->chan->name, pu->parkingnum, pu->context, pu->exten, pu->priority, (pu->parkingtime/1000));
 
@@ -357,14 +636,6 @@ int cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int timeout,
 		cw_msg_tuple("CallerIDName", "%s",  (pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>"))
 	);
 
-	if (peer) {
-		if (adsipark && adsi_available(peer)) {
-			adsi_announce_park(peer, pu->parkingnum);
-		}
-		if (adsipark && adsi_available(peer)) {
-			adsi_unload_session(peer);
-		}
-	}
 	con = cw_context_find(parking_con);
 	if (!con) {
 		con = cw_context_create(NULL, parking_con, registrar);
@@ -376,13 +647,36 @@ int cw_park_call(struct cw_channel *chan, struct cw_channel *peer, int timeout,
 		snprintf(exten, sizeof(exten), "%d", x);
 		cw_add_extension2(con, 1, exten, 1, NULL, NULL, parkedcall_name, strdup(exten), FREE, registrar);
 	}
-	if (peer) 
-		cw_say_digits(peer, pu->parkingnum, "", peer->language);
-	if (pu->notquiteyet) {
+
+	/* Once activated the call may be unparked, and pu freed, at any time */
+	if (peer != chan) {
+		cw_mutex_lock(&parking_lock);
+		parking_activate(pu);
+		cw_mutex_unlock(&parking_lock);
+#ifndef HAVE_EPOLL
+		/* Wake up the (presumably select()ing) thread */
+		pthread_kill(parking_thread, SIGURG);
+#endif
+	}
+
+	if (peer) {
+		if (adsipark && adsi_available(peer)) {
+			adsi_announce_park(peer, x);
+		}
+		if (adsipark && adsi_available(peer)) {
+			adsi_unload_session(peer);
+		}
+		cw_say_digits(peer, x, "", peer->language);
+	}
+	if (peer == chan) {
 		/* Wake up parking thread if we're really done */
-		cw_moh_start(pu->chan, NULL);
-		pu->notquiteyet = 0;
+		cw_moh_start(chan, NULL);
+		cw_mutex_lock(&parking_lock);
+		parking_activate(pu);
+		cw_mutex_unlock(&parking_lock);
+#ifndef HAVE_EPOLL
 		pthread_kill(parking_thread, SIGURG);
+#endif
 	}
 	return 0;
 }
@@ -1567,17 +1861,50 @@ int cw_bridge_call(struct cw_channel *chan,struct cw_channel *peer,struct cw_bri
 	return res;
 }
 
+#ifdef HAVE_EPOLL
+
+static int parking_handler(struct cw_io_rec *ior, int fd, short events, void *data)
+{
+	struct parkeduser *pu = data;
+
+	CW_UNUSED(fd);
+
+	cw_mutex_lock(&parking_lock);
+
+	/* The call may have been taken out of the lot since the event was reported */
+	if (pu->parked && !pu->notquiteyet) {
+		if (!parking_service(pu, ior - pu->ior, (events & CW_IO_PRI)))
+			parking_sync_fds(pu);
+	}
+
+	cw_mutex_unlock(&parking_lock);
+
+	return 1;
+}
+
+
 static __attribute__((__noreturn__)) void *do_parking_thread(void *ignore)
 {
-	int ms, tms, max;
-	struct parkeduser *pu, *pl, *pt = NULL;
-	struct timeval tv;
-	struct cw_frame *f;
-	char exten[CW_MAX_EXTENSION];
-	char *peername,*cp;
-	char returnexten[CW_MAX_EXTENSION];
-	struct cw_context *con;
-	int x;
+	CW_UNUSED(ignore);
+
+	for (;;) {
+		cw_io_run(parking_ioc, 1000);
+
+		/* Calls that were unparked while we were waiting can't have any
+		 * events outstanding now so they're safe to free.
+		 */
+		cw_mutex_lock(&parking_lock);
+		parking_free_dead();
+		cw_mutex_unlock(&parking_lock);
+	}
+}
+
+#else /* HAVE_EPOLL */
+
+static __attribute__((__noreturn__)) void *do_parking_thread(void *ignore)
+{
+	struct parkeduser *pu, *next;
+	int x, max;
 	fd_set rfds, efds;
 	fd_set nrfds, nefds;
 	FD_ZERO(&rfds);
@@ -1586,154 +1913,38 @@ static __attribute__((__noreturn__)) void *do_parking_thread(void *ignore)
 	CW_UNUSED(ignore);
 
 	for (;;) {
-		ms = -1;
 		max = -1;
 		cw_mutex_lock(&parking_lock);
-		pl = NULL;
-		pu = parkinglot;
 		FD_ZERO(&nrfds);
 		FD_ZERO(&nefds);
-		while(pu) {
+		for (pu = parkinglot; pu; pu = next) {
+			next = pu->next;
+
 			if (pu->notquiteyet) {
 				/* Pretend this one isn't here yet */
-				pl = pu;
-				pu = pu->next;
 				continue;
 			}
-			tms = cw_tvdiff_ms(cw_tvnow(), pu->start);
-			if (tms > pu->parkingtime) {
-				/* Stop music on hold */
-				cw_moh_stop(pu->chan);
-				cw_indicate(pu->chan, CW_CONTROL_UNHOLD);
-				/* Get chan, exten from derived kludge */
-				if (pu->peername[0]) {
-					peername = cw_strdupa(pu->peername);
-					cp = strrchr(peername, '-');
-					if (cp) 
-						*cp = 0;
-					con = cw_context_find(parking_con_dial);
-					if (!con) {
-						con = cw_context_create(NULL, parking_con_dial, registrar);
-						if (!con) {
-							cw_log(CW_LOG_ERROR, "Parking dial context '%s' does not exist and unable to create\n", parking_con_dial);
-						}
-					}
-					if (con) {
-						snprintf(returnexten, sizeof(returnexten), "%s,,t", peername);
-						cw_add_extension2(con, 1, peername, 1, NULL, NULL, "Dial", strdup(returnexten), FREE, registrar);
-					}
-					cw_copy_string(pu->chan->exten, peername, sizeof(pu->chan->exten));
-					cw_copy_string(pu->chan->context, parking_con_dial, sizeof(pu->chan->context));
-					pu->chan->priority = 1;
 
-				} else {
-					/* They've been waiting too long, send them back to where they came.  Theoretically they
-					   should have their original extensions and such, but we copy to be on the safe side */
-					cw_copy_string(pu->chan->exten, pu->exten, sizeof(pu->chan->exten));
-					cw_copy_string(pu->chan->context, pu->context, sizeof(pu->chan->context));
-					pu->chan->priority = pu->priority;
+			for (x = 0; x < CW_MAX_FDS; x++) {
+				if ((pu->chan->fds[x] > -1) && (FD_ISSET(pu->chan->fds[x], &rfds) || FD_ISSET(pu->chan->fds[x], &efds))) {
+					parking_service(pu, x, FD_ISSET(pu->chan->fds[x], &efds));
+					break;
 				}
+			}
+			if (!pu->parked)
+				continue;
 
-				cw_manager_event(CW_EVENT_FLAG_CALL, "ParkedCallTimeOut",
-					4,
-					cw_msg_tuple("Exten",        "%d", pu->parkingnum),
-					cw_msg_tuple("Channel",      "%s", pu->chan->name),
-					cw_msg_tuple("CallerID",     "%s", (pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")),
-					cw_msg_tuple("CallerIDName", "%s", (pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>"))
-				);
-
-				if (option_verbose > 1) 
-					cw_verbose(VERBOSE_PREFIX_2 "Timeout for %s parked on %d. Returning to %s,%s,%d\n", pu->chan->name, pu->parkingnum, pu->chan->context, pu->chan->exten, pu->chan->priority);
-				/* Start up the PBX, or hang them up */
-				if (cw_pbx_start(pu->chan))  {
-					cw_log(CW_LOG_WARNING, "Unable to restart the PBX for user on '%s', hanging them up...\n", pu->chan->name);
-					cw_hangup(pu->chan);
-				}
-				/* And take them out of the parking lot */
-				if (pl) 
-					pl->next = pu->next;
-				else
-					parkinglot = pu->next;
-				pt = pu;
-				pu = pu->next;
-				con = cw_context_find(parking_con);
-				if (con) {
-					snprintf(exten, sizeof(exten), "%d", pt->parkingnum);
-					if (cw_context_remove_extension2(con, exten, 1, NULL))
-						cw_log(CW_LOG_WARNING, "Whoa, failed to remove the extension!\n");
-				} else
-					cw_log(CW_LOG_WARNING, "Whoa, no parking context?\n");
-				free(pt);
-			} else {
-				for (x = 0; x < CW_MAX_FDS; x++) {
-					if ((pu->chan->fds[x] > -1) && (FD_ISSET(pu->chan->fds[x], &rfds) || FD_ISSET(pu->chan->fds[x], &efds))) {
-						if (FD_ISSET(pu->chan->fds[x], &efds))
-							cw_set_flag(pu->chan, CW_FLAG_EXCEPTION);
-						else
-							cw_clear_flag(pu->chan, CW_FLAG_EXCEPTION);
-						pu->chan->fdno = x;
-						/* See if they need servicing */
-						f = cw_read(pu->chan);
-						if (!f || ((f->frametype == CW_FRAME_CONTROL) && (f->subclass ==  CW_CONTROL_HANGUP))) {
-
-							cw_manager_event(CW_EVENT_FLAG_CALL, "ParkedCallGiveUp",
-								4,
-								cw_msg_tuple("Exten",        "%d", pu->parkingnum),
-								cw_msg_tuple("Channel",      "%s", pu->chan->name),
-								cw_msg_tuple("CallerID",     "%s", (pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")),
-								cw_msg_tuple("CallerIDName", "%s", (pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>"))
-							);
-
-							/* There's a problem, hang them up*/
-							if (option_verbose > 1) 
-								cw_verbose(VERBOSE_PREFIX_2 "%s got tired of being parked\n", pu->chan->name);
-							cw_hangup(pu->chan);
-							/* And take them out of the parking lot */
-							if (pl) 
-								pl->next = pu->next;
-							else
-								parkinglot = pu->next;
-							pt = pu;
-							pu = pu->next;
-							con = cw_context_find(parking_con);
-							if (con) {
-								snprintf(exten, sizeof(exten), "%d", pt->parkingnum);
-								if (cw_context_remove_extension2(con, exten, 1, NULL))
-									cw_log(CW_LOG_WARNING, "Whoa, failed to remove the extension!\n");
-							} else
-								cw_log(CW_LOG_WARNING, "Whoa, no parking context?\n");
-							free(pt);
-							break;
-						} else {
-							/* XXX Maybe we could do something with packets, like dial "0" for operator or something XXX */
-							cw_fr_free(f);
-							if (pu->moh_trys < 3 && !cw_generator_is_active(pu->chan)) {
-								cw_log(CW_LOG_DEBUG, "MOH on parked call stopped by outside source.  Restarting.\n");
-								cw_moh_start(pu->chan, NULL);
-								pu->moh_trys++;
-							}
-							goto std;	/* XXX Ick: jumping into an else statement??? XXX */
-						}
-					}
-				}
-				if (x >= CW_MAX_FDS) {
-std:					for (x=0; x<CW_MAX_FDS; x++) {
-						/* Keep this one for next one */
-						if (pu->chan->fds[x] > -1) {
-							FD_SET(pu->chan->fds[x], &nrfds);
-							FD_SET(pu->chan->fds[x], &nefds);
-							if (pu->chan->fds[x] > max)
-								max = pu->chan->fds[x];
-						}
-					}
-					/* Keep track of our longest wait */
-					if ((tms < ms) || (ms < 0))
-						ms = tms;
-					pl = pu;
-					pu = pu->next;
+			for (x=0; x<CW_MAX_FDS; x++) {
+				/* Keep this one for next one */
+				if (pu->chan->fds[x] > -1 && pu->chan->fds[x] < FD_SETSIZE) {
+					FD_SET(pu->chan->fds[x], &nrfds);
+					FD_SET(pu->chan->fds[x], &nefds);
+					if (pu->chan->fds[x] > max)
+						max = pu->chan->fds[x];
 				}
 			}
 		}
+		parking_free_dead();
 		cw_mutex_unlock(&parking_lock);
 
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
@@ -1741,15 +1952,16 @@ std:					for (x=0; x<CW_MAX_FDS; x++) {
 
 		rfds = nrfds;
 		efds = nefds;
-		tv = cw_samp2tv(ms, 1000);
-		/* Wait for something to happen */
-		cw_select(max + 1, &rfds, NULL, &efds, (ms > -1) ? &tv : NULL);
+		/* Wait for something to happen. Timeouts are handled by the scheduler. */
+		cw_select(max + 1, &rfds, NULL, &efds, NULL);
 
 		pthread_testcancel();
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	}
 }
 
+#endif /* HAVE_EPOLL */
+
 static int park_call_exec(struct cw_channel *chan, int argc, char **argv, struct cw_dynstr *result)
 {
 	struct localuser *u;
@@ -1785,9 +1997,7 @@ static int park_exec(struct cw_channel *chan, int argc, char **argv, struct cw_d
 	int res=0;
 	struct localuser *u;
 	struct cw_channel *peer=NULL;
-	struct parkeduser *pu, *pl=NULL;
-	char exten[CW_MAX_EXTENSION];
-	struct cw_context *con;
+	struct parkeduser *pu;
 	int park;
 	int dres;
 	struct cw_bridge_config config;
@@ -1801,28 +2011,12 @@ static int park_exec(struct cw_channel *chan, int argc, char **argv, struct cw_d
 
 	park = atoi(argv[0]);
 	cw_mutex_lock(&parking_lock);
-	pu = parkinglot;
-	while(pu) {
-		if (pu->parkingnum == park) {
-			if (pl)
-				pl->next = pu->next;
-			else
-				parkinglot = pu->next;
-			break;
-		}
-		pl = pu;
-		pu = pu->next;
-	}
-	cw_mutex_unlock(&parking_lock);
-	if (pu) {
+	/* A call that is still hearing its parking announcement isn't ready to be picked up yet */
+	if ((pu = parking_find(park)) && !pu->notquiteyet) {
+		parking_unpark(pu, 0);
+
 		peer = pu->chan;
-		con = cw_context_find(parking_con);
-		if (con) {
-			snprintf(exten, sizeof(exten), "%d", pu->parkingnum);
-			if (cw_context_remove_extension2(con, exten, 1, NULL))
-				cw_log(CW_LOG_WARNING, "Whoa, failed to remove the extension!\n");
-		} else
-			cw_log(CW_LOG_WARNING, "Whoa, no parking context?\n");
+		parking_remove_exten(pu->parkingnum);
 
 		cw_manager_event(CW_EVENT_FLAG_CALL, "UnParkedCall",
 			5,
@@ -1832,9 +2026,8 @@ static int park_exec(struct cw_channel *chan, int argc, char **argv, struct cw_d
 			cw_msg_tuple("CallerID",     "%s", (pu->chan->cid.cid_num ? pu->chan->cid.cid_num : "<unknown>")),
 			cw_msg_tuple("CallerIDName", "%s", (pu->chan->cid.cid_name ? pu->chan->cid.cid_name : "<unknown>"))
 		);
-
-		free(pu);
 	}
+	cw_mutex_unlock(&parking_lock);
 	/* JK02: it helps to answer the channel if not already up */
 	if (chan->_state != CW_STATE_UP) {
 		cw_answer(chan);
@@ -2281,6 +2474,17 @@ int init_features(void)
 
 	if ((res = cw_features_reload()))
 		return res;
+	if (!(parking_sched = sched_context_create(1))) {
+		cw_log(CW_LOG_ERROR, "Unable to create parking scheduler context\n");
+		return -1;
+	}
+#ifdef HAVE_EPOLL
+	if ((parking_ioc = cw_io_context_create(64)) == CW_IO_CONTEXT_NONE) {
+		cw_log(CW_LOG_ERROR, "Unable to create parking I/O context: %s\n", strerror(errno));
+		return -1;
+	}
+#endif
+
 	cw_cli_register(&showparked);
 	cw_cli_register(&showfeatures);
 	cw_pthread_create(&parking_thread, &global_attr_default, do_parking_thread, NULL);
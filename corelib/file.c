@@ -31,6 +31,9 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "callweaver.h"
 
@@ -49,6 +52,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/lock.h"
 #include "callweaver/app.h"
 #include "callweaver/pbx.h"
+#include "callweaver/callweaver_hash.h"
 
 
 static int cw_format_qsort_compare_by_name(const void *a, const void *b)
@@ -67,9 +71,16 @@ struct cw_registry format_registry = {
 };
 
 
+struct prompt;
+struct recwriter_ring;
+
 struct cw_filestream {
 	struct cw_format *fmt;
 	void *pvt;
+	/* Cached contents we are reading from (if any) */
+	struct prompt *prompt;
+	/* Queue for the recording writers (if any) */
+	struct recwriter_ring *ring;
 	atomic_t running;
 	int flags;
 	mode_t mode;
@@ -95,6 +106,496 @@ struct cw_filestream {
 };
 
 
+/* Recordings made as a side effect of a call (Monitor, MuxMon) may be opened with
+ * cw_writefile_async(). Frames written to such a stream are copied into a ring
+ * belonging to the stream and the caller carries on. A small pool of writer
+ * threads drains the rings every RECWRITER_INTERVAL ms, or sooner if a ring is
+ * half full, and does the translation, encoding and header updates through a
+ * large stdio buffer. If the disk cannot keep up and a ring fills, frames are
+ * dropped and replaced by a forward seek so the recording stays in step with
+ * the call.
+ */
+
+#define RECWRITER_INTERVAL	100			/* ms */
+#define RECWRITER_BUFSIZ	(64 * 1024)		/* stdio buffer per stream */
+
+#define RECWRITER_ALIGN(n)	(((n) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+static const int recwriter_buckets[] = { 1, 2, 5, 10, 20, 50, 100, 500, 1000 };
+
+struct recwriter_record {
+	unsigned int len;		/* Total size of the record. 0 means the rest of the ring is unused */
+	int frametype;			/* CW_FRAME_NULL if the record is only a seek */
+	int subclass;
+	int samplerate;
+	int samples;
+	int datalen;
+	int whence;			/* How to seek before writing the frame. -1 for no seek */
+	int pad;
+	long offset;			/* Samples to seek */
+	char data[0];
+};
+
+struct recwriter;
+
+struct recwriter_ring {
+	struct recwriter_ring *next;
+	struct recwriter *writer;
+	struct cw_filestream *fs;
+	int fd;
+	off_t synced;			/* Writer private: how much we have asked to be written back */
+	long offset;			/* Producer private: seek pending for the next record */
+	int whence;			/* Producer private: -1 if there is no seek pending */
+	unsigned int closing:1;		/* These are protected by the writer's lock */
+	unsigned int waiting:1;
+	unsigned int detached:1;
+	unsigned int size;		/* Power of 2 */
+	atomic_t r, w;
+	char buf[0];
+};
+
+struct recwriter {
+	pthread_t tid;
+	cw_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done;
+	atomic_t sleeping;
+	int kick;
+	unsigned int streams;
+	struct recwriter_ring *rings;
+	unsigned long frames, batches, max_us;
+	unsigned long long bytes, total_us;
+	unsigned long hist[arraysize(recwriter_buckets) + 1];
+};
+
+static struct recwriter *recwriters;
+static int nrecwriters;
+static unsigned int recwriter_ringsize;
+static atomic_t recwriter_dropped;
+
+static int writestream(struct cw_filestream *fs, struct cw_frame *f);
+static int closestream(struct cw_filestream *f);
+
+
+/* A no-op cmpxchg is a read with a full barrier */
+static inline unsigned int recwriter_pos(atomic_t *pos)
+{
+	int n = atomic_read(pos);
+
+	while (atomic_cmpxchg(pos, n, n) != n)
+		n = atomic_read(pos);
+
+	return (unsigned int)n;
+}
+
+static void recwriter_kick(struct recwriter *writer)
+{
+	cw_mutex_lock(&writer->lock);
+	writer->kick = 1;
+	pthread_cond_signal(&writer->cond);
+	cw_mutex_unlock(&writer->lock);
+}
+
+/* Queues a frame (or, if f is NULL, just the pending seek). Only the thread
+ * writing to the stream calls this and it never waits.
+ */
+static int recwriter_put(struct recwriter_ring *ring, struct cw_frame *f)
+{
+	struct recwriter_record *rec;
+	unsigned int w, r, off, contig, space, need;
+
+	need = RECWRITER_ALIGN(sizeof(*rec) + (f ? f->datalen : 0));
+
+	/* Only we ever move the write position */
+	w = (unsigned int)atomic_read(&ring->w);
+	r = recwriter_pos(&ring->r);
+	off = w & (ring->size - 1);
+	contig = ring->size - off;
+	space = ring->size - (w - r);
+
+	if (contig < need && space >= contig + need) {
+		/* It's the end of the buffer that's in the way so skip to the start */
+		((struct recwriter_record *)&ring->buf[off])->len = 0;
+		atomic_fetch_and_add(&ring->w, contig);
+		w += contig;
+		off = 0;
+		space -= contig;
+		contig = ring->size;
+	}
+
+	if (space < need || contig < need) {
+		atomic_inc(&recwriter_dropped);
+
+		/* Leave a gap where the frame should have been */
+		if (f && f->frametype == CW_FRAME_VOICE && (ring->whence < 0 || ring->whence == SEEK_FORCECUR)) {
+			ring->offset += f->samples;
+			ring->whence = SEEK_FORCECUR;
+		}
+
+		if (atomic_read(&ring->writer->sleeping))
+			recwriter_kick(ring->writer);
+		return 0;
+	}
+
+	rec = (struct recwriter_record *)&ring->buf[off];
+	rec->len = need;
+	rec->whence = ring->whence;
+	rec->offset = ring->offset;
+	if (f) {
+		rec->frametype = f->frametype;
+		rec->subclass = f->subclass;
+		rec->samplerate = f->samplerate;
+		rec->samples = f->samples;
+		rec->datalen = f->datalen;
+		memcpy(rec->data, f->data, f->datalen);
+	} else {
+		rec->frametype = CW_FRAME_NULL;
+		rec->datalen = 0;
+	}
+
+	ring->whence = -1;
+	ring->offset = 0;
+
+	/* Publish it. The locked op orders the stores above before the position change. */
+	atomic_fetch_and_add(&ring->w, need);
+
+	if (w + need - r > ring->size / 2 && atomic_read(&ring->writer->sleeping))
+		recwriter_kick(ring->writer);
+
+	return 0;
+}
+
+static int recwriter_seek(struct recwriter_ring *ring, long offset, int whence)
+{
+	/* Forward skips, which is how channels keep the two sides of a Monitor
+	 * in step, are folded into the next frame
+	 */
+	if (whence == SEEK_FORCECUR && (ring->whence < 0 || ring->whence == SEEK_FORCECUR)) {
+		ring->offset += offset;
+		ring->whence = SEEK_FORCECUR;
+		return 0;
+	}
+
+	if (ring->whence >= 0)
+		recwriter_put(ring, NULL);
+
+	ring->offset = offset;
+	ring->whence = whence;
+	return 0;
+}
+
+/* Waits until everything queued so far has been written. If close is set
+ * the stream is also detached from its writer and the ring may be freed.
+ */
+static void recwriter_wait(struct recwriter_ring *ring, int close)
+{
+	struct recwriter *writer = ring->writer;
+	unsigned int w;
+
+	if (ring->whence >= 0 && !close)
+		recwriter_put(ring, NULL);
+
+	w = (unsigned int)atomic_read(&ring->w);
+
+	cw_mutex_lock(&writer->lock);
+
+	ring->waiting = 1;
+	if (close)
+		ring->closing = 1;
+	writer->kick = 1;
+	pthread_cond_signal(&writer->cond);
+
+	while (close ? !ring->detached : recwriter_pos(&ring->r) != w)
+		pthread_cond_wait(&writer->done, &writer->lock);
+
+	ring->waiting = 0;
+
+	cw_mutex_unlock(&writer->lock);
+}
+
+/* Writes out everything in the ring. Returns the number of frames written. */
+static unsigned int recwriter_drain(struct recwriter_ring *ring, unsigned long long *bytes)
+{
+	struct cw_filestream *fs = ring->fs;
+	struct recwriter_record *rec;
+	struct cw_frame fr;
+	unsigned int start, r, w, off, n = 0;
+
+	start = r = (unsigned int)atomic_read(&ring->r);
+	w = recwriter_pos(&ring->w);
+
+	while (r != w) {
+		off = r & (ring->size - 1);
+		rec = (struct recwriter_record *)&ring->buf[off];
+
+		if (!rec->len) {
+			r += ring->size - off;
+			continue;
+		}
+
+		if (rec->whence >= 0 && fs->fmt->seek(fs->pvt, rec->offset, rec->whence) == -1)
+			cw_log(CW_LOG_WARNING, "Failed to seek in %s, synchronization may be broken\n", fs->filename);
+
+		if (rec->frametype != CW_FRAME_NULL) {
+			cw_fr_init_ex(&fr, rec->frametype, rec->subclass);
+			fr.samplerate = rec->samplerate;
+			fr.samples = rec->samples;
+			fr.datalen = rec->datalen;
+			fr.data = rec->data;
+			if (writestream(fs, &fr) < 0)
+				cw_log(CW_LOG_WARNING, "Failed to write to %s\n", fs->filename);
+			*bytes += rec->datalen;
+			n++;
+		}
+
+		r += rec->len;
+	}
+
+	/* Hand the space back. The locked op orders our reads before the producer can reuse it. */
+	if (r != start)
+		atomic_fetch_and_add(&ring->r, r - start);
+
+	return n;
+}
+
+/* Starts write back of what has reached the kernel and drops what was
+ * written back last time from the page cache, so recordings neither
+ * fill memory with dirty pages nor push other things out of the cache.
+ */
+static void recwriter_writeback(struct recwriter_ring *ring)
+{
+#if defined(HAVE_SYNC_FILE_RANGE) || defined(HAVE_POSIX_FADVISE)
+	struct stat st;
+	off_t end;
+
+	if (!option_recording_dropcache || ring->fd < 0 || fstat(ring->fd, &st))
+		return;
+
+	end = st.st_size & ~((off_t)RECWRITER_BUFSIZ - 1);
+	if (end > ring->synced) {
+#ifdef HAVE_SYNC_FILE_RANGE
+		sync_file_range(ring->fd, ring->synced, end - ring->synced, SYNC_FILE_RANGE_WRITE);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+		if (ring->synced)
+			posix_fadvise(ring->fd, 0, ring->synced, POSIX_FADV_DONTNEED);
+#endif
+		ring->synced = end;
+	}
+#else
+	CW_UNUSED(ring);
+#endif
+}
+
+static void *recwriter_thread(void *data)
+{
+	struct recwriter *writer = data;
+	struct recwriter_ring *ring, *next, **ring_p;
+	struct timespec ts;
+	struct timeval start;
+	unsigned long long bytes;
+	unsigned int frames;
+	unsigned long us;
+	int closing, i;
+
+	for (;;) {
+		cw_mutex_lock(&writer->lock);
+
+		if (!writer->kick) {
+			atomic_cmpxchg(&writer->sleeping, 0, 1);
+			cw_clock_gettime(global_cond_clock_monotonic, &ts);
+			cw_clock_add_ms(&ts, RECWRITER_INTERVAL);
+			cw_cond_timedwait(&writer->cond, &writer->lock, &ts);
+			atomic_cmpxchg(&writer->sleeping, 1, 0);
+		}
+		writer->kick = 0;
+		ring = writer->rings;
+
+		cw_mutex_unlock(&writer->lock);
+
+		/* New rings are only ever added at the head and only we remove them
+		 * so the list can be walked without the lock
+		 */
+		for (; ring; ring = next) {
+			next = ring->next;
+
+			cw_mutex_lock(&writer->lock);
+			closing = ring->closing;
+			cw_mutex_unlock(&writer->lock);
+
+			start = cw_tvnow();
+			bytes = 0;
+			if ((frames = recwriter_drain(ring, &bytes)) && !closing)
+				recwriter_writeback(ring);
+			us = cw_tvdiff(cw_tvnow(), start);
+
+			cw_mutex_lock(&writer->lock);
+
+			if (frames) {
+				writer->frames += frames;
+				writer->bytes += bytes;
+				writer->batches++;
+				writer->total_us += us;
+				if (us > writer->max_us)
+					writer->max_us = us;
+				for (i = 0; i < arraysize(recwriter_buckets) && us > recwriter_buckets[i] * 1000UL; i++);
+				writer->hist[i]++;
+			}
+
+			if (closing) {
+				for (ring_p = &writer->rings; *ring_p != ring; ring_p = &(*ring_p)->next);
+				*ring_p = ring->next;
+				writer->streams--;
+				ring->detached = 1;
+
+				if (!ring->waiting) {
+					/* Nobody is waiting so the close is ours to finish */
+					cw_mutex_unlock(&writer->lock);
+					ring->fs->ring = NULL;
+					closestream(ring->fs);
+					free(ring);
+					continue;
+				}
+			}
+
+			if (ring->waiting)
+				pthread_cond_broadcast(&writer->done);
+
+			cw_mutex_unlock(&writer->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Hands a newly opened stream to the least busy writer. If there are no
+ * writers the stream is simply written synchronously.
+ */
+static void recwriter_attach(struct cw_filestream *fs, FILE *f)
+{
+	struct recwriter *writer;
+	struct recwriter_ring *ring;
+	int i;
+
+	if (!nrecwriters || !(ring = malloc(sizeof(*ring) + recwriter_ringsize)))
+		return;
+
+	writer = &recwriters[0];
+	for (i = 1; i < nrecwriters; i++) {
+		if (recwriters[i].streams < writer->streams)
+			writer = &recwriters[i];
+	}
+
+	ring->writer = writer;
+	ring->fs = fs;
+	ring->fd = (f ? fileno(f) : -1);
+	ring->synced = 0;
+	ring->offset = 0;
+	ring->whence = -1;
+	ring->closing = ring->waiting = ring->detached = 0;
+	ring->size = recwriter_ringsize;
+	atomic_set(&ring->r, 0);
+	atomic_set(&ring->w, 0);
+
+	fs->ring = ring;
+
+	cw_mutex_lock(&writer->lock);
+	ring->next = writer->rings;
+	writer->rings = ring;
+	writer->streams++;
+	cw_mutex_unlock(&writer->lock);
+}
+
+static void recwriter_init(void)
+{
+	int i;
+
+	if (option_recording_writers <= 0 || !(recwriters = calloc(option_recording_writers, sizeof(*recwriters))))
+		return;
+
+	for (recwriter_ringsize = 4096; recwriter_ringsize < (unsigned int)option_recording_buffer * 1024 && recwriter_ringsize < (1U << 24); recwriter_ringsize <<= 1);
+
+	for (i = 0; i < option_recording_writers; i++) {
+		atomic_set(&recwriters[i].sleeping, 0);
+		cw_mutex_init(&recwriters[i].lock);
+		cw_cond_init(&recwriters[i].cond, &global_condattr_monotonic);
+		pthread_cond_init(&recwriters[i].done, NULL);
+
+		if (cw_pthread_create(&recwriters[i].tid, &global_attr_detached, recwriter_thread, &recwriters[i])) {
+			cw_log(CW_LOG_WARNING, "Unable to start recording writer %d\n", i);
+			break;
+		}
+	}
+
+	nrecwriters = i;
+}
+
+static int recwriter_show(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	struct recwriter_ring *ring;
+	struct recwriter *writer;
+	unsigned long buffered;
+	int i, j;
+
+	CW_UNUSED(argv);
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	if (!nrecwriters) {
+		cw_dynstr_printf(ds_p, "Recordings are written synchronously\n");
+		return RESULT_SUCCESS;
+	}
+
+	cw_dynstr_printf(ds_p, "%-6s %7s %10s %10s %12s %10s %8s %8s\n",
+		"Writer", "Streams", "Buffered", "Frames", "Bytes", "Batches", "Avg(us)", "Max(us)");
+
+	for (i = 0; i < nrecwriters; i++) {
+		writer = &recwriters[i];
+
+		cw_mutex_lock(&writer->lock);
+
+		buffered = 0;
+		for (ring = writer->rings; ring; ring = ring->next)
+			buffered += (unsigned int)atomic_read(&ring->w) - (unsigned int)atomic_read(&ring->r);
+
+		cw_dynstr_printf(ds_p, "%-6d %7u %10lu %10lu %12llu %10lu %8llu %8lu\n",
+			i, writer->streams, buffered, writer->frames, writer->bytes, writer->batches,
+			(writer->batches ? writer->total_us / writer->batches : 0ULL), writer->max_us);
+
+		cw_mutex_unlock(&writer->lock);
+	}
+
+	cw_dynstr_printf(ds_p, "\nRing size %u bytes per stream, %d frames dropped\n",
+		recwriter_ringsize, atomic_read(&recwriter_dropped));
+
+	cw_dynstr_printf(ds_p, "\nBatch write latency:\n");
+	for (j = 0; j <= arraysize(recwriter_buckets); j++) {
+		unsigned long n = 0;
+
+		for (i = 0; i < nrecwriters; i++)
+			n += recwriters[i].hist[j];
+
+		if (j < arraysize(recwriter_buckets))
+			cw_dynstr_printf(ds_p, "  <= %4d ms: %lu\n", recwriter_buckets[j], n);
+		else
+			cw_dynstr_printf(ds_p, "   > %4d ms: %lu\n", recwriter_buckets[j - 1], n);
+	}
+
+	return RESULT_SUCCESS;
+}
+
+static struct cw_clicmd recwriter_cli = {
+	.cmda = { "show", "recording", "writers", NULL },
+	.handler = recwriter_show,
+	.summary = "Show recording writer statistics",
+	.usage = "Usage: show recording writers\n"
+	"       Shows how many recordings each writer thread is handling, how much\n"
+	"       audio is waiting to be written, how long writes are taking and how\n"
+	"       many frames had to be dropped because the disk could not keep up.\n",
+};
+
+
 int cw_stopstream(struct cw_channel *chan)
 {
 	struct cw_filestream *fs;
@@ -115,7 +616,7 @@ int cw_stopstream(struct cw_channel *chan)
 	return 0;
 }
 
-int cw_writestream(struct cw_filestream *fs, struct cw_frame *f)
+static int writestream(struct cw_filestream *fs, struct cw_frame *f)
 {
 	struct cw_frame *trf;
 	int res = -1;
@@ -175,6 +676,14 @@ int cw_writestream(struct cw_filestream *fs, struct cw_frame *f)
 	}
 }
 
+int cw_writestream(struct cw_filestream *fs, struct cw_frame *f)
+{
+	if (fs->ring)
+		return recwriter_put(fs->ring, f);
+
+	return writestream(fs, f);
+}
+
 static int copy(const char *infile, const char *outfile)
 {
 	int ifd;
@@ -257,6 +766,611 @@ static int exts_compare(const char *exts, const char *type)
 	return 0;
 }
 
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_FMEMOPEN)
+
+/* IVRs and queues play the same few hundred prompts over and over. Rather than
+ * stat every candidate extension and fopen the winner on every play we remember,
+ * for each path under the sounds directory, whether the file exists and, once it
+ * has been played, its contents. Plays of a cached file read from a shared,
+ * read-only copy via fmemopen so the format modules need no changes.
+ * The cache is kept honest by inotify watches on the directories we have looked
+ * in (or their nearest existing ancestor if they do not exist yet) and is bounded
+ * in bytes and entries, least recently used first out.
+ */
+
+#define PROMPT_BUCKETS		1024
+#define PROMPT_WATCH_BUCKETS	256
+#define PROMPT_MAX_ENTRIES	16384
+
+#define PROMPT_WATCH_MASK	(IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB \
+				| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct prompt {
+	struct prompt *next;		/* hash chain */
+	struct prompt *lru_prev, *lru_next;
+	unsigned int hash;
+	int refs;			/* one for the cache while linked, one per open stream */
+	unsigned int linked:1;
+	unsigned int exists:1;
+	unsigned int toobig:1;
+	size_t size;
+	unsigned char *data;
+	size_t pathlen;
+	char path[0];
+};
+
+struct prompt_watch {
+	struct prompt_watch *next;	/* chained by path */
+	struct prompt_watch *wd_next;	/* chained by watch descriptor */
+	unsigned int hash;
+	int wd;
+	size_t pathlen;
+	char path[0];
+};
+
+static struct prompt *prompt_bypath[PROMPT_BUCKETS];
+static struct prompt *prompt_lru_head, *prompt_lru_tail;
+static struct prompt_watch *prompt_watch_bypath[PROMPT_WATCH_BUCKETS];
+static struct prompt_watch *prompt_watch_bywd[PROMPT_WATCH_BUCKETS];
+static unsigned int prompt_gen;
+static unsigned int prompt_entries, prompt_files, prompt_watches;
+static size_t prompt_bytes, prompt_maxbytes, prompt_maxfile;
+static unsigned long prompt_hits, prompt_misses, prompt_memplays, prompt_diskplays;
+static unsigned long prompt_loads, prompt_evictions, prompt_invalidations;
+static const char *prompt_root;
+static size_t prompt_rootlen;
+static int prompt_fd = -1;
+static pthread_t prompt_thread = CW_PTHREADT_NULL;
+CW_MUTEX_DEFINE_STATIC(prompt_lock);
+
+
+static void prompt_free(struct prompt *p)
+{
+	free(p->data);
+	free(p);
+}
+
+static void prompt_put(struct prompt *p)
+{
+	int refs;
+
+	cw_mutex_lock(&prompt_lock);
+	refs = --p->refs;
+	cw_mutex_unlock(&prompt_lock);
+
+	if (!refs)
+		prompt_free(p);
+}
+
+/* Must be called with prompt_lock held. The entry is freed if it is not
+ * in use by an open stream.
+ */
+static void prompt_unlink(struct prompt *p)
+{
+	struct prompt **q;
+
+	for (q = &prompt_bypath[p->hash % PROMPT_BUCKETS]; *q; q = &(*q)->next) {
+		if (*q == p) {
+			*q = p->next;
+			break;
+		}
+	}
+
+	if (p->lru_prev)
+		p->lru_prev->lru_next = p->lru_next;
+	else
+		prompt_lru_head = p->lru_next;
+	if (p->lru_next)
+		p->lru_next->lru_prev = p->lru_prev;
+	else
+		prompt_lru_tail = p->lru_prev;
+
+	prompt_entries--;
+	if (p->data) {
+		prompt_files--;
+		prompt_bytes -= p->size;
+	}
+	p->linked = 0;
+
+	if (!--p->refs)
+		prompt_free(p);
+}
+
+/* Must be called with prompt_lock held */
+static void prompt_evict(void)
+{
+	struct prompt *p, *prev;
+
+	while (prompt_lru_tail && prompt_entries > PROMPT_MAX_ENTRIES) {
+		prompt_unlink(prompt_lru_tail);
+		prompt_evictions++;
+	}
+
+	/* Forgetting that a file exists or not frees no memory worth having */
+	for (p = prompt_lru_tail; p && prompt_bytes > prompt_maxbytes; p = prev) {
+		prev = p->lru_prev;
+		if (p->data) {
+			prompt_unlink(p);
+			prompt_evictions++;
+		}
+	}
+}
+
+/* Drops the given path and anything below it. A NULL path drops everything.
+ * Must be called with prompt_lock held.
+ */
+static void prompt_invalidate_locked(const char *path, size_t pathlen)
+{
+	struct prompt *p, *next;
+
+	prompt_gen++;
+
+	for (p = prompt_lru_head; p; p = next) {
+		next = p->lru_next;
+		if (!path
+		|| (p->pathlen >= pathlen && !memcmp(p->path, path, pathlen) && (p->path[pathlen] == '\0' || p->path[pathlen] == '/'))) {
+			prompt_unlink(p);
+			prompt_invalidations++;
+		}
+	}
+}
+
+/* Drops the given path from the cache. This is used when we change files
+ * ourselves so the change is seen before the inotify event arrives.
+ */
+static void prompt_invalidate(const char *path)
+{
+	if (prompt_fd >= 0) {
+		cw_mutex_lock(&prompt_lock);
+		prompt_invalidate_locked(path, strlen(path));
+		cw_mutex_unlock(&prompt_lock);
+	}
+}
+
+/* Makes sure changes to the directory containing path will be noticed. If the
+ * directory does not exist we watch its nearest existing ancestor under the
+ * sounds directory so we notice when it is created. Must be called with
+ * prompt_lock held.
+ */
+static int prompt_watch_dir(const char *path)
+{
+	char *dir = cw_strdupa(path);
+	struct prompt_watch *w;
+	unsigned int hash;
+	size_t l;
+	char *p;
+	int wd;
+
+	for (;;) {
+		if (!(p = strrchr(dir, '/')) || (size_t)(p - dir) < prompt_rootlen)
+			return -1;
+		*p = '\0';
+		l = p - dir;
+
+		hash = cw_hash_mem(0, dir, l);
+		for (w = prompt_watch_bypath[hash % PROMPT_WATCH_BUCKETS]; w; w = w->next) {
+			if (w->pathlen == l && !memcmp(w->path, dir, l))
+				return 0;
+		}
+
+		if ((wd = inotify_add_watch(prompt_fd, dir, PROMPT_WATCH_MASK)) >= 0)
+			break;
+
+		if (errno != ENOENT && errno != ENOTDIR) {
+			cw_log(CW_LOG_WARNING, "Unable to watch %s for changes: %s\n", dir, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (!(w = malloc(sizeof(*w) + l + 1))) {
+		inotify_rm_watch(prompt_fd, wd);
+		return -1;
+	}
+
+	w->hash = hash;
+	w->wd = wd;
+	w->pathlen = l;
+	memcpy(w->path, dir, l + 1);
+	w->next = prompt_watch_bypath[hash % PROMPT_WATCH_BUCKETS];
+	prompt_watch_bypath[hash % PROMPT_WATCH_BUCKETS] = w;
+	w->wd_next = prompt_watch_bywd[wd % PROMPT_WATCH_BUCKETS];
+	prompt_watch_bywd[wd % PROMPT_WATCH_BUCKETS] = w;
+	prompt_watches++;
+	return 0;
+}
+
+/* Returns the (referenced) cache entry for path, looking it up on disk if
+ * necessary, or NULL if the path is not one we cache.
+ */
+static struct prompt *prompt_lookup(const char *path)
+{
+	struct stat st;
+	struct prompt *p, *q;
+	unsigned int hash, gen;
+	size_t l;
+
+	if (prompt_fd < 0 || strncmp(path, prompt_root, prompt_rootlen) || path[prompt_rootlen] != '/')
+		return NULL;
+
+	l = strlen(path);
+	hash = cw_hash_mem(0, path, l);
+
+	cw_mutex_lock(&prompt_lock);
+
+	for (p = prompt_bypath[hash % PROMPT_BUCKETS]; p; p = p->next) {
+		if (p->hash == hash && p->pathlen == l && !memcmp(p->path, path, l))
+			break;
+	}
+
+	if (p) {
+		if (p->lru_prev) {
+			p->lru_prev->lru_next = p->lru_next;
+			if (p->lru_next)
+				p->lru_next->lru_prev = p->lru_prev;
+			else
+				prompt_lru_tail = p->lru_prev;
+			p->lru_prev = NULL;
+			p->lru_next = prompt_lru_head;
+			prompt_lru_head->lru_prev = p;
+			prompt_lru_head = p;
+		}
+		p->refs++;
+		prompt_hits++;
+		cw_mutex_unlock(&prompt_lock);
+		return p;
+	}
+
+	prompt_misses++;
+
+	/* The watch has to be in place before we look so that we cannot miss a change */
+	if (prompt_watch_dir(path)) {
+		cw_mutex_unlock(&prompt_lock);
+		return NULL;
+	}
+	gen = prompt_gen;
+
+	cw_mutex_unlock(&prompt_lock);
+
+	if (!(p = malloc(sizeof(*p) + l + 1)))
+		return NULL;
+
+	p->hash = hash;
+	p->refs = 1;
+	p->linked = 0;
+	p->exists = (!stat(path, &st) && S_ISREG(st.st_mode));
+	p->toobig = 0;
+	p->size = 0;
+	p->data = NULL;
+	p->pathlen = l;
+	memcpy(p->path, path, l + 1);
+
+	cw_mutex_lock(&prompt_lock);
+
+	/* If anything changed while we were looking we cannot tell whether our
+	 * answer is still true so we use it this once and do not keep it.
+	 */
+	if (gen == prompt_gen) {
+		for (q = prompt_bypath[hash % PROMPT_BUCKETS]; q; q = q->next) {
+			if (q->hash == hash && q->pathlen == l && !memcmp(q->path, path, l))
+				break;
+		}
+
+		if (!q) {
+			p->next = prompt_bypath[hash % PROMPT_BUCKETS];
+			prompt_bypath[hash % PROMPT_BUCKETS] = p;
+			p->lru_prev = NULL;
+			p->lru_next = prompt_lru_head;
+			if (prompt_lru_head)
+				prompt_lru_head->lru_prev = p;
+			else
+				prompt_lru_tail = p;
+			prompt_lru_head = p;
+			p->linked = 1;
+			p->refs++;
+			prompt_entries++;
+			prompt_evict();
+		}
+	}
+
+	cw_mutex_unlock(&prompt_lock);
+
+	return p;
+}
+
+/* Returns 1 if path exists, 0 if it does not or -1 if the cache cannot say */
+static int prompt_exists(const char *path)
+{
+	struct prompt *p;
+	int res = -1;
+
+	if ((p = prompt_lookup(path))) {
+		res = p->exists;
+		prompt_put(p);
+	}
+
+	return res;
+}
+
+/* Reads the whole of a cached file into memory if it fits. Called without
+ * prompt_lock held and with a reference to p.
+ */
+static void prompt_load(struct prompt *p)
+{
+	struct stat st;
+	unsigned char *data = NULL;
+	size_t size = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(p->path, O_RDONLY)) < 0)
+		return;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && (size_t)st.st_size <= prompt_maxfile && st.st_size > 0) {
+		if ((data = malloc(st.st_size))) {
+			while (size < (size_t)st.st_size && (n = read(fd, data + size, st.st_size - size)) > 0)
+				size += n;
+			if (size != (size_t)st.st_size) {
+				free(data);
+				data = NULL;
+			}
+		}
+	}
+
+	close(fd);
+
+	cw_mutex_lock(&prompt_lock);
+
+	if (!data) {
+		p->toobig = 1;
+	} else if (!p->data) {
+		p->data = data;
+		p->size = size;
+		data = NULL;
+		prompt_loads++;
+		if (p->linked) {
+			prompt_files++;
+			prompt_bytes += size;
+			prompt_evict();
+		}
+	}
+
+	cw_mutex_unlock(&prompt_lock);
+
+	free(data);
+}
+
+/* Opens path for reading, from memory if it is in the cache. If it is, *pp
+ * is set to the cache entry which must be released with prompt_put once the
+ * file has been closed.
+ */
+static FILE *prompt_fopen(const char *path, struct prompt **pp)
+{
+	struct prompt *p;
+	unsigned char *data;
+	FILE *fp;
+	int toobig;
+
+	*pp = NULL;
+
+	if ((p = prompt_lookup(path))) {
+		if (!p->exists) {
+			prompt_put(p);
+			errno = ENOENT;
+			return NULL;
+		}
+
+		cw_mutex_lock(&prompt_lock);
+		data = p->data;
+		toobig = p->toobig;
+		cw_mutex_unlock(&prompt_lock);
+
+		if (!data && !toobig) {
+			prompt_load(p);
+			cw_mutex_lock(&prompt_lock);
+			data = p->data;
+			cw_mutex_unlock(&prompt_lock);
+		}
+
+		/* The data never changes once loaded and our reference keeps it alive */
+		if (data && (fp = fmemopen(data, p->size, "r"))) {
+			cw_mutex_lock(&prompt_lock);
+			prompt_memplays++;
+			cw_mutex_unlock(&prompt_lock);
+			*pp = p;
+			return fp;
+		}
+
+		cw_mutex_lock(&prompt_lock);
+		prompt_diskplays++;
+		cw_mutex_unlock(&prompt_lock);
+		prompt_put(p);
+	}
+
+	return fopen(path, "r");
+}
+
+static void *prompt_watcher(void *data)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct prompt_watch *w, **q;
+	char *path;
+	ssize_t len;
+	size_t l;
+	char *p;
+
+	CW_UNUSED(data);
+
+	for (;;) {
+		len = read(prompt_fd, buf, sizeof(buf));
+
+		if (len <= 0) {
+			if (len < 0 && errno != EINTR && errno != EAGAIN) {
+				cw_log(CW_LOG_ERROR, "inotify read failed: %s - prompt cache disabled\n", strerror(errno));
+				break;
+			}
+			continue;
+		}
+
+		cw_mutex_lock(&prompt_lock);
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			if (ev->wd < 0) {
+				/* The queue overflowed so we have no idea what changed */
+				prompt_invalidate_locked(NULL, 0);
+				continue;
+			}
+
+			for (w = prompt_watch_bywd[ev->wd % PROMPT_WATCH_BUCKETS]; w && w->wd != ev->wd; w = w->wd_next);
+			if (!w)
+				continue;
+
+			if (ev->len && ev->name[0]) {
+				l = w->pathlen + 1 + strlen(ev->name);
+				path = alloca(l + 1);
+				sprintf(path, "%s/%s", w->path, ev->name);
+				prompt_invalidate_locked(path, l);
+			} else
+				prompt_invalidate_locked(w->path, w->pathlen);
+
+			/* If the directory moved the watch now follows it under a name
+			 * we do not know so drop it and start again when next needed.
+			 */
+			if ((ev->mask & IN_MOVE_SELF))
+				inotify_rm_watch(prompt_fd, w->wd);
+
+			if ((ev->mask & IN_IGNORED)) {
+				for (q = &prompt_watch_bywd[w->wd % PROMPT_WATCH_BUCKETS]; *q != w; q = &(*q)->wd_next);
+				*q = w->wd_next;
+				for (q = &prompt_watch_bypath[w->hash % PROMPT_WATCH_BUCKETS]; *q != w; q = &(*q)->next);
+				*q = w->next;
+				prompt_watches--;
+				free(w);
+			}
+		}
+
+		cw_mutex_unlock(&prompt_lock);
+	}
+
+	/* Without change notifications we cannot trust anything we have */
+	cw_mutex_lock(&prompt_lock);
+	prompt_invalidate_locked(NULL, 0);
+	close(prompt_fd);
+	prompt_fd = -1;
+	cw_mutex_unlock(&prompt_lock);
+
+	return NULL;
+}
+
+static void prompt_cache_init(void)
+{
+	if (option_prompt_cache <= 0)
+		return;
+
+	prompt_maxbytes = (size_t)option_prompt_cache * 1024;
+	prompt_maxfile = (size_t)(option_prompt_cache_maxfile > 0 ? option_prompt_cache_maxfile : option_prompt_cache) * 1024;
+	prompt_root = cw_config[CW_SOUNDS_DIR];
+	prompt_rootlen = strlen(prompt_root);
+	while (prompt_rootlen > 1 && prompt_root[prompt_rootlen - 1] == '/')
+		prompt_rootlen--;
+
+	if ((prompt_fd = inotify_init()) < 0) {
+		cw_log(CW_LOG_WARNING, "inotify unavailable (%s) - prompts will not be cached\n", strerror(errno));
+		return;
+	}
+
+	fcntl(prompt_fd, F_SETFD, FD_CLOEXEC);
+
+	if (cw_pthread_create(&prompt_thread, &global_attr_detached, prompt_watcher, NULL)) {
+		cw_log(CW_LOG_WARNING, "Unable to start prompt watcher - prompts will not be cached\n");
+		prompt_thread = CW_PTHREADT_NULL;
+		close(prompt_fd);
+		prompt_fd = -1;
+	}
+}
+
+static int prompt_cache_show(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	unsigned long total;
+
+	CW_UNUSED(argv);
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	if (prompt_fd < 0) {
+		cw_dynstr_printf(ds_p, "The prompt cache is disabled\n");
+		return RESULT_SUCCESS;
+	}
+
+	cw_mutex_lock(&prompt_lock);
+
+	total = prompt_hits + prompt_misses;
+	cw_dynstr_printf(ds_p, "Sounds directory:    %s\n", prompt_root);
+	cw_dynstr_printf(ds_p, "Cached files:        %u using %lu of %lu bytes (at most %lu bytes each)\n",
+		prompt_files, (unsigned long)prompt_bytes, (unsigned long)prompt_maxbytes, (unsigned long)prompt_maxfile);
+	cw_dynstr_printf(ds_p, "Cached paths:        %u of at most %d\n", prompt_entries, PROMPT_MAX_ENTRIES);
+	cw_dynstr_printf(ds_p, "Watched directories: %u\n", prompt_watches);
+	cw_dynstr_printf(ds_p, "Lookups:             %lu hits, %lu misses (%lu%% hit)\n",
+		prompt_hits, prompt_misses, (total ? (100UL * prompt_hits) / total : 0UL));
+	cw_dynstr_printf(ds_p, "Plays:               %lu from memory, %lu from disk\n", prompt_memplays, prompt_diskplays);
+	cw_dynstr_printf(ds_p, "Loads:               %lu\n", prompt_loads);
+	cw_dynstr_printf(ds_p, "Dropped:             %lu evicted, %lu invalidated\n", prompt_evictions, prompt_invalidations);
+
+	cw_mutex_unlock(&prompt_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static int prompt_cache_flush(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	CW_UNUSED(ds_p);
+	CW_UNUSED(argv);
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	if (prompt_fd >= 0) {
+		cw_mutex_lock(&prompt_lock);
+		prompt_invalidate_locked(NULL, 0);
+		cw_mutex_unlock(&prompt_lock);
+	}
+
+	return RESULT_SUCCESS;
+}
+
+static struct cw_clicmd prompt_cache_cli[] = {
+	{
+		.cmda = { "show", "prompt", "cache", NULL },
+		.handler = prompt_cache_show,
+		.summary = "Show prompt cache statistics",
+		.usage = "Usage: show prompt cache\n"
+		"       Shows how much of the sounds directory is cached in memory and how\n"
+		"       often plays were served from memory rather than from disk.\n",
+	},
+	{
+		.cmda = { "flush", "prompt", "cache", NULL },
+		.handler = prompt_cache_flush,
+		.summary = "Drop cached prompts",
+		.usage = "Usage: flush prompt cache\n"
+		"       Forgets everything cached about the sounds directory. Changes are\n"
+		"       normally noticed automatically so this should not be necessary.\n",
+	},
+};
+
+#else
+
+#define prompt_exists(path)		(-1)
+#define prompt_fopen(path, pp)		(*(pp) = NULL, fopen((path), "r"))
+#define prompt_put(p)			do { } while (0)
+#define prompt_invalidate(path)		do { } while (0)
+#define prompt_cache_init()		do { } while (0)
+
+#endif /* HAVE_SYS_INOTIFY_H && HAVE_FMEMOPEN */
+
+
 #define ACTION_EXISTS 1
 #define ACTION_DELETE 2
 #define ACTION_RENAME 3
@@ -285,7 +1399,11 @@ static int filehelper_one(struct cw_object *obj, void *data)
 			if ((fn = build_filename(args->filename, ext))) {
 				struct stat st;
 				char *nfn;
-				if (!stat(fn, &st)) {
+				int found = (args->action == ACTION_EXISTS ? prompt_exists(fn) : -1);
+
+				if (found < 0)
+					found = !stat(fn, &st);
+				if (found) {
 					switch (args->action) {
 					case ACTION_EXISTS:
 						args->res |= f->format;
@@ -295,6 +1413,7 @@ static int filehelper_one(struct cw_object *obj, void *data)
 							args->res = -1;
 							cw_log(CW_LOG_WARNING, "unlink(%s) failed: %s\n", fn, strerror(errno));
 						}
+						prompt_invalidate(fn);
 						break;
 					case ACTION_RENAME:
 						if ((nfn = build_filename(args->filename2, ext))) {
@@ -302,6 +1421,8 @@ static int filehelper_one(struct cw_object *obj, void *data)
 								args->res = -1;
 								cw_log(CW_LOG_WARNING, "rename(%s,%s) failed: %s\n", fn, nfn, strerror(errno));
 							}
+							prompt_invalidate(fn);
+							prompt_invalidate(nfn);
 							free(nfn);
 						} else {
 							args->res = -1;
@@ -314,6 +1435,7 @@ static int filehelper_one(struct cw_object *obj, void *data)
 								args->res = -1;
 								cw_log(CW_LOG_WARNING, "copy(%s,%s) failed: %s\n", fn, nfn, strerror(errno));
 							}
+							prompt_invalidate(nfn);
 							free(nfn);
 						} else {
 							args->res = -1;
@@ -356,6 +1478,7 @@ static int fileopen_one(struct cw_object *obj, void *data)
 {
 	struct cw_format *f = container_of(obj, struct cw_format, obj);
 	struct fileopen_args *args = data;
+	struct prompt *prompt;
 	FILE *bfile;
 
 	if (args->chan && (!(args->chan->writeformat & f->format) && !((f->format >= CW_FORMAT_MAX_AUDIO) && args->fmt)))
@@ -369,8 +1492,9 @@ static int fileopen_one(struct cw_object *obj, void *data)
 		for (ext = strsep(&exts, "|,"); ext; ext = strsep(&exts, "|,")) {
 			char *fn;
 			if ((fn = build_filename(args->filename, ext))) {
-				if ((bfile = fopen(fn, "r"))) {
+				if ((bfile = prompt_fopen(fn, &prompt))) {
 					if ((args->s->pvt = f->open(bfile))) {
+						args->s->prompt = prompt;
 						args->s->fmt = cw_object_dup(f);
 						args->s->owner = args->chan;
 						args->s->lasttimeout = -1;
@@ -378,6 +1502,8 @@ static int fileopen_one(struct cw_object *obj, void *data)
 						return 1;
 					}
 					fclose(bfile);
+					if (prompt)
+						prompt_put(prompt);
 				}
 				free(fn);
 			}
@@ -588,16 +1714,25 @@ int cw_playstream(struct cw_filestream *fs)
 
 int cw_seekstream(struct cw_filestream *fs, long sample_offset, int whence)
 {
+	if (fs->ring)
+		return recwriter_seek(fs->ring, sample_offset, whence);
+
 	return fs->fmt->seek(fs->pvt, sample_offset, whence);
 }
 
 int cw_truncstream(struct cw_filestream *fs)
 {
+	if (fs->ring)
+		recwriter_wait(fs->ring, 0);
+
 	return fs->fmt->trunc(fs->pvt);
 }
 
 long cw_tellstream(struct cw_filestream *fs)
 {
+	if (fs->ring)
+		recwriter_wait(fs->ring, 0);
+
 	return fs->fmt->tell(fs->pvt);
 }
 
@@ -616,7 +1751,7 @@ int cw_stream_rewind(struct cw_filestream *fs, long ms)
 	return cw_seekstream(fs, samples, SEEK_CUR);
 }
 
-int cw_closestream(struct cw_filestream *f)
+static int closestream(struct cw_filestream *f)
 {
 	char *cmd = NULL;
 	size_t size = 0;
@@ -628,6 +1763,9 @@ int cw_closestream(struct cw_filestream *f)
 		cw_translator_free_path(f->trans);
 
 	f->fmt->close(f->pvt);
+	if (f->prompt)
+		prompt_put(f->prompt);
+
 	if (f->realfilename && f->filename) {
 		size = strlen(f->filename) + strlen(f->realfilename) + 15;
 		cmd = alloca(size);
@@ -644,6 +1782,35 @@ int cw_closestream(struct cw_filestream *f)
 	return 0;
 }
 
+int cw_closestream(struct cw_filestream *f)
+{
+	if (f->ring) {
+		recwriter_wait(f->ring, 1);
+		free(f->ring);
+		f->ring = NULL;
+	}
+
+	return closestream(f);
+}
+
+int cw_closestream_async(struct cw_filestream *f)
+{
+	struct recwriter *writer;
+
+	if (!f->ring)
+		return closestream(f);
+
+	writer = f->ring->writer;
+
+	cw_mutex_lock(&writer->lock);
+	f->ring->closing = 1;
+	writer->kick = 1;
+	pthread_cond_signal(&writer->cond);
+	cw_mutex_unlock(&writer->lock);
+
+	return 0;
+}
+
 
 int cw_fileexists(const char *filename, const char *fmt, const char *preflang)
 {
@@ -764,6 +1931,8 @@ struct writefile_args {
 	const char *comment;
 	int flags, myflags;
 	mode_t mode;
+	int async;
+	FILE *f;
 	struct cw_filestream *s;
 };
 
@@ -781,6 +1950,9 @@ static int writefile_one(struct cw_object *obj, void *data)
 		if ((fn = build_filename(args->filename, args->type))) {
 			int fd = open(fn, args->flags | args->myflags, args->mode);
 			if (fd > -1) {
+				/* Anything we had cached for this file is now out of date */
+				prompt_invalidate(fn);
+
 				/* fdopen() the resulting file stream */
 				bfile = fdopen(fd, ((args->flags | args->myflags) & O_RDWR) ? "w+" : "w");
 				if (!bfile) {
@@ -822,6 +1994,11 @@ static int writefile_one(struct cw_object *obj, void *data)
 				}
 			}
 			if (fd > -1) {
+				/* Let the recording writers write in large chunks */
+				if (args->async)
+					setvbuf(bfile, NULL, _IOFBF, RECWRITER_BUFSIZ);
+				args->f = bfile;
+
 				if ((args->s->pvt = f->rewrite(bfile, args->comment))) {
 					args->s->fmt = cw_object_dup(f);
 					args->s->trans = NULL;
@@ -859,7 +2036,7 @@ static int writefile_one(struct cw_object *obj, void *data)
 	return 0;
 }
 
-struct cw_filestream *cw_writefile(const char *filename, const char *type, const char *comment, int flags, int check, mode_t mode)
+static struct cw_filestream *writefile(const char *filename, const char *type, const char *comment, int flags, mode_t mode, int async)
 {
 	struct writefile_args args = {
 		.filename = filename,
@@ -868,10 +2045,9 @@ struct cw_filestream *cw_writefile(const char *filename, const char *type, const
 		.flags = flags,
 		.myflags = O_WRONLY | O_CREAT,
 		.mode = mode,
+		.async = async,
 	};
 
-	CW_UNUSED(check);
-
 	if (!(args.s = calloc(1, sizeof(*args.s)))) {
 		cw_log(CW_LOG_ERROR, "Out of memory\n");
 		return NULL;
@@ -889,13 +2065,30 @@ struct cw_filestream *cw_writefile(const char *filename, const char *type, const
 
 	cw_registry_iterate(&format_registry, writefile_one, &args);
 
-	if (args.s->fmt)
+	if (args.s->fmt) {
+		if (async)
+			recwriter_attach(args.s, args.f);
 		return args.s;
+	}
 
 	cw_log(CW_LOG_WARNING, "No such format '%s'\n", type);
 	return NULL;
 }
 
+struct cw_filestream *cw_writefile(const char *filename, const char *type, const char *comment, int flags, int check, mode_t mode)
+{
+	CW_UNUSED(check);
+
+	return writefile(filename, type, comment, flags, mode, 0);
+}
+
+struct cw_filestream *cw_writefile_async(const char *filename, const char *type, const char *comment, int flags, int check, mode_t mode)
+{
+	CW_UNUSED(check);
+
+	return writefile(filename, type, comment, flags, mode, 1);
+}
+
 
 int cw_waitstream(struct cw_channel *c, const char *breakon)
 {
@@ -1187,5 +2380,13 @@ int cw_file_init(void)
 		cw_object_init_obj(&filestream_generator.obj, CW_OBJECT_CURRENT_MODULE, 0);
 
 	cw_cli_register(&show_file);
+
+	recwriter_init();
+	cw_cli_register(&recwriter_cli);
+
+	prompt_cache_init();
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_FMEMOPEN)
+	cw_cli_register_multiple(prompt_cache_cli, arraysize(prompt_cache_cli));
+#endif
 	return 0;
 }
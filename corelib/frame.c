@@ -244,6 +244,276 @@ void cw_smoother_free(struct cw_smoother *s)
 }
 
 
+/* Frame pool
+ *
+ * Frames duplicated or isolated for queuing are almost always voice frames
+ * of a few hundred bytes that are freed again within a few milliseconds,
+ * often by a different thread. Rather than malloc and free each of these
+ * we keep per-thread caches of frame sized blocks in a few size classes.
+ * When a thread's cache for a class runs dry it takes a batch from a
+ * shared depot and when it grows too large it returns a batch. Frames
+ * larger than the biggest class are simply malloc'd.
+ */
+
+#define FRAME_POOL_CLASSES	4
+#define FRAME_POOL_CACHE_MAX	32	/* blocks per class per thread */
+#define FRAME_POOL_BATCH	16	/* blocks moved to/from the depot at a time */
+#define FRAME_POOL_DEPOT_MAX	512	/* blocks per class in the shared depot */
+
+static const size_t frame_pool_size[FRAME_POOL_CLASSES] = {
+	CW_FRIENDLY_OFFSET + 160,
+	CW_FRIENDLY_OFFSET + 320,
+	CW_FRIENDLY_OFFSET + 640,
+	CW_FRIENDLY_OFFSET + 1280,
+};
+
+struct frame_pool_blk {
+	struct frame_pool_blk *next;
+	unsigned int cls;
+	struct cw_frame frame;		/* must be last - data follows */
+};
+
+struct frame_pool_class {
+	struct frame_pool_blk *head;
+	unsigned int count;
+	unsigned long hits;
+	unsigned long misses;
+	long inuse;
+};
+
+struct frame_pool_cache {
+	struct frame_pool_cache *next;
+	struct frame_pool_class cls[FRAME_POOL_CLASSES];
+};
+
+/* The depot's counters also hold the totals of threads that have exited */
+CW_MUTEX_DEFINE_STATIC(frame_pool_lock);
+static struct frame_pool_class frame_pool_depot[FRAME_POOL_CLASSES];
+static struct frame_pool_cache *frame_pool_caches;
+static int frame_pool_threads;
+
+static pthread_key_t frame_pool_key;
+static pthread_once_t frame_pool_once = PTHREAD_ONCE_INIT;
+
+
+#define frame_pool_blksize(cls)	(sizeof(struct frame_pool_blk) + frame_pool_size[(cls)])
+
+
+/* Move up to n blocks from the head of one list to another. The caller
+ * must hold frame_pool_lock.
+ */
+static void frame_pool_move(struct frame_pool_class *to, struct frame_pool_class *from, unsigned int n)
+{
+	struct frame_pool_blk *blk;
+
+	while (n-- && (blk = from->head)) {
+		from->head = blk->next;
+		from->count--;
+		blk->next = to->head;
+		to->head = blk;
+		to->count++;
+	}
+}
+
+
+/* Return blocks from a cache list to the depot, freeing any that would take
+ * the depot over its limit. If keep is non-zero that many are left behind.
+ */
+static void frame_pool_drain(struct frame_pool_class *c, unsigned int cls, unsigned int keep)
+{
+	struct frame_pool_class excess = { .head = NULL, .count = 0 };
+	struct frame_pool_blk *blk;
+	unsigned int n;
+
+	cw_mutex_lock(&frame_pool_lock);
+
+	n = (c->count > keep ? c->count - keep : 0);
+	if (frame_pool_depot[cls].count < FRAME_POOL_DEPOT_MAX) {
+		unsigned int room = FRAME_POOL_DEPOT_MAX - frame_pool_depot[cls].count;
+
+		frame_pool_move(&frame_pool_depot[cls], c, (n < room ? n : room));
+		n = (n < room ? 0 : n - room);
+	}
+	frame_pool_move(&excess, c, n);
+
+	cw_mutex_unlock(&frame_pool_lock);
+
+	while ((blk = excess.head)) {
+		excess.head = blk->next;
+		free(blk);
+	}
+}
+
+
+static void frame_pool_cache_release(void *data)
+{
+	struct frame_pool_cache *cache = data;
+	struct frame_pool_cache **p;
+	unsigned int cls;
+
+	for (cls = 0; cls < FRAME_POOL_CLASSES; cls++)
+		frame_pool_drain(&cache->cls[cls], cls, 0);
+
+	cw_mutex_lock(&frame_pool_lock);
+
+	for (cls = 0; cls < FRAME_POOL_CLASSES; cls++) {
+		frame_pool_depot[cls].hits += cache->cls[cls].hits;
+		frame_pool_depot[cls].misses += cache->cls[cls].misses;
+		frame_pool_depot[cls].inuse += cache->cls[cls].inuse;
+	}
+
+	for (p = &frame_pool_caches; *p; p = &(*p)->next) {
+		if (*p == cache) {
+			*p = cache->next;
+			break;
+		}
+	}
+	frame_pool_threads--;
+
+	cw_mutex_unlock(&frame_pool_lock);
+
+	free(cache);
+}
+
+
+static void frame_pool_key_create(void)
+{
+	pthread_key_create(&frame_pool_key, frame_pool_cache_release);
+}
+
+
+static struct frame_pool_cache *frame_pool_cache_get(void)
+{
+	struct frame_pool_cache *cache;
+
+	pthread_once(&frame_pool_once, frame_pool_key_create);
+
+	if (unlikely(!(cache = pthread_getspecific(frame_pool_key)))) {
+		if ((cache = calloc(1, sizeof(*cache)))) {
+			cw_mutex_lock(&frame_pool_lock);
+			cache->next = frame_pool_caches;
+			frame_pool_caches = cache;
+			frame_pool_threads++;
+			cw_mutex_unlock(&frame_pool_lock);
+
+			pthread_setspecific(frame_pool_key, cache);
+		}
+	}
+
+	return cache;
+}
+
+
+/* Get a frame header with len bytes of space following it. Only mallocd
+ * is set on the returned frame - everything else is up to the caller.
+ */
+static struct cw_frame *frame_pool_get(size_t len)
+{
+	struct frame_pool_cache *cache;
+	struct frame_pool_class *c;
+	struct frame_pool_blk *blk;
+	unsigned int cls;
+
+	for (cls = 0; cls < FRAME_POOL_CLASSES && len > frame_pool_size[cls]; cls++);
+
+	if (cls == FRAME_POOL_CLASSES) {
+		struct cw_frame *frame;
+
+		if ((frame = malloc(sizeof(*frame) + len)))
+			frame->mallocd = CW_MALLOCD_HDR;
+		return frame;
+	}
+
+	if (likely((cache = frame_pool_cache_get()))) {
+		c = &cache->cls[cls];
+
+		if (unlikely(!c->head)) {
+			cw_mutex_lock(&frame_pool_lock);
+			frame_pool_move(c, &frame_pool_depot[cls], FRAME_POOL_BATCH);
+			cw_mutex_unlock(&frame_pool_lock);
+		}
+
+		if (likely((blk = c->head))) {
+			c->head = blk->next;
+			c->count--;
+			c->hits++;
+		} else if ((blk = malloc(frame_pool_blksize(cls)))) {
+			blk->cls = cls;
+			c->misses++;
+		} else
+			return NULL;
+
+		c->inuse += frame_pool_blksize(cls);
+	} else {
+		if (!(blk = malloc(frame_pool_blksize(cls))))
+			return NULL;
+		blk->cls = cls;
+
+		cw_mutex_lock(&frame_pool_lock);
+		frame_pool_depot[cls].misses++;
+		frame_pool_depot[cls].inuse += frame_pool_blksize(cls);
+		cw_mutex_unlock(&frame_pool_lock);
+	}
+
+	blk->frame.mallocd = CW_MALLOCD_HDR | CW_MALLOCD_POOL;
+	return &blk->frame;
+}
+
+
+void cw_frame_pool_put(struct cw_frame *frame)
+{
+	struct frame_pool_blk *blk = container_of(frame, struct frame_pool_blk, frame);
+	struct frame_pool_cache *cache;
+	struct frame_pool_class *c;
+	unsigned int cls = blk->cls;
+
+	if (likely((cache = frame_pool_cache_get()))) {
+		c = &cache->cls[cls];
+
+		c->inuse -= frame_pool_blksize(cls);
+		blk->next = c->head;
+		c->head = blk;
+		if (unlikely(++c->count > FRAME_POOL_CACHE_MAX))
+			frame_pool_drain(c, cls, FRAME_POOL_CACHE_MAX - FRAME_POOL_BATCH);
+	} else {
+		cw_mutex_lock(&frame_pool_lock);
+		frame_pool_depot[cls].inuse -= frame_pool_blksize(cls);
+		if (frame_pool_depot[cls].count < FRAME_POOL_DEPOT_MAX) {
+			blk->next = frame_pool_depot[cls].head;
+			frame_pool_depot[cls].head = blk;
+			frame_pool_depot[cls].count++;
+			blk = NULL;
+		}
+		cw_mutex_unlock(&frame_pool_lock);
+
+		free(blk);
+	}
+}
+
+
+struct cw_frame *cw_fr_new(int type, int subtype, size_t size)
+{
+	struct cw_frame *frame;
+	int mallocd;
+
+	if ((frame = frame_pool_get(size ? size + CW_FRIENDLY_OFFSET : 0))) {
+		mallocd = frame->mallocd;
+		cw_fr_init_ex(frame, type, subtype);
+		frame->mallocd = mallocd;
+
+		if (size) {
+			frame->mallocd |= CW_MALLOCD_DATA_WITH_HDR;
+			frame->offset = CW_FRIENDLY_OFFSET;
+			frame->data = frame->local_data + CW_FRIENDLY_OFFSET;
+			frame->datalen = size;
+		}
+	} else
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+
+	return frame;
+}
+
+
 struct cw_frame *cw_frisolate(struct cw_frame *frame)
 {
     struct cw_frame *out;
@@ -256,10 +526,12 @@ struct cw_frame *cw_frisolate(struct cw_frame *frame)
         if (frame->data && !(frame->mallocd & CW_MALLOCD_DATA))
             dlen = frame->datalen + frame->offset;
 
-        if ((out = malloc(sizeof(*out) + dlen)))
+        if ((out = frame_pool_get(dlen)))
         {
+            int mallocd = out->mallocd;
+
             memcpy(out, frame, sizeof(struct cw_frame));
-            out->mallocd = CW_MALLOCD_HDR;
+            out->mallocd = mallocd;
 
             if (dlen)
             {
@@ -285,7 +557,7 @@ struct cw_frame *cw_frisolate(struct cw_frame *frame)
 
         if (frame->data && !(frame->mallocd & (CW_MALLOCD_DATA|CW_MALLOCD_DATA_WITH_HDR)))
         {
-            if (!(tmp = malloc(out->offset + out->datalen)))
+            if ((tmp = malloc(out->offset + out->datalen)))
             {
                 out->mallocd |= CW_MALLOCD_DATA;
                 memcpy(tmp + out->offset, out->data, out->datalen);
@@ -310,12 +582,14 @@ struct cw_frame *cw_frdup(struct cw_frame *frame)
         if (frame->data && !(frame->mallocd & CW_MALLOCD_DATA))
             dlen = frame->datalen + frame->offset;
 
-        if ((out = malloc(sizeof(*out) + dlen)))
+        if ((out = frame_pool_get(dlen)))
         {
+            int mallocd = out->mallocd;
+
             memcpy(out, frame, sizeof(struct cw_frame));
 	    out->next = out->prev = NULL;
             out->tx_copies = 1;
-            out->mallocd = CW_MALLOCD_HDR;
+            out->mallocd = mallocd;
 
             if (dlen)
             {
@@ -690,6 +964,55 @@ void cw_frame_dump(const char *name, const struct cw_frame *f, const char *prefi
 }
 
 
+static int show_frame_pool(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+    struct frame_pool_class total[FRAME_POOL_CLASSES];
+    struct frame_pool_cache *cache;
+    int threads, i;
+
+    CW_UNUSED(argv);
+
+    if (argc != 3)
+        return RESULT_SHOWUSAGE;
+
+    /* Per-thread counters are only ever updated by their owner so what
+     * we read here is a snapshot rather than an exact total.
+     */
+    cw_mutex_lock(&frame_pool_lock);
+
+    memcpy(total, frame_pool_depot, sizeof(total));
+    for (cache = frame_pool_caches; cache; cache = cache->next)
+    {
+        for (i = 0;  i < FRAME_POOL_CLASSES;  i++)
+        {
+            total[i].count += cache->cls[i].count;
+            total[i].hits += cache->cls[i].hits;
+            total[i].misses += cache->cls[i].misses;
+            total[i].inuse += cache->cls[i].inuse;
+        }
+    }
+    threads = frame_pool_threads;
+
+    cw_mutex_unlock(&frame_pool_lock);
+
+    cw_dynstr_printf(ds_p, "%-6s %12s %12s %8s %12s %8s\n", "Size", "Hits", "Misses", "Hit %", "Bytes in use", "Cached");
+    for (i = 0;  i < FRAME_POOL_CLASSES;  i++)
+    {
+        unsigned long n = total[i].hits + total[i].misses;
+
+        cw_dynstr_printf(ds_p, "%-6lu %12lu %12lu %7lu%% %12ld %8u\n",
+            (unsigned long)frame_pool_size[i], total[i].hits, total[i].misses,
+            (n ? (100UL * total[i].hits) / n : 0UL), total[i].inuse, total[i].count);
+    }
+    cw_dynstr_printf(ds_p, "%d thread caches, depot limit %d frames per size\n", threads, FRAME_POOL_DEPOT_MAX);
+
+    return RESULT_SUCCESS;
+}
+
+static const char frame_show_frame_pool_usage[] =
+    "Usage: show frame pool\n"
+    "       Displays frame pool allocation statistics\n";
+
 /* XXX no unregister function here ??? */
 static struct cw_clicmd my_clis[] =
 {
@@ -723,6 +1046,12 @@ static struct cw_clicmd my_clis[] =
         .summary = "Shows a specific codec",
         .usage = frame_show_codec_n_usage
     },
+    {
+        .cmda = { "show", "frame", "pool", NULL },
+        .handler = show_frame_pool,
+        .summary = "Shows frame pool statistics",
+        .usage = frame_show_frame_pool_usage
+    },
 };
 
 int init_framer(void)
@@ -16,6 +16,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "callweaver.h"
@@ -23,100 +24,283 @@
 CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 
 #include "callweaver/channel.h"
+#include "callweaver/cli.h"
 #include "callweaver/generator.h"
 #include "callweaver/lock.h"
+#include "callweaver/logger.h"
 #include "callweaver/time.h"
+#include "callweaver/utils.h"
 
 
-/* Note: clock_nanosleep is an Advanced Realtime POSIX function.
- * With GNU libc it is present if you build with __USE_XOPEN2K. Other platforms
- * will need other tests. If clock_nanosleep is not present we fall back on
- * pthread_cond_timedwait. This is as good at getting accurate ticks but the
- * unavoidable mutex (un)locking around the (unused) condition will cost
- * some performance.
+/* Generators are serviced by a small, fixed pool of realtime worker threads
+ * (one per online CPU by default) rather than a thread per generator. Each
+ * worker keeps the generator jobs assigned to it in a list sorted by the
+ * time their next frame is due, sleeps until the head of the list is due,
+ * writes that frame, generates the next and requeues the job.
+ *
+ * Since a job's next tick is almost always later than everything else already
+ * queued the list is searched backwards from the tail when requeuing.
+ *
+ * Note that a generate callback that blocks delays every other generator
+ * served by the same worker. Generators should not block.
  */
-static void *cw_generator_thread(void *data)
+
+/* A frame serviced more than this many microseconds after it was due counts as late */
+#define GENERATOR_LATE_US	5000
+
+/* Upper bound on the number of workers started */
+#define GENERATOR_MAX_WORKERS	64
+
+
+/* Determine if a is sooner than b */
+#define SOONER(a,b) (((b).tv_sec > (a).tv_sec) || \
+					 (((b).tv_sec == (a).tv_sec) && ((b).tv_nsec > (a).tv_nsec)))
+
+
+struct generator_worker;
+
+struct cw_generator_job {
+	struct cw_generator_job *next, *prev;
+	struct generator_worker *worker;
+	struct cw_generator_instance *inst;
+	struct cw_channel *chan;
+	struct cw_generator *class;
+	void *pvt;
+	struct cw_frame *frame;		/* Next frame to be written, already generated */
+	struct timespec tick;		/* When the next frame is due */
+	unsigned int queued:1;		/* On the worker's queue */
+	unsigned int dead:1;		/* Deactivated from its own generate callback */
+};
+
+struct generator_worker {
+	cw_mutex_t lock;
+	cw_cond_t cond;			/* Signalled when the head of the queue changes */
+	cw_cond_t done;			/* Signalled when the current job has been serviced */
+	pthread_t tid;
+	struct cw_generator_job *head, *tail;
+	struct cw_generator_job *current;
+	unsigned int count;		/* Number of jobs assigned to this worker */
+	unsigned long ticks;		/* Frames serviced */
+	unsigned long late;		/* Frames serviced more than GENERATOR_LATE_US after they were due */
+	unsigned long long late_us;	/* Total lateness of late frames */
+	unsigned long max_late_us;	/* Worst lateness seen */
+};
+
+
+static struct generator_worker *workers;
+static int nworkers;
+
+
+static void generator_job_insert(struct generator_worker *worker, struct cw_generator_job *job)
+{
+	struct cw_generator_job *prev;
+
+	for (prev = worker->tail; prev && SOONER(job->tick, prev->tick); prev = prev->prev);
+
+	job->prev = prev;
+	if (prev) {
+		job->next = prev->next;
+		prev->next = job;
+	} else {
+		job->next = worker->head;
+		worker->head = job;
+		cw_cond_signal(&worker->cond);
+	}
+
+	if (job->next)
+		job->next->prev = job;
+	else
+		worker->tail = job;
+
+	job->queued = 1;
+}
+
+
+static void generator_job_unlink(struct generator_worker *worker, struct cw_generator_job *job)
+{
+	if (job->prev)
+		job->prev->next = job->next;
+	else
+		worker->head = job->next;
+
+	if (job->next)
+		job->next->prev = job->prev;
+	else
+		worker->tail = job->prev;
+
+	job->queued = 0;
+}
+
+
+static void generator_job_free(struct cw_generator_job *job)
+{
+	if (job->frame)
+		cw_fr_free(job->frame);
+	job->class->release(job->chan, job->pvt);
+	cw_object_put(job->class);
+	free(job);
+}
+
+
+/* Write the pending frame for a job, advance its tick and generate the
+ * next frame. Returns 0 if there is a next frame, -1 if the generator
+ * has finished.
+ */
+static int generator_job_service(struct cw_generator_job *job)
 {
-	struct cw_generator_instance *gen = data;
-	struct timespec tick;
 	struct cw_frame *f;
-	clockid_t clk = global_clock_monotonic;
-#if !defined(__USE_XOPEN2K)
-	cw_cond_t cond;
-	cw_mutex_t mutex;
-
-	cw_cond_init(&cond, NULL);
-	pthread_cleanup_push(cw_cond_destroy, &cond);
-	cw_mutex_init(&mutex);
-	pthread_cleanup_push(cw_mutex_destroy, &mutex);
-	cw_mutex_lock(&mutex);
-#endif
-
-	cw_clock_gettime(clk, &tick);
-
-	cw_log(CW_LOG_DEBUG, "%s: Generator thread started\n", gen->chan->name);
-
-	f = gen->class->generate(gen->chan, gen->pvt, 160);
-	while (f) {
-		cw_write(gen->chan, &f);
-
-		if (!cw_tvzero(f->delivery)) {
-			clk = CLOCK_REALTIME;
-			tick.tv_sec = f->delivery.tv_sec;
-			tick.tv_nsec = 1000L * f->delivery.tv_usec;
-		} else if (f->duration) {
-			tick.tv_sec += f->duration / 1000;
-			tick.tv_nsec += 1000000L * (f->duration % 1000);
-		} else if (f->samples) {
-			int n = (f->samples / f->samplerate);
-			tick.tv_sec += n;
-			tick.tv_nsec += 1000000L * ((1000 * (f->samples - n * f->samplerate)) / f->samplerate);
-		} else {
-			/* If we have a null frame whatever is generating data just wasn't
-			 * ready for us so we need to give it some time.
-			 * But wait! We might be real time. The data source might not be.
-			 * So sched_yield() may not help - we _need_ to actually sleep.
-			 * We'll choose an arbitrary 0.5ms.
-			 */
-			tick.tv_nsec += 500000L;
-		}
 
-		/* Normalize */
-		if (tick.tv_nsec >= 1000000000L) {
-			tick.tv_nsec -= 1000000000L;
-			tick.tv_sec++;
-		}
+	if (!(f = job->frame) && !(f = job->class->generate(job->chan, job->pvt, 160)))
+		return -1;
+	job->frame = NULL;
+
+	cw_write(job->chan, &f);
+
+	if (!cw_tvzero(f->delivery)) {
+		/* Delivery times are wall clock so convert to our time base */
+		struct timespec now;
+		struct timeval delta = cw_tvsub(f->delivery, cw_tvnow());
+
+		cw_clock_gettime(global_cond_clock_monotonic, &now);
+		job->tick.tv_sec = now.tv_sec + delta.tv_sec;
+		job->tick.tv_nsec = now.tv_nsec + 1000L * delta.tv_usec;
+	} else if (f->duration) {
+		job->tick.tv_sec += f->duration / 1000;
+		job->tick.tv_nsec += 1000000L * (f->duration % 1000);
+	} else if (f->samples) {
+		int n = (f->samples / f->samplerate);
+		job->tick.tv_sec += n;
+		job->tick.tv_nsec += 1000000L * ((1000 * (f->samples - n * f->samplerate)) / f->samplerate);
+	} else {
+		/* If we have a null frame whatever is generating data just wasn't
+		 * ready for us so we need to give it some time.
+		 * But wait! We might be real time. The data source might not be.
+		 * We'll choose an arbitrary 0.5ms.
+		 */
+		job->tick.tv_nsec += 500000L;
+	}
+
+	/* Normalize */
+	if (job->tick.tv_nsec >= 1000000000L) {
+		job->tick.tv_nsec -= 1000000000L;
+		job->tick.tv_sec++;
+	} else if (job->tick.tv_nsec < 0) {
+		job->tick.tv_nsec += 1000000000L;
+		job->tick.tv_sec--;
+	}
+
+	cw_fr_free(f);
+
+	if (job->dead)
+		return -1;
+
+	job->frame = job->class->generate(job->chan, job->pvt, 160);
+	return (job->frame ? 0 : -1);
+}
+
+
+static void generator_mutex_unlock(void *mutex)
+{
+	cw_mutex_unlock(mutex);
+}
+
 
-		cw_fr_free(f);
+static void *generator_worker_thread(void *data)
+{
+	struct generator_worker *worker = data;
+	struct cw_generator_job *job;
+	struct timespec now;
+	unsigned long late;
+	int res;
 
-		f = gen->class->generate(gen->chan, gen->pvt, 160);
+	cw_mutex_lock(&worker->lock);
+	pthread_cleanup_push(generator_mutex_unlock, &worker->lock);
 
+	for (;;) {
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-#if !defined(__USE_XOPEN2K)
-		while (cw_cond_timedwait(&cond, &mutex, &tick) == EINTR);
-#else
-		while (clock_nanosleep(clk, TIMER_ABSTIME, &tick, NULL) && errno == EINTR);
-#endif
+		if (!(job = worker->head)) {
+			while (cw_cond_wait(&worker->cond, &worker->lock) < 0 && errno == EINTR);
+			continue;
+		}
+
+		cw_clock_gettime(global_cond_clock_monotonic, &now);
+
+		if (SOONER(now, job->tick)) {
+			while (cw_cond_timedwait(&worker->cond, &worker->lock, &job->tick) < 0 && errno == EINTR);
+			continue;
+		}
 
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-	}
 
-	cw_log(CW_LOG_DEBUG, "%s: Generator self-deactivating\n", gen->chan->name);
+		worker->ticks++;
+		late = (now.tv_sec - job->tick.tv_sec) * 1000000UL + (now.tv_nsec - job->tick.tv_nsec) / 1000L;
+		if (late > GENERATOR_LATE_US) {
+			worker->late++;
+			worker->late_us += late;
+			if (late > worker->max_late_us)
+				worker->max_late_us = late;
+		}
 
-	/* Next write on the channel should clean out the defunct generator */
-	cw_set_flag(gen->chan, CW_FLAG_WRITE_INT);
+		generator_job_unlink(worker, job);
+		worker->current = job;
+		cw_mutex_unlock(&worker->lock);
+
+		res = generator_job_service(job);
+
+		cw_mutex_lock(&worker->lock);
+		worker->current = NULL;
+		cw_cond_broadcast(&worker->done);
+
+		if (job->dead) {
+			worker->count--;
+			cw_mutex_unlock(&worker->lock);
+			generator_job_free(job);
+			cw_mutex_lock(&worker->lock);
+		} else if (!res) {
+			generator_job_insert(worker, job);
+		} else {
+			cw_log(CW_LOG_DEBUG, "%s: Generator self-deactivating\n", job->chan->name);
+
+			/* Next write on the channel should clean out the defunct generator */
+			cw_set_flag(job->chan, CW_FLAG_WRITE_INT);
+		}
+	}
 
-#if !defined(__USE_XOPEN2K)
-	pthread_cleanup_pop(1);
 	pthread_cleanup_pop(1);
-#endif
 	return NULL;
 }
 
 
+int cw_generator_instance_is_self(struct cw_generator_instance *gen)
+{
+	struct generator_worker *worker;
+	int i;
+
+	if (pthread_equal(gen->tid, CW_PTHREADT_NULL))
+		return 1;
+
+	if (!pthread_equal(gen->tid, pthread_self()))
+		return 0;
+
+	/* We are the worker servicing this generator but we may be
+	 * servicing a different one at the moment.
+	 */
+	for (i = 0; i < nworkers; i++) {
+		worker = &workers[i];
+		if (pthread_equal(worker->tid, gen->tid))
+			return (worker->current && worker->current->inst == gen);
+	}
+
+	return 0;
+}
+
+
 void cw_generator_deactivate(struct cw_generator_instance *gen)
 {
+	struct generator_worker *worker;
+	struct cw_generator_job *job;
+
 	if (!gen->chan)
 		return;
 
@@ -124,21 +308,42 @@ void cw_generator_deactivate(struct cw_generator_instance *gen)
 
 	if (!pthread_equal(gen->tid, CW_PTHREADT_NULL)) {
 		char name[CW_CHANNEL_NAME];
-		struct cw_generator_instance generator;
 
 		cw_log(CW_LOG_DEBUG, "%s: Trying to deactivate generator\n", gen->chan->name);
 
 		cw_copy_string(name, gen->chan->name, sizeof(name));
-		generator = *gen;
+		job = gen->job;
+		gen->job = NULL;
 		gen->tid = CW_PTHREADT_NULL;
 		cw_clear_flag(gen->chan, CW_FLAG_WRITE_INT);
 
 		cw_channel_unlock(gen->chan);
 
-		pthread_cancel(generator.tid);
-		pthread_join(generator.tid, NULL);
-		generator.class->release(generator.chan, generator.pvt);
-		cw_object_put(generator.class);
+		worker = job->worker;
+
+		cw_mutex_lock(&worker->lock);
+
+		if (worker->current == job) {
+			if (pthread_equal(worker->tid, pthread_self())) {
+				/* Deactivated from within our own generate callback. The
+				 * worker will clean up once the callback returns.
+				 */
+				job->dead = 1;
+				cw_mutex_unlock(&worker->lock);
+				return;
+			}
+
+			while (worker->current == job)
+				cw_cond_wait(&worker->done, &worker->lock);
+		}
+
+		if (job->queued)
+			generator_job_unlink(worker, job);
+		worker->count--;
+
+		cw_mutex_unlock(&worker->lock);
+
+		generator_job_free(job);
 		cw_log(CW_LOG_DEBUG, "%s: Generator stopped\n", name);
 	} else
 		cw_channel_unlock(gen->chan);
@@ -147,6 +352,10 @@ void cw_generator_deactivate(struct cw_generator_instance *gen)
 
 int cw_generator_activate(struct cw_channel *chan, struct cw_generator_instance *gen, struct cw_generator *class, void *params)
 {
+	struct generator_worker *worker;
+	struct cw_generator_job *job;
+	int i;
+
 	cw_channel_lock(chan);
 
 	while (!pthread_equal(gen->tid, CW_PTHREADT_NULL)) {
@@ -156,6 +365,13 @@ int cw_generator_activate(struct cw_channel *chan, struct cw_generator_instance
 	}
 
 	if ((gen->pvt = class->alloc(chan, params))) {
+		if (!nworkers || !(job = malloc(sizeof(*job)))) {
+			cw_log(CW_LOG_ERROR, "%s: unable to start generator: %s\n", chan->name, (nworkers ? "Out of memory" : "no generator workers"));
+			class->release(chan, gen->pvt);
+			cw_channel_unlock(chan);
+			return -1;
+		}
+
 		gen->class = cw_object_get(class);
 
 		/* Generators don't need to take a counted reference to the channel
@@ -166,16 +382,127 @@ int cw_generator_activate(struct cw_channel *chan, struct cw_generator_instance
 		 * held between the channel driver's alloc/free.
 		 */
 		gen->chan = chan;
-		if (cw_pthread_create(&gen->tid, &global_attr_rr, cw_generator_thread, gen)) {
-			cw_log(CW_LOG_ERROR, "%s: unable to start generator thread: %s\n", chan->name, strerror(errno));
-			class->release(chan, gen->pvt);
-			cw_channel_unlock(chan);
-			cw_object_put(class);
-			return -1;
+
+		/* Pick the least loaded worker. The counts may be changing under
+		 * us but an approximate balance is all that's needed.
+		 */
+		worker = &workers[0];
+		for (i = 1; i < nworkers; i++) {
+			if (workers[i].count < worker->count)
+				worker = &workers[i];
 		}
+
+		job->worker = worker;
+		job->inst = gen;
+		job->chan = chan;
+		job->class = gen->class;
+		job->pvt = gen->pvt;
+		job->frame = NULL;
+		job->queued = 0;
+		job->dead = 0;
+
+		gen->job = job;
+		gen->tid = worker->tid;
+
+		cw_mutex_lock(&worker->lock);
+		worker->count++;
+		cw_clock_gettime(global_cond_clock_monotonic, &job->tick);
+		generator_job_insert(worker, job);
+		cw_mutex_unlock(&worker->lock);
 	}
 	/* It's down to the class allocator to log its problem */
 
 	cw_channel_unlock(chan);
 	return 0;
 }
+
+
+static int generator_show(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	struct generator_worker *worker;
+	unsigned int count, total = 0;
+	unsigned long ticks, late, max_late_us;
+	unsigned long long late_us;
+	int i;
+
+	CW_UNUSED(argv);
+
+	if (argc != 2)
+		return RESULT_SHOWUSAGE;
+
+	cw_dynstr_printf(ds_p, "%-6s %10s %14s %10s %14s %14s\n", "Worker", "Generators", "Ticks", "Late", "Avg late (us)", "Max late (us)");
+
+	for (i = 0; i < nworkers; i++) {
+		worker = &workers[i];
+
+		cw_mutex_lock(&worker->lock);
+		count = worker->count;
+		ticks = worker->ticks;
+		late = worker->late;
+		late_us = worker->late_us;
+		max_late_us = worker->max_late_us;
+		cw_mutex_unlock(&worker->lock);
+
+		total += count;
+		cw_dynstr_printf(ds_p, "%-6d %10u %14lu %10lu %14llu %14lu\n", i, count, ticks, late, (late ? late_us / late : 0ULL), max_late_us);
+	}
+
+	cw_dynstr_printf(ds_p, "%u active generator%s on %d worker%s (frames more than %dus late are counted as late)\n",
+		total, (total == 1 ? "" : "s"), nworkers, (nworkers == 1 ? "" : "s"), GENERATOR_LATE_US);
+
+	return RESULT_SUCCESS;
+}
+
+
+static const char generator_show_usage[] =
+"Usage: show generators\n"
+"       Shows the generator worker threads, the number of generators each\n"
+"       is servicing and how many frames were serviced late.\n";
+
+static struct cw_clicmd generator_cli = {
+	.cmda = { "show", "generators", NULL },
+	.handler = generator_show,
+	.summary = "Show generator worker statistics",
+	.usage = generator_show_usage,
+};
+
+
+int cw_generator_init(void)
+{
+	long ncpus;
+	int i;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpus = 1;
+	else if (ncpus > GENERATOR_MAX_WORKERS)
+		ncpus = GENERATOR_MAX_WORKERS;
+
+	if (!(workers = calloc(ncpus, sizeof(*workers)))) {
+		cw_log(CW_LOG_ERROR, "Out of memory!\n");
+		return -1;
+	}
+
+	for (i = 0; i < ncpus; i++) {
+		struct generator_worker *worker = &workers[nworkers];
+
+		cw_mutex_init(&worker->lock);
+		cw_cond_init(&worker->cond, &global_condattr_monotonic);
+		cw_cond_init(&worker->done, NULL);
+
+		if (cw_pthread_create(&worker->tid, &global_attr_rr, generator_worker_thread, worker)) {
+			cw_log(CW_LOG_ERROR, "unable to start generator worker: %s\n", strerror(errno));
+			cw_cond_destroy(&worker->cond);
+			cw_cond_destroy(&worker->done);
+			cw_mutex_destroy(&worker->lock);
+			break;
+		}
+
+		nworkers++;
+	}
+
+	if (!nworkers)
+		return -1;
+
+	cw_cli_register(&generator_cli);
+	return 0;
+}
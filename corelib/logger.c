@@ -45,6 +45,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 
 #define DEBUG_MUTEX_CANLOG 0
 
+#include "callweaver/atomic.h"
 #include "callweaver/dynstr.h"
 #include "callweaver/logger.h"
 #include "callweaver/lock.h"
@@ -331,10 +332,444 @@ static struct logchannel *make_logchannel(char *channel, char *components)
 	return NULL;
 }
 
+/* Put a message out to the log channels (or stdout if there aren't any yet).
+ * The message may be modified to strip leading and trailing line breaks.
+ */
+static void log_emit(const char *date, const struct timespec *now, cw_log_level level, unsigned long tid, const char *file, int line, const char *function, char *msg, int msglen)
+{
+	/* FIXME: strip leading and trailing newlines. Really we need to audit all messages. */
+	for (; *msg == '\n' || *msg == '\r'; msg++,msglen--);
+	while (msglen > 0 && (msg[msglen - 1] == '\n' || msg[msglen - 1] == '\r')) msg[--msglen] = '\0';
+
+	if (logchannels) {
+		cw_manager_event(1 << level, "Log",
+			8,
+			cw_msg_tuple("Timestamp", "%lu.%09lu", (unsigned long)now->tv_sec, (unsigned long)now->tv_nsec),
+			cw_msg_tuple("Date",      "%s",      date),
+			cw_msg_tuple("Level",     "%u %s",   (unsigned int)level, levels[level]),
+			cw_msg_tuple("Thread ID", "%lu",     tid),
+			cw_msg_tuple("File",      "%s",      file),
+			cw_msg_tuple("Line",      "%d",      line),
+			cw_msg_tuple("Function",  "%s",      function),
+			cw_msg_tuple("Message",   "\r\n%s\r\n--END MESSAGE--",  msg)
+		);
+	} else {
+		/* 
+		 * we don't have the logger chain configured yet,
+		 * so just log to stdout 
+		*/
+		if (level != CW_LOG_VERBOSE)
+			fprintf(stdout, "%s %s[%lu]: %s:%d %s: %s\n", date, levels[level], tid, file, line, function, msg);
+	}
+}
+
+
+/* Each thread that logs gets its own ring. The thread captures the record - level,
+ * location, thread, timestamp and formatted message - into its ring and carries on.
+ * The logger thread drains all the rings, merges their records by timestamp, formats
+ * the dates and hands the result on to the log channels.
+ */
+#define LOG_RING_SIZE	(32 * 1024)	/* Must be a power of 2 and hold at least two maximal records */
+#define LOG_MSG_MAX	(BUFSIZ - 1)
+#define LOG_NAME_MAX	1024
+#define LOG_BATCH	256
+
+#define LOG_ALIGN(n)	(((n) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+struct log_record {
+	unsigned int len;		/* Total size of the record. 0 means the rest of the ring is unused */
+	cw_log_level level;
+	int line;
+	unsigned short file_len;
+	unsigned short function_len;
+	unsigned int msg_len;
+	unsigned long tid;
+	struct timespec ts;		/* On global_clock_monotonic */
+	char data[0];			/* file\0function\0message\0 */
+};
+
+struct log_ring {
+	struct log_ring *next;
+	atomic_t r, w;
+	unsigned int r_next;		/* Logger thread private */
+	int dead;			/* The owning thread has gone. Free once drained */
+	char buf[LOG_RING_SIZE];
+};
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_ring_key;
+static struct log_ring *log_rings;
+static atomic_t log_sleeping;
+static atomic_t log_waiters;
+static pthread_t log_thread = CW_PTHREADT_NULL;
+static int log_running;
+
+/* Dates are cached per second unless the format asks for fractions of a second */
+static int log_date_cacheable;
+static time_t log_date_sec = -1;
+static char log_date[256];
+
+
+/* A no-op cmpxchg is a read with a full barrier */
+static inline unsigned int log_ring_pos(atomic_t *pos)
+{
+	int n = atomic_read(pos);
+
+	while (atomic_cmpxchg(pos, n, n) != n)
+		n = atomic_read(pos);
+
+	return (unsigned int)n;
+}
+
+
+static void log_wake(void)
+{
+	if (atomic_read(&log_sleeping)) {
+		pthread_mutex_lock(&log_lock);
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_lock);
+	}
+}
+
+
+static void log_ring_release(void *data)
+{
+	struct log_ring *ring = data;
+
+	pthread_mutex_lock(&log_lock);
+	ring->dead = 1;
+	pthread_mutex_unlock(&log_lock);
+}
+
+
+static void log_ring_key_create(void)
+{
+	pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+
+static struct log_ring *log_ring_get(void)
+{
+	struct log_ring *ring;
+
+	pthread_once(&log_ring_once, log_ring_key_create);
+
+	if (unlikely(!(ring = pthread_getspecific(log_ring_key)))) {
+		/* Only the header is initialized. There's no need to touch
+		 * the buffer pages until they're used.
+		 */
+		if ((ring = malloc(sizeof(*ring)))) {
+			atomic_set(&ring->r, 0);
+			atomic_set(&ring->w, 0);
+			ring->r_next = 0;
+			ring->dead = 0;
+
+			pthread_mutex_lock(&log_lock);
+			ring->next = log_rings;
+			log_rings = ring;
+			pthread_mutex_unlock(&log_lock);
+
+			pthread_setspecific(log_ring_key, ring);
+		}
+	}
+
+	return ring;
+}
+
+
+/* Wait for the logger thread to consume something from the ring */
+static void log_ring_wait(struct log_ring *ring, unsigned int r)
+{
+	pthread_mutex_lock(&log_lock);
+
+	atomic_inc(&log_waiters);
+	pthread_cond_signal(&log_cond);
+	if (log_ring_pos(&ring->r) == r)
+		pthread_cond_wait(&log_drained, &log_lock);
+	atomic_dec(&log_waiters);
+
+	pthread_mutex_unlock(&log_lock);
+}
+
+
+static int log_ring_put(struct log_ring *ring, const char *file, int line, const char *function, cw_log_level level, const char *fmt, va_list ap)
+{
+	struct log_record *rec;
+	size_t file_len, function_len;
+	unsigned int w, r, off, contig, space, fixed, room, need;
+	va_list aq;
+	int n;
+
+	file_len = strlen(file);
+	function_len = strlen(function);
+	if (file_len > LOG_NAME_MAX || function_len > LOG_NAME_MAX)
+		return -1;
+
+	fixed = sizeof(*rec) + file_len + 1 + function_len + 1;
+
+	/* Only we ever move the write position */
+	w = (unsigned int)atomic_read(&ring->w);
+
+	for (;;) {
+		r = log_ring_pos(&ring->r);
+		off = w & (LOG_RING_SIZE - 1);
+		contig = LOG_RING_SIZE - off;
+		space = LOG_RING_SIZE - (w - r);
+		if (space > contig)
+			space = contig;
+
+		need = LOG_ALIGN(fixed + 1);
+
+		if (space >= need) {
+			rec = (struct log_record *)&ring->buf[off];
+
+			room = space - fixed;
+			if (room > LOG_MSG_MAX + 1)
+				room = LOG_MSG_MAX + 1;
+
+			va_copy(aq, ap);
+			n = vsnprintf(rec->data + file_len + 1 + function_len + 1, room, fmt, aq);
+			va_end(aq);
+			if (n < 0) {
+				rec->data[file_len + 1 + function_len + 1] = '\0';
+				n = 0;
+			}
+
+			if (n < room || room == LOG_MSG_MAX + 1) {
+				if (n >= room)
+					n = room - 1;
+
+				rec->level = level;
+				rec->line = line;
+				rec->file_len = file_len;
+				rec->function_len = function_len;
+				rec->msg_len = n;
+				rec->tid = GETTID();
+				cw_clock_gettime(global_clock_monotonic, &rec->ts);
+				memcpy(rec->data, file, file_len + 1);
+				memcpy(rec->data + file_len + 1, function, function_len + 1);
+				rec->len = LOG_ALIGN(fixed + n + 1);
+
+				/* Publish it. The locked op orders the stores above before the position change. */
+				atomic_fetch_and_add(&ring->w, rec->len);
+				return 0;
+			}
+
+			/* We now know how much it really needs */
+			need = LOG_ALIGN(fixed + n + 1);
+		}
+
+		if (contig < need && LOG_RING_SIZE - (w - r) >= contig) {
+			/* It's the end of the buffer that's in the way so skip to the start */
+			((struct log_record *)&ring->buf[off])->len = 0;
+			atomic_fetch_and_add(&ring->w, contig);
+			w += contig;
+		} else {
+			/* Otherwise we have to wait for the logger to catch up */
+			log_ring_wait(ring, r);
+		}
+	}
+}
+
+
+struct log_batch_entry {
+	struct log_record *rec;
+	int seq;
+};
+
+static int log_batch_cmp(const void *a, const void *b)
+{
+	const struct log_batch_entry *ea = a;
+	const struct log_batch_entry *eb = b;
+
+	if (ea->rec->ts.tv_sec != eb->rec->ts.tv_sec)
+		return (ea->rec->ts.tv_sec < eb->rec->ts.tv_sec ? -1 : 1);
+	if (ea->rec->ts.tv_nsec != eb->rec->ts.tv_nsec)
+		return (ea->rec->ts.tv_nsec < eb->rec->ts.tv_nsec ? -1 : 1);
+	return ea->seq - eb->seq;
+}
+
+
+static void log_date_configure(void)
+{
+	const char *p;
+
+	/* If the format has fractions of a second in it we can't cache the date */
+	log_date_cacheable = 1;
+	for (p = dateformat; (p = strchr(p, '%')); ) {
+		p += strspn(p + 1, "-^#_0123456789EO") + 1;
+		if (*p == 'f' || *p == 'L' || *p == 'N')
+			log_date_cacheable = 0;
+		if (*p)
+			p++;
+	}
+
+	log_date_sec = -1;
+}
+
+
+static const char *log_date_format(const struct timespec *now)
+{
+	struct tm tm;
+
+	if (!log_date_cacheable || now->tv_sec != log_date_sec) {
+		localtime_r(&now->tv_sec, &tm);
+		if (!cw_strftime(log_date, sizeof(log_date), dateformat, &tm, now, 0))
+			log_date[0] = '\0';
+		log_date_sec = now->tv_sec;
+	}
+
+	return log_date;
+}
+
+
+static int log_pending(void)
+{
+	struct log_ring *ring;
+
+	for (ring = log_rings; ring; ring = ring->next) {
+		if ((unsigned int)atomic_read(&ring->r) != log_ring_pos(&ring->w))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+static void *logger_thread(void *data)
+{
+	static struct log_batch_entry batch[LOG_BATCH];
+	struct log_ring *ring, **ring_p;
+	struct log_record *rec;
+	struct timespec mono, real, now;
+	unsigned int r, w, off;
+	char *file, *function;
+	int i, n;
+
+	CW_UNUSED(data);
+
+	for (;;) {
+		n = 0;
+
+		pthread_mutex_lock(&log_lock);
+
+		for (ring_p = &log_rings; (ring = *ring_p); ) {
+			r = (unsigned int)atomic_read(&ring->r);
+			w = log_ring_pos(&ring->w);
+
+			if (r == w && ring->dead) {
+				*ring_p = ring->next;
+				free(ring);
+				continue;
+			}
+
+			while (r != w && n < LOG_BATCH) {
+				off = r & (LOG_RING_SIZE - 1);
+				rec = (struct log_record *)&ring->buf[off];
+
+				if (!rec->len) {
+					r += LOG_RING_SIZE - off;
+				} else {
+					batch[n].rec = rec;
+					batch[n].seq = n;
+					n++;
+					r += rec->len;
+				}
+			}
+
+			ring->r_next = r;
+			ring_p = &ring->next;
+		}
+
+		pthread_mutex_unlock(&log_lock);
+
+		if (n) {
+			/* The records are stamped on the monotonic clock so they can be
+			 * merged reliably. The wall clock time is worked out from that.
+			 */
+			cw_clock_gettime(global_clock_monotonic, &mono);
+			cw_clock_gettime(CLOCK_REALTIME, &real);
+
+			qsort(batch, n, sizeof(batch[0]), log_batch_cmp);
+
+			for (i = 0; i < n; i++) {
+				rec = batch[i].rec;
+
+				now.tv_sec = real.tv_sec - (mono.tv_sec - rec->ts.tv_sec);
+				now.tv_nsec = real.tv_nsec - (mono.tv_nsec - rec->ts.tv_nsec);
+				while (now.tv_nsec < 0) {
+					now.tv_nsec += 1000000000L;
+					now.tv_sec--;
+				}
+				while (now.tv_nsec >= 1000000000L) {
+					now.tv_nsec -= 1000000000L;
+					now.tv_sec++;
+				}
+
+				file = rec->data;
+				function = file + rec->file_len + 1;
+				log_emit(log_date_format(&now), &now, rec->level, rec->tid, file, rec->line, function,
+					function + rec->function_len + 1, rec->msg_len);
+			}
+		}
+
+		/* Hand back the space we've finished with and let anyone who's
+		 * waiting for it know.
+		 */
+		pthread_mutex_lock(&log_lock);
+
+		for (ring = log_rings; ring; ring = ring->next) {
+			r = (unsigned int)atomic_read(&ring->r);
+			if (ring->r_next != r)
+				atomic_fetch_and_add(&ring->r, ring->r_next - r);
+		}
+
+		if (atomic_read(&log_waiters))
+			pthread_cond_broadcast(&log_drained);
+
+		if (!n) {
+			atomic_cmpxchg(&log_sleeping, 0, 1);
+			if (!log_pending())
+				pthread_cond_wait(&log_cond, &log_lock);
+			atomic_cmpxchg(&log_sleeping, 1, 0);
+		}
+
+		pthread_mutex_unlock(&log_lock);
+	}
+
+	return NULL;
+}
+
+
+/* Wait for everything logged so far to have been passed on */
+static void log_flush(void)
+{
+	if (!log_running || pthread_equal(pthread_self(), log_thread))
+		return;
+
+	pthread_mutex_lock(&log_lock);
+
+	atomic_inc(&log_waiters);
+	while (log_pending()) {
+		pthread_cond_signal(&log_cond);
+		pthread_cond_wait(&log_drained, &log_lock);
+	}
+	atomic_dec(&log_waiters);
+
+	pthread_mutex_unlock(&log_lock);
+}
+
+
 void close_logger(void)
 {
 	struct logchannel *chan;
- 
+
+	/* Make sure anything already logged gets to the current channels */
+	log_flush();
+
 	cw_mutex_lock(&loglock);
 
 	for (chan = logchannels; chan; chan = chan->next)
@@ -375,6 +810,7 @@ static void init_logger_chain(void)
 		cw_copy_string(dateformat, s, sizeof(dateformat));
 	} else
 		cw_copy_string(dateformat, "%b %e %T", sizeof(dateformat));
+	log_date_configure();
 	if ((s = cw_variable_retrieve(cfg, "general", "queue_log"))) {
 		logfiles.queue_log = cw_true(s);
 	}
@@ -521,6 +957,16 @@ static struct cw_clicmd reload_logger_cli = {
 
 int init_logger(void)
 {
+	int res;
+
+	atomic_set(&log_sleeping, 0);
+	atomic_set(&log_waiters, 0);
+
+	if ((res = cw_pthread_create(&log_thread, &global_attr_detached, logger_thread, NULL)))
+		fprintf(stderr, "Logger Warning: Unable to start logger thread, logging synchronously: %s\n", strerror(res));
+	else
+		log_running = 1;
+
 	/* register the relaod logger cli command */
 	cw_cli_register(&reload_logger_cli);
 	cw_cli_register(&logger_show_channels_cli);
@@ -542,9 +988,10 @@ void cw_log_internal(const char *file, int line, const char *function, cw_log_le
 {
 	char buf[BUFSIZ];
 	char date[256];
-	char *msg;
 	struct tm tm;
 	struct timespec now;
+	struct log_ring *ring;
+	const char *p;
 	va_list ap;
 	int msglen;
 
@@ -557,13 +1004,33 @@ void cw_log_internal(const char *file, int line, const char *function, cw_log_le
 	if (!option_verbose && !option_debug && (level == CW_LOG_DEBUG))
 		return;
 
+	/* If nothing is listening for this level there's no point formatting it */
+	if (logchannels && !cw_manager_event_wanted(1 << level))
+		return;
+
 	/* We only want the base name... */
-	if ((msg = strrchr(file, '/')))
-		file = msg + 1;
+	if ((p = strrchr(file, '/')))
+		file = p + 1;
+
+	if (log_running && !pthread_equal(pthread_self(), log_thread) && (ring = log_ring_get())) {
+		int res;
+
+		va_start(ap, fmt);
+		res = log_ring_put(ring, file, line, function, level, fmt, ap);
+		va_end(ap);
 
+		if (!res) {
+			log_wake();
+			return;
+		}
+	}
+
+	/* If the logger thread isn't available (or this _is_ the logger thread)
+	 * we have to do it all here and now.
+	 */
 	cw_clock_gettime(CLOCK_REALTIME, &now);
 	localtime_r(&now.tv_sec, &tm);
-	if (!(msglen = cw_strftime(date, sizeof(date), dateformat, &tm, &now, 0)))
+	if (!cw_strftime(date, sizeof(date), dateformat, &tm, &now, 0))
 		date[0] = '\0';
 
 	va_start(ap, fmt);
@@ -571,28 +1038,5 @@ void cw_log_internal(const char *file, int line, const char *function, cw_log_le
 		msglen = sizeof(buf) - 1;
 	va_end(ap);
 
-	/* FIXME: strip leading and trailing newlines. Really we need to audit all messages. */
-	for (msg = buf; *msg == '\n' || *msg == '\r'; msg++,msglen--);
-	while (msglen > 0 && (msg[msglen - 1] == '\n' || msg[msglen - 1] == '\r')) msg[--msglen] = '\0';
-
-	if (logchannels) {
-		cw_manager_event(1 << level, "Log",
-			8,
-			cw_msg_tuple("Timestamp", "%lu.%09lu", (unsigned long)now.tv_sec, (unsigned long)now.tv_nsec),
-			cw_msg_tuple("Date",      "%s",      date),
-			cw_msg_tuple("Level",     "%u %s",   (unsigned int)level, levels[level]),
-			cw_msg_tuple("Thread ID", TIDFMT,    GETTID()),
-			cw_msg_tuple("File",      "%s",      file),
-			cw_msg_tuple("Line",      "%d",      line),
-			cw_msg_tuple("Function",  "%s",      function),
-			cw_msg_tuple("Message",   "\r\n%s\r\n--END MESSAGE--",  msg)
-		);
-	} else {
-		/* 
-		 * we don't have the logger chain configured yet,
-		 * so just log to stdout 
-		*/
-		if (level != CW_LOG_VERBOSE)
-			fprintf(stdout, "%s %s[" TIDFMT "]: %s:%d %s: %s\n", date, levels[level], GETTID(), file, line, function, msg);
-	}
+	log_emit(date, &now, level, GETTID(), file, line, function, buf, msglen);
 }
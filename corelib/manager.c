@@ -27,6 +27,7 @@
  */
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <ctype.h>
 #include <errno.h>
 #include <grp.h>
@@ -42,6 +43,7 @@
 
 CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 
+#include "callweaver/atomic.h"
 #include "callweaver/channel.h"
 #include "callweaver/connection.h"
 #include "callweaver/file.h"
@@ -65,6 +67,16 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #define DEFAULT_MANAGER_PORT	5038
 #define DEFAULT_QUEUE_SIZE	1024
 
+/* Events are handed off through a ring of this many slots. This MUST be a power of 2. */
+#define MANAGER_EVENT_RING_SIZE		16384
+/* The dispatcher moves up to this many events from the ring to the sessions at a time */
+#define MANAGER_EVENT_BATCH		64
+/* Session writers pick up to this many queued events at a time */
+#define MANAGER_WRITE_BATCH		32
+
+#define MANAGER_EVENT_CATEGORIES	(sizeof(cw_event_flag) * 8)
+#define BITS_PER_LONG			(sizeof(unsigned long) * 8)
+
 
 struct fast_originate_helper {
 	char tech[256];
@@ -86,6 +98,69 @@ static int displayconnects;
 static int queuesize;
 
 
+/* Events are produced from all over the place, often with channel locks held,
+ * so producers must not wait on sessions. They format the event and push it
+ * into a bounded multi-producer ring. A single dispatcher thread takes batches
+ * from the ring, decides which sessions want each event using per-category
+ * subscriber bitmaps and hands them to the sessions taking each session's lock
+ * once per batch.
+ */
+struct manager_event_slot {
+	atomic_t seq;
+	cw_event_flag category;
+	struct cw_manager_message *msg;
+};
+
+static struct manager_event_slot manager_event_ring[MANAGER_EVENT_RING_SIZE];
+static atomic_t manager_event_tail;
+static unsigned int manager_event_head;
+
+/* The union of the categories at least one session is interested in. Producers
+ * use this to avoid formatting events nobody wants. It is set to ~0 whenever the
+ * set of subscribers changes and narrowed again by the dispatcher.
+ */
+static volatile cw_event_flag manager_event_interest;
+static atomic_t manager_event_gen;
+
+static atomic_t manager_event_sleeping;
+static pthread_mutex_t manager_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t manager_event_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t manager_event_tid = CW_PTHREADT_NULL;
+
+static atomic_t manager_event_overflow;
+static unsigned int manager_event_batches, manager_event_batch_max, manager_event_subscribers;
+
+
+static void manager_event_wake(void)
+{
+	/* The atomic op that preceded this (publishing an event or bumping the
+	 * subscriber generation) is a full barrier and so is the dispatcher's
+	 * setting of the sleeping flag. Either we see it sleeping or it sees
+	 * whatever we just did.
+	 */
+	if (atomic_read(&manager_event_sleeping)) {
+		pthread_mutex_lock(&manager_event_lock);
+		pthread_cond_signal(&manager_event_cond);
+		pthread_mutex_unlock(&manager_event_lock);
+	}
+}
+
+
+/* This must be called whenever a session is added to or removed from the
+ * session registry or has its readperm or send_events changed.
+ */
+static void manager_subscribers_changed(void)
+{
+	/* Until the dispatcher has rebuilt its subscriber list producers must assume
+	 * anything may be wanted. The interest must be widened before the generation
+	 * is bumped so that the dispatcher cannot narrow it again using a stale list.
+	 */
+	manager_event_interest = ~0;
+	atomic_inc(&manager_event_gen);
+	manager_event_wake();
+}
+
+
 struct manager_listener_pvt {
 	struct cw_object obj;
 	int (*handler)(struct mansession *, const struct cw_manager_message *);
@@ -218,9 +293,45 @@ int manager_str_to_eventmask(char *instr)
 }
 
 
+/* Queue a message on a session. The session lock must be held.
+ * If the session's queue is full and the oldest message on it is an event the
+ * oldest event is discarded to make room. Responses are never discarded this
+ * way - if the oldest message is a response the new message is dropped instead.
+ */
+static int manager_session_enqueue(struct mansession *sess, struct cw_manager_message *msg)
+{
+	unsigned int q_w_next;
+
+	q_w_next = (sess->q_w + 1) % sess->q_size;
+
+	if (q_w_next == sess->q_r) {
+		if (!sess->q[sess->q_r]->event) {
+			sess->q_overflow++;
+			cw_object_put(msg);
+			return 1;
+		}
+
+		cw_object_put(sess->q[sess->q_r]);
+		sess->q_r = (sess->q_r + 1) % sess->q_size;
+		sess->q_count--;
+		sess->q_dropped++;
+	}
+
+	if (++sess->q_count > sess->q_max)
+		sess->q_max = sess->q_count;
+
+	sess->q[sess->q_w] = msg;
+
+	if (sess->q_w == sess->q_r)
+		pthread_cond_signal(&sess->activity);
+
+	sess->q_w = q_w_next;
+	return 0;
+}
+
+
 int cw_manager_send(struct mansession *sess, const struct message *req, struct cw_manager_message **resp_p)
 {
-	int q_w_next;
 	int ret = -1;
 
 	if (*resp_p) {
@@ -228,24 +339,7 @@ int cw_manager_send(struct mansession *sess, const struct message *req, struct c
 			pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &sess->lock);
 			pthread_mutex_lock(&sess->lock);
 
-			q_w_next = (sess->q_w + 1) % sess->q_size;
-
-			if (q_w_next != sess->q_r) {
-				if (++sess->q_count > sess->q_max)
-					sess->q_max = sess->q_count;
-
-				sess->q[sess->q_w] = *resp_p;
-
-				if (sess->q_w == sess->q_r)
-					pthread_cond_signal(&sess->activity);
-
-				sess->q_w = q_w_next;
-				ret = 0;
-			} else {
-				sess->q_overflow++;
-				cw_object_put(*resp_p);
-				ret = 1;
-			}
+			ret = manager_session_enqueue(sess, *resp_p);
 
 			pthread_cleanup_pop(1);
 		} else
@@ -504,15 +598,15 @@ struct mansess_print_args {
 	struct cw_dynstr *ds_p;
 };
 
-#define MANSESS_FORMAT_HEADER	"%-40s %-15s %-6s %-9s %-8s\n"
-#define MANSESS_FORMAT_DETAIL	"%-40l@ %-15s %6u %9u %8u\n"
+#define MANSESS_FORMAT_HEADER	"%-40s %-15s %-6s %-9s %-8s %-8s\n"
+#define MANSESS_FORMAT_DETAIL	"%-40l@ %-15s %6u %9u %8u %8u\n"
 
 static int mansess_print(struct cw_object *obj, void *data)
 {
 	struct mansession *it = container_of(obj, struct mansession, obj);
 	struct mansess_print_args *args = data;
 
-	cw_dynstr_printf(args->ds_p, MANSESS_FORMAT_DETAIL, &it->addr, it->username, it->q_count, it->q_max, it->q_overflow);
+	cw_dynstr_printf(args->ds_p, MANSESS_FORMAT_DETAIL, &it->addr, it->username, it->q_count, it->q_max, it->q_overflow, it->q_dropped);
 	return 0;
 }
 
@@ -526,8 +620,8 @@ static int handle_show_mansess(struct cw_dynstr *ds_p, int argc, char *argv[])
 	CW_UNUSED(argv);
 
 	cw_dynstr_tprintf(ds_p, 2,
-		cw_fmtval(MANSESS_FORMAT_HEADER, "Address", "Username", "Queued", "Max Queue", "Overflow"),
-		cw_fmtval(MANSESS_FORMAT_HEADER, "--------", "-------", "------", "---------", "--------")
+		cw_fmtval(MANSESS_FORMAT_HEADER, "Address", "Username", "Queued", "Max Queue", "Overflow", "Dropped"),
+		cw_fmtval(MANSESS_FORMAT_HEADER, "--------", "-------", "------", "---------", "--------", "-------")
 	);
 
 	cw_registry_iterate_ordered(&manager_session_registry, mansess_print, &args);
@@ -536,6 +630,41 @@ static int handle_show_mansess(struct cw_dynstr *ds_p, int argc, char *argv[])
 }
 
 
+static const char showmanevents_help[] =
+"Usage: show manager eventbus\n"
+"	Shows the state of the queue that distributes events to manager sessions.\n"
+"	Events are dropped here if the dispatcher cannot keep up with the rate at\n"
+"	which they are produced. Events that a session could not keep up with are\n"
+"	shown as Dropped by \"show manager connected\".\n";
+
+static int handle_show_manevents(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	unsigned int tail, head;
+
+	CW_UNUSED(argc);
+	CW_UNUSED(argv);
+
+	tail = (unsigned int)atomic_read(&manager_event_tail);
+	head = manager_event_head;
+
+	cw_dynstr_printf(ds_p,
+		"Events queued:      %u\n"
+		"Events dispatched:  %u\n"
+		"Events overflowed:  %u\n"
+		"Ring depth:         %u/%u\n"
+		"Batches:            %u (largest %u)\n"
+		"Sessions:           %u\n"
+		"Interest:           0x%08x\n",
+		tail, head, (unsigned int)atomic_read(&manager_event_overflow),
+		tail - head, MANAGER_EVENT_RING_SIZE,
+		manager_event_batches, manager_event_batch_max,
+		manager_event_subscribers,
+		(unsigned int)manager_event_interest);
+
+	return RESULT_SUCCESS;
+}
+
+
 static struct cw_clicmd clicmds[] = {
 	{
 		.cmda = { "show", "manager", "command", NULL },
@@ -563,6 +692,12 @@ static struct cw_clicmd clicmds[] = {
 		.summary = "Show connected manager interface users",
 		.usage = showmanconn_help,
 	},
+	{
+		.cmda = { "show", "manager", "eventbus", NULL },
+		.handler = handle_show_manevents,
+		.summary = "Show manager event distribution statistics",
+		.usage = showmanevents_help,
+	},
 };
 
 
@@ -704,6 +839,8 @@ static struct cw_manager_message *authenticate(struct mansession *sess, const st
 
 			pthread_mutex_unlock(&sess->lock);
 
+			manager_subscribers_changed();
+
 			sess->authenticated = 1;
 			if (option_verbose > 3 && displayconnects)
 				cw_verbose(VERBOSE_PREFIX_2 "Manager '%s' logged on from %l@\n", sess->username, &sess->addr);
@@ -817,6 +954,8 @@ static struct cw_manager_message *action_events(struct mansession *sess, const s
 
 		pthread_mutex_unlock(&sess->lock);
 
+		manager_subscribers_changed();
+
 		msg = cw_manager_response((eventmask ? "Events On" : "Events Off"), NULL);
 	} else
 		msg = cw_manager_response("Error", "Required header \"Mask\" missing");
@@ -1381,6 +1520,31 @@ static struct cw_manager_message *action_mailboxcount(struct mansession *sess, c
 	return msg;
 }
 
+static const char mandescr_userevent[] =
+"Description: Send an event to every manager session that wants user events.\n"
+"Variables: (Names marked with * are required)\n"
+"	*UserEvent: Name of the event\n"
+"The event sent is:\n"
+"	Event: UserEvent\n"
+"	UserEvent: <name>\n"
+"\n";
+static struct cw_manager_message *action_userevent(struct mansession *sess, const struct message *req)
+{
+	char *event = cw_manager_msg_header(req, "UserEvent");
+
+	CW_UNUSED(sess);
+
+	if (cw_strlen_zero(event))
+		return cw_manager_response("Error", "UserEvent not specified");
+
+	cw_manager_event(CW_EVENT_FLAG_USER, "UserEvent",
+		1,
+		cw_msg_tuple("UserEvent", "%s", event)
+	);
+
+	return cw_manager_response("Success", "Event sent");
+}
+
 static const char mandescr_extensionstate[] =
 "Description: Report the extension state for given extension.\n"
 "  If the extension has a hint, will use devicestate to check\n"
@@ -1628,8 +1792,10 @@ static void manager_session_cleanup(void *data)
 {
 	struct mansession *sess = data;
 
-	if (sess->reg_entry)
+	if (sess->reg_entry) {
 		cw_registry_del(&manager_session_registry, sess->reg_entry);
+		manager_subscribers_changed();
+	}
 
 	if (sess->authenticated) {
 		if (sess->username[0]) {
@@ -1654,13 +1820,14 @@ static void *manager_session(void *data)
 	static const int off = 0;
 	struct mansession *sess = data;
 	struct manager_listener_pvt *pvt;
-	int res;
+	int i, res;
 
 	sess->reader_tid = CW_PTHREADT_NULL;
 
 	pthread_cleanup_push(manager_session_cleanup, sess);
 
 	sess->reg_entry = cw_registry_add(&manager_session_registry, 0, &sess->obj);
+	manager_subscribers_changed();
 
 	/* If there is an fd already supplied we will read AMI requests from it */
 	if (sess->fd >= 0) {
@@ -1682,7 +1849,8 @@ static void *manager_session(void *data)
 	}
 
 	for (;;) {
-		struct cw_manager_message *event = NULL;
+		struct cw_manager_message *event[MANAGER_WRITE_BATCH];
+		int nevents = 0;
 
 		pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &sess->lock);
 		pthread_mutex_lock(&sess->lock);
@@ -1706,11 +1874,11 @@ static void *manager_session(void *data)
 			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 		}
 
-		/* Fetch the next event (if any) now. Once we have that
+		/* Fetch the next few events (if any) now. Once we have them
 		 * we can unlock the session.
 		 */
-		if (sess->q_r != sess->q_w) {
-			event = sess->q[sess->q_r];
+		while (nevents < arraysize(event) && sess->q_r != sess->q_w) {
+			event[nevents++] = sess->q[sess->q_r];
 			sess->q_r = (sess->q_r + 1) % sess->q_size;
 			sess->q_count--;
 		}
@@ -1729,10 +1897,29 @@ static void *manager_session(void *data)
 			pthread_cleanup_pop(1);
 		}
 
-		if (event) {
-			if ((res = sess->handler(sess, event)) < 0)
+		if (nevents) {
+			/* Plain AMI sessions get everything in one write. Anything
+			 * else goes through its handler one event at a time.
+			 */
+			if (sess->handler == manager_session_ami) {
+				struct iovec iov[MANAGER_WRITE_BATCH];
+
+				for (i = 0; i < nevents; i++) {
+					iov[i].iov_base = event[i]->ds.data;
+					iov[i].iov_len = event[i]->ds.used;
+				}
+				res = cw_writev_all(sess->fd, iov, nevents);
+			} else {
+				for (i = 0, res = 0; i < nevents && res >= 0; i++)
+					res = sess->handler(sess, event[i]);
+			}
+
+			if (res < 0)
 				cw_log(CW_LOG_WARNING, "Disconnecting manager session %l@, handler gave: %s\n", &sess->addr, strerror(errno));
-			cw_object_put(event);
+
+			for (i = 0; i < nevents; i++)
+				cw_object_put(event[i]);
+
 			if (res < 0)
 				break;
 		}
@@ -1793,6 +1980,7 @@ void manager_session_shutdown(struct mansession *sess)
 {
 	/* Do not send any more events */
 	sess->send_events = 0;
+	manager_subscribers_changed();
 
 	/* If there is a reader tell it to stop handling incoming requests */
 	if (!pthread_equal(sess->reader_tid, CW_PTHREADT_NULL))
@@ -1869,6 +2057,7 @@ static struct cw_manager_message *make_msg(size_t initsize, size_t chunk, size_t
 		cw_dynstr_init(&msg->ds, initsize, chunk);
 		cw_dynstr_vprintf(&msg->ds, fmt, ap);
 		msg->count = count;
+		msg->event = 0;
 		memcpy(msg->map , map, ((count << 1) + 1) * sizeof(msg->map[0]));
 	}
 
@@ -1892,48 +2081,269 @@ int cw_manager_msg_func(struct cw_manager_message **msg_p, size_t count, int map
 }
 
 
-struct manager_event_args {
-	int category;
-	size_t count;
-	struct cw_manager_message *msg;
-	int *map;
-	const char *fmt;
-	va_list ap;
-};
+/* Ring positions are free running and wrap. These keep the arithmetic unsigned. */
+#define RING_POS_ADD(pos, n)	((int)((unsigned int)(pos) + (unsigned int)(n)))
+#define RING_POS_DIFF(a, b)	((int)((unsigned int)(a) - (unsigned int)(b)))
 
-static int manager_event_print(struct cw_object *obj, void *data)
+static int manager_event_push(cw_event_flag category, struct cw_manager_message *msg)
 {
-	struct mansession *it = container_of(obj, struct mansession, obj);
-	struct manager_event_args *args = data;
+	struct manager_event_slot *slot;
+	int pos, seq;
+
+	pos = atomic_read(&manager_event_tail);
+
+	for (;;) {
+		slot = &manager_event_ring[(unsigned int)pos & (MANAGER_EVENT_RING_SIZE - 1)];
+		seq = atomic_read(&slot->seq);
 
-	if ((it->readperm & args->category) == args->category && (it->send_events & args->category) == args->category) {
-		if (args->msg || (args->msg = make_msg(0, 1, args->count, args->map, args->fmt, args->ap))) {
-			struct cw_manager_message *msg = cw_object_dup(args->msg);
-			cw_manager_send(it, NULL, &msg);
+		if (seq == pos) {
+			/* The slot is free. Try and claim it. */
+			if (atomic_cmpxchg(&manager_event_tail, pos, RING_POS_ADD(pos, 1)) == pos)
+				break;
+		} else if (RING_POS_DIFF(seq, pos) < 0) {
+			/* The slot still holds an event from the previous lap. We're full. */
+			atomic_inc(&manager_event_overflow);
+			return -1;
 		}
+
+		pos = atomic_read(&manager_event_tail);
 	}
 
+	slot->category = category;
+	slot->msg = msg;
+
+	/* Publish it. The locked op orders the stores above before the sequence change. */
+	atomic_inc(&slot->seq);
+
+	manager_event_wake();
 	return 0;
 }
 
-void cw_manager_event_func(cw_event_flag category, size_t count, int map[], const char *fmt, ...)
+
+static struct manager_event_slot *manager_event_peek(void)
 {
-	struct manager_event_args args = {
-		.count = count,
-		.msg = NULL,
-		.category = category,
-		.map = map,
-		.fmt = fmt,
-	};
+	struct manager_event_slot *slot = &manager_event_ring[manager_event_head & (MANAGER_EVENT_RING_SIZE - 1)];
+	int ready = RING_POS_ADD(manager_event_head, 1);
+
+	/* A no-op cmpxchg is a read of the sequence with a full barrier so the slot's
+	 * contents are not read before we know they have been published.
+	 */
+	return (atomic_cmpxchg(&slot->seq, ready, ready) == ready ? slot : NULL);
+}
+
+
+struct manager_subscribers {
+	int gen;
+	unsigned int n, size, words;
+	struct mansession **sess;
+	unsigned long *map;		/* One bitmap of sessions for each event category bit */
+	unsigned long *match;		/* One bitmap of sessions for each event in a batch */
+};
+
+static int manager_subscribers_add(struct cw_object *obj, void *data)
+{
+	struct mansession *sess = container_of(obj, struct mansession, obj);
+	struct manager_subscribers *subs = data;
+
+	/* Every session is listed, even one that has turned events off, because
+	 * an event with no category bits goes to all of them.
+	 */
+	if (subs->n == subs->size) {
+		struct mansession **n;
+
+		if (!(n = realloc(subs->sess, (subs->size + 64) * sizeof(subs->sess[0]))))
+			return 1;
+		subs->sess = n;
+		subs->size += 64;
+	}
+
+	subs->sess[subs->n++] = cw_object_dup(sess);
+	return 0;
+}
+
+static void manager_subscribers_rebuild(struct manager_subscribers *subs)
+{
+	cw_event_flag interest;
+	unsigned int i, b, mask;
+	int gen, err;
+
+	do {
+		gen = atomic_read(&manager_event_gen);
+
+		for (i = 0; i < subs->n; i++)
+			cw_object_put(subs->sess[i]);
+		subs->n = 0;
+
+		err = cw_registry_iterate(&manager_session_registry, manager_subscribers_add, subs);
+
+		free(subs->map);
+		subs->map = subs->match = NULL;
+		subs->words = (subs->n + BITS_PER_LONG - 1) / BITS_PER_LONG;
+		if (subs->words) {
+			if ((subs->map = calloc(subs->words * (MANAGER_EVENT_CATEGORIES + MANAGER_EVENT_BATCH), sizeof(subs->map[0]))))
+				subs->match = subs->map + subs->words * MANAGER_EVENT_CATEGORIES;
+			else
+				err = 1;
+		}
+
+		interest = 0;
+		if (subs->map) {
+			for (i = 0; i < subs->n; i++) {
+				mask = subs->sess[i]->readperm & subs->sess[i]->send_events;
+				interest |= mask;
+				for (b = 0; mask; b++, mask >>= 1) {
+					if ((mask & 1))
+						subs->map[b * subs->words + i / BITS_PER_LONG] |= 1UL << (i % BITS_PER_LONG);
+				}
+			}
+		}
+
+		/* If we couldn't see everyone producers have to carry on assuming
+		 * anything might be wanted.
+		 */
+		if (!err)
+			manager_event_interest = interest;
+
+		/* If anything changed while we were looking we need to look again */
+	} while (atomic_read(&manager_event_gen) != gen);
+
+	subs->gen = gen;
+	manager_event_subscribers = subs->n;
+
+	if (err)
+		cw_log(CW_LOG_ERROR, "Out of memory building manager event subscriber list\n");
+}
+
+
+static void manager_event_dispatch(struct manager_subscribers *subs, struct manager_event_slot batch[], int count)
+{
+	unsigned long *match, bits;
+	unsigned int b, w, cat;
+	int i, j;
+
+	/* A session wants an event if it has every one of the event's category
+	 * bits set so each event's set of sessions is the intersection of the
+	 * bitmaps for its category bits.
+	 */
+	for (j = 0; j < count; j++) {
+		match = subs->match + j * subs->words;
+
+		for (w = 0; w < subs->words; w++)
+			match[w] = ~0UL;
+
+		for (cat = batch[j].category, b = 0; cat; b++, cat >>= 1) {
+			if ((cat & 1)) {
+				for (w = 0; w < subs->words; w++)
+					match[w] &= subs->map[b * subs->words + w];
+			}
+		}
+	}
+
+	/* Then each session with something to receive is locked once per batch */
+	for (i = 0; i < subs->n; i++) {
+		struct mansession *sess = NULL;
+
+		w = i / BITS_PER_LONG;
+		bits = 1UL << (i % BITS_PER_LONG);
 
-	va_start(args.ap, fmt);
+		for (j = 0; j < count; j++) {
+			if ((subs->match[j * subs->words + w] & bits)) {
+				if (!sess) {
+					sess = subs->sess[i];
+					pthread_mutex_lock(&sess->lock);
+				}
+				manager_session_enqueue(sess, cw_object_dup(batch[j].msg));
+			}
+		}
+
+		if (sess)
+			pthread_mutex_unlock(&sess->lock);
+	}
+}
+
+
+static void *manager_event_dispatcher(void *data)
+{
+	struct manager_subscribers subs;
+	struct manager_event_slot batch[MANAGER_EVENT_BATCH];
+	struct manager_event_slot *slot;
+	int count, i;
+
+	CW_UNUSED(data);
+
+	memset(&subs, 0, sizeof(subs));
+	subs.gen = atomic_read(&manager_event_gen) - 1;
+
+	for (;;) {
+		if (subs.gen != atomic_read(&manager_event_gen))
+			manager_subscribers_rebuild(&subs);
+
+		for (count = 0; count < MANAGER_EVENT_BATCH && (slot = manager_event_peek()); count++) {
+			batch[count] = *slot;
+			/* Hand the slot back for use on the next lap */
+			atomic_fetch_and_add(&slot->seq, MANAGER_EVENT_RING_SIZE - 1);
+			manager_event_head++;
+		}
+
+		if (count) {
+			if (subs.match)
+				manager_event_dispatch(&subs, batch, count);
+
+			for (i = 0; i < count; i++)
+				cw_object_put(batch[i].msg);
+
+			manager_event_batches++;
+			if (count > manager_event_batch_max)
+				manager_event_batch_max = count;
+		} else {
+			pthread_mutex_lock(&manager_event_lock);
+
+			atomic_cmpxchg(&manager_event_sleeping, 0, 1);
+			if (!manager_event_peek() && subs.gen == atomic_read(&manager_event_gen))
+				pthread_cond_wait(&manager_event_cond, &manager_event_lock);
+			atomic_cmpxchg(&manager_event_sleeping, 1, 0);
+
+			pthread_mutex_unlock(&manager_event_lock);
+		}
+	}
 
-	cw_registry_iterate(&manager_session_registry, manager_event_print, &args);
+	return NULL;
+}
+
+
+int cw_manager_event_wanted(cw_event_flag category)
+{
+	cw_event_flag interest = manager_event_interest;
+
+	/* An event with no category goes to every session whatever it asked for */
+	if (!category)
+		return 1;
+
+	return ((interest & category) == category);
+}
+
+
+void cw_manager_event_func(cw_event_flag category, size_t count, int map[], const char *fmt, ...)
+{
+	struct cw_manager_message *msg;
+	va_list ap;
+
+	/* If nobody wants it there is no point formatting it */
+	if (!cw_manager_event_wanted(category))
+		return;
 
-	va_end(args.ap);
+	/* The args are only valid for the duration of this call so the event has to be
+	 * formatted here. It is formatted once and shared by all the sessions it goes to.
+	 */
+	va_start(ap, fmt);
+	msg = make_msg(0, 1, count, map, fmt, ap);
+	va_end(ap);
 
-	if (args.msg)
-		cw_object_put(args.msg);
+	if (msg) {
+		msg->event = 1;
+		if (manager_event_push(category, msg))
+			cw_object_put(msg);
+	}
 }
 
 static int manager_state_cb(char *context, char *exten, int state, void *data)
@@ -2063,6 +2473,13 @@ static struct manager_action manager_actions[] = {
 		.synopsis = "Check Mailbox Message Count",
 		.description = mandescr_mailboxcount,
 	},
+	{
+		.action = "UserEvent",
+		.authority = CW_EVENT_FLAG_USER,
+		.func = action_userevent,
+		.synopsis = "Send an arbitrary event",
+		.description = mandescr_userevent,
+	},
 	{
 		.action = "ListCommands",
 		.authority = 0,
@@ -2313,6 +2730,20 @@ int manager_reload(void)
 
 int init_manager(void)
 {
+	int i, res;
+
+	for (i = 0; i < MANAGER_EVENT_RING_SIZE; i++)
+		atomic_set(&manager_event_ring[i].seq, i);
+	atomic_set(&manager_event_tail, 0);
+	atomic_set(&manager_event_gen, 0);
+	atomic_set(&manager_event_sleeping, 0);
+	atomic_set(&manager_event_overflow, 0);
+
+	if ((res = cw_pthread_create(&manager_event_tid, &global_attr_detached, manager_event_dispatcher, NULL))) {
+		cw_log(CW_LOG_ERROR, "Unable to start manager event dispatcher: %s\n", strerror(res));
+		return -1;
+	}
+
 	manager_reload();
 
 	cw_manager_action_register_multiple(manager_actions, arraysize(manager_actions));
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
@@ -37,6 +38,7 @@
 
 CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 
+#include "callweaver/atomic.h"
 #include "callweaver/lock.h"
 #include "callweaver/cli.h"
 #include "callweaver/switch.h"
@@ -77,6 +79,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 
 
 struct cw_context;
+struct exten_matcher;
 
 /* cw_exten: An extension */
 struct cw_exten
@@ -135,6 +138,9 @@ struct cw_context
     unsigned int hash;            /* Hashed context name */
     struct cw_exten *root;    /* The root of the list of extensions */
     struct cw_context *next;    /* Link them together */
+    struct cw_context *hash_next;    /* Next context in the same hash bucket */
+    struct exten_matcher *matcher;    /* Compiled form of the extension list */
+    int linear;                 /* Search linearly until the extensions next change */
     struct cw_include *includes;    /* Include other contexts */
     struct cw_ignorepat *ignorepats;    /* Patterns for which to continue playing dialtone */
     const char *registrar;        /* Registrar */
@@ -169,6 +175,10 @@ static int countcalls = 0;
 pthread_rwlock_t conlock;
 static struct cw_context *contexts = NULL;
 
+/* Live contexts are also hashed by name, protected by conlock */
+#define CONTEXT_BUCKETS 512
+static struct cw_context *context_table[CONTEXT_BUCKETS];
+
 CW_MUTEX_DEFINE_STATIC(hintlock);        /* Lock for extension state notifys */
 static int stateid = 1;
 struct cw_hint *hints = NULL;
@@ -464,19 +474,48 @@ static int cw_extension_match(const char *pattern, const char *data)
     return (match == EXTENSION_MATCH_EXACT  ||  match == EXTENSION_MATCH_STRETCHABLE)  ?  1  :  0;
 }
 
+/* The context hash table mirrors the contexts list and is only changed
+ * with conlock write locked.
+ */
+static void context_table_add(struct cw_context *con)
+{
+	struct cw_context **bucket = &context_table[con->hash % CONTEXT_BUCKETS];
+
+	con->hash_next = *bucket;
+	*bucket = con;
+}
+
+static void context_table_del(struct cw_context *con)
+{
+	struct cw_context **p;
+
+	for (p = &context_table[con->hash % CONTEXT_BUCKETS]; *p; p = &(*p)->hash_next) {
+		if (*p == con) {
+			*p = con->hash_next;
+			break;
+		}
+	}
+}
+
+/* Caller must hold conlock */
+static struct cw_context *context_lookup(const char *name, unsigned int hash)
+{
+	struct cw_context *tmp;
+
+	for (tmp = context_table[hash % CONTEXT_BUCKETS]; tmp; tmp = tmp->hash_next)
+		if (hash == tmp->hash && !strcmp(name, tmp->name))
+			break;
+
+	return tmp;
+}
+
 struct cw_context *cw_context_find(const char *name)
 {
 	struct cw_context *tmp;
-	unsigned int hash;
-    
+
 	if (name) {
 		pthread_rwlock_rdlock(&conlock);
-
-		hash = cw_hash_string(0, name);
-		for (tmp = contexts; tmp; tmp = tmp->next)
-			if (hash == tmp->hash && !strcmp(name, tmp->name))
-				break;
-
+		tmp = context_lookup(name, cw_hash_string(0, name));
 		pthread_rwlock_unlock(&conlock);
 	} else
 		tmp = contexts;
@@ -508,15 +547,592 @@ static int matchcid(const char *cidpattern, const char *callerid)
     return 0;
 }
 
+/* Compiled extension matching.
+ *
+ * A context's extension list is compiled into two tries. Literal
+ * extensions go into a trie keyed on their characters. Since the list
+ * keeps literals first and in strcmp order, every node of that trie
+ * covers a contiguous run of the list. Patterns go into a trie keyed on
+ * their tokens (character classes, ignored separators) with the
+ * terminal '.', '~' and '!' wildcards and the end of the pattern as
+ * leaves, and the dialled string is run through it as an NFA. Either
+ * way the cost of a lookup depends on the length of the dialled string
+ * and the number of patterns still alive rather than on the size of the
+ * context.
+ *
+ * The candidates found are judged by exten_try() exactly as the linear
+ * scan judges every extension. The order of candidates only matters for
+ * lookups that pick an extension to use. Those lookups sort their
+ * candidates back into dialplan order. Lookups that only ask whether
+ * anything could match stop at the first hit.
+ *
+ * Matchers are built when contexts are merged into the live dialplan.
+ * Any change to a context's extensions discards its matcher, and a new
+ * one is built by the next lookup.
+ */
+
+#define EXTEN_MATCHER_MIN	8	/* Contexts smaller than this are simply scanned */
+#define EXTEN_MATCHER_BLOCK	16384
+#define EXTEN_MATCH_ACTIVE	64	/* Most pattern states alive at once */
+#define EXTEN_MATCH_CANDIDATES	32	/* Most candidates gathered by an ordered lookup */
+
+#define EXTEN_CLASS_SET(class, c)	((class)[(unsigned char)(c) >> 3] |= (1 << ((unsigned char)(c) & 7)))
+#define EXTEN_CLASS_HAS(class, c)	((class)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+enum exten_ptok {
+	PTOK_END,		/* '\0' or '/' */
+	PTOK_POSSIBLE,		/* '!' */
+	PTOK_STRETCH,		/* '.' or '~' */
+	PTOK_BAD,		/* '[' with no closing ']' */
+	PTOK_IGNORE,		/* ' ' or '-' */
+	PTOK_CLASS,		/* Anything that consumes a character */
+};
+
+struct exten_lnode {
+	struct exten_lnode *child;
+	struct exten_lnode *sibling;
+	struct cw_exten *first;		/* First extension at or below this node */
+	struct cw_exten *last;		/* Last extension at or below this node */
+	unsigned int count;		/* Extensions at or below this node */
+	unsigned int here;		/* How many of those end at this node */
+	char c;
+};
+
+struct exten_pterm {
+	struct exten_pterm *next;
+	struct cw_exten *exten;
+	unsigned int ordinal;		/* Position in the context's extension list */
+	enum exten_ptok kind;
+};
+
+struct exten_pnode {
+	struct exten_pnode *child;
+	struct exten_pnode *sibling;
+	struct exten_pterm *terms;	/* Patterns that end at this node */
+	int ignore;			/* The edge into this node consumes nothing */
+	unsigned char class[32];	/* Characters the edge into this node accepts */
+};
+
+struct exten_matcher_block {
+	struct exten_matcher_block *next;
+	size_t used;
+	char data[EXTEN_MATCHER_BLOCK];
+};
+
+struct exten_matcher {
+	atomic_t refs;
+	struct exten_matcher_block *blocks;
+	struct exten_lnode lroot;
+	struct exten_pnode proot;
+};
+
+struct exten_cand {
+	struct cw_exten *exten;
+	unsigned int ordinal;
+	int match;
+};
+
+struct exten_search {
+	int action;
+	int priority;
+	const char *label;
+	const char *callerid;
+	int *status;
+	struct cw_exten *earlymatch;
+	struct cw_exten *found;
+	struct exten_cand *cand;
+	unsigned int ncand;
+};
+
+
+static void *exten_matcher_alloc(struct exten_matcher *m, size_t size)
+{
+	struct exten_matcher_block *b = m->blocks;
+	void *p;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!b || b->used + size > sizeof(b->data)) {
+		if (!(b = malloc(sizeof(*b))))
+			return NULL;
+		b->used = 0;
+		b->next = m->blocks;
+		m->blocks = b;
+	}
+
+	p = b->data + b->used;
+	b->used += size;
+	memset(p, 0, size);
+	return p;
+}
+
+static void exten_matcher_put(struct exten_matcher *m)
+{
+	struct exten_matcher_block *b;
+
+	if (m && atomic_dec_and_test(&m->refs)) {
+		while ((b = m->blocks)) {
+			m->blocks = b->next;
+			free(b);
+		}
+		atomic_destroy(&m->refs);
+		free(m);
+	}
+}
+
+/* Reads one token of a pattern as cw_extension_pattern_match() sees it.
+ * For PTOK_CLASS the accepted characters are returned in class.
+ */
+static enum exten_ptok exten_pattern_token(const char **pp, unsigned char *class)
+{
+	const char *p = *pp;
+	const char *where;
+	int i, limit, c;
+
+	memset(class, 0, 32);
+
+	switch (toupper(*p)) {
+	case '\0':
+	case '/':
+		return PTOK_END;
+	case '.':
+	case '~':
+		return PTOK_STRETCH;
+	case '!':
+		return PTOK_POSSIBLE;
+	case ' ':
+	case '-':
+		*pp = p + 1;
+		return PTOK_IGNORE;
+	case '[':
+		if (!(where = strchr(++p, ']')))
+			return PTOK_BAD;
+		limit = (int)(where - p);
+		for (i = 0; i < limit; i++) {
+			if (i < limit - 2 && p[i + 1] == '-') {
+				for (c = CHAR_MIN; c <= CHAR_MAX; c++)
+					if (c >= p[i] && c <= p[i + 2])
+						EXTEN_CLASS_SET(class, c);
+				i += 2;
+			} else
+				EXTEN_CLASS_SET(class, p[i]);
+		}
+		p = where;
+		break;
+	case 'X':
+		for (c = '0'; c <= '9'; c++)
+			EXTEN_CLASS_SET(class, c);
+		break;
+	case 'Z':
+		for (c = '1'; c <= '9'; c++)
+			EXTEN_CLASS_SET(class, c);
+		break;
+	case 'N':
+		for (c = '2'; c <= '9'; c++)
+			EXTEN_CLASS_SET(class, c);
+		break;
+	default:
+		EXTEN_CLASS_SET(class, *p);
+		break;
+	}
+
+	*pp = p + 1;
+	return PTOK_CLASS;
+}
+
+static int exten_lnode_add(struct exten_lnode *node, struct cw_exten *e)
+{
+	if (node->count) {
+		/* Each node must cover a contiguous run of the list */
+		if (node->last->next != e)
+			return -1;
+	} else
+		node->first = e;
+
+	node->last = e;
+	node->count++;
+	return 0;
+}
+
+static int exten_matcher_add_literal(struct exten_matcher *m, struct cw_exten *e)
+{
+	struct exten_lnode *node = &m->lroot;
+	struct exten_lnode *child;
+	const char *p;
+
+	if (exten_lnode_add(node, e))
+		return -1;
+
+	for (p = e->exten; *p; p++) {
+		for (child = node->child; child && child->c != *p; child = child->sibling);
+		if (!child) {
+			if (!(child = exten_matcher_alloc(m, sizeof(*child))))
+				return -1;
+			child->c = *p;
+			child->sibling = node->child;
+			node->child = child;
+		}
+		node = child;
+		if (exten_lnode_add(node, e))
+			return -1;
+	}
+
+	/* Extensions that end here must come before any that carry on */
+	if (node->here != node->count - 1)
+		return -1;
+	node->here++;
+	return 0;
+}
+
+static int exten_matcher_add_pattern(struct exten_matcher *m, struct cw_exten *e, unsigned int ordinal)
+{
+	unsigned char class[32];
+	struct exten_pnode *node = &m->proot;
+	struct exten_pnode *child;
+	struct exten_pterm *term;
+	const char *p = e->exten + 1;
+	enum exten_ptok tok;
+
+	while ((tok = exten_pattern_token(&p, class)) >= PTOK_IGNORE) {
+		for (child = node->child; child; child = child->sibling)
+			if (child->ignore == (tok == PTOK_IGNORE) && !memcmp(child->class, class, sizeof(class)))
+				break;
+		if (!child) {
+			if (!(child = exten_matcher_alloc(m, sizeof(*child))))
+				return -1;
+			child->ignore = (tok == PTOK_IGNORE);
+			memcpy(child->class, class, sizeof(class));
+			child->sibling = node->child;
+			node->child = child;
+		}
+		node = child;
+	}
+
+	if (tok == PTOK_BAD)
+		cw_log(CW_LOG_WARNING, "Bad usage of [] in extension pattern '%s'\n", e->exten);
+
+	if (!(term = exten_matcher_alloc(m, sizeof(*term))))
+		return -1;
+	term->exten = e;
+	term->ordinal = ordinal;
+	term->kind = tok;
+	term->next = node->terms;
+	node->terms = term;
+	return 0;
+}
+
+/* Caller must hold con->lock */
+static struct exten_matcher *exten_matcher_build(struct cw_context *con)
+{
+	struct exten_matcher *m;
+	struct cw_exten *e;
+	unsigned int ordinal;
+	int patterns = 0;
+
+	for (e = con->root, ordinal = 0; e && ordinal < EXTEN_MATCHER_MIN; e = e->next, ordinal++);
+	if (ordinal < EXTEN_MATCHER_MIN)
+		return NULL;
+
+	if (!(m = calloc(1, sizeof(*m)))) {
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+		return NULL;
+	}
+	atomic_set(&m->refs, 1);
+
+	for (e = con->root, ordinal = 0; e; e = e->next, ordinal++) {
+		if (e->exten[0] == '_') {
+			patterns = 1;
+			if (exten_matcher_add_pattern(m, e, ordinal))
+				goto fail;
+		} else if (patterns || exten_matcher_add_literal(m, e))
+			goto fail;
+	}
+
+	return m;
+
+fail:
+	cw_log(CW_LOG_WARNING, "Unable to compile context '%s', it will be searched linearly\n", con->name);
+	exten_matcher_put(m);
+	return NULL;
+}
+
+/* Caller must hold con->lock */
+static void exten_matcher_invalidate(struct cw_context *con)
+{
+	exten_matcher_put(con->matcher);
+	con->matcher = NULL;
+	con->linear = 0;
+}
+
+static struct exten_matcher *exten_matcher_get(struct cw_context *con)
+{
+	struct exten_matcher *m;
+
+	if (con->linear)
+		return NULL;
+
+	cw_mutex_lock(&con->lock);
+
+	if (!con->matcher && !con->linear && !(con->matcher = exten_matcher_build(con)))
+		con->linear = 1;
+
+	if ((m = con->matcher))
+		atomic_inc(&m->refs);
+
+	cw_mutex_unlock(&con->lock);
+	return m;
+}
+
+/* Judges one extension exactly as the linear scan in pbx_find_extension
+ * always has. Returns the priority to use if it is the one.
+ */
+static struct cw_exten *exten_try(struct exten_search *s, struct cw_exten *eroot, int match)
+{
+	struct cw_exten *e;
+	int res = 0;
+
+	if (!(eroot->matchcid && !matchcid(eroot->cidmatch, s->callerid))) {
+		switch (s->action) {
+		case HELPER_EXISTS:
+		case HELPER_EXEC:
+		case HELPER_FINDLABEL:
+			/* We are only interested in exact matches */
+			res = (match == EXTENSION_MATCH_POSSIBLE || match == EXTENSION_MATCH_EXACT || match == EXTENSION_MATCH_STRETCHABLE);
+			break;
+		case HELPER_CANMATCH:
+			/* We are interested in exact or incomplete matches */
+			res = (match == EXTENSION_MATCH_POSSIBLE || match == EXTENSION_MATCH_EXACT || match == EXTENSION_MATCH_STRETCHABLE || match == EXTENSION_MATCH_INCOMPLETE);
+			break;
+		case HELPER_MATCHMORE:
+			/* We are only interested in incomplete matches */
+			if (match == EXTENSION_MATCH_POSSIBLE && s->earlymatch == NULL) {
+				/* It matched an extension ending in a '!' wildcard
+				 * so just record it for now, unless there's a better match
+				 */
+				s->earlymatch = eroot;
+				break;
+			}
+			res = (match == EXTENSION_MATCH_STRETCHABLE || match == EXTENSION_MATCH_INCOMPLETE);
+			break;
+		}
+	}
+
+	if (res) {
+		if (*s->status < STATUS_NO_PRIORITY)
+			*s->status = STATUS_NO_PRIORITY;
+
+		for (e = eroot; e; e = e->peer) {
+			/* Match priority */
+			if (s->action == HELPER_FINDLABEL) {
+				if (*s->status < STATUS_NO_LABEL)
+					*s->status = STATUS_NO_LABEL;
+				if (s->label && e->label && !strcmp(s->label, e->label)) {
+					*s->status = STATUS_SUCCESS;
+					return e;
+				}
+			} else if (e->priority == s->priority) {
+				*s->status = STATUS_SUCCESS;
+				return e;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static inline int exten_search_ordered(struct exten_search *s)
+{
+	return (s->action != HELPER_CANMATCH && s->action != HELPER_MATCHMORE);
+}
+
+/* Returns 1 if the search is settled, -1 if it has to fall back to a
+ * linear scan and 0 to carry on.
+ */
+static int exten_search_offer(struct exten_search *s, struct exten_pterm *t, int match)
+{
+	if (exten_search_ordered(s)) {
+		if (s->ncand == EXTEN_MATCH_CANDIDATES)
+			return -1;
+		s->cand[s->ncand].exten = t->exten;
+		s->cand[s->ncand].ordinal = t->ordinal;
+		s->cand[s->ncand].match = match;
+		s->ncand++;
+		return 0;
+	}
+
+	return ((s->found = exten_try(s, t->exten, match)) != NULL);
+}
+
+static int exten_pnode_step(struct exten_search *s, struct exten_pnode *node, char c, struct exten_pnode **next, unsigned int *nnext)
+{
+	struct exten_pnode *child;
+	struct exten_pterm *t;
+	int res;
+
+	for (t = node->terms; t; t = t->next) {
+		if (t->kind == PTOK_STRETCH)
+			res = exten_search_offer(s, t, EXTENSION_MATCH_STRETCHABLE);
+		else if (t->kind == PTOK_POSSIBLE)
+			res = exten_search_offer(s, t, EXTENSION_MATCH_POSSIBLE);
+		else
+			continue;
+		if (res)
+			return res;
+	}
+
+	for (child = node->child; child; child = child->sibling) {
+		if (child->ignore) {
+			if ((res = exten_pnode_step(s, child, c, next, nnext)))
+				return res;
+		} else if (EXTEN_CLASS_HAS(child->class, c)) {
+			if (*nnext == EXTEN_MATCH_ACTIVE)
+				return -1;
+			next[(*nnext)++] = child;
+		}
+	}
+
+	return 0;
+}
+
+static int exten_pnode_incomplete(struct exten_search *s, struct exten_pnode *node)
+{
+	struct exten_pnode *child;
+	struct exten_pterm *t;
+	int res;
+
+	for (t = node->terms; t; t = t->next)
+		if ((res = exten_search_offer(s, t, EXTENSION_MATCH_INCOMPLETE)))
+			return res;
+
+	for (child = node->child; child; child = child->sibling)
+		if ((res = exten_pnode_incomplete(s, child)))
+			return res;
+
+	return 0;
+}
+
+/* A destination with trailing '-' overruns patterns that have already
+ * ended rather than matching them exactly.
+ */
+static int exten_pnode_end(struct exten_search *s, struct exten_pnode *node, int trailing)
+{
+	struct exten_pnode *child;
+	struct exten_pterm *t;
+	int res = 0;
+
+	for (t = node->terms; t; t = t->next) {
+		if (t->kind == PTOK_END) {
+			if (!trailing)
+				res = exten_search_offer(s, t, EXTENSION_MATCH_EXACT);
+		} else if (t->kind == PTOK_POSSIBLE)
+			res = exten_search_offer(s, t, EXTENSION_MATCH_POSSIBLE);
+		else if (!exten_search_ordered(s))
+			res = exten_search_offer(s, t, EXTENSION_MATCH_INCOMPLETE);
+		if (res)
+			return res;
+	}
+
+	/* Incomplete matches only count for lookups that need not be ordered */
+	if (!exten_search_ordered(s)) {
+		for (child = node->child; child; child = child->sibling)
+			if ((res = exten_pnode_incomplete(s, child)))
+				return res;
+	}
+
+	return 0;
+}
+
+static int exten_cand_cmp(const void *a, const void *b)
+{
+	const struct exten_cand *cand_a = a;
+	const struct exten_cand *cand_b = b;
+
+	return (cand_a->ordinal > cand_b->ordinal) - (cand_a->ordinal < cand_b->ordinal);
+}
+
+/* Returns zero if the matcher cannot answer and the context must be
+ * scanned linearly, otherwise s->found and s->earlymatch are as the
+ * linear scan would have left them.
+ */
+static int exten_matcher_search(struct exten_matcher *m, const char *exten, struct exten_search *s)
+{
+	struct exten_cand cand[EXTEN_MATCH_CANDIDATES];
+	struct exten_pnode *buf[2][EXTEN_MATCH_ACTIVE];
+	struct exten_pnode **active, **next, **tmp;
+	struct exten_lnode *lnode;
+	struct cw_exten *e;
+	const char *d;
+	unsigned int nactive, nnext, i;
+	int res;
+
+	/* An empty destination is an incomplete match for everything and one
+	 * that is nothing but '-' is an incomplete match for every pattern.
+	 * Neither is worth indexing.
+	 */
+	for (d = exten; *d == '-'; d++);
+	if (!*d)
+		return 0;
+
+	s->cand = cand;
+	s->ncand = 0;
+
+	/* Literal extensions all come before the patterns */
+	lnode = &m->lroot;
+	for (d = exten; lnode && *d; d++)
+		for (lnode = lnode->child; lnode && lnode->c != *d; lnode = lnode->sibling);
+
+	if (lnode) {
+		for (e = lnode->first, i = 0; i < lnode->count; e = e->next, i++) {
+			if (i >= lnode->here && exten_search_ordered(s))
+				break;
+			if ((s->found = exten_try(s, e, (i < lnode->here ? EXTENSION_MATCH_EXACT : EXTENSION_MATCH_INCOMPLETE))))
+				return 1;
+		}
+	}
+
+	active = buf[0];
+	next = buf[1];
+	active[0] = &m->proot;
+	nactive = 1;
+
+	for (d = exten; *d && nactive; d++) {
+		if (*d == '-')
+			continue;
+
+		for (i = nnext = 0; i < nactive; i++)
+			if ((res = exten_pnode_step(s, active[i], *d, next, &nnext)))
+				return (res > 0);
+
+		tmp = active;
+		active = next;
+		next = tmp;
+		nactive = nnext;
+	}
+
+	for (i = 0; i < nactive; i++)
+		if ((res = exten_pnode_end(s, active[i], (d[-1] == '-'))))
+			return (res > 0);
+
+	if (s->ncand) {
+		qsort(s->cand, s->ncand, sizeof(s->cand[0]), exten_cand_cmp);
+		for (i = 0; i < s->ncand; i++)
+			if ((s->found = exten_try(s, s->cand[i].exten, s->cand[i].match)))
+				break;
+	}
+
+	return 1;
+}
+
 static struct cw_exten *pbx_find_extension(struct cw_channel *chan, struct cw_context *bypass, const char *context, const char *exten, int priority, const char *label, const char *callerid, int action, char *incstack[], int *stacklen, int *status, struct cw_switch **swo, struct cw_dynstr *data, const char **foundcontext)
 {
+    struct exten_search search;
+    struct exten_matcher *matcher;
     int x, res;
     struct cw_context *tmp;
     struct cw_exten *e, *eroot;
     struct cw_include *i;
     struct cw_sw *sw;
     struct cw_switch *asw;
-    unsigned int hash;
 
     /* Initialize status if appropriate */
     if (!*stacklen)
@@ -536,151 +1152,109 @@ static struct cw_exten *pbx_find_extension(struct cw_channel *chan, struct cw_co
         if (!strcasecmp(incstack[x], context))
             return NULL;
     }
-    hash = cw_hash_string(0, context);
+    /* Match context */
     if (bypass)
         tmp = bypass;
     else
-        tmp = contexts;
-    while (tmp)
-    {
-        /* Match context */
-        if (bypass || (hash == tmp->hash && !strcmp(context, tmp->name)))
-        {
-            struct cw_exten *earlymatch = NULL;
+        tmp = context_lookup(context, cw_hash_string(0, context));
+    if (!tmp)
+        return NULL;
 
-            if (*status < STATUS_NO_EXTENSION)
-                *status = STATUS_NO_EXTENSION;
-            for (eroot = tmp->root;  eroot;  eroot = eroot->next)
-            {
-                int match = 0;
+    if (*status < STATUS_NO_EXTENSION)
+        *status = STATUS_NO_EXTENSION;
 
-                /* Match extension */
-                match = cw_extension_pattern_match(exten, eroot->exten);
-                res = 0;
-		if (!(eroot->matchcid  &&  !matchcid(eroot->cidmatch, callerid)))
-		{
-                    switch (action)
-                    {
-                        case HELPER_EXISTS:
-                        case HELPER_EXEC:
-                        case HELPER_FINDLABEL:
-                    	    /* We are only interested in exact matches */
-                    	    res = (match == EXTENSION_MATCH_POSSIBLE  ||  match == EXTENSION_MATCH_EXACT  ||  match == EXTENSION_MATCH_STRETCHABLE);
-                    	    break;
-                        case HELPER_CANMATCH:
-                            /* We are interested in exact or incomplete matches */
-                            res = (match == EXTENSION_MATCH_POSSIBLE  ||  match == EXTENSION_MATCH_EXACT  ||  match == EXTENSION_MATCH_STRETCHABLE  ||  match == EXTENSION_MATCH_INCOMPLETE);
-                    	    break;
-                        case HELPER_MATCHMORE:
-                    	    /* We are only interested in incomplete matches */
-                    	    if (match == EXTENSION_MATCH_POSSIBLE  &&  earlymatch == NULL) 
-			    {
-                               /* It matched an extension ending in a '!' wildcard
-                               So just record it for now, unless there's a better match */
-                               earlymatch = eroot;
-                               res = 0;
-                               break;
-                            }
-                            res = (match == EXTENSION_MATCH_STRETCHABLE  ||  match == EXTENSION_MATCH_INCOMPLETE)  ?  1  :  0;
-                            break;
-                    }
-		}
-                if (res)
-                {
-                    e = eroot;
-                    if (*status < STATUS_NO_PRIORITY)
-                        *status = STATUS_NO_PRIORITY;
-                    while (e)
-                    {
-                        /* Match priority */
-                        if (action == HELPER_FINDLABEL)
-                        {
-                            if (*status < STATUS_NO_LABEL)
-                                *status = STATUS_NO_LABEL;
-                             if (label  &&  e->label  &&  !strcmp(label, e->label))
-                            {
-                                *status = STATUS_SUCCESS;
-                                *foundcontext = context;
-                                return e;
-                            }
-                        }
-                        else if (e->priority == priority)
-                        {
-                            *status = STATUS_SUCCESS;
-                            *foundcontext = context;
-                            return e;
-                        }
-                        e = e->peer;
-                    }
-                }
+    search.action = action;
+    search.priority = priority;
+    search.label = label;
+    search.callerid = callerid;
+    search.status = status;
+    search.earlymatch = NULL;
+    search.found = NULL;
+
+    res = 0;
+    if ((matcher = exten_matcher_get(tmp)))
+    {
+        res = exten_matcher_search(matcher, exten, &search);
+        exten_matcher_put(matcher);
+    }
+    if (!res)
+    {
+        search.earlymatch = NULL;
+        for (eroot = tmp->root;  eroot;  eroot = eroot->next)
+        {
+            /* Match extension */
+            if ((search.found = exten_try(&search, eroot, cw_extension_pattern_match(exten, eroot->exten))))
+                break;
+        }
+    }
+    if (search.found)
+    {
+        *foundcontext = context;
+        return search.found;
+    }
+    if (search.earlymatch)
+    {
+        /* Bizarre logic for HELPER_MATCHMORE. We return zero to break out 
+           of the loop waiting for more digits, and _then_ match (normally)
+           the extension we ended up with. We got an early-matching wildcard
+           pattern, so return NULL to break out of the loop. */
+        return NULL;
+    }
+    /* Check alternative switches */
+    sw = tmp->alts;
+    while (sw)
+    {
+        if ((asw = pbx_findswitch(sw->name)))
+        {
+            /* Substitute variables now */
+            if (sw->eval) {
+                pbx_substitute_variables(chan, NULL, sw->data, data);
+                cw_split_args(NULL, data->data, "", '\0', NULL);
+            } else
+                cw_dynstr_printf(data, "%s", sw->data);
+
+            res = 0;
+            if (!data->error) {
+                if (action == HELPER_CANMATCH && asw->canmatch)
+                    res = asw->canmatch(chan, context, exten, priority, callerid, data->data);
+                else if (action == HELPER_MATCHMORE && asw->matchmore)
+                    res = asw->matchmore(chan, context, exten, priority, callerid, data->data);
+                else if (asw->exists)
+                    res = asw->exists(chan, context, exten, priority, callerid, data->data);
             }
-            if (earlymatch)
+
+            if (res)
             {
-                /* Bizarre logic for HELPER_MATCHMORE. We return zero to break out 
-                   of the loop waiting for more digits, and _then_ match (normally)
-                   the extension we ended up with. We got an early-matching wildcard
-                   pattern, so return NULL to break out of the loop. */
+                /* Got a match */
+                *swo = asw;
+                *foundcontext = context;
                 return NULL;
             }
-            /* Check alternative switches */
-            sw = tmp->alts;
-            while (sw)
-            {
-                if ((asw = pbx_findswitch(sw->name)))
-                {
-                    /* Substitute variables now */
-                    if (sw->eval) {
-                        pbx_substitute_variables(chan, NULL, sw->data, data);
-                        cw_split_args(NULL, data->data, "", '\0', NULL);
-                    } else
-                        cw_dynstr_printf(data, "%s", sw->data);
-
-		    res = 0;
-		    if (!data->error) {
-                        if (action == HELPER_CANMATCH && asw->canmatch)
-                            res = asw->canmatch(chan, context, exten, priority, callerid, data->data);
-                        else if (action == HELPER_MATCHMORE && asw->matchmore)
-                            res = asw->matchmore(chan, context, exten, priority, callerid, data->data);
-                        else if (asw->exists)
-                            res = asw->exists(chan, context, exten, priority, callerid, data->data);
-		    }
-
-                    if (res)
-                    {
-                        /* Got a match */
-                        *swo = asw;
-                        *foundcontext = context;
-                        return NULL;
-                    }
 
-                    cw_dynstr_reset(data);
-                    cw_object_put(asw);
-                }
-                else
-                {
-                    cw_log(CW_LOG_WARNING, "No such switch '%s'\n", sw->name);
-                }
-                sw = sw->next;
-            }
-            /* Setup the stack */
-            incstack[*stacklen] = tmp->name;
-            (*stacklen)++;
-            /* Now try any includes we have in this context */
-            i = tmp->includes;
-            while (i)
-            {
-                if (include_valid(i))
-                {
-                    if ((e = pbx_find_extension(chan, bypass, i->rname, exten, priority, label, callerid, action, incstack, stacklen, status, swo, data, foundcontext))) 
-                        return e;
-                    if (*swo) 
-                        return NULL;
-                }
-                i = i->next;
-            }
-            break;
+            cw_dynstr_reset(data);
+            cw_object_put(asw);
         }
-        tmp = tmp->next;
+        else
+        {
+            cw_log(CW_LOG_WARNING, "No such switch '%s'\n", sw->name);
+        }
+        sw = sw->next;
+    }
+    /* Setup the stack */
+    incstack[*stacklen] = tmp->name;
+    (*stacklen)++;
+    /* Now try any includes we have in this context */
+    i = tmp->includes;
+    while (i)
+    {
+        if (include_valid(i))
+        {
+            if ((e = pbx_find_extension(chan, bypass, i->rname, exten, priority, label, callerid, action, incstack, stacklen, status, swo, data, foundcontext))) 
+                return e;
+            if (*swo) 
+                return NULL;
+        }
+        i = i->next;
     }
     return NULL;
 }
@@ -2307,6 +2881,8 @@ int cw_context_remove_extension2(struct cw_context *con, const char *extension,
     if (cw_mutex_lock(&con->lock))
         return -1;
 
+    exten_matcher_invalidate(con);
+
     /* go through all extensions in context and search the right one ... */
     exten = con->root;
     while (exten)
@@ -2910,6 +3486,8 @@ struct cw_context *cw_context_create(struct cw_context **extcontexts, const char
         tmp->includes = NULL;
         tmp->ignorepats = NULL;
         *local_contexts = tmp;
+        if (!extcontexts)
+            context_table_add(tmp);
         if (option_debug)
             cw_log(CW_LOG_DEBUG, "Registered context '%s' (%#x)\n", tmp->name, tmp->hash);
         else if (option_verbose > 2)
@@ -3996,6 +4574,7 @@ int cw_add_extension2(struct cw_context *con,
         errno = EBUSY;
         return -1;
     }
+    exten_matcher_invalidate(con);
     e = con->root;
     while (e)
     {
@@ -4677,6 +5256,8 @@ void cw_context_destroy(struct cw_context *con, const char *registrar)
                 e = e->next;
                 destroy_exten(el);
             }
+            context_table_del(tmp);
+            exten_matcher_put(tmp->matcher);
             cw_mutex_destroy(&tmp->lock);
             free(tmp);
             if (!con)
@@ -4753,7 +5334,16 @@ void cw_merge_contexts_and_delete(struct cw_context **extcontexts, const char *r
     }
     if (lasttmp)
     {
+        /* Compile the new contexts before anyone can search them */
+        for (tmp = *extcontexts;  tmp;  tmp = tmp->next)
+        {
+            if (!tmp->matcher  &&  !(tmp->matcher = exten_matcher_build(tmp)))
+                tmp->linear = 1;
+        }
+
         pthread_rwlock_wrlock(&conlock);
+        for (tmp = *extcontexts;  tmp;  tmp = tmp->next)
+            context_table_add(tmp);
         lasttmp->next = contexts;
         contexts = *extcontexts;
         pthread_rwlock_unlock(&conlock);
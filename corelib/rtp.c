@@ -36,6 +36,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "callweaver.h"
 
@@ -1466,6 +1467,7 @@ static int cw_rtp_raw_write(struct cw_rtp *rtp, struct cw_frame *f, int codec)
     if (f->subclass < CW_FORMAT_MAX_AUDIO)
     {
         pred = rtp->lastts + f->samples;
+        rtp->lastsamples = f->samples;
 
         /* Re-calculate last TS */
         rtp->lastts = rtp->lastts + ms*8;
@@ -1727,6 +1729,704 @@ static struct cw_rtp_protocol *get_proto(struct cw_channel *chan)
     return NULL;
 }
 
+#ifdef HAVE_EPOLL
+
+/* In-core RTP relay
+ *
+ * When a native bridge is possible in the sense that both legs speak the
+ * same codec and nobody needs to see the media, but the endpoints can't be
+ * re-invited to talk directly (NAT, canreinvite=no etc.), we don't need to
+ * turn every packet into a frame and back. Instead the RTP sockets of both
+ * legs are handed to a relay worker which forwards raw datagrams, rewriting
+ * the payload type, SSRC, sequence number and timestamp so that each far
+ * end sees a continuation of the stream we were already sending it.
+ *
+ * The bridge thread keeps watching the channels' alert pipes for control
+ * frames and hangups and periodically checks for re-INVITEs and codec
+ * changes. Anything it doesn't like drops the bridge back to the frame path.
+ */
+
+#define RTP_RELAY_MAX_WORKERS	4
+#define RTP_RELAY_BATCH		16
+#define RTP_RELAY_PKTSIZE	2048
+#define RTP_RELAY_CHECK_MS	500	/* how often the bridge checks for changes */
+#define RTP_RELAY_PT_NONE	0xff
+
+struct rtp_relay;
+
+struct rtp_relay_leg {
+	struct cw_io_rec ior;
+	struct rtp_relay *relay;
+	struct cw_rtp *rtp;
+	struct cw_sockaddr_net peer;		/* where this leg's far end is */
+	uint8_t ptmap[128];			/* payload type received here -> type sent on the other leg */
+	/* Numbering of the stream received on this leg as seen by the other leg's far end */
+	int started;
+	uint32_t in_ssrc;
+	uint16_t seq_delta;
+	uint16_t last_seq;
+	uint32_t ts_delta;
+	uint32_t last_ts;
+	uint32_t ts_step;			/* timestamp increment between packets */
+	/* Counters for traffic received on this leg */
+	unsigned long packets;
+	unsigned long long bytes;
+	unsigned long dropped;
+	unsigned long nat_learned;
+	unsigned long batches;
+	unsigned long long latency_ns;
+	unsigned long max_latency_ns;
+	char name[CW_CHANNEL_NAME];
+};
+
+struct rtp_relay_worker;
+
+struct rtp_relay {
+	struct rtp_relay *next;
+	struct rtp_relay *dead_next;
+	struct rtp_relay_worker *worker;
+	cw_mutex_t lock;
+	int dead;
+	int fallback;
+	struct timeval start;
+	struct rtp_relay_leg leg[2];
+};
+
+struct rtp_relay_worker {
+	cw_mutex_t lock;
+	pthread_t tid;
+	cw_io_context_t ioc;
+	unsigned int count;
+	struct rtp_relay *dead;
+	/* Only touched by the worker itself */
+	struct cw_sockaddr_net addr[RTP_RELAY_BATCH];
+	struct iovec iov[RTP_RELAY_BATCH];
+	struct mmsghdr msg[RTP_RELAY_BATCH];
+	struct mmsghdr out[RTP_RELAY_BATCH];
+	uint8_t buf[RTP_RELAY_BATCH][RTP_RELAY_PKTSIZE];
+};
+
+static int relay_enabled = 1;
+static int nrelay_workers;
+static struct rtp_relay_worker *relay_workers;
+
+CW_MUTEX_DEFINE_STATIC(relays_lock);
+static struct rtp_relay *relays;
+
+
+static int rtp_relay_recv(int fd, struct mmsghdr *msg, int n)
+{
+#ifdef HAVE_RECVMMSG
+	return recvmmsg(fd, msg, n, MSG_DONTWAIT, NULL);
+#else
+	int i, res;
+
+	for (i = 0; i < n; i++) {
+		if ((res = recvmsg(fd, &msg[i].msg_hdr, MSG_DONTWAIT)) < 0)
+			break;
+		msg[i].msg_len = res;
+	}
+	return (i ? i : -1);
+#endif
+}
+
+
+static void rtp_relay_send(int fd, struct mmsghdr *msg, int n)
+{
+#ifdef HAVE_SENDMMSG
+	int res;
+
+	while (n > 0 && (res = sendmmsg(fd, msg, n, MSG_DONTWAIT)) > 0) {
+		msg += res;
+		n -= res;
+	}
+#else
+	int i;
+
+	for (i = 0; i < n; i++)
+		sendmsg(fd, &msg[i].msg_hdr, MSG_DONTWAIT);
+#endif
+}
+
+
+/* Forward everything waiting on one leg to the other. Runs on a relay worker. */
+static int rtp_relay_handler(struct cw_io_rec *ior, int fd, short events, void *data)
+{
+	struct rtp_relay_leg *in = data;
+	struct rtp_relay *relay = in->relay;
+	struct rtp_relay_worker *worker = relay->worker;
+	struct rtp_relay_leg *out;
+	struct timespec t0, t1;
+	uint32_t *rtpheader;
+	uint32_t hdr, ssrc;
+	unsigned long ns;
+	int i, n, nout, len, pt;
+
+	CW_UNUSED(ior);
+	CW_UNUSED(events);
+
+	cw_clock_gettime(global_cond_clock_monotonic, &t0);
+
+	for (i = 0; i < RTP_RELAY_BATCH; i++) {
+		worker->iov[i].iov_base = worker->buf[i];
+		worker->iov[i].iov_len = sizeof(worker->buf[i]);
+		worker->msg[i].msg_hdr.msg_name = &worker->addr[i];
+		worker->msg[i].msg_hdr.msg_namelen = sizeof(worker->addr[i]);
+		worker->msg[i].msg_hdr.msg_iov = &worker->iov[i];
+		worker->msg[i].msg_hdr.msg_iovlen = 1;
+		worker->msg[i].msg_hdr.msg_control = NULL;
+		worker->msg[i].msg_hdr.msg_controllen = 0;
+		worker->msg[i].msg_hdr.msg_flags = 0;
+	}
+
+	cw_mutex_lock(&relay->lock);
+
+	/* If the bridge has already given up on us the channels (and hence
+	 * the socket) may be going away.
+	 */
+	if (relay->dead || (n = rtp_relay_recv(fd, worker->msg, RTP_RELAY_BATCH)) <= 0) {
+		cw_mutex_unlock(&relay->lock);
+		return 1;
+	}
+
+	out = &relay->leg[in == &relay->leg[0] ? 1 : 0];
+
+	nout = 0;
+	for (i = 0; i < n; i++) {
+		len = worker->msg[i].msg_len;
+
+		if (in->rtp->nat && cw_sockaddr_cmp(&worker->addr[i].sa, &in->peer.sa, -1, 1)) {
+			/* Symmetric RTP - send to whoever sent to us */
+			cw_sockaddr_copy(&in->peer.sa, &worker->addr[i].sa);
+			cw_sockaddr_copy(&in->rtp->sock_info[0].peer.sa, &worker->addr[i].sa);
+			in->rtp->nat_state = NAT_STATE_ACTIVE;
+			in->nat_learned++;
+		}
+
+		if (len < 3 * sizeof(uint32_t) || (worker->msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+		|| in->peer.sa.sa_family == AF_UNSPEC || !cw_sockaddr_get_port(&out->peer.sa)) {
+			in->dropped++;
+			continue;
+		}
+
+		rtpheader = (uint32_t *)worker->buf[i];
+		hdr = ntohl(rtpheader[0]);
+		if ((hdr & 0xC0000000) >> 30 != 2) {
+			in->dropped++;
+			continue;
+		}
+
+		pt = (hdr >> 16) & 0x7F;
+		if (in->ptmap[pt] == RTP_RELAY_PT_NONE) {
+			/* The other side can't take this as is. The frame path will have to translate */
+			relay->fallback = 1;
+			in->dropped++;
+			continue;
+		}
+
+		ssrc = ntohl(rtpheader[2]);
+		if (!in->started || ssrc != in->in_ssrc) {
+			/* New stream - carry on from where the outgoing numbering left off
+			 * stepping the timestamp by however much the last frame or packet
+			 * sent to that far end covered.
+			 */
+			if (!in->started) {
+				in->last_seq = out->rtp->seqno - 1;
+				in->last_ts = out->rtp->lastts;
+				in->ts_step = (out->rtp->lastsamples ? out->rtp->lastsamples : 160);
+				in->started = 1;
+			}
+			in->in_ssrc = ssrc;
+			in->seq_delta = (uint16_t)(in->last_seq + 1 - (hdr & 0xFFFF));
+			in->ts_delta = in->last_ts + in->ts_step - ntohl(rtpheader[1]);
+			hdr |= (1 << 23);
+		} else {
+			uint32_t step = ntohl(rtpheader[1]) + in->ts_delta - in->last_ts;
+
+			/* Anything over a second is a jump rather than a packet interval */
+			if (step && step <= 8000)
+				in->ts_step = step;
+		}
+
+		in->last_seq = (uint16_t)((hdr & 0xFFFF) + in->seq_delta);
+		in->last_ts = ntohl(rtpheader[1]) + in->ts_delta;
+
+		rtpheader[0] = htonl((hdr & 0xFF800000) | ((uint32_t)in->ptmap[pt] << 16) | in->last_seq);
+		rtpheader[1] = htonl(in->last_ts);
+		rtpheader[2] = htonl(out->rtp->ssrc);
+
+		worker->iov[i].iov_len = len;
+		worker->out[nout].msg_hdr.msg_name = &out->peer;
+		worker->out[nout].msg_hdr.msg_namelen = cw_sockaddr_len(&out->peer.sa);
+		worker->out[nout].msg_hdr.msg_iov = &worker->iov[i];
+		worker->out[nout].msg_hdr.msg_iovlen = 1;
+		worker->out[nout].msg_hdr.msg_control = NULL;
+		worker->out[nout].msg_hdr.msg_controllen = 0;
+		worker->out[nout].msg_hdr.msg_flags = 0;
+		nout++;
+
+		in->packets++;
+		in->bytes += len;
+	}
+
+	if (nout) {
+		rtp_relay_send(udp_socket_fd(&out->rtp->sock_info[0]), worker->out, nout);
+
+		in->rtp->lastrelayrx = out->rtp->lastrelaytx = time(NULL);
+
+		cw_clock_gettime(global_cond_clock_monotonic, &t1);
+		ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+		in->batches++;
+		in->latency_ns += ns;
+		if (ns > in->max_latency_ns)
+			in->max_latency_ns = ns;
+	}
+
+	cw_mutex_unlock(&relay->lock);
+	return 1;
+}
+
+
+static void *rtp_relay_worker_thread(void *data)
+{
+	struct rtp_relay_worker *worker = data;
+	struct rtp_relay *relay;
+
+	for (;;) {
+		cw_io_run(worker->ioc, 1000);
+
+		/* Relays that were stopped while we were waiting can't have any
+		 * events outstanding now so they're safe to free.
+		 */
+		if (worker->dead) {
+			cw_mutex_lock(&worker->lock);
+			relay = worker->dead;
+			worker->dead = NULL;
+			cw_mutex_unlock(&worker->lock);
+
+			while (relay) {
+				struct rtp_relay *next = relay->dead_next;
+
+				cw_mutex_destroy(&relay->lock);
+				free(relay);
+				relay = next;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+static void rtp_relay_ptmap(struct rtp_relay_leg *in, struct rtp_relay_leg *out)
+{
+	struct rtpPayloadType rtpPT;
+	int pt, code;
+
+	for (pt = 0; pt < arraysize(in->ptmap); pt++) {
+		in->ptmap[pt] = RTP_RELAY_PT_NONE;
+
+		rtpPT = cw_rtp_lookup_pt(in->rtp, pt);
+		if (rtpPT.code && (code = cw_rtp_lookup_code(out->rtp, rtpPT.is_cw_format, rtpPT.code)) >= 0 && code < 128)
+			in->ptmap[pt] = code;
+	}
+}
+
+
+/* Called with both channels locked */
+static struct rtp_relay *rtp_relay_start(struct cw_channel *c0, struct cw_rtp *p0, struct cw_channel *c1, struct cw_rtp *p1)
+{
+	struct rtp_relay *relay;
+	struct rtp_relay_worker *worker;
+	int i;
+
+	if (!(relay = calloc(1, sizeof(*relay)))) {
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+		return NULL;
+	}
+
+	cw_mutex_init(&relay->lock);
+	relay->start = cw_tvnow();
+
+	relay->leg[0].rtp = p0;
+	cw_copy_string(relay->leg[0].name, c0->name, sizeof(relay->leg[0].name));
+	relay->leg[1].rtp = p1;
+	cw_copy_string(relay->leg[1].name, c1->name, sizeof(relay->leg[1].name));
+
+	for (i = 0; i < 2; i++) {
+		relay->leg[i].relay = relay;
+		cw_sockaddr_copy(&relay->leg[i].peer.sa, cw_rtp_get_peer(relay->leg[i].rtp));
+		rtp_relay_ptmap(&relay->leg[i], &relay->leg[i ^ 1]);
+		cw_io_init(&relay->leg[i].ior, rtp_relay_handler, &relay->leg[i]);
+	}
+
+	/* Pick the least loaded worker. The counts may be changing under
+	 * us but an approximate balance is all that's needed.
+	 */
+	worker = &relay_workers[0];
+	for (i = 1; i < nrelay_workers; i++) {
+		if (relay_workers[i].count < worker->count)
+			worker = &relay_workers[i];
+	}
+	relay->worker = worker;
+
+	cw_mutex_lock(&worker->lock);
+	worker->count++;
+	cw_mutex_unlock(&worker->lock);
+
+	cw_mutex_lock(&relays_lock);
+	relay->next = relays;
+	relays = relay;
+	cw_mutex_unlock(&relays_lock);
+
+	if (cw_io_add(worker->ioc, &relay->leg[0].ior, cw_rtp_fd(p0), CW_IO_IN)
+	|| cw_io_add(worker->ioc, &relay->leg[1].ior, cw_rtp_fd(p1), CW_IO_IN)) {
+		cw_log(CW_LOG_WARNING, "Unable to relay RTP between '%s' and '%s': %s\n", c0->name, c1->name, strerror(errno));
+		relay->fallback = 1;
+	}
+
+	return relay;
+}
+
+
+static void rtp_relay_stop(struct rtp_relay *relay)
+{
+	struct rtp_relay_worker *worker = relay->worker;
+	struct rtp_relay **p;
+	int i;
+
+	cw_mutex_lock(&relay->lock);
+
+	relay->dead = 1;
+
+	for (i = 0; i < 2; i++) {
+		struct rtp_relay_leg *leg = &relay->leg[i];
+
+		if (cw_io_isactive(&leg->ior))
+			cw_io_remove(worker->ioc, &leg->ior);
+
+		/* Let the frame path carry on the numbering we used */
+		if (leg->started) {
+			relay->leg[i ^ 1].rtp->seqno = leg->last_seq + 1;
+			relay->leg[i ^ 1].rtp->lastts = leg->last_ts;
+		}
+	}
+
+	cw_mutex_unlock(&relay->lock);
+
+	cw_mutex_lock(&relays_lock);
+	for (p = &relays; *p; p = &(*p)->next) {
+		if (*p == relay) {
+			*p = relay->next;
+			break;
+		}
+	}
+	cw_mutex_unlock(&relays_lock);
+
+	if (option_debug) {
+		for (i = 0; i < 2; i++) {
+			struct rtp_relay_leg *leg = &relay->leg[i];
+
+			cw_log(CW_LOG_DEBUG, "RTP relay %s -> %s: %lu packets, %llu bytes, %lu dropped, avg %luus max %luus\n",
+				leg->name, relay->leg[i ^ 1].name, leg->packets, leg->bytes, leg->dropped,
+				(leg->batches ? (unsigned long)(leg->latency_ns / leg->batches / 1000) : 0UL),
+				leg->max_latency_ns / 1000);
+		}
+	}
+
+	cw_mutex_lock(&worker->lock);
+	worker->count--;
+	relay->dead_next = worker->dead;
+	worker->dead = relay;
+	cw_mutex_unlock(&worker->lock);
+}
+
+
+/* Returns non-zero if the relay can no longer carry the bridge */
+static int rtp_relay_changed(struct rtp_relay *relay, struct cw_channel *c0, struct cw_rtp_protocol *pr0, int codec0, struct cw_channel *c1, struct cw_rtp_protocol *pr1, int codec1)
+{
+	int i, res;
+
+	if (relay->fallback)
+		return 1;
+
+	if ((pr0->get_codec && pr0->get_codec(c0) != codec0)
+	|| (pr1->get_codec && pr1->get_codec(c1) != codec1))
+		return 1;
+
+	/* The relay keeps the peers up to date with anything it learns so if they
+	 * differ from what it thinks someone else has moved them (i.e. a re-INVITE).
+	 */
+	res = 0;
+	cw_mutex_lock(&relay->lock);
+	for (i = 0; i < 2; i++) {
+		if (cw_sockaddr_cmp(cw_rtp_get_peer(relay->leg[i].rtp), &relay->leg[i].peer.sa, -1, 1))
+			res = 1;
+	}
+	cw_mutex_unlock(&relay->lock);
+
+	return res;
+}
+
+
+static enum cw_bridge_result rtp_relay_bridge(struct cw_channel *c0, struct cw_rtp_protocol *pr0, struct cw_channel *c1, struct cw_rtp_protocol *pr1, int flags, struct cw_frame **fo, struct cw_channel **rc, int timeoutms)
+{
+	struct pollfd pfds[2];
+	struct cw_channel *chans[2];
+	struct timeval start;
+	struct rtp_relay *relay;
+	struct cw_channel *who;
+	struct cw_frame *f;
+	struct cw_rtp *p0, *p1;
+	void *pvt0, *pvt1;
+	enum cw_bridge_result res;
+	int codec0, codec1;
+	int ms, n;
+
+	if (!relay_enabled || !nrelay_workers || !pr0->get_relay_info || !pr1->get_relay_info)
+		return CW_BRIDGE_FAILED_NOWARN;
+
+	cw_channel_lock(c0);
+	while (cw_channel_trylock(c1)) {
+		cw_channel_unlock(c0);
+		usleep(1);
+		cw_channel_lock(c0);
+	}
+
+	p0 = pr0->get_relay_info(c0);
+	p1 = pr1->get_relay_info(c1);
+	codec0 = (pr0->get_codec ? pr0->get_codec(c0) : 0);
+	codec1 = (pr1->get_codec ? pr1->get_codec(c1) : 0);
+
+	relay = NULL;
+	if (p0 && p1
+#ifdef ENABLE_SRTP
+	&& !p0->srtp && !p1->srtp
+#endif
+	&& c0->alertpipe[0] > -1 && c1->alertpipe[0] > -1
+	&& (c0->nativeformats & c1->nativeformats)
+	&& !c0->monitor && !c1->monitor && !c0->spies && !c1->spies
+	&& p0->sock_info[0].rfc3489_state != RFC3489_STATE_REQUEST_PENDING
+	&& p1->sock_info[0].rfc3489_state != RFC3489_STATE_REQUEST_PENDING)
+		relay = rtp_relay_start(c0, p0, c1, p1);
+
+	pvt0 = c0->tech_pvt;
+	pvt1 = c1->tech_pvt;
+
+	cw_channel_unlock(c0);
+	cw_channel_unlock(c1);
+
+	if (!relay)
+		return CW_BRIDGE_FAILED_NOWARN;
+
+	if (option_debug)
+		cw_log(CW_LOG_DEBUG, "Relaying RTP in-core between '%s' and '%s'\n", c0->name, c1->name);
+
+	pfds[0].fd = c0->alertpipe[0];
+	pfds[0].events = POLLIN;
+	pfds[1].fd = c1->alertpipe[0];
+	pfds[1].events = POLLIN;
+	chans[0] = c0;
+	chans[1] = c1;
+
+	res = CW_BRIDGE_FAILED;
+
+	for (;;) {
+		if (cw_channel_get_t38_status(c0) != cw_channel_get_t38_status(c1)) {
+			res = CW_BRIDGE_RETRY;
+			break;
+		}
+
+		if (c0->tech_pvt != pvt0 || c1->tech_pvt != pvt1
+		|| c0->masq || c0->masqr || c1->masq || c1->masqr) {
+			cw_log(CW_LOG_DEBUG, "Oooh, something is weird, backing out\n");
+			res = CW_BRIDGE_RETRY;
+			break;
+		}
+
+		if (rtp_relay_changed(relay, c0, pr0, codec0, c1, pr1, codec1)) {
+			if (option_debug)
+				cw_log(CW_LOG_DEBUG, "Media changed, returning '%s' and '%s' to the frame path\n", c0->name, c1->name);
+			res = CW_BRIDGE_RETRY;
+			break;
+		}
+
+		if (cw_check_hangup(c0) || cw_check_hangup(c1))
+			break;
+
+		ms = (timeoutms >= 0 && timeoutms < RTP_RELAY_CHECK_MS ? timeoutms : RTP_RELAY_CHECK_MS);
+		start = cw_tvnow();
+
+		pfds[0].revents = pfds[1].revents = 0;
+		n = poll(pfds, 2, ms);
+
+		if (timeoutms >= 0) {
+			if ((timeoutms -= cw_tvdiff_ms(cw_tvnow(), start)) <= 0 && n <= 0) {
+				res = CW_BRIDGE_RETRY;
+				break;
+			}
+			if (timeoutms < 0)
+				timeoutms = 0;
+		}
+
+		if (n <= 0)
+			continue;
+
+		who = chans[(pfds[0].revents & POLLIN) ? 0 : 1];
+
+		/* Only the alert pipe was watched so there is nothing for the driver to read */
+		cw_channel_lock(who);
+		who->fdno = -1;
+		cw_channel_unlock(who);
+		f = cw_read(who);
+
+		if (f == NULL
+		|| (f->frametype == CW_FRAME_DTMF
+			&& ((who == c0 && (flags & CW_BRIDGE_DTMF_CHANNEL_0)) || (who == c1 && (flags & CW_BRIDGE_DTMF_CHANNEL_1))))) {
+			*fo = f;
+			*rc = who;
+			if (option_debug)
+				cw_log(CW_LOG_DEBUG, "Oooh, got a %s\n", f  ?  "digit"  :  "hangup");
+			res = CW_BRIDGE_COMPLETE;
+			break;
+		} else if (f->frametype == CW_FRAME_CONTROL && !(flags & CW_BRIDGE_IGNORE_SIGS)) {
+			if (f->subclass == CW_CONTROL_HOLD
+			|| f->subclass == CW_CONTROL_UNHOLD
+			|| f->subclass == CW_CONTROL_VIDUPDATE) {
+				cw_indicate((who == c0 ? c1 : c0), f->subclass);
+				cw_fr_free(f);
+			} else {
+				*fo = f;
+				*rc = who;
+				cw_log(CW_LOG_DEBUG, "Got a FRAME_CONTROL (%d) frame on channel %s\n", f->subclass, who->name);
+				res = CW_BRIDGE_COMPLETE;
+				break;
+			}
+		} else {
+			if (f->frametype == CW_FRAME_DTMF
+			|| f->frametype == CW_FRAME_VOICE
+			|| f->frametype == CW_FRAME_VIDEO) {
+				/* Forward voice or DTMF frames if they happen upon us */
+				cw_write((who == c0 ? c1 : c0), &f);
+			}
+			cw_fr_free(f);
+		}
+
+		/* Swap priority not that it's a big deal at this point */
+		if (who == chans[0]) {
+			struct pollfd tmp = pfds[0];
+
+			pfds[0] = pfds[1];
+			pfds[1] = tmp;
+			chans[0] = chans[1];
+			chans[1] = who;
+		}
+	}
+
+	rtp_relay_stop(relay);
+	return res;
+}
+
+
+static int rtp_show_relays(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	struct rtp_relay *relay;
+	struct timeval now;
+	int i, count = 0;
+
+	CW_UNUSED(argv);
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_dynstr_printf(ds_p, "%-30s %-30s %10s %12s %8s %6s %8s %8s %8s\n",
+		"From", "To", "Packets", "Bytes", "Dropped", "NAT", "Avg (us)", "Max (us)", "Age (s)");
+
+	now = cw_tvnow();
+
+	cw_mutex_lock(&relays_lock);
+
+	for (relay = relays; relay; relay = relay->next) {
+		cw_mutex_lock(&relay->lock);
+
+		for (i = 0; i < 2; i++) {
+			struct rtp_relay_leg *leg = &relay->leg[i];
+
+			cw_dynstr_printf(ds_p, "%-30.30s %-30.30s %10lu %12llu %8lu %6lu %8lu %8lu %8ld\n",
+				leg->name, relay->leg[i ^ 1].name, leg->packets, leg->bytes, leg->dropped, leg->nat_learned,
+				(leg->batches ? (unsigned long)(leg->latency_ns / leg->batches / 1000) : 0UL),
+				leg->max_latency_ns / 1000,
+				(long)(now.tv_sec - relay->start.tv_sec));
+		}
+
+		cw_mutex_unlock(&relay->lock);
+		count++;
+	}
+
+	cw_mutex_unlock(&relays_lock);
+
+	cw_dynstr_printf(ds_p, "%d active relay%s on %d worker%s%s\n",
+		count, (count == 1 ? "" : "s"), nrelay_workers, (nrelay_workers == 1 ? "" : "s"),
+		(relay_enabled ? "" : " (relaying disabled)"));
+
+	return RESULT_SUCCESS;
+}
+
+
+static const char rtp_show_relays_usage[] =
+"Usage: rtp show relays\n"
+"       Shows the native bridges whose RTP is being relayed in-core with\n"
+"       packet counters and forwarding latency for each direction.\n";
+
+static struct cw_clicmd cli_show_relays = {
+	.cmda = { "rtp", "show", "relays", NULL },
+	.handler = rtp_show_relays,
+	.summary = "Show in-core RTP relays",
+	.usage = rtp_show_relays_usage,
+};
+
+
+static void rtp_relay_init(void)
+{
+	long ncpus;
+	int i;
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpus = 1;
+	else if (ncpus > RTP_RELAY_MAX_WORKERS)
+		ncpus = RTP_RELAY_MAX_WORKERS;
+
+	if (!(relay_workers = calloc(ncpus, sizeof(*relay_workers)))) {
+		cw_log(CW_LOG_ERROR, "Out of memory!\n");
+		return;
+	}
+
+	for (i = 0; i < ncpus; i++) {
+		struct rtp_relay_worker *worker = &relay_workers[nrelay_workers];
+
+		if ((worker->ioc = cw_io_context_create(64)) == CW_IO_CONTEXT_NONE) {
+			cw_log(CW_LOG_ERROR, "unable to create RTP relay I/O context: %s\n", strerror(errno));
+			break;
+		}
+
+		cw_mutex_init(&worker->lock);
+
+		if (cw_pthread_create(&worker->tid, &global_attr_rr, rtp_relay_worker_thread, worker)) {
+			cw_log(CW_LOG_ERROR, "unable to start RTP relay worker: %s\n", strerror(errno));
+			cw_mutex_destroy(&worker->lock);
+			cw_io_context_destroy(worker->ioc);
+			break;
+		}
+
+		nrelay_workers++;
+	}
+
+	cw_cli_register(&cli_show_relays);
+}
+
+#endif /* HAVE_EPOLL */
+
+
 /* cw_rtp_bridge: Bridge calls. If possible and allowed, initiate
    re-invite so the peers exchange media directly outside 
    of CallWeaver. */
@@ -1814,7 +2514,12 @@ enum cw_bridge_result cw_rtp_bridge(struct cw_channel *c0, struct cw_channel *c1
         /* Somebody doesn't want to play... */
         cw_channel_unlock(c0);
         cw_channel_unlock(c1);
+#ifdef HAVE_EPOLL
+        /* ...but we may still be able to keep the media away from the frame path */
+        return rtp_relay_bridge(c0, pr0, c1, pr1, flags, fo, rc, timeoutms);
+#else
         return CW_BRIDGE_FAILED_NOWARN;
+#endif
     }
 
 #ifdef ENABLE_SRTP
@@ -2106,6 +2811,9 @@ void cw_rtp_reload(void)
     rtpstart = DEFAULT_RTPSTART;
     rtpend = DEFAULT_RTPEND;
     dtmftimeout = DEFAULT_DTMFTIMEOUT;
+#ifdef HAVE_EPOLL
+    relay_enabled = 1;
+#endif
 
     cfg = cw_config_load("rtp.conf");
     if (cfg)
@@ -2135,6 +2843,10 @@ void cw_rtp_reload(void)
                 dtmftimeout = DEFAULT_DTMFTIMEOUT;
             }
         }
+#ifdef HAVE_EPOLL
+        if ((s = cw_variable_retrieve(cfg, "general", "rtprelay")))
+            relay_enabled = cw_true(s);
+#endif
         if ((s = cw_variable_retrieve(cfg, "general", "rtpchecksums")))
         {
 #ifdef SO_NO_CHECK
@@ -2165,5 +2877,8 @@ int cw_rtp_init(void)
     cw_cli_register(&cli_debug_ip);
     cw_cli_register(&cli_no_debug);
     cw_rtp_reload();
+#ifdef HAVE_EPOLL
+    rtp_relay_init();
+#endif
     return 0;
 }
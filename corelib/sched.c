@@ -42,44 +42,130 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #define SOONER(a,b) (((b).tv_sec > (a).tv_sec) || \
 					 (((b).tv_sec == (a).tv_sec) && ((b).tv_nsec > (a).tv_nsec)))
 
+/* The queue is a D-ary min-heap ordered by expiry time. Each sched_state
+ * records its current position in the heap so it can be removed without
+ * searching. A wider heap is shallower which means fewer cache lines are
+ * touched when jobs are added, which is by far the most common operation.
+ */
+#define SCHED_HEAP_D		4
+#define SCHED_HEAP_PARENT(i)	(((i) - 1) / SCHED_HEAP_D)
+#define SCHED_HEAP_CHILD(i)	((i) * SCHED_HEAP_D + 1)
+
+/* Initial number of heap slots. The heap grows (but never shrinks) as needed. */
+#define SCHED_HEAP_INITIAL	256
+
+
 struct sched_context {
 	cw_mutex_t lock;
 	cw_cond_t timed;
 	cw_cond_t untimed;
 	int timed_present;
 
-	/* Schedule entry and main queue */
-	struct sched_state *schedq;
+	/* Schedule queue */
+	struct sched_state **heap;
+	unsigned int heap_len;
+	unsigned int heap_size;
 
 	int nthreads;
 	pthread_t tid[0];
 };
 
 
-static void schedule(struct sched_context *con, struct sched_state *s)
+static inline void heap_set(struct sched_context *con, unsigned int i, struct sched_state *s)
+{
+	con->heap[i] = s;
+	s->idx = i;
+}
+
+
+static void heap_sift_up(struct sched_context *con, unsigned int i, struct sched_state *s)
+{
+	while (i > 0) {
+		unsigned int parent = SCHED_HEAP_PARENT(i);
+
+		if (!SOONER(s->when, con->heap[parent]->when))
+			break;
+
+		heap_set(con, i, con->heap[parent]);
+		i = parent;
+	}
+
+	heap_set(con, i, s);
+}
+
+
+static void heap_sift_down(struct sched_context *con, unsigned int i, struct sched_state *s)
+{
+	for (;;) {
+		unsigned int child, last, best;
+
+		if ((child = SCHED_HEAP_CHILD(i)) >= con->heap_len)
+			break;
+
+		last = child + SCHED_HEAP_D;
+		if (last > con->heap_len)
+			last = con->heap_len;
+
+		for (best = child++; child < last; child++) {
+			if (SOONER(con->heap[child]->when, con->heap[best]->when))
+				best = child;
+		}
+
+		if (!SOONER(con->heap[best]->when, s->when))
+			break;
+
+		heap_set(con, i, con->heap[best]);
+		i = best;
+	}
+
+	heap_set(con, i, s);
+}
+
+
+static void heap_remove(struct sched_context *con, struct sched_state *s)
+{
+	unsigned int i = s->idx;
+	struct sched_state *last = con->heap[--con->heap_len];
+
+	if (last != s) {
+		if (i > 0 && SOONER(last->when, con->heap[SCHED_HEAP_PARENT(i)]->when))
+			heap_sift_up(con, i, last);
+		else
+			heap_sift_down(con, i, last);
+	}
+}
+
+
+static int schedule(struct sched_context *con, struct sched_state *s)
 {
 	/* Take a sched structure and put it in the
 	 * queue, such that the soonest event is
-	 * first in the list. 
+	 * at the top of the heap.
 	 */
-	 
-	struct sched_state **s_p;
 
-	for (s_p = &con->schedq; *s_p; s_p = &(*s_p)->next) {
-		if (SOONER(s->when, (*s_p)->when))
-			break;
+	if (con->heap_len == con->heap_size) {
+		struct sched_state **heap;
+		unsigned int size = (con->heap_size ? con->heap_size * 2 : SCHED_HEAP_INITIAL);
+
+		if (!(heap = realloc(con->heap, size * sizeof(heap[0])))) {
+			cw_log(CW_LOG_ERROR, "Out of memory!\n");
+			return -1;
+		}
+
+		con->heap = heap;
+		con->heap_size = size;
 	}
 
-	/* If we insert at the head of the list we need to let a service thread
+	heap_sift_up(con, con->heap_len++, s);
+
+	/* If we insert at the top of the heap we need to let a service thread
 	 * know things have changed. If all the service threads are busy that
 	 * isn't a problem.
 	 */
-	if (s_p == &con->schedq)
+	if (s->idx == 0)
 		cw_cond_signal(con->timed_present ? &con->timed : &con->untimed);
 
-	/* Insert this event into the schedule */
-	s->next = *s_p;
-	*s_p = s;
+	return 0;
 }
 
 
@@ -100,8 +186,10 @@ static int cw_sched_add_variable_nolock(struct sched_context *con, struct sched_
 				state->when.tv_nsec -= 1000000000;
 			}
 		}
-		schedule(con, state);
-		res = 0;
+		if (!schedule(con, state))
+			res = 0;
+		else
+			state->callback = NULL;
 	}
 
 	return res;
@@ -121,21 +209,14 @@ int cw_sched_add_variable(struct sched_context *con, struct sched_state *state,
 
 static int cw_sched_del_nolock(struct sched_context *con, struct sched_state *state)
 {
-	struct sched_state **s_p, *s;
 	int res = -1;
 
 	state->vers++;
 
 	if (state->callback) {
-		for (s_p = &con->schedq; *s_p; s_p = &(*s_p)->next) {
-			if ((*s_p) == state) {
-				s = *s_p;
-				*s_p = s->next;
-				s->callback = NULL;
-				res = 0;
-				break;
-			}
-		}
+		heap_remove(con, state);
+		state->callback = NULL;
+		res = 0;
 	}
 
 	return res;
@@ -199,13 +280,13 @@ static void *service_thread(void *data)
 	for (;;) {
 		cw_clock_gettime(global_cond_clock_monotonic, &now);
 
-		while (con->schedq && SOONER(con->schedq->when, now)) {
-			while (con->schedq && SOONER(con->schedq->when, now)) {
-				struct sched_state *current = con->schedq;
+		while (con->heap_len && SOONER(con->heap[0]->when, now)) {
+			while (con->heap_len && SOONER(con->heap[0]->when, now)) {
+				struct sched_state *current = con->heap[0];
 				struct sched_state copy = *current;
 				int res;
 
-				con->schedq = con->schedq->next;
+				heap_remove(con, current);
 
 				current->callback = NULL;
 
@@ -239,9 +320,9 @@ static void *service_thread(void *data)
 
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 
-		if (!con->timed_present && con->schedq) {
+		if (!con->timed_present && con->heap_len) {
 			con->timed_present = 1;
-			while (cw_cond_timedwait(&con->timed, &con->lock, &con->schedq->when) < 0 && errno == EINTR);
+			while (cw_cond_timedwait(&con->timed, &con->lock, &con->heap[0]->when) < 0 && errno == EINTR);
 			con->timed_present = 0;
 		} else {
 			while (cw_cond_wait(&con->untimed, &con->lock) < 0 && errno == EINTR);
@@ -263,7 +344,8 @@ struct sched_context *sched_context_create(int nthreads)
 		cw_cond_init(&con->untimed, NULL);
 		cw_mutex_init_attr(&con->lock, &global_mutexattr_errorcheck);
 		con->timed_present = 0;
-		con->schedq = NULL;
+		con->heap = NULL;
+		con->heap_len = con->heap_size = 0;
 		con->nthreads = nthreads;
 		for (n = 0, i = 0; i < nthreads; i++) {
 			con->tid[i] = CW_PTHREADT_NULL;
@@ -299,5 +381,6 @@ void sched_context_destroy(struct sched_context *con)
 	cw_cond_destroy(&con->timed);
 	cw_cond_destroy(&con->untimed);
 	cw_mutex_destroy(&con->lock);
+	free(con->heap);
 	free(con);
 }
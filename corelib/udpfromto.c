@@ -82,13 +82,53 @@ int cw_udpfromto_init(int s, int family)
 #endif
 }
 	
+#if defined(HAVE_IP_PKTINFO) || defined(HAVE_IP_RECVDSTADDR) || defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
+static void udpfromto_getdst(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msgh); cmsg != NULL; cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+#if defined(HAVE_IP_PKTINFO)
+		if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_PKTINFO) {
+			struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+			to->sa_family = AF_INET;
+			memcpy(&((struct sockaddr_in *)to)->sin_addr, &pktinfo->ipi_addr, sizeof(pktinfo->ipi_addr));
+			*tolen = sizeof(struct sockaddr_in);
+			break;
+		}
+#elif defined(HAVE_IP_RECVDSTADDR)
+		if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
+			struct in_addr *inaddr = (struct in_addr *)CMSG_DATA(cmsg);
+			to->sa_family = AF_INET;
+			memcpy(&((struct sockaddr_in *)to)->sin_addr, inaddr, sizeof(*inaddr));
+			*tolen = sizeof(struct sockaddr_in);
+			break;
+		}
+#endif
+#if defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
+#if defined(IPV6_PKTINFO)
+		if (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
+#elif defined(IPV6_2292PKTINFO)
+		if (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_2292PKTINFO)
+#endif
+		{
+			struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+			to->sa_family = AF_INET6;
+			memcpy(&((struct sockaddr_in6 *)to)->sin6_addr, &pktinfo->ipi6_addr, sizeof(pktinfo->ipi6_addr));
+			*tolen = sizeof(struct sockaddr_in6);
+			break;
+		}
+#endif
+	}
+}
+#endif
+
 int cw_recvfromto(int s, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen, struct sockaddr *to, socklen_t *tolen)
 {
 #if defined(HAVE_IP_PKTINFO) || defined(HAVE_IP_RECVDSTADDR) || defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
 	char cbuf[256];
 	struct msghdr msgh;
 	struct iovec iov;
-	struct cmsghdr *cmsg;
 	int err;
 
 	iov.iov_base = buf;
@@ -112,41 +152,8 @@ int cw_recvfromto(int s, void *buf, size_t len, int flags, struct sockaddr *from
 	if (fromlen)
 		*fromlen = msgh.msg_namelen;
 
-	if (to && tolen) {
-		for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgh,cmsg)) {
-#if defined(HAVE_IP_PKTINFO)
-			if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_PKTINFO) {
-				struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
-				to->sa_family = AF_INET;
-				memcpy(&((struct sockaddr_in *)to)->sin_addr, &pktinfo->ipi_addr, sizeof(pktinfo->ipi_addr));
-				*tolen = sizeof(struct sockaddr_in);
-				break;
-			}
-#elif defined(HAVE_IP_RECVDSTADDR)
-			if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVDSTADDR) {
-				struct in_addr *inaddr = (struct in_addr *)CMSG_DATA(cmsg);
-				to->sa_family = AF_INET;
-				memcpy(&((struct sockaddr_in *)to)->sin_addr, inaddr, sizeof(*inaddr));
-				*tolen = sizeof(struct sockaddr_in);
-				break;
-			}
-#endif
-#if defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
-#if defined(IPV6_PKTINFO)
-			if (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
-#elif defined(IPV6_2292PKTINFO)
-			if (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_2292PKTINFO)
-#endif
-			{
-				struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-				to->sa_family = AF_INET6;
-				memcpy(&((struct sockaddr_in6 *)to)->sin6_addr, &pktinfo->ipi6_addr, sizeof(pktinfo->ipi6_addr));
-				*tolen = sizeof(struct sockaddr_in6);
-				break;
-			}
-#endif
-		}
-	}
+	if (to && tolen)
+		udpfromto_getdst(&msgh, to, tolen);
 
 	return err;
 #else 
@@ -158,6 +165,72 @@ int cw_recvfromto(int s, void *buf, size_t len, int flags, struct sockaddr *from
 #endif
 }
 
+int cw_recvmmsgfromto(int s, struct cw_udpfromto_msg *msgs, unsigned int n, int flags)
+{
+#if defined(HAVE_RECVMMSG)
+	struct mmsghdr mmsgh[n];
+	struct iovec iov[n];
+#if defined(HAVE_IP_PKTINFO) || defined(HAVE_IP_RECVDSTADDR) || defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
+	char cbuf[n][256];
+#endif
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = msgs[i].buf;
+		iov[i].iov_len = msgs[i].len;
+		mmsgh[i].msg_hdr.msg_iov = &iov[i];
+		mmsgh[i].msg_hdr.msg_iovlen = 1;
+		mmsgh[i].msg_hdr.msg_name = msgs[i].from;
+		mmsgh[i].msg_hdr.msg_namelen = msgs[i].fromlen;
+		mmsgh[i].msg_hdr.msg_control = NULL;
+		mmsgh[i].msg_hdr.msg_controllen = 0;
+		mmsgh[i].msg_hdr.msg_flags = 0;
+#if defined(HAVE_IP_PKTINFO) || defined(HAVE_IP_RECVDSTADDR) || defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
+		if (msgs[i].to && msgs[i].tolen) {
+			mmsgh[i].msg_hdr.msg_control = cbuf[i];
+			mmsgh[i].msg_hdr.msg_controllen = sizeof(cbuf[i]);
+		}
+#endif
+	}
+
+#ifdef MSG_WAITFORONE
+	flags |= MSG_WAITFORONE;
+#endif
+
+	if ((err = recvmmsg(s, mmsgh, n, flags, NULL)) < 0)
+		return err;
+
+	for (i = 0; i < (unsigned int)err; i++) {
+		msgs[i].len = mmsgh[i].msg_len;
+		msgs[i].flags = mmsgh[i].msg_hdr.msg_flags;
+		msgs[i].fromlen = mmsgh[i].msg_hdr.msg_namelen;
+#if defined(HAVE_IP_PKTINFO) || defined(HAVE_IP_RECVDSTADDR) || defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
+		if (msgs[i].to && msgs[i].tolen)
+			udpfromto_getdst(&mmsgh[i].msg_hdr, msgs[i].to, &msgs[i].tolen);
+#endif
+	}
+
+	return err;
+#else
+	/* fallback: one cw_recvfromto per datagram until there are no more waiting */
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < n; i++) {
+		if ((err = cw_recvfromto(s, msgs[i].buf, msgs[i].len, flags | MSG_TRUNC, msgs[i].from, &msgs[i].fromlen, msgs[i].to, &msgs[i].tolen)) < 0)
+			break;
+
+		msgs[i].flags = (err > msgs[i].len ? MSG_TRUNC : 0);
+		msgs[i].len = (err > msgs[i].len ? msgs[i].len : err);
+
+		flags |= MSG_DONTWAIT;
+	}
+
+	return (i ? i : err);
+#endif
+}
+
 int cw_sendfromto(int s, const void *buf, size_t len, int flags, const struct sockaddr *from, socklen_t fromlen, const struct sockaddr *to, socklen_t tolen)
 {
 #if defined(HAVE_IP_PKTINFO) || defined(HAVE_IP_SENDSRCADDR) || defined(IPV6_PKTINFO) || defined(IPV6_2292PKTINFO)
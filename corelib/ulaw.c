@@ -31,11 +31,96 @@
 
 CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 
+#include "callweaver/logger.h"
 #include "core/ulaw.h"
+#include "core/g711_vec.h"
 
 uint8_t __cw_lin2mu[16384];
 int16_t __cw_mulaw[256];
 
+
+#ifdef G711_VEC
+
+/* The vector encoder for this CPU, if it reproduces the table. It is
+ * checked against every possible input at startup and the table is used
+ * if it doesn't.
+ */
+static g711_vec_encoder_t ulaw_encode_simd;
+
+/*
+ * The vector encoder computes what the table holds: the mu-law code for the
+ * sample with its bottom two bits set (the table is indexed by the top 14 bits
+ * and filled in ascending order so the last sample in each bucket wins). The
+ * biased magnitude is always at least 0x84 so its top bit always gives the
+ * segment directly. Saturating the bias addition gives the same code as the
+ * clip to segment 7.
+ */
+#define ULAW_ENCODE_VEC(isa) \
+static inline g711_vec_target(isa) g711_vec_t(isa) ulaw_encode_##isa(g711_vec_t(isa) x) \
+{ \
+	g711_vec_t(isa) sign, lin; \
+ \
+	x = g711_vec_op(isa, or)(x, g711_vec_op(isa, set1)(3)); \
+	sign = g711_vec_op(isa, srai)(x, 15); \
+	lin = g711_vec_op(isa, adds)(g711_vec_op(isa, xor)(x, sign), g711_vec_op(isa, set1)(0x84)); \
+ \
+	return g711_vec_op(isa, xor)(g711_vec_op(isa, float_code)(lin), \
+		g711_vec_op(isa, xor)(g711_vec_op(isa, set1)(0xff), g711_vec_op(isa, and)(sign, g711_vec_op(isa, set1)(0x80)))); \
+}
+
+ULAW_ENCODE_VEC(sse2)
+ULAW_ENCODE_VEC(avx2)
+
+G711_VEC_ENCODER(cw_lin2mu, ulaw_encode, sse2)
+G711_VEC_ENCODER(cw_lin2mu, ulaw_encode, avx2)
+
+static int ulaw_simd_check(g711_vec_encoder_t encode, const char *isa)
+{
+	int16_t lin[256];
+	uint8_t mu[256];
+	int i, j;
+
+	for (i = -32768; i < 32768; i += 256) {
+		for (j = 0; j < 256; j++)
+			lin[j] = i + j;
+		encode(mu, lin, 256);
+		for (j = 0; j < 256; j++) {
+			if (mu[j] != CW_LIN2MU(lin[j])) {
+				cw_log(CW_LOG_WARNING, "%s mu-law encoder disagrees with SpanDSP at %d - using tables\n", isa, lin[j]);
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+#endif
+
+
+void cw_lin2mu_buf(uint8_t *dst, const int16_t *src, int n)
+{
+	int i = 0;
+
+#ifdef G711_VEC
+	if (ulaw_encode_simd)
+		i = ulaw_encode_simd(dst, src, n);
+#endif
+
+	for (; i < n; i++)
+		dst[i] = CW_LIN2MU(src[i]);
+}
+
+void cw_mulaw_buf(int16_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	/* A 512 byte table stays in L1 and beats any arithmetic decode */
+	for (i = 0; i < n; i++)
+		dst[i] = CW_MULAW(src[i]);
+}
+
+
 void cw_ulaw_init(void)
 {
 	int i;
@@ -46,4 +131,13 @@ void cw_ulaw_init(void)
 	/* Set up the reverse (mu-law) conversion table */
 	for (i = -32768;  i < 32768;  i++)
 		__cw_lin2mu[((uint16_t) i) >> 2] = linear_to_ulaw(i);
+
+#ifdef G711_VEC
+	{
+		const char *isa;
+		g711_vec_encoder_t encode = g711_vec_select(cw_lin2mu_sse2, cw_lin2mu_avx2, &isa);
+
+		ulaw_encode_simd = (encode && ulaw_simd_check(encode, isa) ? encode : NULL);
+	}
+#endif
 }
@@ -45,11 +45,13 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 /* Portions of the conversion code are by guido@sienanet.it */
 
 #define BLOCKSIZE 160
+#define HEADER_INTERVAL 16000  /* bytes (1 second) between header updates while writing */
 
 struct pvt
 {
     FILE *f; /* Descriptor */
     int bytes;
+    int hdrbytes;                         /* bytes when the header was last updated */
     int needsgain;
     int foffset;
     int lasttimeout;
@@ -375,6 +377,8 @@ static void wav_close(void *data)
     
     if (pvt->f)
     {
+        if (pvt->bytes != pvt->hdrbytes)
+            update_header(pvt->f);
         /* Pad to even length */
         if (pvt->bytes & 0x1)
             fwrite(&zero, 1, 1, pvt->f);
@@ -509,7 +513,13 @@ static int wav_write(void *data, struct cw_frame *f)
     }
     
     pvt->bytes += f->datalen;
-    update_header(pvt->f);
+    /* Rewriting the header costs two seeks and writes so only keep it
+       roughly up to date while recording. It is made exact on close. */
+    if (pvt->bytes - pvt->hdrbytes >= HEADER_INTERVAL)
+    {
+        update_header(pvt->f);
+        pvt->hdrbytes = pvt->bytes;
+    }
         
     return 0;
 }
@@ -55,6 +55,8 @@ static const uint8_t wav49_silence[] = /* 65 */
     0x92,0x24,0x49,0x92,0x00
 };
 
+#define HEADER_INTERVAL 25  /* blocks (1 second) between header updates while writing */
+
 struct pvt
 {
     /* Believe it or not, we must decode/recode to account for the
@@ -62,6 +64,8 @@ struct pvt
     FILE *f; /* Descriptor */
     int foffset;
     int secondhalf;                     /* Are we on the second half */
+    int blocks;                         /* 65 byte blocks written */
+    int hdrblocks;                      /* blocks when the header was last updated */
     struct timeval last;
     struct cw_frame fr;               /* Frame information */
     uint8_t buf[CW_FRIENDLY_OFFSET + 66];              /* Two Real GSM Frames */
@@ -457,6 +461,8 @@ static void wav_close(void *data)
     struct pvt *pvt = data;
     char zero = 0;
     
+    if (pvt->blocks != pvt->hdrblocks)
+        update_header(pvt->f);
     /* Pad to even length */
     fseek(pvt->f, 0, SEEK_END);
     if (ftell(pvt->f) & 0x1)
@@ -496,6 +502,18 @@ static struct cw_frame *wav_read(void *data, int *whennext)
     return &pvt->fr;
 }
 
+/* Rewriting the header costs two seeks and writes so only keep it
+   roughly up to date while recording. It is made exact on close. */
+static void wav_written(struct pvt *pvt)
+{
+    pvt->blocks++;
+    if (pvt->blocks - pvt->hdrblocks >= HEADER_INTERVAL)
+    {
+        update_header(pvt->f);
+        pvt->hdrblocks = pvt->blocks;
+    }
+}
+
 static int wav_write(void *data, struct cw_frame *f)
 {
     uint8_t wav49_data[65];
@@ -525,7 +543,7 @@ static int wav_write(void *data, struct cw_frame *f)
                 cw_log(CW_LOG_WARNING, "Bad write (%d/65): %s\n", res, strerror(errno));
                 return -1;
             }
-            update_header(pvt->f);
+            wav_written(pvt);
             len += 65;
         }
         else
@@ -540,7 +558,7 @@ static int wav_write(void *data, struct cw_frame *f)
                     cw_log(CW_LOG_WARNING, "Bad write (%d/65): %s\n", res, strerror(errno));
                     return -1;
                 }
-                update_header(pvt->f);
+                wav_written(pvt);
             }
             else
             {
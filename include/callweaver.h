@@ -110,6 +110,8 @@ extern int reload_logger(int);
 extern int cwdb_init(void);
 /* Provided by channel.c */
 extern int cw_channels_init(void);
+/* Provided by autoservice.c */
+extern int cw_autoservice_init(void);
 
 
 #if !defined(LOW_MEMORY)
@@ -217,7 +217,7 @@ static inline int atomic_dec_and_test(atomic_t *v)
 static inline unsigned long __cmpxchg(pthread_mutex_t *mutex,
 	volatile void *ptr, unsigned long old_n, unsigned long new_n, int size)
 {
-	int prev;
+	unsigned long prev;
 
 	pthread_mutex_lock(mutex);
 	switch (size) {
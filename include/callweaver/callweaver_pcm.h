@@ -41,6 +41,13 @@ extern CW_API_PUBLIC int16_t __cw_mulaw[256];
 #define CW_LIN2MU(a) (__cw_lin2mu[((unsigned short)(a)) >> 2])
 #define CW_MULAW(a) (__cw_mulaw[(a)])
 
+/*! converts a buffer of n signed linear samples to mulaw
+ * (using the vector encoder where the CPU and SpanDSP allow) */
+extern CW_API_PUBLIC void cw_lin2mu_buf(uint8_t *dst, const int16_t *src, int n);
+
+/*! converts a buffer of n mulaw samples to signed linear */
+extern CW_API_PUBLIC void cw_mulaw_buf(int16_t *dst, const uint8_t *src, int n);
+
 
 
 /*! Init the ulaw conversion stuff */
@@ -59,4 +66,11 @@ extern CW_API_PUBLIC int16_t __cw_alaw[256];
 #define CW_LIN2A(a) (__cw_lin2a[((unsigned short)(a)) >> 3])
 #define CW_ALAW(a) (__cw_alaw[(int)(a)])
 
+/*! converts a buffer of n signed linear samples to alaw
+ * (using the vector encoder where the CPU and SpanDSP allow) */
+extern CW_API_PUBLIC void cw_lin2a_buf(uint8_t *dst, const int16_t *src, int n);
+
+/*! converts a buffer of n alaw samples to signed linear */
+extern CW_API_PUBLIC void cw_alaw_buf(int16_t *dst, const uint8_t *src, int n);
+
 #endif
@@ -28,6 +28,7 @@
 #include <setjmp.h>
 #include <stdarg.h>
 
+#include "callweaver/atomic.h"
 #include "callweaver/dynstr.h"
 #include "callweaver/object.h"
 #include "callweaver/registry.h"
@@ -164,6 +165,20 @@ struct cw_channel_spy {
 	struct cw_channel_spy *next;
 };
 
+/*! Frames queued for cw_read() on a channel.
+ * Any thread may queue a frame without holding the channel lock. Only
+ * cw_read(), with the channel locked, takes frames off.
+ */
+struct cw_readq {
+	struct cw_frame *front;			/*!< Frames put back by cw_read(), served first */
+	struct cw_frame *head;			/*!< Oldest queued frame (consumer end) */
+	struct cw_frame * volatile tail;	/*!< Newest queued frame (producer end) */
+	struct cw_frame stub;			/*!< Keeps the list from ever being empty */
+	atomic_t count;				/*!< Frames queued, including front */
+	atomic_t hangup;			/*!< Hangups queued */
+	pthread_mutex_t lock;			/*!< Serialises cmpxchg without hardware support */
+};
+
 /*! T.38 channel status */
 typedef enum {
     T38_OFFER_REJECTED		= -1,
@@ -303,7 +318,9 @@ struct cw_channel {
 	/* ISDN Transfer Capbility - CW_FLAG_DIGITAL is not enough */
 	unsigned short transfercapability;
 
-	struct cw_frame *readq;
+	struct cw_readq readq;
+	/*! Wakes the reader when frames are queued. Both ends are the same
+	 *  fd if it is an eventfd. Use cw_alertpipe_read/write. */
 	int alertpipe[2];
 	/*! Write translation path */
 	struct cw_trans_pvt *writetrans;
@@ -474,6 +491,18 @@ extern CW_API_PUBLIC t38_status_t cw_channel_get_t38_status( struct cw_channel *
 /*! Queue an outgoing frame */
 extern CW_API_PUBLIC int cw_queue_frame(struct cw_channel *chan, struct cw_frame *f);
 
+/*! Returns the number of frames waiting to be read on a channel */
+static inline int cw_channel_readq_len(struct cw_channel *chan)
+{
+	return atomic_read(&chan->readq.count);
+}
+
+/*! Signal one queued frame on a channel's alert pipe or eventfd */
+extern CW_API_PUBLIC int cw_alertpipe_write(int *alertpipe);
+
+/*! Consume one signal from a channel's alert pipe or eventfd */
+extern CW_API_PUBLIC int cw_alertpipe_read(int *alertpipe);
+
 /*! Queue a hangup frame */
 extern CW_API_PUBLIC int cw_queue_hangup(struct cw_channel *chan);
 
@@ -25,6 +25,7 @@
 #include "callweaver/registry.h"
 #include "callweaver/dynstr.h"
 #include "callweaver/sockaddr.h"
+#include "callweaver/udpfromto.h"
 #include "callweaver/cli.h"
 #include "callweaver/utils.h"
 
@@ -40,14 +41,27 @@ struct cw_connection;
 struct cw_connection_tech {
 	const char *name;
 	int (*read)(struct cw_connection *conn);
+	/* Optional. Datagram connections opened with a batch size greater than one
+	 * are read by the service thread itself, up to batch datagrams per wakeup,
+	 * and the datagrams are handed over here rather than calling read.
+	 */
+	int (*read_batch)(struct cw_connection *conn, struct cw_udpfromto_msg *msgs, int n);
 };
 
 
+/* Largest datagram a batched connection will receive */
+#define CW_CONNECTION_DGRAM_MAX	65536
+
+/* Flags for cw_connection_listen_batch */
+#define CW_CONNECTION_REUSEPORT	(1 << 0)	/* Several connections may bind the same address and share the traffic */
+
+
 struct cw_connection {
 	struct cw_object obj;
 	struct cw_registry_entry *reg_entry;
 	enum cw_connection_state state;
 	unsigned int reliable:1;
+	unsigned int batch;
 	int sock;
 	pthread_t tid;
 	const struct cw_connection_tech *tech;
@@ -91,6 +105,8 @@ extern CW_API_PUBLIC void cw_connection_close(struct cw_connection *conn);
 
 extern CW_API_PUBLIC struct cw_connection *cw_connection_listen(int type, struct sockaddr *addr, socklen_t addrlen, const struct cw_connection_tech *tech, struct cw_object *pvt_obj);
 
+extern CW_API_PUBLIC struct cw_connection *cw_connection_listen_batch(int type, struct sockaddr *addr, socklen_t addrlen, const struct cw_connection_tech *tech, struct cw_object *pvt_obj, unsigned int batch, int flags);
+
 
 extern CW_API_PUBLIC int cw_connection_init(void);
 
@@ -36,4 +36,21 @@ struct cw_channel;
 extern int cw_search_dns(void *context, const char *dname, int class, int type,
 	 int (*callback)(void *context, char *answer, int len, char *fullanswer));
 
+/*!	\brief	Queue a DNS lookup to be done by a worker thread
+	\param	context
+	\param	dname	Domain name to lookup (host, SRV domain, TXT record name)
+	\param	class	Record Class (see "man res_search")
+	\param	type	Record type (see "man res_search")
+	\param	callback Callback function for handling DNS result (as for cw_search_dns)
+	\param	done	Called with the cw_search_dns result once the answer has been parsed
+	\return 0 if the lookup was queued, -1 otherwise
+
+	Both callbacks are called from the worker thread, never from the caller.
+*/
+extern CW_API_PUBLIC int cw_search_dns_async(void *context, const char *dname, int class, int type,
+	int (*callback)(void *context, char *answer, int len, char *fullanswer),
+	void (*done)(void *context, int result));
+
+extern int cw_dns_init(void);
+
 #endif /* _CALLWEAVER_DNS_H */
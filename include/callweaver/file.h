@@ -226,6 +226,15 @@ extern CW_API_PUBLIC struct cw_filestream *cw_readfile(const char *filename, con
  */
 extern CW_API_PUBLIC struct cw_filestream *cw_writefile(const char *filename, const char *type, const char *comment, int flags, int check, mode_t mode);
 
+/*! Starts writing a file in the background */
+/*!
+ * As cw_writefile() but frames written to the stream are queued and written to
+ * disk by the recording writer threads so the caller never waits for the disk.
+ * If the writers cannot keep up frames are dropped rather than the caller held up.
+ * If there are no recording writers this is the same as cw_writefile().
+ */
+extern CW_API_PUBLIC struct cw_filestream *cw_writefile_async(const char *filename, const char *type, const char *comment, int flags, int check, mode_t mode);
+
 /*! Writes a frame to a stream */
 /*! 
  * \param fs filestream to write to
@@ -243,6 +252,16 @@ extern CW_API_PUBLIC int cw_writestream(struct cw_filestream *fs, struct cw_fram
  */
 extern CW_API_PUBLIC int cw_closestream(struct cw_filestream *f);
 
+/*! Closes a stream without waiting for it */
+/*!
+ * \param f filestream to close
+ * For streams opened with cw_writefile_async() the writer finishes writing and
+ * closes the file in the background. Use cw_closestream() instead if the file
+ * must be complete when the call returns. Other streams are closed immediately.
+ * Returns 0 on success, -1 on failure
+ */
+extern CW_API_PUBLIC int cw_closestream_async(struct cw_filestream *f);
+
 /*! Opens stream for use in seeking, playing */
 /*!
  * \param chan channel to work with
@@ -93,6 +93,8 @@ struct cw_frame
 /*! Need the data be free'd? */
 #define CW_MALLOCD_DATA                (1 << 1)
 #define CW_MALLOCD_DATA_WITH_HDR       (1 << 2)
+/*! The header (and any data with it) came from the frame pool */
+#define CW_MALLOCD_POOL                (1 << 3)
 
 /* Frame types */
 /*! A DTMF digit, subclass is the digit */
@@ -308,6 +310,33 @@ static inline void cw_fr_init(struct cw_frame *frame)
 	frame->tx_copies = 1;
 }
 
+/*! \brief Allocate a frame from the frame pool
+ *
+ * \param type		frame type
+ * \param subtype	frame sub-type
+ * \param size		data size
+ *
+ * Allocate and initialise a frame with space for size bytes of data
+ * (plus CW_FRIENDLY_OFFSET) following the header. Small voice sized
+ * frames are served from per-thread caches rather than malloc.
+ * If size is zero data is left NULL for the caller to point elsewhere.
+ *
+ * The frame must be released with cw_fr_free().
+ *
+ * \return the new frame or NULL if out of memory
+ */
+extern CW_API_PUBLIC struct cw_frame *cw_fr_new(int type, int subtype, size_t size);
+
+
+/*! \brief Return a pooled frame header to the frame pool
+ *
+ * \param frame		frame to release
+ *
+ * Internal to cw_fr_free(). Do not call this directly.
+ */
+extern CW_API_PUBLIC void cw_frame_pool_put(struct cw_frame *frame);
+
+
 /*! \brief Free a frame
  *
  * \param frame		frame to free
@@ -326,8 +355,12 @@ static inline void cw_fr_free(struct cw_frame *frame)
 		if (unlikely(frame->data && (frame->mallocd & CW_MALLOCD_DATA)))
 			free((char *)frame->data - frame->offset);
 
-		if (likely((frame->mallocd & CW_MALLOCD_HDR)))
-			free(frame);
+		if (likely((frame->mallocd & CW_MALLOCD_HDR))) {
+			if (likely((frame->mallocd & CW_MALLOCD_POOL)))
+				cw_frame_pool_put(frame);
+			else
+				free(frame);
+		}
 	}
 }
 
@@ -33,26 +33,27 @@ struct cw_generator {
 	int is_initialized;
 };
 
+struct cw_generator_job;
+
 struct cw_generator_instance {
-	pthread_t tid;
+	pthread_t tid;			/* Worker thread servicing this generator, CW_PTHREADT_NULL if inactive */
 	struct cw_channel *chan;
 	struct cw_generator *class;
 	void *pvt;
+	struct cw_generator_job *job;	/* Internal to the generator engine */
 };
 
 
 
 extern CW_API_PUBLIC void cw_generator_deactivate(struct cw_generator_instance *gen);
 extern CW_API_PUBLIC int cw_generator_activate(struct cw_channel *chan, struct cw_generator_instance *gen, struct cw_generator *class, void *params);
+extern CW_API_PUBLIC int cw_generator_instance_is_self(struct cw_generator_instance *gen);
+
+extern int cw_generator_init(void);
 
 #define cw_generator_is_active(chan) (!pthread_equal((chan)->generator.tid, CW_PTHREADT_NULL))
 
-#define cw_generator_is_self(chan) ({ \
-	const typeof(chan) __chan = (chan); \
-	!pthread_equal(__chan->generator.tid, CW_PTHREADT_NULL) \
-		? pthread_equal(__chan->generator.tid, pthread_self()) \
-		: 1; \
-})
+#define cw_generator_is_self(chan) cw_generator_instance_is_self(&(chan)->generator)
 
 #endif /* _CALLWEAVER_GENERATOR_H */
 
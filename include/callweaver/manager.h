@@ -66,6 +66,7 @@ struct cw_manager_message {
 	struct cw_object obj;
 	struct cw_dynstr ds;		/*!< The AMI formatted event data */
 	size_t count;			/*!< The number of key/value pairs in this event */
+	int event;			/*!< Non-zero if this is an event (and may be discarded if the session is not keeping up) */
 	int map[0];			/*!< Offsets to the start of key and value strings in the msg data */
 };
 
@@ -94,7 +95,7 @@ struct mansession {
 	struct message *m;
 	int (*handler)(struct mansession *, const struct cw_manager_message *);
 	struct cw_object *pvt_obj;
-	unsigned int q_size, q_r, q_w, q_count, q_max, q_overflow;
+	unsigned int q_size, q_r, q_w, q_count, q_max, q_overflow, q_dropped;
 	struct cw_manager_message **q;
 	pthread_t reader_tid;
 	pthread_t writer_tid;
@@ -243,6 +244,13 @@ extern CW_API_PUBLIC int cw_manager_msg_func(struct cw_manager_message **msg_p,
 extern CW_API_PUBLIC void cw_manager_event_func(cw_event_flag category, size_t count, int map[], const char *fmt, ...)
 	__attribute__ ((format (printf, 4,5)));
 
+/*! \brief check whether any manager session may want events of a given category
+ *      \param category	Event category
+ *      \return zero if nothing currently wants events of this category.
+ *      Events with no category go to every session so are always wanted.
+ */
+extern CW_API_PUBLIC int cw_manager_event_wanted(cw_event_flag category);
+
 
 #ifndef CW_DEBUG_COMPILE
 
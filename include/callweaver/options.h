@@ -50,6 +50,11 @@ extern CW_API_PUBLIC int option_reconnect;
 extern CW_API_PUBLIC int fully_booted;
 extern CW_API_PUBLIC int option_exec_includes;
 extern CW_API_PUBLIC int option_cache_record_files;
+extern CW_API_PUBLIC int option_prompt_cache;
+extern CW_API_PUBLIC int option_prompt_cache_maxfile;
+extern CW_API_PUBLIC int option_recording_writers;
+extern CW_API_PUBLIC int option_recording_buffer;
+extern CW_API_PUBLIC int option_recording_dropcache;
 extern CW_API_PUBLIC int option_transcode_slin;
 extern CW_API_PUBLIC int option_maxcalls;
 extern CW_API_PUBLIC double option_maxload;
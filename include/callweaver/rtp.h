@@ -58,6 +58,8 @@ struct cw_rtp_protocol
 	/* Set RTP peer */
 	int (* const set_rtp_peer)(struct cw_channel *chan, struct cw_rtp *peer, struct cw_rtp *vpeer, int codecs, int nat_active);
 	int (* const get_codec)(struct cw_channel *chan);
+	/* Get RTP struct for in-core relaying, or NULL if media must go through frames */
+	struct cw_rtp *(* const get_relay_info)(struct cw_channel *chan);
 	const char * const type;
 	struct cw_rtp_protocol *next;
 };
@@ -78,6 +80,7 @@ struct cw_rtp
 	uint8_t rawdata[8192 + CW_FRIENDLY_OFFSET];
 	uint32_t ssrc;
 	uint32_t lastts;
+	uint32_t lastsamples;	/* samples in the last audio frame sent */
 	uint32_t lastrxts;
 	uint32_t lastividtimestamp;
 	uint32_t lastovidtimestamp;
@@ -110,6 +113,9 @@ struct cw_rtp
 	int rtp_lookup_code_cache_code;
 	int rtp_lookup_code_cache_result;
 	int rtp_offered_from_local;
+	/* Wall clock time of the last packet relayed in-core, if any */
+	time_t lastrelayrx;
+	time_t lastrelaytx;
 #ifdef ENABLE_SRTP
 	struct cw_srtp *srtp;
 #endif
@@ -82,7 +82,7 @@ typedef void (*cw_schedfail_cb)(void *data);
  */
 struct sched_state {
 	/* These are internal and should not be accessed other than by the scheduler */
-	struct sched_state *next;	/* Next event in the list */
+	unsigned int idx;		/* Position in the schedule heap */
 	cw_sched_cb callback;		/* Callback */
 	void *data; 			/* Data */
 	int vers;			/* Internal version counter */
@@ -3,9 +3,34 @@
 
 #include <sys/socket.h>
 
+/*! A datagram to be received by cw_recvmmsgfromto
+ *
+ * buf, len, from, fromlen, to and tolen are set up by the caller
+ * as for cw_recvfromto. On return len is the number of bytes
+ * actually received and flags holds the received message flags
+ * (MSG_TRUNC if the datagram did not fit in the buffer).
+ */
+struct cw_udpfromto_msg {
+	void *buf;
+	size_t len;
+	struct sockaddr *from;
+	socklen_t fromlen;
+	struct sockaddr *to;
+	socklen_t tolen;
+	int flags;
+};
+
 extern CW_API_PUBLIC int cw_udpfromto_init(int s, int family);
 
 extern CW_API_PUBLIC int cw_recvfromto(int s, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen, struct sockaddr *to, socklen_t *tolen);
+
+/*! Receive up to n datagrams in one call where the platform allows
+ *
+ * Returns the number of datagrams received or -1 on error. Only the
+ * first datagram may block (unless flags includes MSG_DONTWAIT).
+ */
+extern CW_API_PUBLIC int cw_recvmmsgfromto(int s, struct cw_udpfromto_msg *msgs, unsigned int n, int flags);
+
 extern CW_API_PUBLIC int cw_sendfromto(int s, const void *buf, size_t len, int flags, const struct sockaddr *from, socklen_t fromlen, const struct sockaddr *to, socklen_t tolen);
 
 #endif
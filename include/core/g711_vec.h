@@ -0,0 +1,148 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2009, Eris Associates Limited, UK
+ *
+ * Mike Jagdis <mjagdis@eris-associates.co.uk>
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ * \brief Vector helpers shared by the mu-law and A-law encoders
+ *
+ * Each operation exists once per instruction set, named g711_<isa>_<op>, so
+ * that both the SSE2 and AVX2 kernels can be built into the same object
+ * with function target attributes regardless of the compiler flags. Which
+ * one runs is decided at startup by g711_vec_select().
+ */
+
+#ifndef _CALLWEAVER_G711_VEC_H
+#define _CALLWEAVER_G711_VEC_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * The segment and mantissa of a G.711 code are the exponent and the top four
+ * mantissa bits of the (biased) magnitude as a float. Converting it and
+ * shifting the float's bits right by 19 leaves (exponent << 4) | mantissa,
+ * which needs only the float exponent bias and the segment offset of 7
+ * subtracting to give the code.
+ */
+#define G711_VEC_FLOAT_OFFSET		((127 + 7) << 4)
+
+/* Target attributes on functions that use intrinsics need gcc 4.9 or clang */
+#if (defined(__i386__) || defined(__x86_64__)) \
+	&& (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define G711_VEC
+
+#  include <immintrin.h>
+
+/* Generic spellings that paste the instruction set into the name */
+#  define g711_vec_t(isa)		g711_##isa##_t
+#  define g711_vec_target(isa)		g711_##isa##_target
+#  define g711_vec_lanes(isa)		g711_##isa##_lanes
+#  define g711_vec_op(isa, op)		g711_##isa##_##op
+
+#  define g711_sse2_t			__m128i
+#  define g711_sse2_target		__attribute__((target("sse2")))
+#  define g711_sse2_lanes		8
+#  define g711_sse2_set1(n)		_mm_set1_epi16(n)
+#  define g711_sse2_loadu(p)		_mm_loadu_si128((const __m128i *)(p))
+#  define g711_sse2_or(a, b)		_mm_or_si128((a), (b))
+#  define g711_sse2_xor(a, b)		_mm_xor_si128((a), (b))
+#  define g711_sse2_and(a, b)		_mm_and_si128((a), (b))
+#  define g711_sse2_blend(m, a, b)	_mm_or_si128(_mm_and_si128((m), (a)), _mm_andnot_si128((m), (b)))
+#  define g711_sse2_sub(a, b)		_mm_sub_epi16((a), (b))
+#  define g711_sse2_adds(a, b)		_mm_adds_epi16((a), (b))
+#  define g711_sse2_cmpgt(a, b)		_mm_cmpgt_epi16((a), (b))
+#  define g711_sse2_srai(a, n)		_mm_srai_epi16((a), (n))
+#  define g711_sse2_srli(a, n)		_mm_srli_epi16((a), (n))
+#  define g711_sse2_pack_storeu(p, lo, hi) \
+	_mm_storeu_si128((__m128i *)(p), _mm_packus_epi16((lo), (hi)))
+
+static inline g711_sse2_target __m128i g711_sse2_float_code(__m128i v)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_castps_si128(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+	__m128i hi = _mm_castps_si128(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+
+	return _mm_sub_epi16(_mm_packs_epi32(_mm_srli_epi32(lo, 19), _mm_srli_epi32(hi, 19)), _mm_set1_epi16(G711_VEC_FLOAT_OFFSET));
+}
+
+#  define g711_avx2_t			__m256i
+#  define g711_avx2_target		__attribute__((target("avx2")))
+#  define g711_avx2_lanes		16
+#  define g711_avx2_set1(n)		_mm256_set1_epi16(n)
+#  define g711_avx2_loadu(p)		_mm256_loadu_si256((const __m256i *)(p))
+#  define g711_avx2_or(a, b)		_mm256_or_si256((a), (b))
+#  define g711_avx2_xor(a, b)		_mm256_xor_si256((a), (b))
+#  define g711_avx2_and(a, b)		_mm256_and_si256((a), (b))
+#  define g711_avx2_blend(m, a, b)	_mm256_blendv_epi8((b), (a), (m))
+#  define g711_avx2_sub(a, b)		_mm256_sub_epi16((a), (b))
+#  define g711_avx2_adds(a, b)		_mm256_adds_epi16((a), (b))
+#  define g711_avx2_cmpgt(a, b)		_mm256_cmpgt_epi16((a), (b))
+#  define g711_avx2_srai(a, n)		_mm256_srai_epi16((a), (n))
+#  define g711_avx2_srli(a, n)		_mm256_srli_epi16((a), (n))
+/* packus works within 128 bit lanes so the quadwords need putting back in order */
+#  define g711_avx2_pack_storeu(p, lo, hi) \
+	_mm256_storeu_si256((__m256i *)(p), _mm256_permute4x64_epi64(_mm256_packus_epi16((lo), (hi)), 0xd8))
+
+/* unpack and pack both work within 128 bit lanes so the order is preserved */
+static inline g711_avx2_target __m256i g711_avx2_float_code(__m256i v)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_castps_si256(_mm256_cvtepi32_ps(_mm256_unpacklo_epi16(v, zero)));
+	__m256i hi = _mm256_castps_si256(_mm256_cvtepi32_ps(_mm256_unpackhi_epi16(v, zero)));
+
+	return _mm256_sub_epi16(_mm256_packs_epi32(_mm256_srli_epi32(lo, 19), _mm256_srli_epi32(hi, 19)), _mm256_set1_epi16(G711_VEC_FLOAT_OFFSET));
+}
+
+/* A buffer encoder converts as many whole pairs of vectors as fit in n
+ * and returns how many samples that was, leaving the tail to the table.
+ */
+typedef int (*g711_vec_encoder_t)(uint8_t *dst, const int16_t *src, int n);
+
+/* Defines name_isa(), a buffer encoder built from the vector kernel_isa() */
+#  define G711_VEC_ENCODER(name, kernel, isa) \
+g711_vec_target(isa) int name##_##isa(uint8_t *dst, const int16_t *src, int n) \
+{ \
+	const int step = 2 * g711_vec_lanes(isa); \
+	int done; \
+ \
+	for (done = 0; n - done >= step; done += step) \
+		g711_vec_op(isa, pack_storeu)(dst + done, \
+			kernel##_##isa(g711_vec_op(isa, loadu)(src + done)), \
+			kernel##_##isa(g711_vec_op(isa, loadu)(src + done + g711_vec_lanes(isa)))); \
+ \
+	return done; \
+}
+
+/* The widest encoder the CPU we are running on supports, or NULL */
+static inline g711_vec_encoder_t g711_vec_select(g711_vec_encoder_t sse2, g711_vec_encoder_t avx2, const char **isa)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		*isa = "AVX2";
+		return avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		*isa = "SSE2";
+		return sse2;
+	}
+
+	return NULL;
+}
+#endif
+
+#endif /* _CALLWEAVER_G711_VEC_H */
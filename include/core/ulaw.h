@@ -24,6 +24,15 @@
 #define _CALLWEAVER_ULAW_PVT_H
 
 #include "callweaver/callweaver_pcm.h"
+#include "core/g711_vec.h"
+
+#ifdef G711_VEC
+/* The vector encoders, whichever the CPU supports. Each converts as much
+ * of the buffer as it can and returns the number of samples done.
+ */
+extern int cw_lin2mu_sse2(uint8_t *dst, const int16_t *src, int n);
+extern int cw_lin2mu_avx2(uint8_t *dst, const int16_t *src, int n);
+#endif
 
 
 #endif /* _CALLWEAVER_ULAW_H */
@@ -68,6 +68,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/utils.h"
 #include "callweaver/crypto.h"
 #include "callweaver/callweaver_db.h"
+#include "callweaver/callweaver_hash.h"
 #include "callweaver/acl.h"
 #include "callweaver/keywords.h"
 
@@ -204,8 +205,19 @@ struct dundi_transaction {
 	struct dundi_transaction *next;	/* Next with respect to the parent */
 	struct dundi_request *parent;	/* Parent request (if there is one) */
 	struct dundi_transaction *allnext; /* Next with respect to all DUNDi transactions */
+	struct dundi_transaction *snext; /* Next in the same bucket of trans_by_strans */
+	struct dundi_transaction *dnext; /* Next in the same bucket of trans_by_dtrans */
 } *alltrans;
 
+/* Transactions are also indexed by our transaction id and by their
+ * address and transaction id so that incoming packets can find their
+ * transaction without walking alltrans.
+ */
+#define DUNDI_TRANS_BUCKETS	256
+
+static struct dundi_transaction *trans_by_strans[DUNDI_TRANS_BUCKETS];
+static struct dundi_transaction *trans_by_dtrans[DUNDI_TRANS_BUCKETS];
+
 struct dundi_request {
 	char dcontext[CW_MAX_EXTENSION];
 	char number[CW_MAX_EXTENSION];
@@ -336,20 +348,70 @@ static int str2tech(const char *str)
 static int dundi_lookup_internal(struct dundi_result *result, int maxret, struct cw_channel *chan, const char *dcontext, const char *number, int ttl, int blockempty, struct dundi_hint_metadata *md, int *expiration, int cybpass, int modeselect, dundi_eid *skip, dundi_eid *avoid[], int direct[]);
 static int dundi_precache_internal(const char *context, const char *number, int ttl, dundi_eid *avoids[]);
 static struct dundi_transaction *create_transaction(struct dundi_peer *p);
+static inline unsigned int trans_dhash(const struct sockaddr_in *sain, unsigned short dtrans)
+{
+	unsigned int hash;
+
+	hash = cw_hash_mem(dtrans, &sain->sin_addr, sizeof(sain->sin_addr));
+	hash = cw_hash_mem(hash, &sain->sin_port, sizeof(sain->sin_port));
+	return hash % DUNDI_TRANS_BUCKETS;
+}
+
+static void trans_hash(struct dundi_transaction *trans)
+{
+	struct dundi_transaction **bucket;
+
+	bucket = &trans_by_strans[trans->strans % DUNDI_TRANS_BUCKETS];
+	trans->snext = *bucket;
+	*bucket = trans;
+
+	bucket = &trans_by_dtrans[trans_dhash(&trans->addr, trans->dtrans)];
+	trans->dnext = *bucket;
+	*bucket = trans;
+}
+
+static void trans_unhash(struct dundi_transaction *trans)
+{
+	struct dundi_transaction **t;
+
+	for (t = &trans_by_strans[trans->strans % DUNDI_TRANS_BUCKETS]; *t; t = &(*t)->snext) {
+		if (*t == trans) {
+			*t = trans->snext;
+			break;
+		}
+	}
+
+	for (t = &trans_by_dtrans[trans_dhash(&trans->addr, trans->dtrans)]; *t; t = &(*t)->dnext) {
+		if (*t == trans) {
+			*t = trans->dnext;
+			break;
+		}
+	}
+}
+
 static struct dundi_transaction *find_transaction(struct dundi_hdr *hdr, struct sockaddr_in *sain)
 {
-	/* Look for an exact match first */
 	struct dundi_transaction *trans;
-	trans = alltrans;
-	while(trans) {
-		if (!inaddrcmp(&trans->addr, sain) &&
-		     ((trans->strans == (ntohs(hdr->dtrans) & 32767)) /* Matches our destination */ ||
-			  ((trans->dtrans == (ntohs(hdr->strans) & 32767)) && (!hdr->dtrans))) /* We match their destination */) {
-			  if (hdr->strans)
-				  trans->dtrans = ntohs(hdr->strans) & 32767;
-			  break;
+	unsigned short strans = ntohs(hdr->dtrans) & 32767;
+	unsigned short dtrans = ntohs(hdr->strans) & 32767;
+
+	/* Look for an exact match first */
+	for (trans = trans_by_strans[strans % DUNDI_TRANS_BUCKETS]; trans; trans = trans->snext) {
+		/* Matches our destination */
+		if (trans->strans == strans && !inaddrcmp(&trans->addr, sain))
+			break;
+	}
+	if (!trans && !hdr->dtrans) {
+		for (trans = trans_by_dtrans[trans_dhash(sain, dtrans)]; trans; trans = trans->dnext) {
+			/* We match their destination */
+			if (trans->dtrans == dtrans && !inaddrcmp(&trans->addr, sain))
+				break;
 		}
-		trans = trans->allnext;
+	}
+	if (trans && hdr->strans && trans->dtrans != dtrans) {
+		trans_unhash(trans);
+		trans->dtrans = dtrans;
+		trans_hash(trans);
 	}
 	if (!trans) {
 		switch(hdr->cmdresp & 0x7f) {
@@ -363,8 +425,10 @@ static struct dundi_transaction *find_transaction(struct dundi_hdr *hdr, struct
 				/* Create new transaction */
 				trans = create_transaction(NULL);
 				if (trans) {
+					trans_unhash(trans);
 					memcpy(&trans->addr, sain, sizeof(trans->addr));
-					trans->dtrans = ntohs(hdr->strans) & 32767;
+					trans->dtrans = dtrans;
+					trans_hash(trans);
 				} else
 					cw_log(CW_LOG_WARNING, "Out of memory\n");
 			}
@@ -460,11 +524,9 @@ static int get_trans_id(void)
 	int stid = (cw_random() % 32766) + 1;
 	int tid = stid;
 	do {
-		t = alltrans;
-		while(t) {
-			if (t->strans == tid) 
+		for (t = trans_by_strans[tid % DUNDI_TRANS_BUCKETS]; t; t = t->snext) {
+			if (t->strans == tid)
 				break;
-			t = t->allnext;
 		}
 		if (!t)
 			return tid;
@@ -479,8 +541,10 @@ static int reset_transaction(struct dundi_transaction *trans)
 	tid = get_trans_id();
 	if (tid < 1)
 		return -1;
+	trans_unhash(trans);
 	trans->strans = tid;
 	trans->dtrans = 0;
+	trans_hash(trans);
 	trans->iseqno = 0;
 	trans->oiseqno = 0;
 	trans->oseqno = 0;
@@ -806,14 +870,536 @@ static int dundi_answer_entity(struct dundi_transaction *trans, struct dundi_ies
 	return 0;
 }
 
+/* The answer cache is held in memory. Entries are indexed by a hash of
+ * the peer, context and number together with either the CRC-32 of the
+ * avoid list or the root EID and are kept in a heap ordered by expiry so
+ * stale entries can be dropped without a scan. It can be snapshotted to
+ * disk periodically so that it survives a restart.
+ */
+#define DUNDI_CACHE_BUCKETS		4096
+#define DUNDI_DEFAULT_CACHE_SIZE	65536
+
+struct dundi_cache_id {
+	dundi_eid peer;				/* Peer the answer came from */
+	dundi_eid root;				/* Root EID if keyed by root */
+	uint32_t crc32;				/* CRC-32 of the avoid list if not keyed by root */
+	unsigned char byroot;			/* Keyed by root rather than by CRC-32 */
+	unsigned char hint;			/* This is a "don't ask" hint rather than an answer */
+} __attribute__ ((__packed__));
+
+struct dundi_cache_answer {
+	unsigned int flags;
+	int weight;
+	int tech;
+	dundi_eid eid;				/* EID of the original answerer */
+	const char *dest;
+};
+
+struct dundi_cache_entry {
+	struct dundi_cache_entry *next;		/* Next in the same hash bucket */
+	unsigned int hash;
+	int heapidx;				/* Position in the expiry heap */
+	time_t expiration;
+	size_t size;
+	struct dundi_cache_id id;
+	const char *dcontext;
+	const char *number;
+	char *tail;				/* Free space for strings */
+	int nanswers;
+	struct dundi_cache_answer answers[0];
+};
+
+/* Snapshot file layout: the magic followed by one record per entry, each
+ * followed by its context and number, then by its answers each followed
+ * by its destination. Strings are not terminated.
+ */
+static const char dundi_cache_magic[8] = { 'D', 'U', 'N', 'D', 'I', 'C', '0', '1' };
+
+struct dundi_cache_record {
+	int64_t expiration;
+	struct dundi_cache_id id;
+	uint16_t dcontextlen;
+	uint16_t numberlen;
+	uint16_t nanswers;
+} __attribute__ ((__packed__));
+
+struct dundi_cache_answer_record {
+	uint32_t flags;
+	int32_t weight;
+	int32_t tech;
+	dundi_eid eid;
+	uint16_t destlen;
+} __attribute__ ((__packed__));
+
+CW_MUTEX_DEFINE_STATIC(dundi_cache_lock);
+CW_MUTEX_DEFINE_STATIC(dundi_snapshot_lock);
+static struct dundi_cache_entry *dundi_cache[DUNDI_CACHE_BUCKETS];
+static struct dundi_cache_entry **dundi_cache_heap;
+static int dundi_cache_heapalloc;
+static int dundi_cache_entries;
+static size_t dundi_cache_bytes;
+static int dundi_cache_size = DUNDI_DEFAULT_CACHE_SIZE;
+static int dundi_cache_snapshot = 0;
+static time_t dundi_cache_nextsnapshot;
+static int dundi_cache_snapshotting;
+
+static struct {
+	unsigned long stores;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long expired;
+	unsigned long evicted;
+	unsigned long snapshots;
+	unsigned long snapshotted;
+	unsigned long loaded;
+	time_t lastsnapshot;
+} dundi_cache_stats;
+
+static unsigned int dundi_cache_hash(const struct dundi_cache_id *id, const char *dcontext, const char *number)
+{
+	unsigned int hash;
+
+	hash = cw_hash_mem(0, id, sizeof(*id));
+	hash = cw_hash_string(hash, dcontext);
+	hash = cw_hash_add(hash, '/');
+	return cw_hash_string(hash, number);
+}
+
+static void dundi_cache_heap_set(int i, struct dundi_cache_entry *e)
+{
+	dundi_cache_heap[i] = e;
+	e->heapidx = i;
+}
+
+static void dundi_cache_heap_up(int i)
+{
+	struct dundi_cache_entry *e = dundi_cache_heap[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (dundi_cache_heap[parent]->expiration <= e->expiration)
+			break;
+		dundi_cache_heap_set(i, dundi_cache_heap[parent]);
+		i = parent;
+	}
+	dundi_cache_heap_set(i, e);
+}
+
+static void dundi_cache_heap_down(int i)
+{
+	struct dundi_cache_entry *e = dundi_cache_heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < dundi_cache_entries) {
+		if (child + 1 < dundi_cache_entries && dundi_cache_heap[child + 1]->expiration < dundi_cache_heap[child]->expiration)
+			child++;
+		if (e->expiration <= dundi_cache_heap[child]->expiration)
+			break;
+		dundi_cache_heap_set(i, dundi_cache_heap[child]);
+		i = child;
+	}
+	dundi_cache_heap_set(i, e);
+}
+
+/* All of the following expect dundi_cache_lock to be held */
+
+static struct dundi_cache_entry *dundi_cache_find(const struct dundi_cache_id *id, const char *dcontext, const char *number, unsigned int hash)
+{
+	struct dundi_cache_entry *e;
+
+	for (e = dundi_cache[hash % DUNDI_CACHE_BUCKETS]; e; e = e->next) {
+		if (e->hash == hash && !memcmp(&e->id, id, sizeof(*id))
+		&& !strcmp(e->number, number) && !strcmp(e->dcontext, dcontext))
+			break;
+	}
+
+	return e;
+}
+
+static void dundi_cache_remove(struct dundi_cache_entry *e)
+{
+	struct dundi_cache_entry **p;
+	int i;
+
+	for (p = &dundi_cache[e->hash % DUNDI_CACHE_BUCKETS]; *p; p = &(*p)->next) {
+		if (*p == e) {
+			*p = e->next;
+			break;
+		}
+	}
+
+	i = e->heapidx;
+	if (i < --dundi_cache_entries) {
+		dundi_cache_heap_set(i, dundi_cache_heap[dundi_cache_entries]);
+		dundi_cache_heap_up(i);
+		dundi_cache_heap_down(dundi_cache_heap[i]->heapidx);
+	}
+
+	dundi_cache_bytes -= e->size;
+	free(e);
+}
+
+static void dundi_cache_purge(time_t now)
+{
+	while (dundi_cache_entries && dundi_cache_heap[0]->expiration <= now) {
+		dundi_cache_remove(dundi_cache_heap[0]);
+		dundi_cache_stats.expired++;
+	}
+}
+
+static void dundi_cache_flush(void)
+{
+	while (dundi_cache_entries)
+		dundi_cache_remove(dundi_cache_heap[0]);
+}
+
+/* Takes ownership of e. An existing entry with the same key is replaced
+ * unless replace is zero in which case the new entry is discarded.
+ */
+static void dundi_cache_insert(struct dundi_cache_entry *e, int replace)
+{
+	struct dundi_cache_entry *old, **heap;
+	int n;
+
+	if ((old = dundi_cache_find(&e->id, e->dcontext, e->number, e->hash))) {
+		if (!replace) {
+			free(e);
+			return;
+		}
+		dundi_cache_remove(old);
+	}
+
+	while (dundi_cache_entries && dundi_cache_entries >= dundi_cache_size) {
+		dundi_cache_remove(dundi_cache_heap[0]);
+		dundi_cache_stats.evicted++;
+	}
+
+	if (dundi_cache_size <= 0) {
+		free(e);
+		return;
+	}
+
+	if (dundi_cache_entries == dundi_cache_heapalloc) {
+		n = (dundi_cache_heapalloc ? dundi_cache_heapalloc * 2 : 256);
+		if (!(heap = realloc(dundi_cache_heap, n * sizeof(*heap)))) {
+			cw_log(CW_LOG_ERROR, "Out of memory\n");
+			free(e);
+			return;
+		}
+		dundi_cache_heap = heap;
+		dundi_cache_heapalloc = n;
+	}
+
+	e->next = dundi_cache[e->hash % DUNDI_CACHE_BUCKETS];
+	dundi_cache[e->hash % DUNDI_CACHE_BUCKETS] = e;
+
+	dundi_cache_heap_set(dundi_cache_entries++, e);
+	dundi_cache_heap_up(e->heapidx);
+	dundi_cache_bytes += e->size;
+}
+
+/* The caller adds exactly nanswers answers, whose destinations must
+ * total no more than destspace bytes including terminators.
+ */
+static struct dundi_cache_entry *dundi_cache_new(const struct dundi_cache_id *id, const char *dcontext, size_t dcontextlen, const char *number, size_t numberlen, time_t expiration, int nanswers, size_t destspace)
+{
+	struct dundi_cache_entry *e;
+	size_t size;
+
+	size = sizeof(*e) + nanswers * sizeof(e->answers[0]) + dcontextlen + 1 + numberlen + 1 + destspace;
+	if ((e = malloc(size))) {
+		e->size = size;
+		e->expiration = expiration;
+		e->id = *id;
+		e->nanswers = 0;
+		e->tail = (char *)&e->answers[nanswers];
+		memcpy(e->tail, dcontext, dcontextlen);
+		e->tail[dcontextlen] = '\0';
+		e->dcontext = e->tail;
+		e->tail += dcontextlen + 1;
+		memcpy(e->tail, number, numberlen);
+		e->tail[numberlen] = '\0';
+		e->number = e->tail;
+		e->tail += numberlen + 1;
+		e->hash = dundi_cache_hash(id, e->dcontext, e->number);
+	} else
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+
+	return e;
+}
+
+static void dundi_cache_add_answer(struct dundi_cache_entry *e, unsigned int flags, int weight, int tech, const dundi_eid *eid, const char *dest, size_t destlen)
+{
+	struct dundi_cache_answer *answer = &e->answers[e->nanswers++];
+
+	answer->flags = flags;
+	answer->weight = weight;
+	answer->tech = tech;
+	answer->eid = *eid;
+	memcpy(e->tail, dest, destlen);
+	e->tail[destlen] = '\0';
+	answer->dest = e->tail;
+	e->tail += destlen + 1;
+}
+
+static int dundi_cache_store(const struct dundi_cache_id *id, const char *dcontext, const char *number, time_t expiration, struct dundi_result *dr, int count)
+{
+	struct dundi_cache_entry *e;
+	size_t destspace = 0;
+	int x;
+
+	for (x = 0; x < count; x++)
+		destspace += (dr[x].dest.data ? strlen(dr[x].dest.data) : 0) + 1;
+
+	if (!(e = dundi_cache_new(id, dcontext, strlen(dcontext), number, strlen(number), expiration, count, destspace)))
+		return -1;
+
+	for (x = 0; x < count; x++)
+		dundi_cache_add_answer(e, dr[x].flags, dr[x].weight, dr[x].techint, &dr[x].eid,
+			(dr[x].dest.data ? dr[x].dest.data : ""), (dr[x].dest.data ? strlen(dr[x].dest.data) : 0));
+
+	cw_mutex_lock(&dundi_cache_lock);
+	dundi_cache_purge(time(NULL));
+	dundi_cache_insert(e, 1);
+	dundi_cache_stats.stores++;
+	cw_mutex_unlock(&dundi_cache_lock);
+	return 0;
+}
+
+static void dundi_cache_save_snapshot(void)
+{
+	char path[256], tmppath[256];
+	struct dundi_cache_record rec;
+	struct dundi_cache_answer_record arec;
+	struct dundi_cache_entry *e;
+	unsigned char *buf, *p;
+	FILE *fp;
+	size_t size, destlen;
+	int count, x, y;
+
+	snprintf(path, sizeof(path), "%s/dundi-cache", cw_config[CW_DB_DIR]);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	/* The network thread may still be finishing a snapshot when we unload */
+	cw_mutex_lock(&dundi_snapshot_lock);
+
+	/* Serialize under the lock and write out without it */
+	cw_mutex_lock(&dundi_cache_lock);
+
+	dundi_cache_purge(time(NULL));
+
+	size = sizeof(dundi_cache_magic);
+	for (x = 0; x < dundi_cache_entries; x++) {
+		e = dundi_cache_heap[x];
+		size += sizeof(rec) + strlen(e->dcontext) + strlen(e->number);
+		for (y = 0; y < e->nanswers; y++)
+			size += sizeof(arec) + strlen(e->answers[y].dest);
+	}
+
+	if (!(buf = malloc(size))) {
+		cw_mutex_unlock(&dundi_cache_lock);
+		cw_mutex_unlock(&dundi_snapshot_lock);
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+		return;
+	}
+
+	memcpy(buf, dundi_cache_magic, sizeof(dundi_cache_magic));
+	p = buf + sizeof(dundi_cache_magic);
+	count = 0;
+	for (x = 0; x < dundi_cache_entries; x++) {
+		e = dundi_cache_heap[x];
+		rec.expiration = e->expiration;
+		rec.id = e->id;
+		rec.dcontextlen = strlen(e->dcontext);
+		rec.numberlen = strlen(e->number);
+		rec.nanswers = e->nanswers;
+		memcpy(p, &rec, sizeof(rec));
+		p += sizeof(rec);
+		memcpy(p, e->dcontext, rec.dcontextlen);
+		p += rec.dcontextlen;
+		memcpy(p, e->number, rec.numberlen);
+		p += rec.numberlen;
+		for (y = 0; y < e->nanswers; y++) {
+			destlen = strlen(e->answers[y].dest);
+			arec.flags = e->answers[y].flags;
+			arec.weight = e->answers[y].weight;
+			arec.tech = e->answers[y].tech;
+			arec.eid = e->answers[y].eid;
+			arec.destlen = destlen;
+			memcpy(p, &arec, sizeof(arec));
+			p += sizeof(arec);
+			memcpy(p, e->answers[y].dest, destlen);
+			p += destlen;
+		}
+		count++;
+	}
+
+	cw_mutex_unlock(&dundi_cache_lock);
+
+	if ((fp = fopen(tmppath, "w"))) {
+		if (fwrite(buf, 1, p - buf, fp) == (size_t)(p - buf) && !fflush(fp) && !fsync(fileno(fp))) {
+			if (!fclose(fp)) {
+				if (!rename(tmppath, path)) {
+					cw_mutex_lock(&dundi_cache_lock);
+					dundi_cache_stats.snapshots++;
+					dundi_cache_stats.snapshotted = count;
+					time(&dundi_cache_stats.lastsnapshot);
+					cw_mutex_unlock(&dundi_cache_lock);
+					if (option_debug)
+						cw_log(CW_LOG_DEBUG, "Saved %d DUNDi cache entries to %s\n", count, path);
+				} else
+					cw_log(CW_LOG_WARNING, "Unable to rename %s to %s: %s\n", tmppath, path, strerror(errno));
+			} else
+				cw_log(CW_LOG_WARNING, "Unable to write %s: %s\n", tmppath, strerror(errno));
+		} else {
+			cw_log(CW_LOG_WARNING, "Unable to write %s: %s\n", tmppath, strerror(errno));
+			fclose(fp);
+		}
+	} else
+		cw_log(CW_LOG_WARNING, "Unable to create %s: %s\n", tmppath, strerror(errno));
+
+	cw_mutex_unlock(&dundi_snapshot_lock);
+	free(buf);
+}
+
+static void dundi_cache_load_snapshot(void)
+{
+	char path[256];
+	char magic[sizeof(dundi_cache_magic)];
+	char dcontext[CW_MAX_EXTENSION], number[CW_MAX_EXTENSION];
+	struct dundi_cache_record rec;
+	struct dundi_cache_answer_record arec;
+	struct dundi_cache_entry *e;
+	FILE *fp;
+	char *dest;
+	time_t now;
+	off_t answers;
+	size_t destspace;
+	int count = 0;
+	int c, y;
+
+	snprintf(path, sizeof(path), "%s/dundi-cache", cw_config[CW_DB_DIR]);
+
+	if (!(fp = fopen(path, "r"))) {
+		if (errno != ENOENT)
+			cw_log(CW_LOG_WARNING, "Unable to open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, dundi_cache_magic, sizeof(magic))) {
+		cw_log(CW_LOG_WARNING, "%s is not a DUNDi cache snapshot, ignoring it\n", path);
+		fclose(fp);
+		return;
+	}
+
+	if (!(dest = malloc(65536))) {
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+		fclose(fp);
+		return;
+	}
+
+	time(&now);
+
+	while ((c = getc(fp)) != EOF) {
+		ungetc(c, fp);
+
+		if (fread(&rec, sizeof(rec), 1, fp) != 1
+		|| rec.dcontextlen >= sizeof(dcontext) || rec.numberlen >= sizeof(number)
+		|| fread(dcontext, 1, rec.dcontextlen, fp) != rec.dcontextlen
+		|| fread(number, 1, rec.numberlen, fp) != rec.numberlen)
+			break;
+
+		/* The answers are read twice, once to size the entry and once to fill it */
+		answers = ftello(fp);
+		destspace = 0;
+		for (y = 0; y < rec.nanswers; y++) {
+			if (fread(&arec, sizeof(arec), 1, fp) != 1 || fseeko(fp, arec.destlen, SEEK_CUR))
+				break;
+			destspace += arec.destlen + 1;
+		}
+		if (y < rec.nanswers)
+			break;
+
+		if (rec.expiration > now) {
+			if (fseeko(fp, answers, SEEK_SET)
+			|| !(e = dundi_cache_new(&rec.id, dcontext, rec.dcontextlen, number, rec.numberlen, rec.expiration, rec.nanswers, destspace)))
+				break;
+
+			for (y = 0; y < rec.nanswers; y++) {
+				if (fread(&arec, sizeof(arec), 1, fp) != 1 || fread(dest, 1, arec.destlen, fp) != arec.destlen)
+					break;
+				dundi_cache_add_answer(e, arec.flags, arec.weight, arec.tech, &arec.eid, dest, arec.destlen);
+			}
+			if (y < rec.nanswers) {
+				free(e);
+				break;
+			}
+
+			/* Anything cached since we started is more recent than the snapshot */
+			cw_mutex_lock(&dundi_cache_lock);
+			dundi_cache_insert(e, 0);
+			cw_mutex_unlock(&dundi_cache_lock);
+			count++;
+		}
+	}
+
+	if (c != EOF)
+		cw_log(CW_LOG_WARNING, "%s is truncated or corrupt, some entries were not loaded\n", path);
+
+	cw_mutex_lock(&dundi_cache_lock);
+	dundi_cache_stats.loaded = count;
+	cw_mutex_unlock(&dundi_cache_lock);
+
+	free(dest);
+	fclose(fp);
+
+	if (option_verbose > 1)
+		cw_verbose(VERBOSE_PREFIX_2 "Loaded %d DUNDi cache entries from %s\n", count, path);
+}
+
+static void *dundi_cache_snapshot_thread(void *data)
+{
+	CW_UNUSED(data);
+
+	dundi_cache_save_snapshot();
+
+	cw_mutex_lock(&dundi_cache_lock);
+	dundi_cache_snapshotting = 0;
+	cw_mutex_unlock(&dundi_cache_lock);
+	return NULL;
+}
+
+/* Called from the network thread, which must not wait on the disk */
+static void check_cache_snapshot(void)
+{
+	pthread_t snapshotthread;
+	time_t now;
+	int busy;
+
+	if (dundi_cache_snapshot > 0) {
+		time(&now);
+		if ((now - dundi_cache_nextsnapshot) >= 0) {
+			dundi_cache_nextsnapshot = now + dundi_cache_snapshot;
+
+			cw_mutex_lock(&dundi_cache_lock);
+			busy = dundi_cache_snapshotting;
+			dundi_cache_snapshotting = 1;
+			cw_mutex_unlock(&dundi_cache_lock);
+
+			if (!busy && cw_pthread_create(&snapshotthread, &global_attr_detached, dundi_cache_snapshot_thread, NULL)) {
+				cw_log(CW_LOG_WARNING, "Unable to create DUNDi cache snapshot thread!\n");
+				cw_mutex_lock(&dundi_cache_lock);
+				dundi_cache_snapshotting = 0;
+				cw_mutex_unlock(&dundi_cache_lock);
+			}
+		}
+	}
+}
+
 static int cache_save_hint(dundi_eid *eidpeer, struct dundi_request *req, struct dundi_hint *hint, int expiration)
 {
-	int unaffected;
-	char key1[256];
-	char key2[256];
-	char eidpeer_str[20];
-	char eidroot_str[20];
-	char data[80];
+	struct dundi_cache_id id;
 	time_t timeout;
 
 	if (expiration < 0)
@@ -823,32 +1409,27 @@ static int cache_save_hint(dundi_eid *eidpeer, struct dundi_request *req, struct
 	if (!cw_test_flag_nonstd(hint, htons(DUNDI_HINT_DONT_ASK)))	
 		return 0;
 
-	unaffected = cw_test_flag_nonstd(hint, htons(DUNDI_HINT_UNAFFECTED));
-
-	dundi_eid_to_str_short(eidpeer_str, sizeof(eidpeer_str), eidpeer);
-	dundi_eid_to_str_short(eidroot_str, sizeof(eidroot_str), &req->root_eid);
-	snprintf(key1, sizeof(key1), "hint/%s/%s/%s/e%08lx", eidpeer_str, (char *)hint->data, req->dcontext, unaffected ? 0 : req->crc32);
-	snprintf(key2, sizeof(key2), "hint/%s/%s/%s/r%s", eidpeer_str, (char *)hint->data, req->dcontext, eidroot_str);
-
 	time(&timeout);
 	timeout += expiration;
-	snprintf(data, sizeof(data), "%ld,", (long)(timeout));
-	
-	cw_db_put("dundi/cache", key1, data);
-	cw_log(CW_LOG_DEBUG, "Caching hint at '%s'\n", key1);
-	cw_db_put("dundi/cache", key2, data);
-	cw_log(CW_LOG_DEBUG, "Caching hint at '%s'\n", key2);
+
+	memset(&id, 0, sizeof(id));
+	id.peer = *eidpeer;
+	id.hint = 1;
+	id.crc32 = (cw_test_flag_nonstd(hint, htons(DUNDI_HINT_UNAFFECTED)) ? 0 : req->crc32);
+	dundi_cache_store(&id, req->dcontext, (char *)hint->data, timeout, NULL, 0);
+	cw_log(CW_LOG_DEBUG, "Caching hint for '%s' in '%s' by CRC-32 %08lx\n", (char *)hint->data, req->dcontext, (unsigned long)id.crc32);
+
+	id.crc32 = 0;
+	id.byroot = 1;
+	id.root = req->root_eid;
+	dundi_cache_store(&id, req->dcontext, (char *)hint->data, timeout, NULL, 0);
+	cw_log(CW_LOG_DEBUG, "Caching hint for '%s' in '%s' by root\n", (char *)hint->data, req->dcontext);
 	return 0;
 }
 
 static int cache_save(dundi_eid *eidpeer, struct dundi_request *req, int start, int unaffected, int expiration, int push)
 {
-	int x;
-	char key1[256];
-	char key2[256];
-	char data[1024];
-	char eidpeer_str[20];
-	char eidroot_str[20];
+	struct dundi_cache_id id;
 	time_t timeout;
 
 	if (expiration < 1)	
@@ -861,24 +1442,19 @@ static int cache_save(dundi_eid *eidpeer, struct dundi_request *req, int start,
 		expiration -= 10;
 	if (expiration < 1)
 		expiration = 1;
-	dundi_eid_to_str_short(eidpeer_str, sizeof(eidpeer_str), eidpeer);
-	dundi_eid_to_str_short(eidroot_str, sizeof(eidroot_str), &req->root_eid);
-	snprintf(key1, sizeof(key1), "%s/%s/%s/e%08lx", eidpeer_str, req->number, req->dcontext, unaffected ? 0 : req->crc32);
-	snprintf(key2, sizeof(key2), "%s/%s/%s/r%s", eidpeer_str, req->number, req->dcontext, eidroot_str);
-	/* Build request string */
+
 	time(&timeout);
 	timeout += expiration;
-	snprintf(data, sizeof(data), "%ld,", (long)(timeout));
-	for (x=start;x<req->respcount;x++) {
-		/* Skip anything with an illegal comma in it */
-		if (strchr(req->dr[x].dest.data, ','))
-			continue;
-		snprintf(data + strlen(data), sizeof(data) - strlen(data), "%u/%d/%d/%s/%s,",
-			req->dr[x].flags, req->dr[x].weight, req->dr[x].techint, req->dr[x].dest.data,
-			dundi_eid_to_str_short(eidpeer_str, sizeof(eidpeer_str), &req->dr[x].eid));
-	}
-	cw_db_put("dundi/cache", key1, data);
-	cw_db_put("dundi/cache", key2, data);
+
+	memset(&id, 0, sizeof(id));
+	id.peer = *eidpeer;
+	id.crc32 = (unaffected ? 0 : req->crc32);
+	dundi_cache_store(&id, req->dcontext, req->number, timeout, req->dr + start, req->respcount - start);
+
+	id.crc32 = 0;
+	id.byroot = 1;
+	id.root = req->root_eid;
+	dundi_cache_store(&id, req->dcontext, req->number, timeout, req->dr + start, req->respcount - start);
 	return 0;
 }
 
@@ -1127,85 +1703,72 @@ static int dundi_answer_query(struct dundi_transaction *trans, struct dundi_ies
 	return 0;
 }
 
-static int cache_lookup_internal(time_t now, struct dundi_request *req, char *key, char *eid_str_full, int *lowexpiration)
+static int cache_lookup_internal(time_t now, struct dundi_request *req, const struct dundi_cache_id *id, const char *number, char *eid_str_full, int *lowexpiration)
 {
-	struct cw_dynstr ds = CW_DYNSTR_INIT;
-	char *ptr, *term, *src;
-	int tech;
-	struct cw_flags flags;
-	int weight;
-	int length;
-	int z;
+	struct dundi_cache_entry *e;
+	struct dundi_cache_answer *answer;
 	int expiration;
+	int x, z;
 	char fs[256];
-	time_t timeout;
+	char eid_str[20];
 
-	/* Build request string */
-	if (!cw_db_get("dundi/cache", key, &ds)) {
-		ptr = ds.data;
-		if (sscanf(ptr, "%ld,%n", &timeout, &length) == 1) {
-			expiration = timeout - now;
-			if (expiration > 0) {
-				cw_log(CW_LOG_DEBUG, "Found cache expiring in %d seconds!\n", (int)(timeout - now));
-				ptr += length;
-				while((sscanf(ptr, "%u/%d/%d/%n", &(flags.flags), &weight, &tech, &length) == 3)) {
-					ptr += length;
-					term = strchr(ptr, ',');
-					if (term) {
-						*term = '\0';
-						src = strrchr(ptr, '/');
-						if (src) {
-							*src = '\0';
-							src++;
-						} else
-							src = (char *)"";
-						cw_log(CW_LOG_DEBUG, "Found cached answer '%s/%s' originally from '%s' with flags '%s' on behalf of '%s'\n", 
-							tech2str(tech), ptr, src, dundi_flags2str(fs, sizeof(fs), flags.flags), eid_str_full);
-						/* Make sure it's not already there */
-						for (z=0;z<req->respcount;z++) {
-							if ((req->dr[z].techint == tech) &&
-							    !strcmp(req->dr[z].dest.data, ptr))
-									break;
-						}
-						if (z == req->respcount) {
-							/* Copy into parent responses */
-							cw_copy_flags(&(req->dr[req->respcount]), &flags, CW_FLAGS_ALL);	
-							req->dr[req->respcount].weight = weight;
-							req->dr[req->respcount].techint = tech;
-							req->dr[req->respcount].expiration = expiration;
-							dundi_str_short_to_eid(&req->dr[req->respcount].eid, src);
-							dundi_eid_to_str(req->dr[req->respcount].eid_str, 
-								sizeof(req->dr[req->respcount].eid_str), &req->dr[req->respcount].eid);
-							cw_dynstr_printf(&req->dr[req->respcount].dest, "%s", ptr);
-							cw_copy_string(req->dr[req->respcount].tech, tech2str(tech),
-								sizeof(req->dr[req->respcount].tech));
-							req->respcount++;
-							cw_clear_flag_nonstd(req->hmd, DUNDI_HINT_DONT_ASK);	
-						} else if (req->dr[z].weight > weight)
-							req->dr[z].weight = weight;
-						ptr = term + 1;
-					}
-				}
-				/* We found *something* cached */
-				if (expiration < *lowexpiration)
-					*lowexpiration = expiration;
-				return 1;
-			} else 
-				cw_db_del("dundi/cache", key);
-		} else 
-			cw_db_del("dundi/cache", key);
+	cw_mutex_lock(&dundi_cache_lock);
 
-		cw_dynstr_free(&ds);
+	dundi_cache_purge(now);
+
+	if (!(e = dundi_cache_find(id, req->dcontext, number, dundi_cache_hash(id, req->dcontext, number)))) {
+		dundi_cache_stats.misses++;
+		cw_mutex_unlock(&dundi_cache_lock);
+		return 0;
 	}
-		
-	return 0;
+
+	dundi_cache_stats.hits++;
+
+	expiration = e->expiration - now;
+	cw_log(CW_LOG_DEBUG, "Found cache expiring in %d seconds!\n", expiration);
+
+	for (x = 0; x < e->nanswers; x++) {
+		answer = &e->answers[x];
+		cw_log(CW_LOG_DEBUG, "Found cached answer '%s/%s' originally from '%s' with flags '%s' on behalf of '%s'\n", 
+			tech2str(answer->tech), answer->dest, dundi_eid_to_str_short(eid_str, sizeof(eid_str), &answer->eid),
+			dundi_flags2str(fs, sizeof(fs), answer->flags), eid_str_full);
+		/* Make sure it's not already there */
+		for (z=0;z<req->respcount;z++) {
+			if ((req->dr[z].techint == answer->tech) &&
+			    !strcmp(req->dr[z].dest.data, answer->dest))
+					break;
+		}
+		if (z == req->respcount) {
+			if (req->respcount >= req->maxcount)
+				continue;
+			/* Copy into parent responses */
+			req->dr[req->respcount].flags = answer->flags;
+			req->dr[req->respcount].weight = answer->weight;
+			req->dr[req->respcount].techint = answer->tech;
+			req->dr[req->respcount].expiration = expiration;
+			req->dr[req->respcount].eid = answer->eid;
+			dundi_eid_to_str(req->dr[req->respcount].eid_str, 
+				sizeof(req->dr[req->respcount].eid_str), &req->dr[req->respcount].eid);
+			cw_dynstr_printf(&req->dr[req->respcount].dest, "%s", answer->dest);
+			cw_copy_string(req->dr[req->respcount].tech, tech2str(answer->tech),
+				sizeof(req->dr[req->respcount].tech));
+			req->respcount++;
+			cw_clear_flag_nonstd(req->hmd, DUNDI_HINT_DONT_ASK);	
+		} else if (req->dr[z].weight > answer->weight)
+			req->dr[z].weight = answer->weight;
+	}
+
+	cw_mutex_unlock(&dundi_cache_lock);
+
+	/* We found *something* cached */
+	if (expiration < *lowexpiration)
+		*lowexpiration = expiration;
+	return 1;
 }
 
 static int cache_lookup(struct dundi_request *req, dundi_eid *peer_eid, unsigned long csum_crc32, int *lowexpiration)
 {
-	char key[256];
-	char eid_str[20];
-	char eidroot_str[20];
+	struct dundi_cache_id id;
 	time_t now;
 	int res=0;
 	int res2=0;
@@ -1214,17 +1777,20 @@ static int cache_lookup(struct dundi_request *req, dundi_eid *peer_eid, unsigned
 	int x;
 
 	time(&now);
-	dundi_eid_to_str_short(eid_str, sizeof(eid_str), peer_eid);
-	dundi_eid_to_str_short(eidroot_str, sizeof(eidroot_str), &req->root_eid);
 	dundi_eid_to_str(eid_str_full, sizeof(eid_str_full), peer_eid);
-	snprintf(key, sizeof(key), "%s/%s/%s/e%08lx", eid_str, req->number, req->dcontext, csum_crc32);
-	res |= cache_lookup_internal(now, req, key, eid_str_full, lowexpiration);
-	snprintf(key, sizeof(key), "%s/%s/%s/e%08lx", eid_str, req->number, req->dcontext, 0L);
-	res |= cache_lookup_internal(now, req, key, eid_str_full, lowexpiration);
-	snprintf(key, sizeof(key), "%s/%s/%s/r%s", eid_str, req->number, req->dcontext, eidroot_str);
-	res |= cache_lookup_internal(now, req, key, eid_str_full, lowexpiration);
+
+	memset(&id, 0, sizeof(id));
+	id.peer = *peer_eid;
+	id.crc32 = csum_crc32;
+	res |= cache_lookup_internal(now, req, &id, req->number, eid_str_full, lowexpiration);
+	id.crc32 = 0;
+	res |= cache_lookup_internal(now, req, &id, req->number, eid_str_full, lowexpiration);
+	id.byroot = 1;
+	id.root = req->root_eid;
+	res |= cache_lookup_internal(now, req, &id, req->number, eid_str_full, lowexpiration);
 	x = 0;
 	if (!req->respcount) {
+		id.hint = 1;
 		while(!res2) {
 			/* Look and see if we have a hint that would preclude us from looking at this
 			   peer for this number. */
@@ -1232,12 +1798,15 @@ static int cache_lookup(struct dundi_request *req, dundi_eid *peer_eid, unsigned
 				break;
 			x++;
 			/* Check for hints */
-			snprintf(key, sizeof(key), "hint/%s/%s/%s/e%08lx", eid_str, tmp, req->dcontext, csum_crc32);
-			res2 |= cache_lookup_internal(now, req, key, eid_str_full, lowexpiration);
-			snprintf(key, sizeof(key), "hint/%s/%s/%s/e%08lx", eid_str, tmp, req->dcontext, 0L);
-			res2 |= cache_lookup_internal(now, req, key, eid_str_full, lowexpiration);
-			snprintf(key, sizeof(key), "hint/%s/%s/%s/r%s", eid_str, tmp, req->dcontext, eidroot_str);
-			res2 |= cache_lookup_internal(now, req, key, eid_str_full, lowexpiration);
+			id.byroot = 0;
+			memset(&id.root, 0, sizeof(id.root));
+			id.crc32 = csum_crc32;
+			res2 |= cache_lookup_internal(now, req, &id, tmp, eid_str_full, lowexpiration);
+			id.crc32 = 0;
+			res2 |= cache_lookup_internal(now, req, &id, tmp, eid_str_full, lowexpiration);
+			id.byroot = 1;
+			id.root = req->root_eid;
+			res2 |= cache_lookup_internal(now, req, &id, tmp, eid_str_full, lowexpiration);
 			if (res2) {
 				if (strlen(tmp) > strlen(req->hmd->exten)) {
 					/* Update meta data if appropriate */
@@ -2125,6 +2694,7 @@ static void *network_thread(void *data)
 		/* 10s select timeout */
 		cw_io_run(io, 10000);
 		check_password();
+		check_cache_snapshot();
 	}
 
 	/* NOT REACHED */
@@ -2234,7 +2804,9 @@ static int dundi_flush(struct cw_dynstr *ds_p, int argc, char *argv[])
 		}
 		cw_mutex_unlock(&peerlock);
 	} else {
-		cw_db_deltree("dundi/cache", NULL);
+		cw_mutex_lock(&dundi_cache_lock);
+		dundi_cache_flush();
+		cw_mutex_unlock(&dundi_cache_lock);
 		cw_dynstr_printf(ds_p, "DUNDi Cache Flushed\n");
 	}
 	return RESULT_SUCCESS;
@@ -2602,6 +3174,38 @@ static int dundi_show_trans(struct cw_dynstr *ds_p, int argc, char *argv[])
 #undef FORMAT2
 }
 
+static int dundi_show_cache(struct cw_dynstr *ds_p, int argc, char *argv[])
+{
+	char buf[32];
+	struct tm tm;
+
+	CW_UNUSED(argv);
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&dundi_cache_lock);
+	dundi_cache_purge(time(NULL));
+	cw_dynstr_printf(ds_p, "Entries:       %d of %d (%lu bytes)\n", dundi_cache_entries, dundi_cache_size, (unsigned long)dundi_cache_bytes);
+	cw_dynstr_printf(ds_p, "Stores:        %lu\n", dundi_cache_stats.stores);
+	cw_dynstr_printf(ds_p, "Lookups:       %lu hits, %lu misses\n", dundi_cache_stats.hits, dundi_cache_stats.misses);
+	cw_dynstr_printf(ds_p, "Expired:       %lu\n", dundi_cache_stats.expired);
+	cw_dynstr_printf(ds_p, "Evicted:       %lu\n", dundi_cache_stats.evicted);
+	if (dundi_cache_snapshot > 0)
+		cw_dynstr_printf(ds_p, "Snapshot:      every %d seconds to %s/dundi-cache\n", dundi_cache_snapshot, cw_config[CW_DB_DIR]);
+	else
+		cw_dynstr_printf(ds_p, "Snapshot:      disabled\n");
+	if (dundi_cache_stats.snapshots) {
+		localtime_r(&dundi_cache_stats.lastsnapshot, &tm);
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+		cw_dynstr_printf(ds_p, "Last snapshot: %s, %lu entries (%lu snapshots taken)\n", buf, dundi_cache_stats.snapshotted, dundi_cache_stats.snapshots);
+	}
+	if (dundi_cache_stats.loaded)
+		cw_dynstr_printf(ds_p, "Loaded:        %lu entries from snapshot at startup\n", dundi_cache_stats.loaded);
+	cw_mutex_unlock(&dundi_cache_lock);
+	return RESULT_SUCCESS;
+}
+
 static int dundi_show_entityid(struct cw_dynstr *ds_p, int argc, char *argv[])
 {
 	char eid_str[20];
@@ -2733,6 +3337,10 @@ static const char show_precache_usage[] =
 "Usage: dundi show precache\n"
 "       Lists all known DUNDi scheduled precache updates.\n";
 
+static const char show_cache_usage[] =
+"Usage: dundi show cache\n"
+"       Displays DUNDi answer cache statistics.\n";
+
 static const char show_entityid_usage[] =
 "Usage: dundi show entityid\n"
 "       Displays the global entityid for this host.\n";
@@ -2818,6 +3426,13 @@ static struct cw_clicmd  cli_show_trans = {
 	.usage = show_trans_usage,
 };
 
+static struct cw_clicmd  cli_show_cache = {
+	.cmda = { "dundi", "show", "cache", NULL },
+	.handler = dundi_show_cache,
+	.summary = "Show DUNDi cache statistics",
+	.usage = show_cache_usage,
+};
+
 static struct cw_clicmd  cli_show_entityid = {
 	.cmda = { "dundi", "show", "entityid", NULL },
 	.handler = dundi_show_entityid,
@@ -2904,6 +3519,7 @@ static struct dundi_transaction *create_transaction(struct dundi_peer *p)
 		trans->strans = tid;
 		trans->allnext = alltrans;
 		alltrans = trans;
+		trans_hash(trans);
 	}
 	return trans;
 }
@@ -3050,6 +3666,7 @@ static void destroy_trans(struct dundi_transaction *trans, int fromtimeout)
 		prev = cur;
 		cur = cur->allnext;
 	}
+	trans_unhash(trans);
 	destroy_packets(trans->packets);
 	destroy_packets(trans->lasttrans);
 	trans->packets = NULL;
@@ -4655,6 +5272,8 @@ static int set_config(const char *config_file, struct sockaddr_in* sain)
 
 	dundi_ttl = DUNDI_DEFAULT_TTL;
 	dundi_cache_time = DUNDI_DEFAULT_CACHE_TIME;
+	dundi_cache_size = DUNDI_DEFAULT_CACHE_SIZE;
+	dundi_cache_snapshot = 0;
 	cfg = cw_config_load(config_file);
 	
 	
@@ -4759,9 +5378,24 @@ static int set_config(const char *config_file, struct sockaddr_in* sain)
 				cw_log(CW_LOG_WARNING, "'%s' is not a valid cache time at line %d. Using default value '%d'.\n",
 					v->value, v->lineno, DUNDI_DEFAULT_CACHE_TIME);
 			}
+		} else if (!strcasecmp(v->name, "cachesize")) {
+			if ((sscanf(v->value, "%d", &x) == 1) && x >= 0) {
+				dundi_cache_size = x;
+			} else {
+				cw_log(CW_LOG_WARNING, "'%s' is not a valid cache size at line %d. Using default value '%d'.\n",
+					v->value, v->lineno, DUNDI_DEFAULT_CACHE_SIZE);
+			}
+		} else if (!strcasecmp(v->name, "cachesnapshot")) {
+			if ((sscanf(v->value, "%d", &x) == 1) && x >= 0) {
+				dundi_cache_snapshot = x;
+			} else {
+				cw_log(CW_LOG_WARNING, "'%s' is not a valid cache snapshot interval at line %d. Snapshots disabled.\n",
+					v->value, v->lineno);
+			}
 		}
 		v = v->next;
 	}
+	dundi_cache_nextsnapshot = time(NULL) + dundi_cache_snapshot;
 	cw_mutex_unlock(&peerlock);
 	mark_mappings();
 	v = cw_variable_browse(cfg, "mappings");
@@ -4821,6 +5455,7 @@ static int unload_module(void)
 	cw_cli_unregister(&cli_show_peers);
 	cw_cli_unregister(&cli_show_entityid);
 	cw_cli_unregister(&cli_show_trans);
+	cw_cli_unregister(&cli_show_cache);
 	cw_cli_unregister(&cli_show_requests);
 	cw_cli_unregister(&cli_show_mappings);
 	cw_cli_unregister(&cli_show_precache);
@@ -4829,6 +5464,12 @@ static int unload_module(void)
 	cw_cli_unregister(&cli_precache);
 	cw_cli_unregister(&cli_queryeid);
 	res |= cw_unregister_function(dundi_func);
+
+	if (dundi_cache_snapshot > 0)
+		dundi_cache_save_snapshot();
+	cw_mutex_lock(&dundi_cache_lock);
+	dundi_cache_flush();
+	cw_mutex_unlock(&dundi_cache_lock);
 	return res;
 }
 
@@ -4888,6 +5529,9 @@ static int load_module(void)
 
 	res |= reload_module();
 
+	if (dundi_cache_snapshot > 0)
+		dundi_cache_load_snapshot();
+
 	cw_switch_register(&dundi_switch);
 	cw_cli_register(&cli_debug);
 	cw_cli_register(&cli_store_history);
@@ -4897,6 +5541,7 @@ static int load_module(void)
 	cw_cli_register(&cli_show_peers);
 	cw_cli_register(&cli_show_entityid);
 	cw_cli_register(&cli_show_trans);
+	cw_cli_register(&cli_show_cache);
 	cw_cli_register(&cli_show_requests);
 	cw_cli_register(&cli_show_mappings);
 	cw_cli_register(&cli_show_precache);
@@ -41,6 +41,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <mysql/mysql.h>
 #include <mysql/mysql_version.h>
 #include <mysql/errmsg.h>
@@ -61,23 +62,91 @@
 
 CW_MUTEX_DEFINE_STATIC(mysql_lock);
 #define RES_CONFIG_MYSQL_CONF "res_mysql.conf"
-MYSQL         mysql;
 static char   dbhost[50];
 static char   dbuser[50];
 static char   dbpass[50];
 static char   dbname[50];
 static char   dbsock[50];
 static int    dbport;
-static int    connected;
-static time_t connect_time;
+
+#define MYSQL_POOL_MIN_DEFAULT		1
+#define MYSQL_POOL_MAX_DEFAULT		4
+#define MYSQL_POOL_IDLE_DEFAULT		60	/* seconds before spare idle connections are closed */
+#define MYSQL_POOL_PING_DEFAULT		30	/* seconds idle before a connection is checked on reuse */
+#define MYSQL_POOL_WAIT_DEFAULT		5000	/* milliseconds to wait for a free connection */
+
+#define MYSQL_MAX_PARAMS		32
+#define MYSQL_MAX_STMTS			64	/* prepared statements kept per connection */
+#define MYSQL_COLUMN_BUFSIZE		256	/* longer values are fetched separately */
+
+/* my_bool before MySQL 8, bool after */
+typedef typeof(*((MYSQL_BIND *)0)->is_null) mysql_flag_t;
+
+/* Upper bounds (in ms) of the query latency histogram buckets. The last bucket is everything slower. */
+static const int mysql_hist_ms[] = { 1, 2, 5, 10, 20, 50, 100, 500, 1000 };
+
+/* A statement prepared on one connection. The SQL text, with ? in place
+ * of the values, is the key so each (table, column set, operator) shape
+ * gets its own statement.
+ */
+struct mysql_stmt {
+	struct mysql_stmt *next;
+	MYSQL_STMT *stmt;
+	char sql[0];
+};
+
+struct mysql_conn {
+	struct mysql_conn *next;
+	MYSQL mysql;
+	unsigned int gen;
+	int broken;
+	time_t idle_since;
+	char db[50];
+	struct mysql_stmt *stmts;
+	unsigned int nstmts;
+};
+
+/* A fully fetched result. Each row's columns are NULL for SQL NULL
+ * like a MYSQL_ROW. The connection has gone back to the pool by the
+ * time anyone looks at it.
+ */
+struct mysql_row {
+	struct mysql_row *next;
+	char *col[0];
+};
+
+struct mysql_result {
+	unsigned int nfields;
+	unsigned long nrows;
+	unsigned long affected;
+	struct mysql_row *rows, **tail;
+	char *names[0];
+};
+
+/* The pool and its statistics are protected by mysql_lock */
+static struct mysql_conn *pool_idle;
+static int pool_total, pool_inuse, pool_waiting;
+static unsigned int pool_gen;
+static int pool_min = MYSQL_POOL_MIN_DEFAULT;
+static int pool_max = MYSQL_POOL_MAX_DEFAULT;
+static int pool_idle_timeout = MYSQL_POOL_IDLE_DEFAULT;
+static int pool_ping = MYSQL_POOL_PING_DEFAULT;
+static int pool_wait = MYSQL_POOL_WAIT_DEFAULT;
+static pthread_cond_t pool_cond;
+
+static unsigned long stat_acquired, stat_waited, stat_timeouts;
+static unsigned long stat_connects, stat_connfail, stat_prepared;
+static unsigned long stat_queries, stat_failed;
+static unsigned long long stat_wait_us, stat_query_us;
+static unsigned int stat_wait_max_us, stat_query_max_us;
+static unsigned long stat_hist[arraysize(mysql_hist_ms) + 1];
 
 static int parse_config(void);
-static int mysql_reconnect(const char *database);
 static int realtime_mysql_status(struct cw_dynstr *ds_p, int argc, char **argv);
 
 static const char cli_realtime_mysql_status_usage[] =
 "Usage: realtime mysql status\n"
-"       Shows connection information for the MySQL RealTime driver\n";
+"       Shows connection pool and query statistics for the MySQL RealTime driver\n";
 
 static struct cw_clicmd cli_realtime_mysql_status = {
         .cmda = { "realtime", "mysql", "status", NULL },
@@ -86,14 +155,523 @@ static struct cw_clicmd cli_realtime_mysql_status = {
 	.usage = cli_realtime_mysql_status_usage,
 };
 
-static struct cw_variable *realtime_mysql(const char *database, const char *table, va_list ap)
+
+static time_t mysql_now(void)
+{
+	struct timespec ts;
+
+	cw_clock_gettime(global_clock_monotonic, &ts);
+	return ts.tv_sec;
+}
+
+static void mysql_conn_reset_stmts(struct mysql_conn *pc)
+{
+	struct mysql_stmt *st;
+
+	while ((st = pc->stmts)) {
+		pc->stmts = st->next;
+		mysql_stmt_close(st->stmt);
+		free(st);
+	}
+	pc->nstmts = 0;
+}
+
+static void mysql_conn_free(struct mysql_conn *pc)
+{
+	mysql_conn_reset_stmts(pc);
+	mysql_close(&pc->mysql);
+	free(pc);
+}
+
+static struct mysql_conn *mysql_connect(void)
+{
+	char host[sizeof(dbhost)], user[sizeof(dbuser)], pass[sizeof(dbpass)], sock[sizeof(dbsock)];
+	struct mysql_conn *pc;
+	int port;
+
+	if (!(pc = calloc(1, sizeof(*pc)))) {
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+		return NULL;
+	}
+
+	if (!mysql_init(&pc->mysql)) {
+		cw_log(CW_LOG_WARNING, "MySQL RealTime: Insufficient memory to allocate MySQL resource.\n");
+		free(pc);
+		return NULL;
+	}
+
+	cw_mutex_lock(&mysql_lock);
+	memcpy(host, dbhost, sizeof(host));
+	memcpy(user, dbuser, sizeof(user));
+	memcpy(pass, dbpass, sizeof(pass));
+	memcpy(sock, dbsock, sizeof(sock));
+	memcpy(pc->db, dbname, sizeof(pc->db));
+	port = dbport;
+	pc->gen = pool_gen;
+	cw_mutex_unlock(&mysql_lock);
+
+	/* N.B. MYSQL_OPT_RECONNECT is deliberately left off. Prepared statements do
+	 * not survive a reconnect so broken connections are dropped from the pool
+	 * and replaced instead.
+	 */
+	if (!mysql_real_connect(&pc->mysql, host, user, pass, pc->db, port, sock, 0)) {
+		cw_log(CW_LOG_ERROR, "MySQL RealTime: Failed to connect database server %s on %s (err %u). Check debug for more info.\n", pc->db, host, mysql_errno(&pc->mysql));
+		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Cannot Connect (%u): %s\n", mysql_errno(&pc->mysql), mysql_error(&pc->mysql));
+		mysql_close(&pc->mysql);
+		free(pc);
+		pc = NULL;
+	} else
+		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Successfully connected to database.\n");
+
+	cw_mutex_lock(&mysql_lock);
+	if (pc)
+		stat_connects++;
+	else
+		stat_connfail++;
+	cw_mutex_unlock(&mysql_lock);
+
+	return pc;
+}
+
+/* Must be called with mysql_lock held. Unlinks idle connections that have
+ * been idle too long (or belong to an old configuration) onto *reaped for
+ * the caller to close once the lock is released.
+ */
+static void mysql_pool_reap(time_t now, struct mysql_conn **reaped)
+{
+	struct mysql_conn **p, *pc;
+
+	p = &pool_idle;
+	while ((pc = *p)) {
+		if (pc->gen != pool_gen || (pool_total > pool_min && now - pc->idle_since >= pool_idle_timeout)) {
+			*p = pc->next;
+			pc->next = *reaped;
+			*reaped = pc;
+			pool_total--;
+		} else
+			p = &pc->next;
+	}
+}
+
+static void mysql_pool_close(struct mysql_conn *list)
+{
+	struct mysql_conn *pc;
+
+	while ((pc = list)) {
+		list = pc->next;
+		mysql_conn_free(pc);
+	}
+}
+
+static struct mysql_conn *mysql_acquire(void)
 {
-	MYSQL_RES *result;
-	MYSQL_ROW row;
+	struct timespec deadline;
+	struct timeval start;
+	struct mysql_conn *pc, *reaped = NULL;
+	unsigned int us;
+	int waited = 0;
+
+	cw_mutex_lock(&mysql_lock);
+
+	mysql_pool_reap(mysql_now(), &reaped);
+
+	for (;;) {
+		if ((pc = pool_idle)) {
+			pool_idle = pc->next;
+			break;
+		}
+
+		if (pool_total < pool_max) {
+			/* Reserve the slot and connect once we've dropped the lock */
+			pool_total++;
+			break;
+		}
+
+		if (!waited) {
+			waited = 1;
+			start = cw_tvnow();
+			cw_clock_gettime(global_cond_clock_monotonic, &deadline);
+			cw_clock_add_ms(&deadline, pool_wait);
+		}
+
+		pool_waiting++;
+		if (cw_cond_timedwait(&pool_cond, &mysql_lock, &deadline) == ETIMEDOUT && !pool_idle && pool_total >= pool_max) {
+			pool_waiting--;
+			stat_timeouts++;
+			cw_mutex_unlock(&mysql_lock);
+			mysql_pool_close(reaped);
+			cw_log(CW_LOG_WARNING, "MySQL RealTime: No free database connection after %dms (all %d in use)\n", pool_wait, pool_max);
+			return NULL;
+		}
+		pool_waiting--;
+	}
+
+	pool_inuse++;
+	stat_acquired++;
+	if (waited) {
+		us = cw_tvdiff(cw_tvnow(), start);
+		stat_waited++;
+		stat_wait_us += us;
+		if (us > stat_wait_max_us)
+			stat_wait_max_us = us;
+	}
+
+	cw_mutex_unlock(&mysql_lock);
+
+	mysql_pool_close(reaped);
+
+	/* Anything that has been idle a while is pinged since firewalls and
+	 * server restarts kill connections without telling us.
+	 */
+	if (pc && pool_ping >= 0 && mysql_now() - pc->idle_since >= pool_ping && mysql_ping(&pc->mysql)) {
+		cw_log(CW_LOG_NOTICE, "MySQL RealTime: Ping failed (%u).  Making a new connection.\n", mysql_errno(&pc->mysql));
+		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Server Error (%u): %s\n", mysql_errno(&pc->mysql), mysql_error(&pc->mysql));
+		mysql_conn_free(pc);
+		pc = NULL;
+	}
+
+	if (!pc && !(pc = mysql_connect())) {
+		cw_mutex_lock(&mysql_lock);
+		pool_total--;
+		pool_inuse--;
+		cw_cond_signal(&pool_cond);
+		cw_mutex_unlock(&mysql_lock);
+	}
+
+	return pc;
+}
+
+static void mysql_release(struct mysql_conn *pc)
+{
+	struct mysql_conn *reaped = NULL;
+	time_t now = mysql_now();
+
+	cw_mutex_lock(&mysql_lock);
+
+	pool_inuse--;
+
+	if (!pc->broken) {
+		pc->idle_since = now;
+		pc->next = pool_idle;
+		pool_idle = pc;
+	} else {
+		pc->next = reaped;
+		reaped = pc;
+		pool_total--;
+	}
+
+	mysql_pool_reap(now, &reaped);
+
+	cw_cond_signal(&pool_cond);
+
+	cw_mutex_unlock(&mysql_lock);
+
+	mysql_pool_close(reaped);
+}
+
+/* Opens connections until there are at least poolmin of them */
+static void mysql_pool_fill(void)
+{
+	struct mysql_conn *pc;
+	int n;
+
+	cw_mutex_lock(&mysql_lock);
+	n = pool_min - pool_total;
+	pool_total += (n > 0 ? n : 0);
+	pool_inuse += (n > 0 ? n : 0);
+	cw_mutex_unlock(&mysql_lock);
+
+	for (; n > 0; n--) {
+		if ((pc = mysql_connect()))
+			mysql_release(pc);
+		else {
+			cw_mutex_lock(&mysql_lock);
+			pool_total--;
+			pool_inuse--;
+			cw_mutex_unlock(&mysql_lock);
+		}
+	}
+}
+
+static void mysql_result_free(struct mysql_result *res)
+{
+	struct mysql_row *row;
+
+	if (res) {
+		while ((row = res->rows)) {
+			res->rows = row->next;
+			free(row);
+		}
+		free(res);
+	}
+}
+
+/* Copies the fetched row out of the bind buffers, going back for any
+ * column too long for its buffer.
+ */
+static int mysql_result_add(struct mysql_result *res, MYSQL_STMT *stmt, MYSQL_BIND *bind, unsigned long *lengths, mysql_flag_t *nulls)
+{
+	MYSQL_BIND big;
+	struct mysql_row *row;
+	char *p;
+	size_t size;
+	unsigned int i;
+
+	size = sizeof(*row) + res->nfields * sizeof(row->col[0]);
+	for (i = 0; i < res->nfields; i++) {
+		if (!nulls[i])
+			size += lengths[i] + 1;
+	}
+
+	if (!(row = malloc(size)))
+		return -1;
+
+	p = (char *)&row->col[res->nfields];
+	for (i = 0; i < res->nfields; i++) {
+		if (nulls[i]) {
+			row->col[i] = NULL;
+			continue;
+		}
+
+		row->col[i] = p;
+		if (lengths[i] <= bind[i].buffer_length)
+			memcpy(p, bind[i].buffer, lengths[i]);
+		else {
+			memset(&big, 0, sizeof(big));
+			big.buffer_type = MYSQL_TYPE_STRING;
+			big.buffer = p;
+			big.buffer_length = lengths[i];
+			if (mysql_stmt_fetch_column(stmt, &big, i, 0)) {
+				free(row);
+				return -1;
+			}
+		}
+		p += lengths[i];
+		*(p++) = '\0';
+	}
+
+	row->next = NULL;
+	*res->tail = row;
+	res->tail = &row->next;
+	res->nrows++;
+
+	return 0;
+}
+
+static struct mysql_result *mysql_stmt_run(MYSQL_STMT *stmt, int nparams, const char * const *values)
+{
+	MYSQL_BIND params[MYSQL_MAX_PARAMS + 1];
+	MYSQL_BIND *bind = NULL;
+	unsigned long plen[MYSQL_MAX_PARAMS + 1];
+	unsigned long *lengths = NULL;
+	mysql_flag_t *nulls = NULL;
+	struct mysql_result *res = NULL;
+	MYSQL_RES *meta;
 	MYSQL_FIELD *fields;
-	int numFields, i, valsz;
+	char *buffers = NULL, *p;
+	size_t size;
+	unsigned int i, n;
+	int ret;
+
+	memset(params, 0, nparams * sizeof(params[0]));
+	for (i = 0; i < nparams; i++) {
+		plen[i] = strlen(values[i]);
+		params[i].buffer_type = MYSQL_TYPE_STRING;
+		params[i].buffer = (char *)values[i];
+		params[i].buffer_length = plen[i];
+		params[i].length = &plen[i];
+	}
+
+	if ((nparams && mysql_stmt_bind_param(stmt, params)) || mysql_stmt_execute(stmt))
+		return NULL;
+
+	meta = mysql_stmt_result_metadata(stmt);
+	n = (meta ? mysql_num_fields(meta) : 0);
+
+	size = sizeof(*res) + n * sizeof(res->names[0]);
+	if (meta) {
+		fields = mysql_fetch_fields(meta);
+		for (i = 0; i < n; i++)
+			size += strlen(fields[i].name) + 1;
+	}
+
+	if (!(res = malloc(size)))
+		goto out;
+
+	res->nfields = n;
+	res->nrows = 0;
+	res->affected = 0;
+	res->rows = NULL;
+	res->tail = &res->rows;
+
+	if (!meta) {
+		res->affected = mysql_stmt_affected_rows(stmt);
+		return res;
+	}
+
+	p = (char *)&res->names[n];
+	for (i = 0; i < n; i++) {
+		res->names[i] = p;
+		p = stpcpy(p, fields[i].name) + 1;
+	}
+
+	if (!(bind = calloc(n, sizeof(*bind) + sizeof(*lengths) + sizeof(*nulls) + MYSQL_COLUMN_BUFSIZE)))
+		goto fail;
+	lengths = (unsigned long *)&bind[n];
+	nulls = (mysql_flag_t *)&lengths[n];
+	buffers = (char *)&nulls[n];
+
+	for (i = 0; i < n; i++) {
+		bind[i].buffer_type = MYSQL_TYPE_STRING;
+		bind[i].buffer = buffers + i * MYSQL_COLUMN_BUFSIZE;
+		bind[i].buffer_length = MYSQL_COLUMN_BUFSIZE;
+		bind[i].length = &lengths[i];
+		bind[i].is_null = &nulls[i];
+	}
+
+	if (mysql_stmt_bind_result(stmt, bind) || mysql_stmt_store_result(stmt))
+		goto fail;
+
+	while ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED) {
+		if (mysql_result_add(res, stmt, bind, lengths, nulls))
+			goto fail;
+	}
+
+	if (ret == MYSQL_NO_DATA)
+		goto out;
+
+fail:
+	mysql_result_free(res);
+	res = NULL;
+out:
+	mysql_stmt_free_result(stmt);
+	if (meta)
+		mysql_free_result(meta);
+	free(bind);
+	return res;
+}
+
+static struct mysql_result *mysql_exec(struct mysql_conn *pc, const char *sql, int nparams, const char * const *values)
+{
+	struct mysql_stmt *st;
+	struct mysql_result *res = NULL;
+	struct timeval start;
+	MYSQL_STMT *stmt;
+	unsigned int us, err;
+	int i, prepared = 0;
+
+	start = cw_tvnow();
+
+	for (st = pc->stmts; st && strcmp(st->sql, sql); st = st->next);
+
+	if (st)
+		stmt = st->stmt;
+	else if ((stmt = mysql_stmt_init(&pc->mysql))) {
+		if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
+			cw_log(CW_LOG_DEBUG, "MySQL RealTime: Prepare Failed (%u): %s\n", mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+			err = mysql_stmt_errno(stmt);
+			mysql_stmt_close(stmt);
+			stmt = NULL;
+			if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST)
+				pc->broken = 1;
+		} else {
+			prepared = 1;
+			if (pc->nstmts < MYSQL_MAX_STMTS && (st = malloc(sizeof(*st) + strlen(sql) + 1))) {
+				st->stmt = stmt;
+				strcpy(st->sql, sql);
+				st->next = pc->stmts;
+				pc->stmts = st;
+				pc->nstmts++;
+			}
+		}
+	}
+
+	if (stmt) {
+		if (!(res = mysql_stmt_run(stmt, nparams, values))) {
+			err = mysql_stmt_errno(stmt);
+			cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query Failed because (%u): %s\n", err, mysql_stmt_error(stmt));
+			if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST)
+				pc->broken = 1;
+		}
+
+		/* Statements that didn't fit in the cache are one shot */
+		if (!st)
+			mysql_stmt_close(stmt);
+	}
+
+	us = cw_tvdiff(cw_tvnow(), start);
+
+	for (i = 0; i < arraysize(mysql_hist_ms) && us >= mysql_hist_ms[i] * 1000U; i++);
+
+	cw_mutex_lock(&mysql_lock);
+	stat_queries++;
+	stat_prepared += prepared;
+	if (!res)
+		stat_failed++;
+	stat_query_us += us;
+	if (us > stat_query_max_us)
+		stat_query_max_us = us;
+	stat_hist[i]++;
+	cw_mutex_unlock(&mysql_lock);
+
+	return res;
+}
+
+/*! \brief Run a parameterised query on a pooled connection
+ *
+ * The whole result is fetched before the connection goes back to the pool.
+ * If the connection turns out to have died under us the query is retried
+ * once on another.
+ */
+static struct mysql_result *mysql_query_pool(const char *database, const char *sql, int nparams, const char * const *values)
+{
+	struct mysql_conn *pc;
+	struct mysql_result *res = NULL;
+	int tries;
+
+	if (!database || cw_strlen_zero(database))
+		database = dbname;
+
+	for (tries = 0; !res && tries < 2; tries++) {
+		if (!(pc = mysql_acquire()))
+			break;
+
+		/* Families may be mapped to their own database on the same server */
+		if (strcmp(pc->db, database)) {
+			if (mysql_select_db(&pc->mysql, database)) {
+				cw_log(CW_LOG_WARNING, "MySQL RealTime: Unable to select database: %s. Still Connected (%u).\n", database, mysql_errno(&pc->mysql));
+				cw_log(CW_LOG_DEBUG, "MySQL RealTime: Database Select Failed (%u): %s\n", mysql_errno(&pc->mysql), mysql_error(&pc->mysql));
+				if (mysql_errno(&pc->mysql) == CR_SERVER_GONE_ERROR || mysql_errno(&pc->mysql) == CR_SERVER_LOST)
+					pc->broken = 1;
+				else
+					tries = 2;
+				mysql_release(pc);
+				continue;
+			}
+			/* Statements were resolved against the old database */
+			mysql_conn_reset_stmts(pc);
+			cw_copy_string(pc->db, database, sizeof(pc->db));
+		}
+
+		res = mysql_exec(pc, sql, nparams, values);
+
+		if (!pc->broken)
+			tries = 2;
+
+		mysql_release(pc);
+	}
+
+	return res;
+}
+
+static struct cw_variable *realtime_mysql(const char *database, const char *table, va_list ap)
+{
+	struct mysql_result *result;
+	struct mysql_row *r;
+	char **row;
+	int i, n;
 	char sql[512];
-	char buf[511]; /* Keep this size uneven as it is 2n+1. */
+	const char *values[MYSQL_MAX_PARAMS];
 	char *stringp;
 	char *chunk;
 	const char *op;
@@ -110,14 +688,6 @@ static struct cw_variable *realtime_mysql(const char *database, const char *tabl
 	newval = va_arg(ap, const char *);
 	if(!newparam || !newval)  {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Realtime retrieval requires at least 1 parameter and 1 value to search on.\n");
-		mysql_close(&mysql);
-		return NULL;
-	}
-
-	/* Must connect to the server before anything else, as the escape function requires the mysql handle. */
-	cw_mutex_lock(&mysql_lock);
-	if (!mysql_reconnect(database)) {
-		cw_mutex_unlock(&mysql_lock);
 		return NULL;
 	}
 
@@ -126,48 +696,45 @@ static struct cw_variable *realtime_mysql(const char *database, const char *tabl
 
 	if(!strchr(newparam, ' ')) op = " ="; else op = "";
 
-	if ((valsz = strlen (newval)) * 2 + 1 > sizeof(buf))
-		valsz = (sizeof(buf) - 1) / 2;
-	mysql_real_escape_string(&mysql, buf, newval, valsz);
-	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s '%s'", table, newparam, op, buf);
+	n = 0;
+	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s ?", table, newparam, op);
+	values[n++] = newval;
 	while((newparam = va_arg(ap, const char *))) {
 		newval = va_arg(ap, const char *);
+		if (n == MYSQL_MAX_PARAMS) {
+			cw_log(CW_LOG_WARNING, "MySQL RealTime: Too many parameters (more than %d) for table %s\n", MYSQL_MAX_PARAMS, table);
+			return NULL;
+		}
 		if(!strchr(newparam, ' ')) op = " ="; else op = "";
-		if ((valsz = strlen (newval)) * 2 + 1 > sizeof(buf))
-			valsz = (sizeof(buf) - 1) / 2;
-		mysql_real_escape_string(&mysql, buf, newval, valsz);
-		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s '%s'", newparam, op, buf);
+		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s ?", newparam, op);
+		values[n++] = newval;
 	}
 	va_end(ap);
 
 	cw_log(CW_LOG_DEBUG, "MySQL RealTime: Retrieve SQL: %s\n", sql);
 
 	/* Execution. */
-	if(mysql_real_query(&mysql, sql, strlen(sql))) {
+	if(!(result = mysql_query_pool(database, sql, n, values))) {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query: %s\n", sql);
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query Failed because: %s\n", mysql_error(&mysql));
-		cw_mutex_unlock(&mysql_lock);
 		return NULL;
 	}
 
-	if((result = mysql_store_result(&mysql))) {
-		numFields = mysql_num_fields(result);
-		fields = mysql_fetch_fields(result);
-
-		while((row = mysql_fetch_row(result))) {
-			for(i = 0; i < numFields; i++) {
+	if (result->nrows) {
+		for (r = result->rows; r; r = r->next) {
+			row = r->col;
+			for(i = 0; i < result->nfields; i++) {
 				stringp = row[i];
 				while(stringp) {
 					chunk = strsep(&stringp, ";");
 					if(chunk && !cw_strlen_zero(cw_strip(chunk))) {
 						if(prev) {
-							prev->next = cw_variable_new(fields[i].name, chunk);
+							prev->next = cw_variable_new(result->names[i], chunk);
 							if (prev->next) {
 								prev = prev->next;
 							}
 						} else {
-							prev = var = cw_variable_new(fields[i].name, chunk);
+							prev = var = cw_variable_new(result->names[i], chunk);
 						}
 					}
 				}
@@ -177,8 +744,7 @@ static struct cw_variable *realtime_mysql(const char *database, const char *tabl
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Could not find any rows in table %s.\n", table);
 	}
 
-	cw_mutex_unlock(&mysql_lock);
-	mysql_free_result(result);
+	mysql_result_free(result);
 
 	return var;
 }
@@ -186,10 +752,10 @@ static struct cw_variable *realtime_mysql(const char *database, const char *tabl
 static struct cw_config *realtime_multi_mysql(const char *database, const char *table, va_list ap)
 {
 	char sql[512];
-	char buf[511]; /* Keep this size uneven as it is 2n+1. */
-	MYSQL_RES *result;
-	MYSQL_ROW row;
-	MYSQL_FIELD *fields;
+	const char *values[MYSQL_MAX_PARAMS];
+	struct mysql_result *result;
+	struct mysql_row *r;
+	char **row;
 	char *initfield;
 	char *stringp;
 	char *chunk;
@@ -198,26 +764,18 @@ static struct cw_config *realtime_multi_mysql(const char *database, const char *
 	struct cw_variable *var=NULL;
 	struct cw_config *cfg = NULL;
 	struct cw_category *cat = NULL;
-	int numFields, i, valsz;
+	int i, n;
 
 	if(!table) {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: No table specified.\n");
 		return NULL;
 	}
 	
-	cfg = cw_config_new();
-	if (!cfg) {
-		/* If I can't alloc memory at this point, why bother doing anything else? */
-		cw_log(CW_LOG_WARNING, "Out of memory\n");
-		return NULL;
-	}
-
 	/* Get the first parameter and first value in our list of passed paramater/value pairs */
 	newparam = va_arg(ap, const char *);
 	newval = va_arg(ap, const char *);
 	if(!newparam || !newval)  {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Realtime retrieval requires at least 1 parameter and 1 value to search on.\n");
-		mysql_close(&mysql);
 		return NULL;
 	}
 
@@ -226,29 +784,23 @@ static struct cw_config *realtime_multi_mysql(const char *database, const char *
 		*stringp = '\0';
 	}
 
-	/* Must connect to the server before anything else, as the escape function requires the mysql handle. */
-	cw_mutex_lock(&mysql_lock);
-	if (!mysql_reconnect(database)) {
-		cw_mutex_unlock(&mysql_lock);
-		return NULL;
-	}
-
 	/* Create the first part of the query using the first parameter/value pairs we just extracted
 	   If there is only 1 set, then we have our query. Otherwise, loop thru the list and concat */
 
 	if(!strchr(newparam, ' ')) op = " ="; else op = "";
 
-	if ((valsz = strlen (newval)) * 2 + 1 > sizeof(buf))
-		valsz = (sizeof(buf) - 1) / 2;
-	mysql_real_escape_string(&mysql, buf, newval, valsz);
-	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s '%s'", table, newparam, op, buf);
+	n = 0;
+	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s ?", table, newparam, op);
+	values[n++] = newval;
 	while((newparam = va_arg(ap, const char *))) {
 		newval = va_arg(ap, const char *);
+		if (n == MYSQL_MAX_PARAMS) {
+			cw_log(CW_LOG_WARNING, "MySQL RealTime: Too many parameters (more than %d) for table %s\n", MYSQL_MAX_PARAMS, table);
+			return NULL;
+		}
 		if(!strchr(newparam, ' ')) op = " ="; else op = "";
-		if ((valsz = strlen (newval)) * 2 + 1 > sizeof(buf))
-			valsz = (sizeof(buf) - 1) / 2;
-		mysql_real_escape_string(&mysql, buf, newval, valsz);
-		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s '%s'", newparam, op, buf);
+		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s ?", newparam, op);
+		values[n++] = newval;
 	}
 
 	if(initfield) {
@@ -260,34 +812,38 @@ static struct cw_config *realtime_multi_mysql(const char *database, const char *
 	cw_log(CW_LOG_DEBUG, "MySQL RealTime: Retrieve SQL: %s\n", sql);
 
 	/* Execution. */
-	if(mysql_real_query(&mysql, sql, strlen(sql))) {
+	if(!(result = mysql_query_pool(database, sql, n, values))) {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query: %s\n", sql);
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query Failed because: %s\n", mysql_error(&mysql));
-		cw_mutex_unlock(&mysql_lock);
 		return NULL;
 	}
 
-	if((result = mysql_store_result(&mysql))) {
-		numFields = mysql_num_fields(result);
-		fields = mysql_fetch_fields(result);
+	cfg = cw_config_new();
+	if (!cfg) {
+		/* If I can't alloc memory at this point, why bother doing anything else? */
+		cw_log(CW_LOG_WARNING, "Out of memory\n");
+		mysql_result_free(result);
+		return NULL;
+	}
 
-		while((row = mysql_fetch_row(result))) {
+	if (result->nrows) {
+		for (r = result->rows; r; r = r->next) {
+			row = r->col;
 			var = NULL;
 			cat = cw_category_new("");
 			if(!cat) {
 				cw_log(CW_LOG_WARNING, "Out of memory\n");
 				continue;
 			}
-			for(i = 0; i < numFields; i++) {
+			for(i = 0; i < result->nfields; i++) {
 				stringp = row[i];
 				while(stringp) {
 					chunk = strsep(&stringp, ";");
 					if(chunk && !cw_strlen_zero(cw_strip(chunk))) {
-						if(initfield && !strcmp(initfield, fields[i].name)) {
+						if(initfield && !strcmp(initfield, result->names[i])) {
 							cw_category_rename(cat, chunk);
 						}
-						var = cw_variable_new(fields[i].name, chunk);
+						var = cw_variable_new(result->names[i], chunk);
 						cw_variable_append(cat, var);
 					}
 				}
@@ -298,19 +854,19 @@ static struct cw_config *realtime_multi_mysql(const char *database, const char *
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Could not find any rows in table %s.\n", table);
 	}
 
-	cw_mutex_unlock(&mysql_lock);
-	mysql_free_result(result);
+	mysql_result_free(result);
 
 	return cfg;
 }
 
 static int update_mysql(const char *database, const char *table, const char *keyfield, const char *lookup, va_list ap)
 {
-	my_ulonglong numrows;
+	struct mysql_result *result;
+	unsigned long numrows;
 	char sql[512];
-	char buf[511]; /* Keep this size uneven as it is 2n+1. */
-	int valsz;
+	const char *values[MYSQL_MAX_PARAMS + 1];
 	const char *newparam, *newval;
+	int n;
 
 	if(!table) {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: No table specified.\n");
@@ -322,52 +878,41 @@ static int update_mysql(const char *database, const char *table, const char *key
 	newval = va_arg(ap, const char *);
 	if(!newparam || !newval)  {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Realtime retrieval requires at least 1 parameter and 1 value to search on.\n");
-		mysql_close(&mysql);
                return -1;
 	}
 
-	/* Must connect to the server before anything else, as the escape function requires the mysql handle. */
-	cw_mutex_lock(&mysql_lock);
-	if (!mysql_reconnect(database)) {
-		cw_mutex_unlock(&mysql_lock);
-		return -1;
-	}
-
 	/* Create the first part of the query using the first parameter/value pairs we just extracted
 	   If there is only 1 set, then we have our query. Otherwise, loop thru the list and concat */
 
-	if ((valsz = strlen (newval)) * 1 + 1 > sizeof(buf))
-		valsz = (sizeof(buf) - 1) / 2;
-	mysql_real_escape_string(&mysql, buf, newval, valsz);
-	snprintf(sql, sizeof(sql), "UPDATE %s SET %s = '%s'", table, newparam, buf);
+	n = 0;
+	snprintf(sql, sizeof(sql), "UPDATE %s SET %s = ?", table, newparam);
+	values[n++] = newval;
 	while((newparam = va_arg(ap, const char *))) {
 		newval = va_arg(ap, const char *);
-		if ((valsz = strlen (newval)) * 2 + 1 > sizeof(buf))
-			valsz = (sizeof(buf) - 1) / 2;
-		mysql_real_escape_string(&mysql, buf, newval, valsz);
-		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), ", %s = '%s'", newparam, buf);
+		if (n == MYSQL_MAX_PARAMS) {
+			cw_log(CW_LOG_WARNING, "MySQL RealTime: Too many parameters (more than %d) for table %s\n", MYSQL_MAX_PARAMS, table);
+			return -1;
+		}
+		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), ", %s = ?", newparam);
+		values[n++] = newval;
 	}
 	va_end(ap);
-	if ((valsz = strlen (lookup)) * 1 + 1 > sizeof(buf))
-		valsz = (sizeof(buf) - 1) / 2;
-	mysql_real_escape_string(&mysql, buf, lookup, valsz);
-	snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " WHERE %s = '%s'", keyfield, buf);
+	snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " WHERE %s = ?", keyfield);
+	values[n++] = lookup;
 
 	cw_log(CW_LOG_DEBUG,"MySQL RealTime: Update SQL: %s\n", sql);
 
 	/* Execution. */
-	if(mysql_real_query(&mysql, sql, strlen(sql))) {
+	if(!(result = mysql_query_pool(database, sql, n, values))) {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query: %s\n", sql);
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query Failed because: %s\n", mysql_error(&mysql));
-		cw_mutex_unlock(&mysql_lock);
 		return -1;
 	}
 
-	numrows = mysql_affected_rows(&mysql);
-	cw_mutex_unlock(&mysql_lock);
+	numrows = result->affected;
+	mysql_result_free(result);
 
-	cw_log(CW_LOG_DEBUG,"MySQL RealTime: Updated %llu rows on table: %s\n", numrows, table);
+	cw_log(CW_LOG_DEBUG,"MySQL RealTime: Updated %lu rows on table: %s\n", numrows, table);
 
 	/* From http://dev.mysql.com/doc/mysql/en/mysql-affected-rows.html
 	 * An integer greater than zero indicates the number of rows affected
@@ -381,11 +926,12 @@ static int update_mysql(const char *database, const char *table, const char *key
 
 static struct cw_config *config_mysql(const char *database, const char *table, const char *file, struct cw_config *cfg)
 {
-	MYSQL_RES *result;
-	MYSQL_ROW row;
-	my_ulonglong num_rows;
+	struct mysql_result *result;
+	struct mysql_row *r;
+	char **row;
 	struct cw_variable *new_v;
 	struct cw_category *cur_cat = NULL;
+	const char *values[1];
 	char sql[250] = "";
 	char last[80] = "";
 	int last_cat_metric = 0;
@@ -397,37 +943,32 @@ static struct cw_config *config_mysql(const char *database, const char *table, c
 		return NULL;
 	}
 
-	snprintf(sql, sizeof(sql), "SELECT category, var_name, var_val, cat_metric FROM %s WHERE filename='%s' and commented=0 ORDER BY filename, cat_metric desc, var_metric asc, category, var_name, var_val, id", table, file);
+	snprintf(sql, sizeof(sql), "SELECT category, var_name, var_val, cat_metric FROM %s WHERE filename=? and commented=0 ORDER BY filename, cat_metric desc, var_metric asc, category, var_name, var_val, id", table);
+	values[0] = file;
 
 	cw_log(CW_LOG_DEBUG, "MySQL RealTime: Static SQL: %s\n", sql);
 
-	/* We now have our complete statement; Lets connect to the server and execute it. */
-	cw_mutex_lock(&mysql_lock);
-	if(!mysql_reconnect(database)) {
-		cw_mutex_unlock(&mysql_lock);
-		return NULL;
-	}
-
-	if(mysql_real_query(&mysql, sql, strlen(sql))) {
+	/* The whole result is fetched and the connection released before we look
+	 * at it so #includes can be loaded from the database too.
+	 */
+	if(!(result = mysql_query_pool(database, sql, 1, values))) {
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query: %s\n", sql);
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Query Failed because: %s\n", mysql_error(&mysql));
-		cw_mutex_unlock(&mysql_lock);
 		return NULL;
 	}
 
-	if((result = mysql_store_result(&mysql))) {
-		num_rows = mysql_num_rows(result);
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Found %llu rows.\n", num_rows);
+	if (result->nrows) {
+		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Found %lu rows.\n", result->nrows);
 
-		/* There might exist a better way to access the column names other than counting,
-                   but I believe that would require another loop that we don't need. */
+		for (r = result->rows; r; r = r->next) {
+			row = r->col;
+
+			if (!row[0] || !row[1] || !row[2] || !row[3])
+				continue;
 
-		while((row = mysql_fetch_row(result))) {
 			if(!strcmp(row[1], "#include")) {
 				if (!cw_config_internal_load(row[2], cfg)) {
-					mysql_free_result(result);
-					cw_mutex_unlock(&mysql_lock);
+					mysql_result_free(result);
 					return NULL;
 				}
 				continue;
@@ -439,7 +980,7 @@ static struct cw_config *config_mysql(const char *database, const char *table, c
 					cw_log(CW_LOG_WARNING, "Out of memory\n");
 					break;
 				}
-				strcpy(last, row[0]);
+				cw_copy_string(last, row[0], sizeof(last));
 				last_cat_metric = atoi(row[3]);
 				cw_category_append(cfg, cur_cat);
 			}
@@ -450,8 +991,7 @@ static struct cw_config *config_mysql(const char *database, const char *table, c
 		cw_log(CW_LOG_WARNING, "MySQL RealTime: Could not find config '%s' in database.\n", file);
 	}
 
-	mysql_free_result(result);
-	cw_mutex_unlock(&mysql_lock);
+	mysql_result_free(result);
 
 	return cfg;
 }
@@ -467,22 +1007,24 @@ static struct cw_config_engine mysql_engine = {
 
 static void release(void)
 {
+	struct mysql_conn *list;
+
 	cw_mutex_lock(&mysql_lock);
-	mysql_close(&mysql);
+	list = pool_idle;
+	pool_idle = NULL;
 	cw_mutex_unlock(&mysql_lock);
+
+	mysql_pool_close(list);
 }
 
 
 static int load_module(void)
 {
-	parse_config();
+	cw_cond_init(&pool_cond, &global_condattr_monotonic);
 
-	cw_mutex_lock(&mysql_lock);
+	parse_config();
 
-	if(!mysql_reconnect(NULL)) {
-		cw_log(CW_LOG_WARNING, "MySQL RealTime: Couldn't establish connection. Check debug.\n");
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Cannot Connect: %s\n", mysql_error(&mysql));
-	}
+	mysql_pool_fill();
 
 	if(option_verbose) {
 		cw_verbose("MySQL RealTime driver loaded.\n");
@@ -490,8 +1032,6 @@ static int load_module(void)
 	cw_cli_register(&cli_realtime_mysql_status);
 	cw_config_engine_register(&mysql_engine);
 
-	cw_mutex_unlock(&mysql_lock);
-
 	return 0;
 }
 
@@ -514,22 +1054,19 @@ static int unload_module(void)
 
 static int reload_module(void)
 {
-	/* Aquire control before doing anything to the module itself. */
-	cw_mutex_lock(&mysql_lock);
+	struct mysql_conn *reaped = NULL;
 
-	mysql_close(&mysql);
-	connected = 0;
 	parse_config();
 
-	if(!mysql_reconnect(NULL)) {
-		cw_log(CW_LOG_WARNING, "MySQL RealTime: Couldn't establish connection. Check debug.\n");
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Cannot Connect: %s\n", mysql_error(&mysql));
-	}
+	/* Idle connections made with the old settings go now, the rest as they are released */
+	cw_mutex_lock(&mysql_lock);
+	mysql_pool_reap(mysql_now(), &reaped);
+	cw_mutex_unlock(&mysql_lock);
 
-	cw_verbose(VERBOSE_PREFIX_2 "MySQL RealTime reloaded.\n");
+	mysql_pool_close(reaped);
+	mysql_pool_fill();
 
-	/* Done reloading. Release lock so others can now use driver. */
-	cw_mutex_unlock(&mysql_lock);
+	cw_verbose(VERBOSE_PREFIX_2 "MySQL RealTime reloaded.\n");
 
 	return 0;
 }
@@ -541,6 +1078,14 @@ static int parse_config (void)
 
 	config = cw_config_load(RES_CONFIG_MYSQL_CONF);
 
+	cw_mutex_lock(&mysql_lock);
+
+	pool_min = MYSQL_POOL_MIN_DEFAULT;
+	pool_max = MYSQL_POOL_MAX_DEFAULT;
+	pool_idle_timeout = MYSQL_POOL_IDLE_DEFAULT;
+	pool_ping = MYSQL_POOL_PING_DEFAULT;
+	pool_wait = MYSQL_POOL_WAIT_DEFAULT;
+
 	if(config) {
 		if(!(s=cw_variable_retrieve(config, "general", "dbuser"))) {
 			cw_log(CW_LOG_WARNING, "MySQL RealTime: No database user found, using 'callweaver' as default.\n");
@@ -583,7 +1128,33 @@ static int parse_config (void)
                 } else {
                         strncpy(dbsock, s, sizeof(dbsock) - 1);
                 }
+
+		if ((s = cw_variable_retrieve(config, "general", "poolmin")))
+			pool_min = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolmax")))
+			pool_max = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolidle")))
+			pool_idle_timeout = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolping")))
+			pool_ping = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolwait")))
+			pool_wait = atoi(s);
+
+		if (pool_max < 1) {
+			cw_log(CW_LOG_WARNING, "MySQL RealTime: poolmax must be at least 1\n");
+			pool_max = 1;
+		}
+		if (pool_min < 0 || pool_min > pool_max) {
+			cw_log(CW_LOG_WARNING, "MySQL RealTime: poolmin must be between 0 and poolmax (%d)\n", pool_max);
+			pool_min = (pool_min < 0 ? 0 : pool_max);
+		}
 	}
+
+	/* Connections made with the old settings are closed as they are released */
+	pool_gen++;
+
+	cw_mutex_unlock(&mysql_lock);
+
 	cw_config_destroy(config);
 
 	if(dbhost[0]) {
@@ -598,103 +1169,53 @@ static int parse_config (void)
 	return 1;
 }
 
-static int mysql_reconnect(const char *database)
+static int realtime_mysql_status(struct cw_dynstr *ds_p, int argc, char **argv)
 {
-	char my_database[50];
-#ifdef MYSQL_OPT_RECONNECT
-	my_bool trueval = 1;
-#endif
+	struct mysql_conn *pc;
+	unsigned long queries;
+	int i, idle;
 
-	if(!database || cw_strlen_zero(database))
-		cw_copy_string(my_database, dbname, sizeof(my_database));
-	else
-		cw_copy_string(my_database, database, sizeof(my_database));
+	CW_UNUSED(argc);
+	CW_UNUSED(argv);
 
-	/* mutex lock should have been locked before calling this function. */
+	cw_mutex_lock(&mysql_lock);
 
-reconnect_tryagain:
-	if((!connected) && (dbhost[0] || dbsock[0]) && dbuser[0] && dbpass[0] && my_database[0]) {
-		if(!mysql_init(&mysql)) {
-			cw_log(CW_LOG_WARNING, "MySQL RealTime: Insufficient memory to allocate MySQL resource.\n");
-			connected = 0;
-			return 0;
-		}
-		if(mysql_real_connect(&mysql, dbhost, dbuser, dbpass, my_database, dbport, dbsock, 0)) {
-#ifdef MYSQL_OPT_RECONNECT
-			/* The default is no longer to automatically reconnect on failure,
-			 * (as of 5.0.3) so we have to set that option here. */
-			mysql_options(&mysql, MYSQL_OPT_RECONNECT, &trueval);
-#endif
-			cw_log(CW_LOG_DEBUG, "MySQL RealTime: Successfully connected to database.\n");
-			connected = 1;
-			connect_time = time(NULL);
-			return 1;
-		} else {
-			cw_log(CW_LOG_ERROR, "MySQL RealTime: Failed to connect database server %s on %s (err %u). Check debug for more info.\n", dbname, dbhost, mysql_errno(&mysql));
-			cw_log(CW_LOG_DEBUG, "MySQL RealTime: Cannot Connect (%u): %s\n", mysql_errno(&mysql), mysql_error(&mysql));
-			connected = 0;
-			return 0;
-		}
+	if(dbhost[0]) {
+		cw_dynstr_printf(ds_p, "Database:    %s@%s, port %d", dbname, dbhost, dbport);
+	} else if(dbsock[0]) {
+		cw_dynstr_printf(ds_p, "Database:    %s on socket file %s", dbname, dbsock);
 	} else {
-		/* MySQL likes to return an error, even if it reconnects successfully.
-		 * So the postman pings twice. */
-		if (mysql_ping(&mysql) != 0 && mysql_ping(&mysql) != 0) {
-			connected = 0;
-			cw_log(CW_LOG_ERROR, "MySQL RealTime: Ping failed (%u).  Trying an explicit reconnect.\n", mysql_errno(&mysql));
-			cw_log(CW_LOG_DEBUG, "MySQL RealTime: Server Error (%u): %s\n", mysql_errno(&mysql), mysql_error(&mysql));
-			goto reconnect_tryagain;
-		}
-
-		connected = 1;
-
-		if(mysql_select_db(&mysql, my_database) != 0) {
-			cw_log(CW_LOG_WARNING, "MySQL RealTime: Unable to select database: %s. Still Connected (%u).\n", my_database, mysql_errno(&mysql));
-			cw_log(CW_LOG_DEBUG, "MySQL RealTime: Database Select Failed (%u): %s\n", mysql_errno(&mysql), mysql_error(&mysql));
-			return 0;
-		}
-
-		cw_log(CW_LOG_DEBUG, "MySQL RealTime: Everything is fine.\n");
-		return 1;
+		cw_dynstr_printf(ds_p, "Database:    %s@%s", dbname, dbhost);
 	}
-}
+	if(dbuser[0]) {
+		cw_dynstr_printf(ds_p, " with username %s", dbuser);
+	}
+	cw_dynstr_printf(ds_p, "\n");
 
-static int realtime_mysql_status(struct cw_dynstr *ds_p, int argc, char **argv)
-{
-	char status[256], status2[100] = "";
-	int conntime = time(NULL) - connect_time;
+	for (idle = 0, pc = pool_idle; pc; pc = pc->next)
+		idle++;
 
-	CW_UNUSED(argc);
-	CW_UNUSED(argv);
+	cw_dynstr_printf(ds_p, "Connections: %d (%d in use, %d idle), min %d, max %d, %d waiting\n",
+		pool_total, pool_inuse, idle, pool_min, pool_max, pool_waiting);
+	cw_dynstr_printf(ds_p, "Connects:    %lu, failed %lu\n", stat_connects, stat_connfail);
+	cw_dynstr_printf(ds_p, "Acquired:    %lu, had to wait %lu (avg %.1fms, max %.1fms), timed out %lu\n",
+		stat_acquired, stat_waited,
+		(stat_waited ? (double)stat_wait_us / stat_waited / 1000.0 : 0.0), stat_wait_max_us / 1000.0,
+		stat_timeouts);
 
-	if(mysql_reconnect(NULL)) {
-		if(dbhost[0]) {
-			snprintf(status, 255, "Connected to %s@%s, port %d", dbname, dbhost, dbport);
-		} else if(dbsock[0]) {
-			snprintf(status, 255, "Connected to %s on socket file %s", dbname, dbsock);
-		} else {
-			snprintf(status, 255, "Connected to %s@%s", dbname, dbhost);
-		}
+	queries = stat_queries;
+	cw_dynstr_printf(ds_p, "Queries:     %lu, failed %lu, statements prepared %lu (avg %.2fms, max %.1fms)\n",
+		queries, stat_failed, stat_prepared,
+		(queries ? (double)stat_query_us / queries / 1000.0 : 0.0), stat_query_max_us / 1000.0);
 
-		if(dbuser[0]) {
-			snprintf(status2, 99, " with username %s", dbuser);
-		}
+	cw_dynstr_printf(ds_p, "Latency:    ");
+	for (i = 0; i < arraysize(mysql_hist_ms); i++)
+		cw_dynstr_printf(ds_p, " <%dms %lu", mysql_hist_ms[i], stat_hist[i]);
+	cw_dynstr_printf(ds_p, " >=%dms %lu\n", mysql_hist_ms[arraysize(mysql_hist_ms) - 1], stat_hist[i]);
 
-		if (conntime > 31536000) {
-			cw_dynstr_printf(ds_p, "%s%s for %d years, %d days, %d hours, %d minutes, %d seconds.\n", status, status2, conntime / 31536000, (conntime % 31536000) / 86400, (conntime % 86400) / 3600, (conntime % 3600) / 60, conntime % 60);
-		} else if (conntime > 86400) {
-			cw_dynstr_printf(ds_p, "%s%s for %d days, %d hours, %d minutes, %d seconds.\n", status, status2, conntime / 86400, (conntime % 86400) / 3600, (conntime % 3600) / 60, conntime % 60);
-		} else if (conntime > 3600) {
-			cw_dynstr_printf(ds_p, "%s%s for %d hours, %d minutes, %d seconds.\n", status, status2, conntime / 3600, (conntime % 3600) / 60, conntime % 60);
-		} else if (conntime > 60) {
-			cw_dynstr_printf(ds_p, "%s%s for %d minutes, %d seconds.\n", status, status2, conntime / 60, conntime % 60);
-		} else {
-			cw_dynstr_printf(ds_p, "%s%s for %d seconds.\n", status, status2, conntime);
-		}
+	cw_mutex_unlock(&mysql_lock);
 
-		return RESULT_SUCCESS;
-	} else {
-		return RESULT_FAILURE;
-	}
+	return RESULT_SUCCESS;
 }
 
 
@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 
 #include "callweaver.h"
 
@@ -36,6 +37,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
 #include "callweaver/lock.h"
 #include "callweaver/options.h"
 #include "callweaver/utils.h"
+#include "callweaver/cli.h"
 
 #include <libpq-fe.h>
 
@@ -44,10 +46,58 @@ static const char tdesc[] = "PostgreSQL Configuration";
 CW_MUTEX_DEFINE_STATIC(pgsql_lock);
 #define RES_CONFIG_PGSQL_CONF "res_pgsql.conf"
 static char conninfo[512];
-static PGconn *conn = NULL;
+
+#define PGSQL_POOL_MIN_DEFAULT		1
+#define PGSQL_POOL_MAX_DEFAULT		4
+#define PGSQL_POOL_IDLE_DEFAULT		60	/* seconds before spare idle connections are closed */
+#define PGSQL_POOL_PING_DEFAULT		30	/* seconds idle before a connection is checked on reuse */
+#define PGSQL_POOL_WAIT_DEFAULT		5000	/* milliseconds to wait for a free connection */
+
+#define PGSQL_MAX_PARAMS		32
+#define PGSQL_MAX_STMTS			64	/* prepared statements kept per connection */
+
+/* Upper bounds (in ms) of the query latency histogram buckets. The last bucket is everything slower. */
+static const int pgsql_hist_ms[] = { 1, 2, 5, 10, 20, 50, 100, 500, 1000 };
+
+/* A statement prepared on one connection. The SQL text, with $n in
+ * place of the values, is the key so each (table, column set, operator)
+ * shape gets its own plan.
+ */
+struct pgsql_stmt {
+	struct pgsql_stmt *next;
+	char name[16];
+	char sql[0];
+};
+
+struct pgsql_conn {
+	struct pgsql_conn *next;
+	PGconn *conn;
+	unsigned int gen;
+	time_t idle_since;
+	struct pgsql_stmt *stmts;
+	unsigned int nstmts;
+	unsigned int stmtseq;
+};
+
+/* The pool and its statistics are protected by pgsql_lock */
+static struct pgsql_conn *pool_idle;
+static int pool_total, pool_inuse, pool_waiting;
+static unsigned int pool_gen;
+static int pool_min = PGSQL_POOL_MIN_DEFAULT;
+static int pool_max = PGSQL_POOL_MAX_DEFAULT;
+static int pool_idle_timeout = PGSQL_POOL_IDLE_DEFAULT;
+static int pool_ping = PGSQL_POOL_PING_DEFAULT;
+static int pool_wait = PGSQL_POOL_WAIT_DEFAULT;
+static pthread_cond_t pool_cond;
+
+static unsigned long stat_acquired, stat_waited, stat_timeouts;
+static unsigned long stat_connects, stat_connfail, stat_prepared;
+static unsigned long stat_queries, stat_failed;
+static unsigned long long stat_wait_us, stat_query_us;
+static unsigned int stat_wait_max_us, stat_query_max_us;
+static unsigned long stat_hist[arraysize(pgsql_hist_ms) + 1];
 
 static int parse_config(void);
-static int pgsql_reconnect(const char *database);
 
 
 static int parse_config(void)
@@ -57,67 +107,399 @@ static int parse_config(void)
 
 	config = cw_config_load(RES_CONFIG_PGSQL_CONF);
 
+	cw_mutex_lock(&pgsql_lock);
+
+	pool_min = PGSQL_POOL_MIN_DEFAULT;
+	pool_max = PGSQL_POOL_MAX_DEFAULT;
+	pool_idle_timeout = PGSQL_POOL_IDLE_DEFAULT;
+	pool_ping = PGSQL_POOL_PING_DEFAULT;
+	pool_wait = PGSQL_POOL_WAIT_DEFAULT;
+
 	if (config) {
 
 		/* get the database host */
 		s = cw_variable_retrieve(config, "general", "dsn");
 		if (s == NULL) {
 			cw_log(CW_LOG_WARNING, "PgSQL RealTime: No DSN found, using 'dbname=callweaver user=callweaver'.\n");
-			strncpy(conninfo, "dbname=callweaver user=callweaver", sizeof(conninfo));
+			cw_copy_string(conninfo, "dbname=callweaver user=callweaver", sizeof(conninfo));
 		} else {
-			strncpy(conninfo, s, sizeof(conninfo));
+			cw_copy_string(conninfo, s, sizeof(conninfo));
 		}
 
+		if ((s = cw_variable_retrieve(config, "general", "poolmin")))
+			pool_min = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolmax")))
+			pool_max = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolidle")))
+			pool_idle_timeout = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolping")))
+			pool_ping = atoi(s);
+		if ((s = cw_variable_retrieve(config, "general", "poolwait")))
+			pool_wait = atoi(s);
+
+		if (pool_max < 1) {
+			cw_log(CW_LOG_WARNING, "PgSQL RealTime: poolmax must be at least 1\n");
+			pool_max = 1;
+		}
+		if (pool_min < 0 || pool_min > pool_max) {
+			cw_log(CW_LOG_WARNING, "PgSQL RealTime: poolmin must be between 0 and poolmax (%d)\n", pool_max);
+			pool_min = (pool_min < 0 ? 0 : pool_max);
+		}
 	} else {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime config file (%s) not found.\n", RES_CONFIG_PGSQL_CONF);
 	}
+
+	/* Connections made with the old settings are closed as they are released */
+	pool_gen++;
+
+	cw_mutex_unlock(&pgsql_lock);
+
 	cw_config_destroy(config);
 
 	return 1;
 }
 
-static int pgsql_reconnect(const char *database)
+static time_t pgsql_now(void)
 {
-	CW_UNUSED(database);
+	struct timespec ts;
 
-	if (conn != NULL) {
-		/* we may already be connected */
-		if (PQstatus(conn) == CONNECTION_OK) {
-			return 1;
-		} else {
-			cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Existing database connection broken. Trying to reset.\n");
-
-			/* try to reset the connection */
-			PQreset(conn);
-
-			/* check the connection status again */
-			if (PQstatus(conn) == CONNECTION_OK) {
-				cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Existing database connection reset ok.\n");
-				return 1;
-			} else {
-				/* still no luck, tear down the connection and we'll make a new connection */
-				cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Unable to reset existing database connection.\n");
-				PQfinish(conn);
-			}
+	cw_clock_gettime(global_clock_monotonic, &ts);
+	return ts.tv_sec;
+}
+
+static void pgsql_conn_reset_stmts(struct pgsql_conn *pc)
+{
+	struct pgsql_stmt *stmt;
+
+	while ((stmt = pc->stmts)) {
+		pc->stmts = stmt->next;
+		free(stmt);
+	}
+	pc->nstmts = 0;
+}
+
+static void pgsql_conn_free(struct pgsql_conn *pc)
+{
+	pgsql_conn_reset_stmts(pc);
+	PQfinish(pc->conn);
+	free(pc);
+}
+
+static struct pgsql_conn *pgsql_connect(void)
+{
+	char info[sizeof(conninfo)];
+	struct pgsql_conn *pc;
+
+	if (!(pc = calloc(1, sizeof(*pc)))) {
+		cw_log(CW_LOG_ERROR, "Out of memory\n");
+		return NULL;
+	}
+
+	cw_mutex_lock(&pgsql_lock);
+	memcpy(info, conninfo, sizeof(info));
+	pc->gen = pool_gen;
+	cw_mutex_unlock(&pgsql_lock);
+
+	pc->conn = PQconnectdb(info);
+
+	cw_mutex_lock(&pgsql_lock);
+	if (PQstatus(pc->conn) == CONNECTION_OK)
+		stat_connects++;
+	else
+		stat_connfail++;
+	cw_mutex_unlock(&pgsql_lock);
+
+	if (PQstatus(pc->conn) != CONNECTION_OK) {
+		cw_log(CW_LOG_WARNING, "PgSQL RealTime: Couldn't establish DB connection. Check debug.\n");
+		cw_log(CW_LOG_ERROR, "PgSQL RealTime: reason %s\n", PQerrorMessage(pc->conn));
+		pgsql_conn_free(pc);
+		return NULL;
+	}
+
+	if (option_debug)
+		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Successfully connected to PostgreSQL database.\n");
+	return pc;
+}
+
+/* Must be called with pgsql_lock held. Unlinks idle connections that have
+ * been idle too long (or belong to an old configuration) onto *reaped for
+ * the caller to close once the lock is released.
+ */
+static void pgsql_pool_reap(time_t now, struct pgsql_conn **reaped)
+{
+	struct pgsql_conn **p, *pc;
+
+	p = &pool_idle;
+	while ((pc = *p)) {
+		if (pc->gen != pool_gen || (pool_total > pool_min && now - pc->idle_since >= pool_idle_timeout)) {
+			*p = pc->next;
+			pc->next = *reaped;
+			*reaped = pc;
+			pool_total--;
+		} else
+			p = &pc->next;
+	}
+}
+
+static void pgsql_pool_close(struct pgsql_conn *list)
+{
+	struct pgsql_conn *pc;
+
+	while ((pc = list)) {
+		list = pc->next;
+		pgsql_conn_free(pc);
+	}
+}
+
+/* Checks a connection taken from the idle list. Anything that has been idle
+ * a while is pinged since firewalls and server restarts kill connections
+ * without telling us.
+ */
+static int pgsql_conn_check(struct pgsql_conn *pc)
+{
+	PGresult *res;
+	int ok;
+
+	ok = (PQstatus(pc->conn) == CONNECTION_OK);
+
+	if (ok && pool_ping >= 0 && pgsql_now() - pc->idle_since >= pool_ping) {
+		res = PQexec(pc->conn, "SELECT 1");
+		ok = (PQresultStatus(res) == PGRES_TUPLES_OK);
+		PQclear(res);
+	}
+
+	if (!ok) {
+		cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Existing database connection broken. Trying to reset.\n");
+
+		/* Prepared statements do not survive a reset */
+		pgsql_conn_reset_stmts(pc);
+		PQreset(pc->conn);
+
+		if ((ok = (PQstatus(pc->conn) == CONNECTION_OK)))
+			cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Existing database connection reset ok.\n");
+		else
+			cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Unable to reset existing database connection.\n");
+	}
+
+	return ok;
+}
+
+static struct pgsql_conn *pgsql_acquire(void)
+{
+	struct timespec deadline;
+	struct timeval start;
+	struct pgsql_conn *pc, *reaped = NULL;
+	unsigned int us;
+	int waited = 0;
+
+	cw_mutex_lock(&pgsql_lock);
+
+	pgsql_pool_reap(pgsql_now(), &reaped);
+
+	for (;;) {
+		if ((pc = pool_idle)) {
+			pool_idle = pc->next;
+			break;
+		}
+
+		if (pool_total < pool_max) {
+			/* Reserve the slot and connect once we've dropped the lock */
+			pool_total++;
+			break;
 		}
+
+		if (!waited) {
+			waited = 1;
+			start = cw_tvnow();
+			cw_clock_gettime(global_cond_clock_monotonic, &deadline);
+			cw_clock_add_ms(&deadline, pool_wait);
+		}
+
+		pool_waiting++;
+		if (cw_cond_timedwait(&pool_cond, &pgsql_lock, &deadline) == ETIMEDOUT && !pool_idle && pool_total >= pool_max) {
+			pool_waiting--;
+			stat_timeouts++;
+			cw_mutex_unlock(&pgsql_lock);
+			pgsql_pool_close(reaped);
+			cw_log(CW_LOG_WARNING, "PgSQL RealTime: No free database connection after %dms (all %d in use)\n", pool_wait, pool_max);
+			return NULL;
+		}
+		pool_waiting--;
+	}
+
+	pool_inuse++;
+	stat_acquired++;
+	if (waited) {
+		us = cw_tvdiff(cw_tvnow(), start);
+		stat_waited++;
+		stat_wait_us += us;
+		if (us > stat_wait_max_us)
+			stat_wait_max_us = us;
+	}
+
+	cw_mutex_unlock(&pgsql_lock);
+
+	pgsql_pool_close(reaped);
+
+	if (pc && !pgsql_conn_check(pc)) {
+		pgsql_conn_free(pc);
+		pc = NULL;
 	}
 
-	conn = PQconnectdb(conninfo);
+	if (!pc && !(pc = pgsql_connect())) {
+		cw_mutex_lock(&pgsql_lock);
+		pool_total--;
+		pool_inuse--;
+		cw_cond_signal(&pool_cond);
+		cw_mutex_unlock(&pgsql_lock);
+	}
 
-	if (PQstatus(conn) == CONNECTION_OK) {
-		cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Successfully connected to PostgreSQL database.\n");
-		return 1;
+	return pc;
+}
+
+static void pgsql_release(struct pgsql_conn *pc)
+{
+	struct pgsql_conn *reaped = NULL;
+	time_t now = pgsql_now();
+
+	cw_mutex_lock(&pgsql_lock);
+
+	pool_inuse--;
+
+	if (PQstatus(pc->conn) == CONNECTION_OK && PQtransactionStatus(pc->conn) == PQTRANS_IDLE) {
+		pc->idle_since = now;
+		pc->next = pool_idle;
+		pool_idle = pc;
 	} else {
-		cw_log(CW_LOG_WARNING, "PgSQL RealTime: Couldn't establish DB connection. Check debug.\n");
-		cw_log(CW_LOG_ERROR, "PgSQL RealTime: reason %s\n", PQerrorMessage(conn));
-	}		
+		pc->next = reaped;
+		reaped = pc;
+		pool_total--;
+	}
+
+	pgsql_pool_reap(now, &reaped);
+
+	cw_cond_signal(&pool_cond);
 
-	return -1;
+	cw_mutex_unlock(&pgsql_lock);
+
+	pgsql_pool_close(reaped);
+}
+
+/* Opens connections until there are at least poolmin of them */
+static void pgsql_pool_fill(void)
+{
+	struct pgsql_conn *pc;
+	int n;
+
+	cw_mutex_lock(&pgsql_lock);
+	n = pool_min - pool_total;
+	pool_total += (n > 0 ? n : 0);
+	pool_inuse += (n > 0 ? n : 0);
+	cw_mutex_unlock(&pgsql_lock);
+
+	for (; n > 0; n--) {
+		if ((pc = pgsql_connect()))
+			pgsql_release(pc);
+		else {
+			cw_mutex_lock(&pgsql_lock);
+			pool_total--;
+			pool_inuse--;
+			cw_mutex_unlock(&pgsql_lock);
+		}
+	}
+}
+
+static PGresult *pgsql_exec(struct pgsql_conn *pc, const char *sql, int nparams, const char * const *values)
+{
+	struct pgsql_stmt *stmt;
+	struct timeval start;
+	PGresult *res;
+	ExecStatusType status;
+	unsigned int us;
+	int i, prepared = 0;
+
+	start = cw_tvnow();
+
+	for (stmt = pc->stmts; stmt && strcmp(stmt->sql, sql); stmt = stmt->next);
+
+	if (!stmt && pc->nstmts < PGSQL_MAX_STMTS && (stmt = malloc(sizeof(*stmt) + strlen(sql) + 1))) {
+		snprintf(stmt->name, sizeof(stmt->name), "cw_rt_%u", pc->stmtseq++);
+		strcpy(stmt->sql, sql);
+
+		res = PQprepare(pc->conn, stmt->name, sql, nparams, NULL);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			/* Leave the error for the caller to report */
+			free(stmt);
+			goto done;
+		}
+		PQclear(res);
+
+		stmt->next = pc->stmts;
+		pc->stmts = stmt;
+		pc->nstmts++;
+		prepared = 1;
+	}
+
+	if (stmt)
+		res = PQexecPrepared(pc->conn, stmt->name, nparams, values, NULL, NULL, 0);
+	else
+		res = PQexecParams(pc->conn, sql, nparams, NULL, values, NULL, NULL, 0);
+
+done:
+	us = cw_tvdiff(cw_tvnow(), start);
+	status = PQresultStatus(res);
+
+	for (i = 0; i < arraysize(pgsql_hist_ms) && us >= pgsql_hist_ms[i] * 1000U; i++);
+
+	cw_mutex_lock(&pgsql_lock);
+	stat_queries++;
+	stat_prepared += prepared;
+	if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK)
+		stat_failed++;
+	stat_query_us += us;
+	if (us > stat_query_max_us)
+		stat_query_max_us = us;
+	stat_hist[i]++;
+	cw_mutex_unlock(&pgsql_lock);
+
+	return res;
+}
+
+/*! \brief Run a parameterised query on a pooled connection
+ *
+ * The whole result is fetched before the connection goes back to the pool.
+ * If the connection turns out to have died under us the query is retried
+ * once on another.
+ */
+static PGresult *pgsql_query(const char *sql, int nparams, const char * const *values)
+{
+	struct pgsql_conn *pc;
+	PGresult *res = NULL;
+	int tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		if (!(pc = pgsql_acquire()))
+			break;
+
+		if (res)
+			PQclear(res);
+		res = pgsql_exec(pc, sql, nparams, values);
+
+		if (PQstatus(pc->conn) == CONNECTION_OK) {
+			pgsql_release(pc);
+			break;
+		}
+
+		pgsql_release(pc);
+	}
+
+	return res;
 }
 
 static struct cw_variable *realtime_pgsql(const char *database, const char *table, va_list ap)
 {
 	char sql[1024];
+	const char *values[PGSQL_MAX_PARAMS];
 	PGresult *res;
 	char *stringp;
 	char *chunk;
@@ -126,6 +508,9 @@ static struct cw_variable *realtime_pgsql(const char *database, const char *tabl
 	struct cw_variable *var=NULL, *prev=NULL;
 	long int row, rowcount = 0;
 	int col, colcount = 0;
+	int n;
+
+	CW_UNUSED(database);
 
 	if (!table) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: No table specified.\n");
@@ -145,30 +530,30 @@ static struct cw_variable *realtime_pgsql(const char *database, const char *tabl
 
 	if (!strchr(newparam, ' ')) op = " ="; else op = "";
 
-	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s '%s'", table, newparam, op, newval);
+	n = 0;
+	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s $%d", table, newparam, op, n + 1);
+	values[n++] = newval;
 	while ((newparam = va_arg(ap, const char *))) {
 		newval = va_arg(ap, const char *);
+		if (n == PGSQL_MAX_PARAMS) {
+			cw_log(CW_LOG_WARNING, "PgSQL RealTime: Too many parameters (more than %d) for table %s\n", PGSQL_MAX_PARAMS, table);
+			return NULL;
+		}
 		if (!strchr(newparam, ' ')) op = " ="; else op = "";
-		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s '%s'", newparam, op, newval);
+		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s $%d", newparam, op, n + 1);
+		values[n++] = newval;
 	}
 	va_end(ap);
 
 	cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Retrieve SQL: %s\n", sql);
 
-	/* SQL statement is ready, check database connection is still good */
-	if (!pgsql_reconnect(database)) {
-		return NULL;
-	}
-
-	cw_mutex_lock(&pgsql_lock);
-	res = PQexec(conn, sql);
+	res = pgsql_query(sql, n, values);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query: %s\n", sql);
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query failed because: %s\n", PQresultErrorMessage(res));
 		PQclear(res);
-		cw_mutex_unlock(&pgsql_lock);
 		return NULL;
 	}
 
@@ -200,7 +585,6 @@ static struct cw_variable *realtime_pgsql(const char *database, const char *tabl
 	}
 
 	PQclear(res);
-	cw_mutex_unlock(&pgsql_lock);
 
 	return var;
 }
@@ -208,6 +592,7 @@ static struct cw_variable *realtime_pgsql(const char *database, const char *tabl
 static struct cw_config *realtime_multi_pgsql(const char *database, const char *table, va_list ap)
 {
 	char sql[1024];
+	const char *values[PGSQL_MAX_PARAMS];
 	PGresult *res;
 	const char *initfield = NULL;
 	char *stringp;
@@ -219,6 +604,9 @@ static struct cw_config *realtime_multi_pgsql(const char *database, const char *
 	struct cw_category *cat = NULL;
 	long int row, rowcount = 0;
 	int col, colcount = 0;
+	int n;
+
+	CW_UNUSED(database);
 
 	if(!table) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: No table specified.\n");
@@ -249,11 +637,19 @@ static struct cw_config *realtime_multi_pgsql(const char *database, const char *
 
 	if(!strchr(newparam, ' ')) op = " ="; else op = "";
 
-	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s '%s'", table, newparam, op, newval);
+	n = 0;
+	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s $%d", table, newparam, op, n + 1);
+	values[n++] = newval;
 	while ((newparam = va_arg(ap, const char *))) {
 		newval = va_arg(ap, const char *);
+		if (n == PGSQL_MAX_PARAMS) {
+			cw_log(CW_LOG_WARNING, "PgSQL RealTime: Too many parameters (more than %d) for table %s\n", PGSQL_MAX_PARAMS, table);
+			cw_config_destroy(cfg);
+			return NULL;
+		}
 		if (!strchr(newparam, ' ')) op = " ="; else op = "";
-		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s '%s'", newparam, op, newval);
+		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " AND %s%s $%d", newparam, op, n + 1);
+		values[n++] = newval;
 	}
 
 	if (initfield) {
@@ -264,20 +660,14 @@ static struct cw_config *realtime_multi_pgsql(const char *database, const char *
 
 	cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Retrieve SQL: %s\n", sql);
 
-	/* SQL statement is ready, check database connection is still good */
-	if (!pgsql_reconnect(database)) {
-		return NULL;
-	}
-
-	cw_mutex_lock(&pgsql_lock);
-	res = PQexec(conn, sql);
+	res = pgsql_query(sql, n, values);
 	
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query: %s\n", sql);
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query failed because: %s\n", PQresultErrorMessage(res));
 		PQclear(res);
-		cw_mutex_unlock(&pgsql_lock);
+		cw_config_destroy(cfg);
 		return NULL;
 	}
 
@@ -314,7 +704,6 @@ static struct cw_config *realtime_multi_pgsql(const char *database, const char *
 	}
 
 	PQclear(res);
-	cw_mutex_unlock(&pgsql_lock);
 
 	return cfg;
 }
@@ -324,7 +713,11 @@ static int update_pgsql(const char *database, const char *table, const char *key
 	PGresult *res;
 	long int rowcount = 0;
 	char sql[1024];
+	const char *values[PGSQL_MAX_PARAMS + 1];
 	const char *newparam, *newval;
+	int n;
+
+	CW_UNUSED(database);
 
 	if (!table) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: No table specified.\n");
@@ -342,37 +735,37 @@ static int update_pgsql(const char *database, const char *table, const char *key
 	/* Create the first part of the query using the first parameter/value pairs we just extracted
 	   If there is only 1 set, then we have our query. Otherwise, loop thru the list and concat */
 
-	snprintf(sql, sizeof(sql), "UPDATE %s SET %s = '%s'", table, newparam, newval);
+	n = 0;
+	snprintf(sql, sizeof(sql), "UPDATE %s SET %s = $%d", table, newparam, n + 1);
+	values[n++] = newval;
 	while ((newparam = va_arg(ap, const char *))) {
 		newval = va_arg(ap, const char *);
-		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), ", %s = '%s'", newparam, newval);
+		if (n == PGSQL_MAX_PARAMS) {
+			cw_log(CW_LOG_WARNING, "PgSQL RealTime: Too many parameters (more than %d) for table %s\n", PGSQL_MAX_PARAMS, table);
+			return -1;
+		}
+		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), ", %s = $%d", newparam, n + 1);
+		values[n++] = newval;
 	}
 	va_end(ap);
-	snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " WHERE %s = '%s'", keyfield, lookup);
+	snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " WHERE %s = $%d", keyfield, n + 1);
+	values[n++] = lookup;
 
 	cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Update SQL: %s\n", sql);
 
-	/* SQL statement is ready, check database connection is still good */
-	if (!pgsql_reconnect(database)) {
-		return -1;
-	}
-
-	cw_mutex_lock(&pgsql_lock);
-	res = PQexec(conn, sql);
+	res = pgsql_query(sql, n, values);
 	
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query: %s\n", sql);
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query failed because: %s\n", PQresultErrorMessage(res));
 		PQclear(res);
-		cw_mutex_unlock(&pgsql_lock);
 		return -1;
 	}
 
 	rowcount = atol(PQcmdTuples(res));
 
 	PQclear(res);
-	cw_mutex_unlock(&pgsql_lock);
 
 	cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Updated %ld rows on table: %s\n", rowcount, table);
 
@@ -388,33 +781,30 @@ static struct cw_config *config_pgsql(const char *database, const char *table, c
 	char last[128] = "";
 	struct cw_category *cur_cat = NULL;
 	struct cw_variable *new_v;
+	const char *values[1];
 	PGresult *res;
 	long int row, rowcount = 0;
 	int last_cat_metric = 0;
 
+	CW_UNUSED(database);
+
 	if (!file || !strcmp(file, RES_CONFIG_PGSQL_CONF)) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: Cannot configure myself.\n");
 		return NULL;		
 	}
 
-	snprintf(sql, sizeof(sql), "SELECT category, var_name, var_val, cat_metric FROM %s WHERE filename='%s' and commented=0 ORDER BY filename, cat_metric DESC, var_metric ASC, category, var_name, var_val, id", table, file);
+	snprintf(sql, sizeof(sql), "SELECT category, var_name, var_val, cat_metric FROM %s WHERE filename=$1 and commented=0 ORDER BY filename, cat_metric DESC, var_metric ASC, category, var_name, var_val, id", table);
+	values[0] = file;
 
 	cw_log(CW_LOG_NOTICE, "PgSQL RealTime: Static SQL: %s\n", sql);
 
-	/* SQL statement is ready, check database connection is still good */
-	if (!pgsql_reconnect(database)) {
-		return NULL;
-	}
-
-	cw_mutex_lock(&pgsql_lock);
-	res = PQexec(conn, sql);
+	res = pgsql_query(sql, 1, values);
 	
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		cw_log(CW_LOG_WARNING, "PgSQL RealTime: Failed to query database. Check debug for more info.\n");
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query: %s\n", sql);
 		cw_log(CW_LOG_DEBUG, "PgSQL RealTime: Query failed because: %s\n", PQresultErrorMessage(res));
 		PQclear(res);
-		cw_mutex_unlock(&pgsql_lock);
 		return NULL;
 	}
 
@@ -426,7 +816,6 @@ static struct cw_config *config_pgsql(const char *database, const char *table, c
 			if (!strcmp(PQgetvalue(res, row, 1), "#include")) {
 				if (!cw_config_internal_load(PQgetvalue(res, row, 2), cfg)) {
 					PQclear(res);
-					cw_mutex_unlock(&pgsql_lock);
 					return NULL;
 				}
 				continue;
@@ -452,7 +841,6 @@ static struct cw_config *config_pgsql(const char *database, const char *table, c
 	}
 
 	PQclear(res);
-	cw_mutex_unlock(&pgsql_lock);
 
 	return cfg;
 }
@@ -465,11 +853,64 @@ static struct cw_config_engine pgsql_engine = {
 	.update_func = update_pgsql
 };
 
+static int realtime_pgsql_status(struct cw_dynstr *ds_p, int argc, char **argv)
+{
+	unsigned long queries;
+	int i, idle;
+	struct pgsql_conn *pc;
+
+	CW_UNUSED(argc);
+	CW_UNUSED(argv);
+
+	cw_mutex_lock(&pgsql_lock);
+
+	for (idle = 0, pc = pool_idle; pc; pc = pc->next)
+		idle++;
+
+	cw_dynstr_printf(ds_p, "Connections: %d (%d in use, %d idle), min %d, max %d, %d waiting\n",
+		pool_total, pool_inuse, idle, pool_min, pool_max, pool_waiting);
+	cw_dynstr_printf(ds_p, "Connects:    %lu, failed %lu\n", stat_connects, stat_connfail);
+	cw_dynstr_printf(ds_p, "Acquired:    %lu, had to wait %lu (avg %.1fms, max %.1fms), timed out %lu\n",
+		stat_acquired, stat_waited,
+		(stat_waited ? (double)stat_wait_us / stat_waited / 1000.0 : 0.0), stat_wait_max_us / 1000.0,
+		stat_timeouts);
+
+	queries = stat_queries;
+	cw_dynstr_printf(ds_p, "Queries:     %lu, failed %lu, statements prepared %lu (avg %.2fms, max %.1fms)\n",
+		queries, stat_failed, stat_prepared,
+		(queries ? (double)stat_query_us / queries / 1000.0 : 0.0), stat_query_max_us / 1000.0);
+
+	cw_dynstr_printf(ds_p, "Latency:    ");
+	for (i = 0; i < arraysize(pgsql_hist_ms); i++)
+		cw_dynstr_printf(ds_p, " <%dms %lu", pgsql_hist_ms[i], stat_hist[i]);
+	cw_dynstr_printf(ds_p, " >=%dms %lu\n", pgsql_hist_ms[arraysize(pgsql_hist_ms) - 1], stat_hist[i]);
+
+	cw_mutex_unlock(&pgsql_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static const char cli_realtime_pgsql_status_usage[] =
+"Usage: realtime pgsql status\n"
+"       Shows the connection pool and query statistics for the PostgreSQL RealTime driver\n";
+
+static struct cw_clicmd cli_realtime_pgsql_status = {
+	.cmda = { "realtime", "pgsql", "status", NULL },
+	.handler = realtime_pgsql_status,
+	.summary = "Shows connection pool statistics for the PostgreSQL RealTime driver",
+	.usage = cli_realtime_pgsql_status_usage,
+};
+
 static void release(void)
 {
+	struct pgsql_conn *list;
+
 	cw_mutex_lock(&pgsql_lock);
-	PQfinish(conn);
+	list = pool_idle;
+	pool_idle = NULL;
 	cw_mutex_unlock(&pgsql_lock);
+
+	pgsql_pool_close(list);
 }
 
 static int unload_module(void)
@@ -478,6 +919,7 @@ static int unload_module(void)
 	cw_mutex_lock(&pgsql_lock);
 
 	cw_config_engine_unregister(&pgsql_engine);
+	cw_cli_unregister(&cli_realtime_pgsql_status);
 
 	/* Unlock so something else can destroy the lock */
 	cw_mutex_unlock(&pgsql_lock);
@@ -485,19 +927,39 @@ static int unload_module(void)
 	return 0;
 }
 
+static int reload_module(void)
+{
+	struct pgsql_conn *reaped = NULL;
+
+	parse_config();
+
+	/* Idle connections made with the old settings go now, the rest as they are released */
+	cw_mutex_lock(&pgsql_lock);
+	pgsql_pool_reap(pgsql_now(), &reaped);
+	cw_mutex_unlock(&pgsql_lock);
+
+	pgsql_pool_close(reaped);
+	pgsql_pool_fill();
+
+	return 0;
+}
+
 static int load_module(void)
 {
 	/* We should never be unloaded */
 	cw_object_get(get_modinfo()->self);
 
-	cw_config_engine_register(&pgsql_engine);
+	cw_cond_init(&pool_cond, &global_condattr_monotonic);
 
 	parse_config();
 
-	pgsql_reconnect(NULL);
+	pgsql_pool_fill();
+
+	cw_config_engine_register(&pgsql_engine);
+	cw_cli_register(&cli_realtime_pgsql_status);
 
 	return 0;
 }
 
 
-MODULE_INFO(load_module, NULL, unload_module, release, tdesc)
+MODULE_INFO(load_module, reload_module, unload_module, release, tdesc)
@@ -185,7 +185,7 @@ static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
 		if (cw_fileexists(monitor->read_filename, NULL, NULL)) {
 			cw_filedelete(monitor->read_filename, NULL);
 		}
-		if (!(monitor->read_stream = cw_writefile(monitor->read_filename,
+		if (!(monitor->read_stream = cw_writefile_async(monitor->read_filename,
 						monitor->format, NULL,
 						O_CREAT|O_TRUNC|O_WRONLY, 0, 0644))) {
 			cw_log(CW_LOG_WARNING, "Could not create file %s\n",
@@ -197,7 +197,7 @@ static int __cw_monitor_start(	struct cw_channel *chan, const char *format_spec,
 		if (cw_fileexists(monitor->write_filename, NULL, NULL)) {
 			cw_filedelete(monitor->write_filename, NULL);
 		}
-		if (!(monitor->write_stream = cw_writefile(monitor->write_filename,
+		if (!(monitor->write_stream = cw_writefile_async(monitor->write_filename,
 						monitor->format, NULL,
 						O_CREAT|O_TRUNC|O_WRONLY, 0, 0644))) {
 			cw_log(CW_LOG_WARNING, "Could not create file %s\n",
@@ -234,12 +234,17 @@ static int __cw_monitor_stop(struct cw_channel *chan, int need_lock)
 
 	if (chan->monitor) {
 		char filename[ FILENAME_MAX ];
+		int (*closestream)(struct cw_filestream *) = cw_closestream_async;
+
+		/* The files are only needed complete now if we are about to rename or join them */
+		if ((chan->monitor->filename_changed || chan->monitor->joinfiles) && !cw_strlen_zero(chan->monitor->filename_base))
+			closestream = cw_closestream;
 
 		if (chan->monitor->read_stream) {
-			cw_closestream(chan->monitor->read_stream);
+			closestream(chan->monitor->read_stream);
 		}
 		if (chan->monitor->write_stream) {
-			cw_closestream(chan->monitor->write_stream);
+			closestream(chan->monitor->write_stream);
 		}
 
 		if (chan->monitor->filename_changed && !cw_strlen_zero(chan->monitor->filename_base)) {
@@ -0,0 +1,323 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2009, Eris Associates Limited, UK
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ *
+ * aclbench.c
+ *
+ * Times cw_acl_check with the list walk and with the compiled radix tree
+ * for ACLs of increasing size and checks that both give the same answer
+ * for every address looked up. There are two sets of rules:
+ *
+ * carrier  - deny everything, then random /16 to /32 permits and denies
+ *            scattered over the IPv4 space like customer trunks and
+ *            blocklists. Half the lookups fall inside a rule and half
+ *            are random.
+ * overlap  - random permits and denies from a tiny IPv4 and IPv6 space
+ *            with every mask length, so rules nest and overlap heavily
+ *            and last-match-wins decides almost every lookup. Some
+ *            lookups have a port and some are v4-mapped.
+ *
+ * usage: aclbench [entries ...]
+ *
+ * The default is 10, 1000 and 100000 entries. The exit status is non-zero
+ * if the tree and the list disagree about any address.
+ *
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "callweaver.h"
+#include "callweaver/acl.h"
+#include "callweaver/dynstr.h"
+#include "callweaver/logger.h"
+#include "callweaver/options.h"
+#include "callweaver/srv.h"
+#include "callweaver/utils.h"
+
+
+/* acl.c needs these from the rest of the core */
+int option_debug;
+
+void cw_log_internal(const char *file, int line, const char *function, cw_log_level level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+int cw_dynstr_printf(struct cw_dynstr *ds_p, const char *fmt, ...)
+{
+	return 0;
+}
+
+int cw_get_srv(struct cw_channel *chan, char *host, int hostlen, int *port, const char *service)
+{
+	return -1;
+}
+
+
+/* Number of addresses looked up */
+#define QUERIES		200000
+
+/* Cap on the work the list walk does per ACL size (entries x lookups) */
+#define LIST_WORK	200000000.0
+
+
+static uint32_t seed = 12345;
+
+static uint32_t rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void set_in(struct sockaddr_storage *ss, uint32_t addr)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(addr);
+}
+
+static void set_in6(struct sockaddr_storage *ss)
+{
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+	int i;
+
+	memset(sin6, 0, sizeof(*sin6));
+	sin6->sin6_family = AF_INET6;
+	for (i = 0; i < 16; i++)
+		sin6->sin6_addr.s6_addr[i] = (i < 2 ? 0x20 : (rnd() & 3));
+}
+
+static void set_mapped(struct sockaddr_storage *ss, uint32_t addr)
+{
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+	memset(sin6, 0, sizeof(*sin6));
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_addr.s6_addr[10] = sin6->sin6_addr.s6_addr[11] = 0xff;
+	addr = htonl(addr);
+	memcpy(&sin6->sin6_addr.s6_addr[12], &addr, 4);
+}
+
+
+static struct cw_acl *build_carrier(int entries, struct sockaddr_storage *query, int nquery)
+{
+	struct sockaddr_storage ss;
+	struct cw_acl *acl = NULL;
+	uint32_t *prefix;
+	int *masklen;
+	int i;
+
+	if (!(prefix = malloc(entries * sizeof(*prefix))) || !(masklen = malloc(entries * sizeof(*masklen)))) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+
+	set_in(&ss, 0);
+	cw_acl_add_addr(&acl, "deny", (struct sockaddr *)&ss, sizeof(struct sockaddr_in), 0);
+	prefix[0] = 0;
+	masklen[0] = 0;
+
+	for (i = 1; i < entries; i++) {
+		masklen[i] = 16 + rnd() % 17;
+		prefix[i] = rnd() & (0xffffffffU << (32 - masklen[i]));
+		set_in(&ss, prefix[i]);
+		cw_acl_add_addr(&acl, (rnd() % 8 ? "permit" : "deny"), (struct sockaddr *)&ss, sizeof(struct sockaddr_in), masklen[i]);
+	}
+
+	for (i = 0; i < nquery; i++) {
+		if (i & 1) {
+			int r = rnd() % entries;
+
+			set_in(&query[i], prefix[r] | (rnd() & ~(masklen[r] ? 0xffffffffU << (32 - masklen[r]) : 0U)));
+		} else
+			set_in(&query[i], rnd());
+	}
+
+	free(masklen);
+	free(prefix);
+	return acl;
+}
+
+
+/* Addresses are drawn from 10.0.0.0/12 and 2000::/16 with most bits fixed
+ * so rules and lookups collide often.
+ */
+#define OVERLAP_IN()	(0x0a000000 | (rnd() & 0x000f0f0f))
+
+static struct cw_acl *build_overlap(int entries, struct sockaddr_storage *query, int nquery)
+{
+	struct sockaddr_storage ss;
+	struct cw_acl *acl = NULL;
+	int i;
+
+	for (i = 0; i < entries; i++) {
+		const char *sense = ((rnd() & 1) ? "permit" : "deny");
+
+		/* Mask lengths include -1 (a host) and lengths past the address size */
+		if (rnd() % 4 == 0) {
+			set_in6(&ss);
+			cw_acl_add_addr(&acl, sense, (struct sockaddr *)&ss, sizeof(struct sockaddr_in6), (int)(rnd() % 130) - 1);
+		} else {
+			set_in(&ss, OVERLAP_IN());
+			cw_acl_add_addr(&acl, sense, (struct sockaddr *)&ss, sizeof(struct sockaddr_in), (int)(rnd() % 34) - 1);
+		}
+	}
+
+	for (i = 0; i < nquery; i++) {
+		switch (rnd() % 8) {
+			case 0:
+			case 1:
+				set_in6(&query[i]);
+				break;
+			case 2:
+				set_mapped(&query[i], OVERLAP_IN());
+				break;
+			default:
+				set_in(&query[i], OVERLAP_IN());
+				if (rnd() & 1)
+					((struct sockaddr_in *)&query[i])->sin_port = htons(5060);
+				break;
+		}
+	}
+
+	return acl;
+}
+
+
+static const struct {
+	const char *name;
+	struct cw_acl *(*build)(int entries, struct sockaddr_storage *query, int nquery);
+} workloads[] = {
+	{ "carrier", build_carrier },
+	{ "overlap", build_overlap },
+};
+
+
+static int bench(int w, int entries, struct sockaddr_storage *query, int nquery)
+{
+	struct cw_acl *acl;
+	char *listres;
+	double t, tlist, ttree;
+	int i, nlist, mismatches, sum;
+
+	acl = workloads[w].build(entries, query, nquery);
+
+	if (!(listres = malloc(nquery))) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+
+	/* Uncompiled, cw_acl_check walks the list */
+	nlist = LIST_WORK / entries;
+	if (nlist > nquery)
+		nlist = nquery;
+	if (nlist < 1000)
+		nlist = 1000;
+
+	t = now();
+	for (i = 0; i < nlist; i++)
+		listres[i] = cw_acl_check(acl, (struct sockaddr *)&query[i], 2);
+	tlist = now() - t;
+
+	t = now();
+	if (cw_acl_compile(acl)) {
+		fprintf(stderr, "%s %d entries: compile failed\n", workloads[w].name, entries);
+		exit(1);
+	}
+	t = now() - t;
+
+	sum = 0;
+	ttree = now();
+	for (i = 0; i < nquery; i++)
+		sum += cw_acl_check(acl, (struct sockaddr *)&query[i], 2);
+	ttree = now() - ttree;
+
+	mismatches = 0;
+	for (i = 0; i < nlist; i++) {
+		if (cw_acl_check(acl, (struct sockaddr *)&query[i], 2) != listres[i]) {
+			if (!mismatches)
+				fprintf(stderr, "%s %d entries: tree and list disagree at lookup %d\n", workloads[w].name, entries, i);
+			mismatches++;
+		}
+	}
+
+	printf("%-8s %7d entries  list %10.1f ns/lookup  tree %6.1f ns/lookup  compile %8.2f ms  %d/%d differ\n",
+		workloads[w].name, entries, tlist * 1e9 / nlist, ttree * 1e9 / nquery, t * 1e3, mismatches, nlist);
+
+	cw_acl_free(acl);
+	free(listres);
+
+	/* Make sure the lookups aren't optimised away */
+	return (sum < 0 ? -1 : mismatches);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const int defsizes[] = { 10, 1000, 100000 };
+	struct sockaddr_storage *query;
+	int i, w, failed = 0;
+
+	if (!(query = malloc(QUERIES * sizeof(*query)))) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (atoi(argv[i]) <= 0) {
+			fprintf(stderr, "usage: %s [entries ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (w = 0; w < arraysize(workloads); w++) {
+		if (argc > 1) {
+			for (i = 1; i < argc; i++)
+				failed |= bench(w, atoi(argv[i]), query, QUERIES);
+		} else {
+			for (i = 0; i < arraysize(defsizes); i++)
+				failed |= bench(w, defsizes[i], query, QUERIES);
+		}
+	}
+
+	free(query);
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,386 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2009, Eris Associates Limited, UK
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ *
+ * amibench.c
+ *
+ * Measures manager event fan-out on a running CallWeaver. A number of AMI
+ * clients log in and ask for user events, then producer connections send
+ * UserEvent actions as fast as the manager will take them. Every client
+ * counts the events it receives. The report gives the rate the events
+ * were accepted at, the rate they were delivered at across all clients
+ * and how many were lost to slow session drops.
+ *
+ * The manager user needs "user" in both read and write.
+ *
+ * usage: amibench [-h host] [-p port] [-u user] [-s secret]
+ *                 [-c clients] [-P producers] [-n events-per-producer]
+ *
+ * The defaults are 127.0.0.1:5038, 50 clients, 1 producer and 100000
+ * events.
+ *
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+#define EVENT_NAME	"amibench"
+
+/* Actions are written in batches of this many */
+#define SEND_BATCH	64
+
+
+struct ami_conn {
+	int fd;
+	int len, pos;
+	char buf[65536];
+};
+
+struct client {
+	pthread_t tid;
+	struct ami_conn conn;
+	long events;
+	double last;
+};
+
+struct producer {
+	pthread_t writer, reader;
+	struct ami_conn conn;
+	long responses, errors;
+};
+
+
+static const char *host = "127.0.0.1";
+static const char *port = "5038";
+static const char *user = "admin";
+static const char *secret = "";
+static int nclients = 50;
+static int nproducers = 1;
+static long nevents = 100000;
+
+static volatile int stop;
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int ami_connect(struct ami_conn *conn)
+{
+	struct addrinfo hints, *addrs, *addr;
+	int err, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((err = getaddrinfo(host, port, &hints, &addrs))) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+
+	conn->fd = -1;
+	for (addr = addrs; addr; addr = addr->ai_next) {
+		if ((conn->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+			continue;
+		if (!connect(conn->fd, addr->ai_addr, addr->ai_addrlen))
+			break;
+		close(conn->fd);
+		conn->fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (conn->fd < 0) {
+		fprintf(stderr, "%s:%s: %s\n", host, port, strerror(errno));
+		return -1;
+	}
+
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	conn->len = conn->pos = 0;
+	return 0;
+}
+
+
+/* Returns the next line without its line ending, or NULL at EOF */
+static char *ami_line(struct ami_conn *conn)
+{
+	for (;;) {
+		char *p, *line;
+		int n;
+
+		if ((p = memchr(conn->buf + conn->pos, '\n', conn->len - conn->pos))) {
+			line = conn->buf + conn->pos;
+			conn->pos = p - conn->buf + 1;
+			if (p > line && p[-1] == '\r')
+				p--;
+			*p = '\0';
+			return line;
+		}
+
+		if (conn->pos) {
+			memmove(conn->buf, conn->buf + conn->pos, conn->len - conn->pos);
+			conn->len -= conn->pos;
+			conn->pos = 0;
+		}
+
+		if (conn->len == sizeof(conn->buf) - 1)
+			conn->len = 0;
+
+		if ((n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - 1 - conn->len)) <= 0)
+			return NULL;
+		conn->len += n;
+	}
+}
+
+
+static int ami_write(struct ami_conn *conn, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(conn->fd, data, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/* Reads a response block and returns 0 if it was a success */
+static int ami_response(struct ami_conn *conn)
+{
+	char *line;
+	int ok = -1, in_response = 0;
+
+	while ((line = ami_line(conn))) {
+		if (!strncasecmp(line, "Response:", 9)) {
+			in_response = 1;
+			ok = (strstr(line + 9, "Success") ? 0 : -1);
+		} else if (!*line && in_response)
+			return ok;
+	}
+
+	return -1;
+}
+
+
+static int ami_login(struct ami_conn *conn, const char *events)
+{
+	char buf[1024];
+	int n;
+
+	/* Skip the greeting */
+	if (ami_connect(conn) || !ami_line(conn))
+		return -1;
+
+	n = snprintf(buf, sizeof(buf),
+		"Action: Login\r\n"
+		"Username: %s\r\n"
+		"Secret: %s\r\n"
+		"Events: %s\r\n"
+		"\r\n",
+		user, secret, events);
+
+	if (ami_write(conn, buf, n) || ami_response(conn)) {
+		fprintf(stderr, "login as %s failed\n", user);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void *client_thread(void *data)
+{
+	struct client *client = data;
+	char *line;
+
+	while (!stop && (line = ami_line(&client->conn))) {
+		if (!strcmp(line, "UserEvent: " EVENT_NAME)) {
+			client->events++;
+			client->last = now();
+		}
+	}
+
+	return NULL;
+}
+
+
+static void *producer_writer(void *data)
+{
+	static const char action[] = "Action: UserEvent\r\nUserEvent: " EVENT_NAME "\r\n\r\n";
+	struct producer *producer = data;
+	char buf[SEND_BATCH * (sizeof(action) - 1)];
+	long i;
+	int j, n;
+
+	for (j = 0; j < SEND_BATCH; j++)
+		memcpy(buf + j * (sizeof(action) - 1), action, sizeof(action) - 1);
+
+	for (i = 0; i < nevents; i += n) {
+		n = (nevents - i < SEND_BATCH ? nevents - i : SEND_BATCH);
+		if (ami_write(&producer->conn, buf, n * (sizeof(action) - 1))) {
+			perror("write");
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+static void *producer_reader(void *data)
+{
+	struct producer *producer = data;
+	char *line;
+
+	while (producer->responses < nevents && (line = ami_line(&producer->conn))) {
+		if (!strncasecmp(line, "Response:", 9)) {
+			producer->responses++;
+			if (!strstr(line + 9, "Success"))
+				producer->errors++;
+		}
+	}
+
+	return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct client *clients;
+	struct producer *producers;
+	double start, accepted, delivered_at, settle;
+	long total, errors, prev;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "h:p:u:s:c:P:n:")) != -1) {
+		switch (c) {
+			case 'h': host = optarg; break;
+			case 'p': port = optarg; break;
+			case 'u': user = optarg; break;
+			case 's': secret = optarg; break;
+			case 'c': nclients = atoi(optarg); break;
+			case 'P': nproducers = atoi(optarg); break;
+			case 'n': nevents = atol(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-h host] [-p port] [-u user] [-s secret] [-c clients] [-P producers] [-n events-per-producer]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (nclients <= 0 || nproducers <= 0 || nevents <= 0) {
+		fprintf(stderr, "clients, producers and events must be positive\n");
+		return 1;
+	}
+
+	if (!(clients = calloc(nclients, sizeof(*clients))) || !(producers = calloc(nproducers, sizeof(*producers)))) {
+		fprintf(stderr, "Out of memory!\n");
+		return 1;
+	}
+
+	for (i = 0; i < nclients; i++) {
+		if (ami_login(&clients[i].conn, "user"))
+			return 1;
+	}
+	for (i = 0; i < nproducers; i++) {
+		if (ami_login(&producers[i].conn, "off"))
+			return 1;
+	}
+
+	for (i = 0; i < nclients; i++)
+		pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+
+	printf("%d clients, %d producers, %ld events each\n\n", nclients, nproducers, nevents);
+
+	start = now();
+	for (i = 0; i < nproducers; i++) {
+		pthread_create(&producers[i].reader, NULL, producer_reader, &producers[i]);
+		pthread_create(&producers[i].writer, NULL, producer_writer, &producers[i]);
+	}
+
+	errors = 0;
+	for (i = 0; i < nproducers; i++) {
+		pthread_join(producers[i].writer, NULL);
+		pthread_join(producers[i].reader, NULL);
+		errors += producers[i].errors;
+	}
+	accepted = now() - start;
+
+	/* Deliveries continue after the last action is answered. Wait until
+	 * every client has everything or nothing arrives for a second.
+	 */
+	total = 0;
+	settle = now();
+	do {
+		prev = total;
+		usleep(100000);
+		for (total = 0, i = 0; i < nclients; i++)
+			total += clients[i].events;
+		if (total != prev)
+			settle = now();
+	} while (total < (long)nclients * nproducers * nevents && now() - settle < 1.0);
+
+	delivered_at = start;
+	for (i = 0; i < nclients; i++) {
+		if (clients[i].last > delivered_at)
+			delivered_at = clients[i].last;
+	}
+	delivered_at -= start;
+	if (delivered_at <= 0.0)
+		delivered_at = accepted;
+
+	stop = 1;
+	for (i = 0; i < nclients; i++)
+		shutdown(clients[i].conn.fd, SHUT_RDWR);
+	for (i = 0; i < nclients; i++)
+		pthread_join(clients[i].tid, NULL);
+
+	printf("accepted   %10ld events in %7.3fs  %12.0f events/s  (%ld errors)\n",
+		(long)nproducers * nevents, accepted, nproducers * nevents / accepted, errors);
+	printf("delivered  %10ld events in %7.3fs  %12.0f events/s  (%.0f per client)\n",
+		total, delivered_at, total / delivered_at, total / delivered_at / nclients);
+	printf("lost       %10ld events (%.2f%%)\n",
+		(long)nclients * nproducers * nevents - total,
+		100.0 * ((double)nclients * nproducers * nevents - total) / ((double)nclients * nproducers * nevents));
+
+	return 0;
+}
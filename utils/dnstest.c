@@ -0,0 +1,444 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2009, Eris Associates Limited, UK
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ *
+ * dnstest.c
+ *
+ * Runs the resolver cache in corelib/dns.c against a stub DNS server on
+ * the loopback interface that counts the questions it is asked. It checks
+ * that answers and names that don't exist are cached, that server
+ * failures and answers with a zero TTL are not, that threads asking the
+ * same question at once share a single query and that asynchronous
+ * lookups call back with the answer and then call done.
+ *
+ * usage: dnstest
+ *
+ * The resolver is pointed at the stub by wrapping res_ninit, so this needs
+ * a C library that has it. The exit status is non-zero if any check fails.
+ *
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "callweaver.h"
+#include "callweaver/cli.h"
+#include "callweaver/dns.h"
+#include "callweaver/lock.h"
+#include "callweaver/logger.h"
+#include "callweaver/module.h"
+#include "callweaver/utils.h"
+
+
+/* dns.c needs these from the rest of the core */
+clock_t global_cond_clock_monotonic = CLOCK_MONOTONIC;
+pthread_condattr_t global_condattr_monotonic;
+pthread_mutexattr_t global_mutexattr_errorcheck;
+pthread_attr_t global_attr_detached;
+
+void cw_log_internal(const char *file, int line, const char *function, cw_log_level level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (level == CW_LOG_DEBUG)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+int cw_pthread_create_module(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine)(void *), void *data, struct cw_module *module, const char *description)
+{
+	return pthread_create(thread, attr, start_routine, data);
+}
+
+struct modinfo *get_modinfo(void)
+{
+	static struct modinfo modinfo;
+
+	return &modinfo;
+}
+
+struct cw_registry clicmd_registry;
+
+struct cw_registry_entry *cw_registry_add(struct cw_registry *registry, unsigned int hash, struct cw_object *obj)
+{
+	return NULL;
+}
+
+int cw_dynstr_printf(struct cw_dynstr *ds_p, const char *fmt, ...)
+{
+	return 0;
+}
+
+
+/* The stub server. Every name is under DOMAIN and the first label says
+ * how it is answered.
+ */
+#define DOMAIN		"dnstest.invalid"
+
+#define ANSWER_TTL	300
+#define ANSWER_ADDR	0xc0000201	/* 192.0.2.1 */
+
+/* How long the server sits on a "slow" question so others pile up */
+#define SLOW_MS		300
+
+#define CONCURRENT	8
+
+enum {
+	NAME_POS,
+	NAME_MISSING,
+	NAME_BROKEN,
+	NAME_ZEROTTL,
+	NAME_SLOW,
+	NAME_ASYNC,
+	NAME_ASYNCMISSING,
+};
+
+static const struct {
+	const char *label;
+	int rcode;
+	int ttl;
+	int delay_ms;
+} names[] = {
+	[NAME_POS]          = { "pos",          NOERROR,  ANSWER_TTL, 0 },
+	[NAME_MISSING]      = { "missing",      NXDOMAIN, 0,          0 },
+	[NAME_BROKEN]       = { "broken",       SERVFAIL, 0,          0 },
+	[NAME_ZEROTTL]      = { "zerottl",      NOERROR,  0,          0 },
+	[NAME_SLOW]         = { "slow",         NOERROR,  ANSWER_TTL, SLOW_MS },
+	[NAME_ASYNC]        = { "async",        NOERROR,  ANSWER_TTL, 0 },
+	[NAME_ASYNCMISSING] = { "asyncmissing", NXDOMAIN, 0,          0 },
+};
+
+static int queries[arraysize(names)];
+static pthread_mutex_t queries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sockaddr_in server_addr;
+static int server_fd;
+
+
+static int name_index(const unsigned char *q, int len)
+{
+	int i;
+
+	if (len < 1 || q[0] >= len)
+		return -1;
+
+	for (i = 0; i < arraysize(names); i++) {
+		if (q[0] == strlen(names[i].label) && !strncasecmp((const char *)q + 1, names[i].label, q[0]))
+			return i;
+	}
+
+	return -1;
+}
+
+static void *server_thread(void *data)
+{
+	unsigned char buf[512];
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	HEADER *h = (HEADER *)buf;
+	int len, qlen, n;
+
+	for (;;) {
+		fromlen = sizeof(from);
+		if ((len = recvfrom(server_fd, buf, sizeof(buf) - 16, 0, (struct sockaddr *)&from, &fromlen)) < (int)sizeof(HEADER) + 5)
+			continue;
+
+		/* The question is the name, type and class after the header */
+		for (qlen = sizeof(HEADER); qlen < len && buf[qlen]; qlen += buf[qlen] + 1);
+		if ((qlen += 5) > len)
+			continue;
+
+		if ((n = name_index(buf + sizeof(HEADER), qlen - sizeof(HEADER))) < 0) {
+			h->rcode = NXDOMAIN;
+			h->ancount = 0;
+		} else {
+			pthread_mutex_lock(&queries_lock);
+			queries[n]++;
+			pthread_mutex_unlock(&queries_lock);
+
+			if (names[n].delay_ms)
+				usleep(names[n].delay_ms * 1000);
+
+			h->rcode = names[n].rcode;
+			h->ancount = 0;
+			if (names[n].rcode == NOERROR) {
+				unsigned char *p = buf + qlen;
+				uint32_t ttl = htonl(names[n].ttl);
+				uint32_t addr = htonl(ANSWER_ADDR);
+
+				/* A pointer to the question name then type A, class IN, TTL, length and address */
+				*p++ = 0xc0; *p++ = sizeof(HEADER);
+				*p++ = 0; *p++ = T_A;
+				*p++ = 0; *p++ = C_IN;
+				memcpy(p, &ttl, 4); p += 4;
+				*p++ = 0; *p++ = 4;
+				memcpy(p, &addr, 4); p += 4;
+				h->ancount = htons(1);
+				qlen = p - buf;
+			}
+		}
+
+		h->qr = 1;
+		h->ra = 1;
+		h->aa = 1;
+		h->nscount = h->arcount = 0;
+		sendto(server_fd, buf, qlen, 0, (struct sockaddr *)&from, fromlen);
+	}
+
+	return NULL;
+}
+
+static int server_start(void)
+{
+	socklen_t addrlen = sizeof(server_addr);
+	pthread_t tid;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+	|| bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr))
+	|| getsockname(server_fd, (struct sockaddr *)&server_addr, &addrlen)) {
+		perror("stub server");
+		return -1;
+	}
+
+	return pthread_create(&tid, NULL, server_thread, NULL);
+}
+
+static int server_queries(int n)
+{
+	int ret;
+
+	pthread_mutex_lock(&queries_lock);
+	ret = queries[n];
+	pthread_mutex_unlock(&queries_lock);
+
+	return ret;
+}
+
+
+/* res_ninit is usually a macro for the real entry point, so this takes
+ * its place in dns.c. It does the normal set up and then swaps in the
+ * stub server for whatever resolv.conf said.
+ */
+#define STR(x)	#x
+#define XSTR(x)	STR(x)
+
+int res_ninit(res_state statp)
+{
+	static int (*real_res_ninit)(res_state);
+	int ret;
+
+	if (!real_res_ninit && !(real_res_ninit = (int (*)(res_state))dlsym(RTLD_NEXT, XSTR(res_ninit)))) {
+		fprintf(stderr, "can't find %s: %s\n", XSTR(res_ninit), dlerror());
+		return -1;
+	}
+
+	if (!(ret = real_res_ninit(statp))) {
+		statp->nscount = 1;
+		statp->nsaddr_list[0] = server_addr;
+		statp->retrans = 1;
+		statp->retry = 1;
+		statp->options &= ~(RES_DNSRCH | RES_DEFNAMES);
+	}
+
+	return ret;
+}
+
+
+static int failed;
+
+#define CHECK(cond, ...) \
+	do { \
+		if (!(cond)) { \
+			printf("FAIL: " __VA_ARGS__); \
+			putchar('\n'); \
+			failed = 1; \
+		} \
+	} while (0)
+
+
+struct result {
+	int answers;
+	uint32_t addr;
+	int done;
+	int ret;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static int callback(void *context, char *answer, int len, char *fullanswer)
+{
+	struct result *result = context;
+
+	if (len == 4) {
+		memcpy(&result->addr, answer, 4);
+		result->addr = ntohl(result->addr);
+	}
+	result->answers++;
+	return 1;
+}
+
+static int lookup(const char *label, struct result *result)
+{
+	char name[256];
+
+	memset(result, 0, sizeof(*result));
+	snprintf(name, sizeof(name), "%s." DOMAIN ".", label);
+	return cw_search_dns(result, name, C_IN, T_A, callback);
+}
+
+
+static void *concurrent_thread(void *data)
+{
+	struct result *result = data;
+
+	result->ret = lookup("slow", result);
+	return NULL;
+}
+
+static void test_concurrent(void)
+{
+	struct result results[CONCURRENT];
+	pthread_t tid[CONCURRENT];
+	int i;
+
+	for (i = 0; i < CONCURRENT; i++)
+		pthread_create(&tid[i], NULL, concurrent_thread, &results[i]);
+	for (i = 0; i < CONCURRENT; i++) {
+		pthread_join(tid[i], NULL);
+		CHECK(results[i].ret == 1 && results[i].addr == ANSWER_ADDR, "concurrent lookup %d got %d", i, results[i].ret);
+	}
+
+	CHECK(server_queries(NAME_SLOW) == 1, "%d concurrent lookups made %d queries", CONCURRENT, server_queries(NAME_SLOW));
+}
+
+
+static void async_done(void *context, int ret)
+{
+	struct result *result = context;
+
+	pthread_mutex_lock(&result->lock);
+	result->ret = ret;
+	result->done++;
+	pthread_cond_signal(&result->cond);
+	pthread_mutex_unlock(&result->lock);
+}
+
+static void async_lookup(const char *label, struct result *result)
+{
+	char name[256];
+	struct timespec ts;
+
+	memset(result, 0, sizeof(*result));
+	pthread_mutex_init(&result->lock, NULL);
+	pthread_cond_init(&result->cond, NULL);
+
+	snprintf(name, sizeof(name), "%s." DOMAIN ".", label);
+	if (cw_search_dns_async(result, name, C_IN, T_A, callback, async_done)) {
+		result->ret = -2;
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 10;
+	pthread_mutex_lock(&result->lock);
+	while (!result->done && pthread_cond_timedwait(&result->cond, &result->lock, &ts) != ETIMEDOUT);
+	pthread_mutex_unlock(&result->lock);
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct result result;
+	int ret;
+
+	pthread_condattr_init(&global_condattr_monotonic);
+	pthread_condattr_setclock(&global_condattr_monotonic, global_cond_clock_monotonic);
+	pthread_mutexattr_init(&global_mutexattr_errorcheck);
+	pthread_mutexattr_settype(&global_mutexattr_errorcheck, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_attr_init(&global_attr_detached);
+	pthread_attr_setdetachstate(&global_attr_detached, PTHREAD_CREATE_DETACHED);
+
+	if (server_start() || cw_dns_init())
+		return 1;
+
+	printf("stub server on 127.0.0.1:%d\n\n", ntohs(server_addr.sin_port));
+
+	/* Answers are cached, whatever case the name is asked in */
+	ret = lookup("pos", &result);
+	CHECK(ret == 1 && result.answers == 1 && result.addr == ANSWER_ADDR, "positive lookup got %d", ret);
+	ret = lookup("pos", &result);
+	CHECK(ret == 1 && result.answers == 1 && result.addr == ANSWER_ADDR, "cached positive lookup got %d", ret);
+	ret = lookup("POS", &result);
+	CHECK(ret == 1 && result.answers == 1, "cached positive lookup in upper case got %d", ret);
+	CHECK(server_queries(NAME_POS) == 1, "3 positive lookups made %d queries", server_queries(NAME_POS));
+
+	/* So are names that don't exist */
+	ret = lookup("missing", &result);
+	CHECK(ret < 0 && !result.answers, "negative lookup got %d", ret);
+	ret = lookup("missing", &result);
+	CHECK(ret < 0 && !result.answers, "cached negative lookup got %d", ret);
+	CHECK(server_queries(NAME_MISSING) == 1, "2 negative lookups made %d queries", server_queries(NAME_MISSING));
+
+	/* Server failures and zero TTLs are asked again */
+	lookup("broken", &result);
+	ret = lookup("broken", &result);
+	CHECK(ret < 0 && !result.answers, "failing lookup got %d", ret);
+	CHECK(server_queries(NAME_BROKEN) == 2, "2 failing lookups made %d queries", server_queries(NAME_BROKEN));
+
+	lookup("zerottl", &result);
+	ret = lookup("zerottl", &result);
+	CHECK(ret == 1 && result.answers == 1, "zero TTL lookup got %d", ret);
+	CHECK(server_queries(NAME_ZEROTTL) == 2, "2 zero TTL lookups made %d queries", server_queries(NAME_ZEROTTL));
+
+	/* Everyone asking while the server thinks shares its answer */
+	test_concurrent();
+
+	/* Asynchronous lookups call back from a worker then call done */
+	async_lookup("async", &result);
+	CHECK(result.done == 1 && result.ret == 1 && result.answers == 1 && result.addr == ANSWER_ADDR,
+		"async lookup done %d times with %d and %d answers", result.done, result.ret, result.answers);
+	async_lookup("async", &result);
+	CHECK(result.done == 1 && result.ret == 1 && result.answers == 1, "cached async lookup done %d times with %d", result.done, result.ret);
+	CHECK(server_queries(NAME_ASYNC) == 1, "2 async lookups made %d queries", server_queries(NAME_ASYNC));
+
+	async_lookup("asyncmissing", &result);
+	CHECK(result.done == 1 && result.ret < 0 && !result.answers, "negative async lookup done %d times with %d", result.done, result.ret);
+
+	printf("%s\n", (failed ? "FAILED" : "passed"));
+	return failed;
+}
@@ -0,0 +1,192 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2009, Eris Associates Limited, UK
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ *
+ * g711bench.c
+ *
+ * Measures samples/sec through each G.711 conversion path: the per-sample
+ * tables, each vector encoder the CPU supports, the buffer functions the
+ * core actually uses and the direct mu-law <-> A-law translation.
+ *
+ * usage: g711bench [samples-per-buffer [iterations]]
+ *
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#define SPANDSP_EXPOSE_INTERNAL_STRUCTURES
+#include <spandsp.h>
+
+#include "callweaver/logger.h"
+#include "core/ulaw.h"
+#include "core/alaw.h"
+
+
+/* ulaw.c and alaw.c only log if a vector encoder fails its self-check */
+void cw_log_internal(const char *file, int line, const char *function, cw_log_level level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+
+static int16_t *lin, *lin2;
+static uint8_t *enc, *enc2;
+static uint8_t mu2a[256];
+static int samples = 160;
+static int iterations = 200000;
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double elapsed)
+{
+	printf("%-24s %10.1f Msamples/s\n", name, (double)samples * iterations / elapsed / 1e6);
+}
+
+
+static void __attribute__ ((noinline)) table_lin2mu(uint8_t *dst, const int16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = CW_LIN2MU(src[i]);
+}
+
+static void __attribute__ ((noinline)) table_lin2a(uint8_t *dst, const int16_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = CW_LIN2A(src[i]);
+}
+
+static void __attribute__ ((noinline)) table_mu2a(uint8_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = mu2a[src[i]];
+}
+
+
+#define BENCH(name, stmt) \
+	do { \
+		double t = now(); \
+		int r; \
+		for (r = 0; r < iterations; r++) { \
+			stmt; \
+			__asm__ __volatile__ ("" : : : "memory"); \
+		} \
+		report(name, now() - t); \
+	} while (0)
+
+#ifdef G711_VEC
+/* A vector encoder with the table finishing off the tail, as the buffer
+ * functions do, checked against the table before it is timed.
+ */
+static void bench_vec(const char *name, g711_vec_encoder_t encode, void (*table)(uint8_t *, const int16_t *, int))
+{
+	int i;
+
+	i = encode(enc, lin, samples);
+	table(enc + i, lin + i, samples - i);
+	table(enc2, lin, samples);
+	if (memcmp(enc, enc2, samples)) {
+		printf("%-24s does not match the table\n", name);
+		return;
+	}
+
+	BENCH(name, i = encode(enc, lin, samples); table(enc + i, lin + i, samples - i));
+}
+#endif
+
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = 1;
+	int i;
+
+	if (argc > 1)
+		samples = atoi(argv[1]);
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if (samples <= 0 || iterations <= 0) {
+		fprintf(stderr, "usage: %s [samples-per-buffer [iterations]]\n", argv[0]);
+		return 1;
+	}
+
+	cw_ulaw_init();
+	cw_alaw_init();
+	for (i = 0; i < 256; i++)
+		mu2a[i] = ulaw_to_alaw(i);
+
+	lin = malloc(samples * sizeof(*lin));
+	lin2 = malloc(samples * sizeof(*lin2));
+	enc = malloc(samples);
+	enc2 = malloc(samples);
+
+	/* Speech-like levels: random samples spread over all the segments */
+	for (i = 0; i < samples; i++) {
+		seed = seed * 1103515245 + 12345;
+		lin[i] = (int16_t)(seed >> 8) >> (seed % 8);
+	}
+
+	printf("%d samples per buffer, %d iterations\n\n", samples, iterations);
+
+	BENCH("slin -> ulaw table", table_lin2mu(enc, lin, samples));
+#ifdef G711_VEC
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		bench_vec("slin -> ulaw SSE2", cw_lin2mu_sse2, table_lin2mu);
+	if (__builtin_cpu_supports("avx2"))
+		bench_vec("slin -> ulaw AVX2", cw_lin2mu_avx2, table_lin2mu);
+#endif
+	BENCH("slin -> ulaw buf", cw_lin2mu_buf(enc, lin, samples));
+
+	BENCH("slin -> alaw table", table_lin2a(enc, lin, samples));
+#ifdef G711_VEC
+	if (__builtin_cpu_supports("sse2"))
+		bench_vec("slin -> alaw SSE2", cw_lin2a_sse2, table_lin2a);
+	if (__builtin_cpu_supports("avx2"))
+		bench_vec("slin -> alaw AVX2", cw_lin2a_avx2, table_lin2a);
+#endif
+	BENCH("slin -> alaw buf", cw_lin2a_buf(enc, lin, samples));
+
+	cw_lin2mu_buf(enc, lin, samples);
+	BENCH("ulaw -> slin buf", cw_mulaw_buf(lin2, enc, samples));
+	BENCH("ulaw -> alaw table", table_mu2a(enc2, enc, samples));
+	BENCH("ulaw -> slin -> alaw", cw_mulaw_buf(lin2, enc, samples); cw_lin2a_buf(enc2, lin2, samples));
+
+	cw_lin2a_buf(enc, lin, samples);
+	BENCH("alaw -> slin buf", cw_alaw_buf(lin2, enc, samples));
+
+	return 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2009, Eris Associates Limited, UK
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ *
+ * schedbench.c
+ *
+ * Drives the same timer workload through the scheduler in corelib/sched.c
+ * (an indexed heap) and through the sorted list it replaced, which is
+ * reproduced here. Each run adds n jobs, reschedules a fifth of them,
+ * cancels a third and then takes the rest off the front of the queue in
+ * expiry order as the service threads do when they fire.
+ *
+ * usage: schedbench [timers]
+ *
+ * The list is quadratic so at the default 100000 timers it takes minutes.
+ *
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "callweaver.h"
+#include "callweaver/sched.h"
+#include "callweaver/lock.h"
+#include "callweaver/logger.h"
+#include "callweaver/module.h"
+#include "callweaver/utils.h"
+
+
+/* sched.c needs these from the rest of the core */
+clock_t global_cond_clock_monotonic = CLOCK_MONOTONIC;
+pthread_condattr_t global_condattr_monotonic;
+pthread_mutexattr_t global_mutexattr_errorcheck;
+pthread_attr_t global_attr_default;
+
+void cw_log_internal(const char *file, int line, const char *function, cw_log_level level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+int cw_pthread_create_module(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine)(void *), void *data, struct cw_module *module, const char *description)
+{
+	return pthread_create(thread, attr, start_routine, data);
+}
+
+struct modinfo *get_modinfo(void)
+{
+	static struct modinfo modinfo;
+
+	return &modinfo;
+}
+
+
+/* The sorted list scheduler, as it was before the heap */
+
+#define SOONER(a,b) (((b).tv_sec > (a).tv_sec) || \
+					 (((b).tv_sec == (a).tv_sec) && ((b).tv_nsec > (a).tv_nsec)))
+
+struct list_state {
+	struct list_state *next;
+	cw_sched_cb callback;
+	void *data;
+	int vers;
+	cw_schedfail_cb failed;
+	struct timespec when;
+};
+
+struct list_context {
+	cw_mutex_t lock;
+	struct list_state *schedq;
+};
+
+
+static void list_schedule(struct list_context *con, struct list_state *s)
+{
+	struct list_state **s_p;
+
+	for (s_p = &con->schedq; *s_p; s_p = &(*s_p)->next) {
+		if (SOONER(s->when, (*s_p)->when))
+			break;
+	}
+
+	s->next = *s_p;
+	*s_p = s;
+}
+
+static int list_add_nolock(struct list_context *con, struct list_state *state, int ms, cw_sched_cb callback, void *data)
+{
+	int res = -1;
+
+	if (!state->callback) {
+		state->vers++;
+		state->callback = callback;
+		state->data = data;
+		state->failed = NULL;
+		cw_clock_gettime(global_cond_clock_monotonic, &state->when);
+		if (ms) {
+			state->when.tv_sec += ms / 1000;
+			if ((state->when.tv_nsec += (ms % 1000) * 1000000) > 1000000000) {
+				state->when.tv_sec++;
+				state->when.tv_nsec -= 1000000000;
+			}
+		}
+		list_schedule(con, state);
+		res = 0;
+	}
+
+	return res;
+}
+
+static int list_del_nolock(struct list_context *con, struct list_state *state)
+{
+	struct list_state **s_p, *s;
+	int res = -1;
+
+	state->vers++;
+
+	if (state->callback) {
+		for (s_p = &con->schedq; *s_p; s_p = &(*s_p)->next) {
+			if ((*s_p) == state) {
+				s = *s_p;
+				*s_p = s->next;
+				s->callback = NULL;
+				res = 0;
+				break;
+			}
+		}
+	}
+
+	return res;
+}
+
+static int list_add(struct list_context *con, struct list_state *state, int ms, cw_sched_cb callback, void *data)
+{
+	int res;
+
+	cw_mutex_lock(&con->lock);
+	res = list_add_nolock(con, state, ms, callback, data);
+	cw_mutex_unlock(&con->lock);
+
+	return res;
+}
+
+static int list_del(struct list_context *con, struct list_state *state)
+{
+	int res;
+
+	cw_mutex_lock(&con->lock);
+	res = list_del_nolock(con, state);
+	cw_mutex_unlock(&con->lock);
+
+	return res;
+}
+
+static int list_modify(struct list_context *con, struct list_state *state, int ms, cw_sched_cb callback, void *data)
+{
+	int res;
+
+	cw_mutex_lock(&con->lock);
+	res = list_del_nolock(con, state);
+	list_add_nolock(con, state, ms, callback, data);
+	cw_mutex_unlock(&con->lock);
+
+	return res;
+}
+
+
+/* The workload */
+
+/* Jobs are at least a minute out so nothing fires while we are timing */
+#define JOB_MS(i)	(60000 + (int)(((unsigned int)(i) * 2654435761U) % 600000U))
+#define NEW_MS(i)	(60000 + (int)(((unsigned int)(i) * 40503U) % 600000U))
+
+static int ntimers = 100000;
+
+
+static int job(void *data)
+{
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, const char *phase, int ops, double elapsed)
+{
+	printf("%-6s %-8s %7d ops %10.1f ms %12.0f ops/s\n", name, phase, ops, elapsed * 1e3, ops / elapsed);
+}
+
+static int cmp_when(const void *a, const void *b)
+{
+	const struct timespec *x = *(const struct timespec * const *)a;
+	const struct timespec *y = *(const struct timespec * const *)b;
+
+	return (SOONER(*x, *y) ? -1 : (SOONER(*y, *x) ? 1 : 0));
+}
+
+
+/* The states left after the deletes sorted by expiry, which is the order
+ * they leave the front of the queue in when they fire.
+ */
+#define EXPIRY_ORDER(states, order, n) \
+	do { \
+		int i_; \
+		(n) = 0; \
+		for (i_ = 0; i_ < ntimers; i_++) \
+			if ((states)[i_].callback) \
+				(order)[(n)++] = &(states)[i_].when; \
+		qsort((order), (n), sizeof((order)[0]), cmp_when); \
+	} while (0)
+
+#define STATE_OF(type, ts) \
+	((type *)((char *)(ts) - offsetof(type, when)))
+
+
+static void bench_heap(void)
+{
+	struct sched_context *con;
+	struct sched_state *states;
+	struct timespec **order;
+	double t;
+	int i, n;
+
+	if (!(con = sched_context_create(1)) || !(states = calloc(ntimers, sizeof(*states))) || !(order = malloc(ntimers * sizeof(*order)))) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+
+	for (i = 0; i < ntimers; i++)
+		cw_sched_state_init(&states[i]);
+
+	t = now();
+	for (i = 0; i < ntimers; i++)
+		cw_sched_add(con, &states[i], JOB_MS(i), job, NULL);
+	report("heap", "add", ntimers, now() - t);
+
+	t = now();
+	for (i = 1, n = 0; i < ntimers; i += 5, n++)
+		cw_sched_modify(con, &states[i], NEW_MS(i), job, NULL);
+	report("heap", "modify", n, now() - t);
+
+	t = now();
+	for (i = 0, n = 0; i < ntimers; i += 3, n++)
+		cw_sched_del(con, &states[i]);
+	report("heap", "delete", n, now() - t);
+
+	EXPIRY_ORDER(states, order, n);
+	t = now();
+	for (i = 0; i < n; i++)
+		if (cw_sched_del(con, STATE_OF(struct sched_state, order[i])))
+			fprintf(stderr, "heap lost a job!\n");
+	report("heap", "expire", n, now() - t);
+
+	sched_context_destroy(con);
+	free(order);
+	free(states);
+}
+
+
+static void bench_list(void)
+{
+	struct list_context con;
+	struct list_state *states;
+	struct timespec **order;
+	double t;
+	int i, n;
+
+	if (!(states = calloc(ntimers, sizeof(*states))) || !(order = malloc(ntimers * sizeof(*order)))) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	}
+
+	cw_mutex_init_attr(&con.lock, &global_mutexattr_errorcheck);
+	con.schedq = NULL;
+
+	t = now();
+	for (i = 0; i < ntimers; i++)
+		list_add(&con, &states[i], JOB_MS(i), job, NULL);
+	report("list", "add", ntimers, now() - t);
+
+	t = now();
+	for (i = 1, n = 0; i < ntimers; i += 5, n++)
+		list_modify(&con, &states[i], NEW_MS(i), job, NULL);
+	report("list", "modify", n, now() - t);
+
+	t = now();
+	for (i = 0, n = 0; i < ntimers; i += 3, n++)
+		list_del(&con, &states[i]);
+	report("list", "delete", n, now() - t);
+
+	EXPIRY_ORDER(states, order, n);
+	t = now();
+	for (i = 0; i < n; i++)
+		if (list_del(&con, STATE_OF(struct list_state, order[i])))
+			fprintf(stderr, "list lost a job!\n");
+	report("list", "expire", n, now() - t);
+
+	cw_mutex_destroy(&con.lock);
+	free(order);
+	free(states);
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && (ntimers = atoi(argv[1])) <= 0) {
+		fprintf(stderr, "usage: %s [timers]\n", argv[0]);
+		return 1;
+	}
+
+	pthread_condattr_init(&global_condattr_monotonic);
+	pthread_condattr_setclock(&global_condattr_monotonic, global_cond_clock_monotonic);
+	pthread_mutexattr_init(&global_mutexattr_errorcheck);
+	pthread_mutexattr_settype(&global_mutexattr_errorcheck, PTHREAD_MUTEX_ERRORCHECK);
+	pthread_attr_init(&global_attr_default);
+
+	printf("%d timers\n\n", ntimers);
+
+	bench_heap();
+	putchar('\n');
+	bench_list();
+
+	return 0;
+}